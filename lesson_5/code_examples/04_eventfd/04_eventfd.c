@@ -8,12 +8,57 @@
 #include <sys/eventfd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>       // clock_gettime
 #include <sys/time.h>   // gettimeofday
 #include <stdarg.h>     // va_list etc
 
 // Data structure in shared memory
 #define MSG_SIZE 1024
 
+// Broadcast ring: one writer (T1), every receiver reads every slot
+#define RING_SLOTS 256                  // power of two
+#define RING_MASK (RING_SLOTS - 1)
+#define MAX_RECEIVERS 32                // one bit each in receivers_mask
+#define RING_SPIN 128                   // polls before a reader goes to sleep
+
+#define BENCH_MESSAGES 200000
+#define BENCH_MSYNC_MESSAGES 20000      // the msync design is much slower
+
+// A published message. seq is written last, with release ordering, so a reader
+// that sees seq == s+1 with acquire ordering also sees the rest of the slot.
+typedef struct {
+    uint64_t seq;                       // s+1 once sequence s is in the slot
+    uint32_t receivers_mask;            // bit i set => threadID=(2+i) is targeted
+    uint32_t stop;                      // last message: receivers exit
+    uint64_t publish_ns;                // CLOCK_MONOTONIC, for latency
+    char  message_timestamp[64];
+    char  message[MSG_SIZE];
+} __attribute__((aligned(64))) ring_slot_t;
+
+// Written only by its receiver, apart from T1 clearing sleeping when it wakes it
+typedef struct {
+    uint64_t cursor;                    // next sequence this receiver reads
+    uint32_t sleeping;                  // 1 while blocked on its eventfd
+    uint64_t received;                  // messages targeted at this receiver
+    uint64_t wakeups;                   // eventfd reads
+    uint64_t latency_total_ns;          // publish to receive
+    uint64_t latency_max_ns;
+} __attribute__((aligned(64))) reader_state_t;
+
+typedef struct {
+    uint64_t head __attribute__((aligned(64)));    // next sequence T1 publishes
+    uint32_t producer_sleeping;         // T1 blocked on a full ring
+    uint64_t wakeups_sent;              // eventfd writes by T1
+    uint64_t producer_waits;            // times T1 slept on a full ring
+    reader_state_t readers[MAX_RECEIVERS];
+    ring_slot_t slots[RING_SLOTS];
+} shared_ring_t;
+
+static shared_ring_t *g_ring = NULL;
+static size_t g_ring_size = sizeof(shared_ring_t);
+
+// The original design, kept for the benchmark: a single message/response slot,
+// msync() around every access and T1 waiting for every ack
 typedef struct {
     // the message
     char  message[MSG_SIZE];
@@ -33,12 +78,16 @@ typedef struct {
     // it might be overwritten or each thread might build a combined response array.)
     char  response[MSG_SIZE];
     char  response_timestamp[64];
+
+    // benchmark only
+    uint64_t publish_ns;
+    uint32_t stop;
 } shared_data_t;
 
 static shared_data_t *g_shared = NULL;
 static size_t g_shm_size = sizeof(shared_data_t);
 
-// T1's eventfd: all receivers write here to ack
+// T1's eventfd: receivers write here when T1 waits on them
 static int efdT1 = -1;
 
 // The eventfds for each receiver thread
@@ -47,6 +96,9 @@ static int *efdReceivers = NULL; // array of length N
 // Number of receiver threads
 static int N = 2; // default
 
+// Benchmark mode: receivers keep statistics instead of printing
+static int g_quiet = 0;
+
 
 // safe_print() with flockfile/unlockfile to avoid interleaving
 static void safe_print(const char *fmt, ...) {
@@ -86,6 +138,148 @@ static void get_timestamp_ms(char *buf, size_t buflen) {
     snprintf(buf, buflen, "%ld ms", ms);
 }
 
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Create T1's eventfd and one per receiver
+static int open_eventfds(void) {
+    efdT1 = eventfd(0, 0);
+    if (efdT1 < 0) {
+        perror("eventfd T1");
+        return -1;
+    }
+
+    // create array of eventfds for each receiver
+    efdReceivers = calloc(N, sizeof(int));
+    if (!efdReceivers) {
+        perror("calloc efdReceivers");
+        return -1;
+    }
+    for (int i = 0; i < N; i++) {
+        efdReceivers[i] = eventfd(0, 0);
+        if (efdReceivers[i] < 0) {
+            perror("eventfd for receiver");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void close_eventfds(void) {
+    close(efdT1);
+    for (int i = 0; i < N; i++) {
+        close(efdReceivers[i]);
+    }
+    free(efdReceivers);
+    efdReceivers = NULL;
+}
+
+
+// ----- Broadcast ring -----
+// T1 fills slot head % RING_SLOTS and publishes it by storing its sequence
+// number; it never waits for acks, only for space when the slowest receiver is
+// a whole ring behind. Each receiver follows its own cursor and publishes how
+// far it has read so T1 knows which slots are free again.
+//
+// Nobody writes an eventfd unless the other side is asleep. A receiver that
+// finds nothing new sets sleeping, then looks at the slot once more before
+// blocking; T1 stores the sequence, then looks at sleeping. With a full fence
+// between the store and the load on both sides, at least one of them sees the
+// other's write, so a wake-up cannot be lost. T1 waiting for space does the
+// same with producer_sleeping and the cursors.
+
+static uint64_t ring_min_cursor(void) {
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < N; i++) {
+        uint64_t c = __atomic_load_n(&g_ring->readers[i].cursor, __ATOMIC_SEQ_CST);
+        if (c < oldest) {
+            oldest = c;
+        }
+    }
+    return oldest;
+}
+
+// Block T1 until sequence s no longer overwrites a slot someone has to read
+static void ring_wait_space(uint64_t s) {
+    while (s - ring_min_cursor() >= RING_SLOTS) {
+        __atomic_store_n(&g_ring->producer_sleeping, 1, __ATOMIC_SEQ_CST);
+        if (s - ring_min_cursor() < RING_SLOTS) {
+            __atomic_store_n(&g_ring->producer_sleeping, 0, __ATOMIC_RELAXED);
+            break;
+        }
+        g_ring->producer_waits++;
+        wait_eventfd(efdT1);
+    }
+}
+
+// Publish one message to the receivers in mask; returns its sequence number
+static uint64_t ring_publish(uint32_t mask, const char *msg, int stop) {
+    uint64_t s = g_ring->head;          // only T1 writes head
+    ring_wait_space(s);
+
+    ring_slot_t *slot = &g_ring->slots[s & RING_MASK];
+    size_t len = strnlen(msg, MSG_SIZE - 1);
+    memcpy(slot->message, msg, len);
+    slot->message[len] = '\0';
+    if (!g_quiet) {
+        get_timestamp_ms(slot->message_timestamp, sizeof(slot->message_timestamp));
+    }
+    slot->receivers_mask = mask;
+    slot->stop = stop;
+    slot->publish_ns = now_ns();
+    __atomic_store_n(&slot->seq, s + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_ring->head, s + 1, __ATOMIC_RELEASE);
+
+    // Receivers outside mask are woken too: they still have to move their
+    // cursor past the slot, or they would hold the ring full
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int i = 0; i < N; i++) {
+        reader_state_t *r = &g_ring->readers[i];
+        if (__atomic_load_n(&r->sleeping, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&r->sleeping, 0, __ATOMIC_ACQ_REL)) {
+            g_ring->wakeups_sent++;
+            signal_eventfd(efdReceivers[i]);
+        }
+    }
+    return s;
+}
+
+// Wait until the slot holds sequence want-1; spin a little, then sleep
+static void ring_wait_message(reader_state_t *me, ring_slot_t *slot, uint64_t want, int efdMe) {
+    for (int spin = 0; spin < RING_SPIN; spin++) {
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == want) {
+            return;
+        }
+    }
+    while (1) {
+        __atomic_store_n(&me->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == want) {
+            // If T1 cleared the flag meanwhile, its eventfd write only causes
+            // one spurious wake-up later
+            __atomic_store_n(&me->sleeping, 0, __ATOMIC_RELAXED);
+            return;
+        }
+        wait_eventfd(efdMe);
+        me->wakeups++;
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == want) {
+            return;
+        }
+    }
+}
+
+// Move past sequence s and wake T1 if it is waiting for the space
+static void ring_release(reader_state_t *me, uint64_t s) {
+    __atomic_store_n(&me->cursor, s + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_ring->producer_sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&g_ring->producer_sleeping, 0, __ATOMIC_ACQ_REL)) {
+        signal_eventfd(efdT1);
+    }
+}
+
 
 // Per-thread arg struct
 typedef struct {
@@ -95,9 +289,7 @@ typedef struct {
 
 
 // Receiver thread function
-// each thread sees if its bit is set in g_shared->receivers_mask
-// If so, it processes the message, sets its bit in ack_mask, signals T1
-
+// reads every message in order; prints the ones with its bit in receivers_mask
 static void* receiver_thread(void *arg) {
     receiver_arg_t *rarg = (receiver_arg_t*)arg;
     int myID  = rarg->threadID;    // e.g. 2..N+1
@@ -105,104 +297,269 @@ static void* receiver_thread(void *arg) {
 
     // The index i in [0..N-1]
     int i = myID - 2;
+    uint32_t mask = (1u << i);
+    reader_state_t *me = &g_ring->readers[i];
 
-    safe_print("[T%d] Started.\n", myID);
+    if (!g_quiet) {
+        safe_print("[T%d] Started.\n", myID);
+    }
+
+    while (1) {
+        // 1) Wait for the next sequence number
+        uint64_t s = me->cursor;
+        ring_slot_t *slot = &g_ring->slots[s & RING_MASK];
+        ring_wait_message(me, slot, s + 1, efdMe);
+        int stop = slot->stop;
+
+        // 2) Check if my bit is set in receivers_mask
+        if (slot->receivers_mask & mask) {
+            uint64_t latency = now_ns() - slot->publish_ns;
+            me->received++;
+            me->latency_total_ns += latency;
+            if (latency > me->latency_max_ns) {
+                me->latency_max_ns = latency;
+            }
+            if (!g_quiet && !stop) {
+                safe_print("[T%d] Received message %lu: '%s'\n", myID,
+                           (unsigned long)s, slot->message);
+                safe_print("[T%d] Message timestamp: %s (%.1f us after publish)\n",
+                           myID, slot->message_timestamp, latency / 1000.0);
+            }
+        }
+
+        // 3) Hand the slot back; T1 may overwrite it from here on
+        ring_release(me, s);
+        if (stop) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+
+// Start N receiver threads running fn
+static int start_receivers(pthread_t **threads, receiver_arg_t **args,
+                      void *(*fn)(void *)) {
+    *threads = calloc(N, sizeof(pthread_t));
+    *args = calloc(N, sizeof(receiver_arg_t));
+    if (!*threads || !*args) {
+        perror("calloc rx data");
+        return -1;
+    }
+    for (int i = 0; i < N; i++) {
+        (*args)[i].threadID = 2 + i;    // e.g. 2..(N+1)
+        (*args)[i].efdMe    = efdReceivers[i];
+        pthread_create(&(*threads)[i], NULL, fn, &(*args)[i]);
+    }
+    return 0;
+}
+
+static void join_receivers(pthread_t *threads, receiver_arg_t *args) {
+    for (int i = 0; i < N; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(args);
+}
+
+
+// ----- msync design (benchmark only) -----
+
+static void* msync_receiver_thread(void *arg) {
+    receiver_arg_t *rarg = (receiver_arg_t*)arg;
+    int i = rarg->threadID - 2;
+    uint32_t mask = (1u << i);
+    reader_state_t *me = &g_ring->readers[i];   // statistics only
 
     while (1) {
         // 1) Wait until T1 signals me
-        wait_eventfd(efdMe);
+        wait_eventfd(rarg->efdMe);
+        me->wakeups++;
 
         // 2) msync read => get updated data
         if (msync(g_shared, g_shm_size, MS_SYNC | MS_INVALIDATE) < 0) {
             perror("[Rx] msync read");
         }
-
-        // 3) Check if my bit is set in receivers_mask
-        uint32_t mask = (1 << i);
+        if (g_shared->stop) {
+            break;
+        }
         if ((g_shared->receivers_mask & mask) == 0) {
-            // Not for me => ignore
             continue;
         }
 
-        // We are targeted => read the message
-        safe_print("[T%d] Received message: '%s'\n", myID, g_shared->message);
-        safe_print("[T%d] Message timestamp: %s\n", myID, g_shared->message_timestamp);
-
-        // Build a response (just a simple string)
-        snprintf(g_shared->response, MSG_SIZE, 
-                 "T%d acked the message (maskBit=%u)", myID, mask);
-
-        // Set response timestamp
-        get_timestamp_ms(g_shared->response_timestamp, sizeof(g_shared->response_timestamp));
+        uint64_t latency = now_ns() - g_shared->publish_ns;
+        me->received++;
+        me->latency_total_ns += latency;
+        if (latency > me->latency_max_ns) {
+            me->latency_max_ns = latency;
+        }
+        snprintf(g_shared->response, MSG_SIZE,
+                 "T%d acked the message (maskBit=%u)", rarg->threadID, mask);
 
-        // 4) Set my bit in ack_mask
-        g_shared->ack_mask |= mask;
+        // 3) Set my bit in ack_mask. A plain |= can lose another receiver's
+        // bit and leave T1 waiting forever, so this one is atomic.
+        __atomic_fetch_or(&g_shared->ack_mask, mask, __ATOMIC_SEQ_CST);
 
-        // 5) msync => so T1 sees it
+        // 4) msync => so T1 sees it, then signal T1
         if (msync(g_shared, g_shm_size, MS_SYNC | MS_INVALIDATE) < 0) {
             perror("[Rx] msync write");
         }
-
-        // 6) signal T1 => "I have acked"
         signal_eventfd(efdT1);
     }
     return NULL;
 }
 
+// One message at a time, every receiver targeted, T1 waiting for all acks
+static void msync_publish(uint32_t bitmask, const char *msg) {
+    strncpy(g_shared->message, msg, MSG_SIZE - 1);
+    g_shared->message[MSG_SIZE - 1] = '\0';
+    g_shared->receivers_mask = bitmask;
+    g_shared->ack_mask = 0;
+    g_shared->publish_ns = now_ns();
 
-// main / T1
-// usage: ./prog [N]
-static int main_impl(void) {
-    safe_print("[T1] Will create %d receiver threads (IDs=2..%d)\n", N, N+1);
+    if (msync(g_shared, g_shm_size, MS_SYNC | MS_INVALIDATE) < 0) {
+        perror("[T1] msync write");
+    }
+    for (int i = 0; i < N; i++) {
+        if (bitmask & (1u << i)) {
+            signal_eventfd(efdReceivers[i]);
+        }
+    }
+    while (1) {
+        wait_eventfd(efdT1);
+        if (msync(g_shared, g_shm_size, MS_SYNC | MS_INVALIDATE) < 0) {
+            perror("[T1] msync read ack");
+        }
+        if (__atomic_load_n(&g_shared->ack_mask, __ATOMIC_SEQ_CST) == bitmask) {
+            break;
+        }
+    }
+}
+
+
+// ----- Benchmark -----
+
+static int map_shared(void) {
+    g_ring = mmap(NULL, g_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (g_ring == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    memset(g_ring, 0, g_ring_size);
+    return 0;
+}
 
-    // 1) create shared memory
-    g_shared = mmap(NULL, g_shm_size,
-                    PROT_READ | PROT_WRITE,
-                    MAP_SHARED | MAP_ANONYMOUS,
-                    -1, 0);
+static void print_bench_row(const char *name, int messages, double seconds) {
+    uint64_t received = 0, wakeups = 0, total_ns = 0, max_ns = 0;
+    for (int i = 0; i < N; i++) {
+        reader_state_t *r = &g_ring->readers[i];
+        received += r->received;
+        wakeups += r->wakeups;
+        total_ns += r->latency_total_ns;
+        if (r->latency_max_ns > max_ns) {
+            max_ns = r->latency_max_ns;
+        }
+    }
+    safe_print("%-16s | %10.0f | %12.1f | %12.1f | %14.2f\n", name,
+               messages / seconds,
+               received ? total_ns / 1000.0 / received : 0.0,
+               max_ns / 1000.0,
+               received ? (double)wakeups / received : 0.0);
+}
+
+static int run_benchmark(void) {
+    pthread_t *threads;
+    receiver_arg_t *args;
+    uint32_t all = (N == 32) ? UINT32_MAX : ((1u << N) - 1);
+    char msg[64];
+
+    g_quiet = 1;
+    safe_print("Broadcasting to %d receivers (msgs/s = messages published per second;\n"
+               "latency = publish to receive; wakeups = eventfd reads per message received)\n\n", N);
+    safe_print("%-16s | %10s | %12s | %12s | %14s\n",
+               "Design", "msgs/s", "avg lat us", "max lat us", "wakeups/msg");
+    safe_print("-----------------+------------+--------------+--------------+---------------\n");
+
+    // 1) msync + single slot + acks
+    if (map_shared() != 0 || open_eventfds() != 0) {
+        return 1;
+    }
+    g_shared = mmap(NULL, g_shm_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
     if (g_shared == MAP_FAILED) {
         perror("mmap");
         return 1;
     }
     memset(g_shared, 0, g_shm_size);
-
-    // 2) create T1's eventfd
-    efdT1 = eventfd(0, 0);
-    if (efdT1 < 0) {
-        perror("eventfd T1");
+    if (start_receivers(&threads, &args, msync_receiver_thread) != 0) {
         return 1;
     }
 
-    // create array of eventfds for each receiver
-    efdReceivers = calloc(N, sizeof(int));
-    if (!efdReceivers) {
-        perror("calloc efdReceivers");
-        return 1;
+    uint64_t start = now_ns();
+    for (int m = 0; m < BENCH_MSYNC_MESSAGES; m++) {
+        snprintf(msg, sizeof(msg), "message %d", m);
+        msync_publish(all, msg);
     }
+    double seconds = (now_ns() - start) / 1e9;
+    g_shared->stop = 1;
+    msync(g_shared, g_shm_size, MS_SYNC | MS_INVALIDATE);
     for (int i = 0; i < N; i++) {
-        efdReceivers[i] = eventfd(0, 0);
-        if (efdReceivers[i] < 0) {
-            perror("eventfd for receiver");
-            return 1;
-        }
+        signal_eventfd(efdReceivers[i]);
     }
+    join_receivers(threads, args);
+    print_bench_row("msync + acks", BENCH_MSYNC_MESSAGES, seconds);
+    munmap(g_shared, g_shm_size);
+    munmap(g_ring, g_ring_size);
+    close_eventfds();
 
-    // 3) start N receiver threads
-    pthread_t *rxThreads = calloc(N, sizeof(pthread_t));
-    receiver_arg_t *rxArgs = calloc(N, sizeof(receiver_arg_t));
-    if (!rxThreads || !rxArgs) {
-        perror("calloc rx data");
+    // 2) Broadcast ring; the clock stops when every receiver has read everything
+    if (map_shared() != 0 || open_eventfds() != 0) {
         return 1;
     }
-    for (int i = 0; i < N; i++) {
-        rxArgs[i].threadID = 2 + i;    // e.g. 2..(N+1)
-        rxArgs[i].efdMe    = efdReceivers[i];
-        pthread_create(&rxThreads[i], NULL, receiver_thread, &rxArgs[i]);
+    if (start_receivers(&threads, &args, receiver_thread) != 0) {
+        return 1;
+    }
+
+    start = now_ns();
+    for (int m = 0; m < BENCH_MESSAGES; m++) {
+        snprintf(msg, sizeof(msg), "message %d", m);
+        ring_publish(all, msg, 0);
+    }
+    ring_publish(0, "", 1);
+    join_receivers(threads, args);
+    seconds = (now_ns() - start) / 1e9;
+    print_bench_row("broadcast ring", BENCH_MESSAGES, seconds);
+    safe_print("\nRing: %lu eventfd writes by T1 for %d messages, T1 waited for space %lu times\n",
+               (unsigned long)g_ring->wakeups_sent, BENCH_MESSAGES,
+               (unsigned long)g_ring->producer_waits);
+
+    munmap(g_ring, g_ring_size);
+    close_eventfds();
+    return 0;
+}
+
+
+// main / T1
+// usage: ./prog [N] [bench]
+static int main_impl(void) {
+    safe_print("[T1] Will create %d receiver threads (IDs=2..%d)\n", N, N+1);
+
+    // 1) create shared memory and the eventfds
+    if (map_shared() != 0 || open_eventfds() != 0) {
+        return 1;
     }
-    uint32_t max_mask = (1 << N) - 1;
+
+    // 2) start N receiver threads
+    pthread_t *rxThreads;
+    receiver_arg_t *rxArgs;
+    if (start_receivers(&rxThreads, &rxArgs, receiver_thread) != 0) {
+        return 1;
+    }
+    uint32_t max_mask = (N == 32) ? UINT32_MAX : ((1u << N) - 1);
     safe_print("[T1] All receivers started. Ready to send bitmask+message.\n");
 
-    // 4) T1 loop
+    // 3) T1 loop: publish and move on, receivers print when they get to it
     while (1) {
         char input[MSG_SIZE];
         safe_print("[T1] Enter: 'bitmask decimal' + ' message' or 'exit':\n> ");
@@ -223,82 +580,40 @@ static int main_impl(void) {
         uint32_t bitmask = strtoul(input, &msg_ptr, 10);
         while (*msg_ptr == ' ') msg_ptr++;
 
-        // fill in shared memory
-        strncpy(g_shared->message, msg_ptr, MSG_SIZE - 1);
-        g_shared->message[MSG_SIZE - 1] = '\0';
-        get_timestamp_ms(g_shared->message_timestamp, sizeof(g_shared->message_timestamp));
-
         if (bitmask > max_mask) {
             safe_print("[T1] Invalid bitmask 0x%X: it exceeds the number of threads (%d). Max=0x%X\n",
                        bitmask, N, max_mask);
             continue;
         }
-        // set receivers_mask
-        g_shared->receivers_mask = bitmask;
-        // clear ack_mask
-        g_shared->ack_mask = 0;
-
-        // msync so receivers see it
-        if (msync(g_shared, g_shm_size, MS_SYNC | MS_INVALIDATE) < 0) {
-            perror("[T1] msync write");
-        }
 
-        // 5) signal each thread whose bit is set in bitmask
-        for (int i = 0; i < N; i++) {
-            uint32_t mask = (1 << i);
-            if ((bitmask & mask) != 0) {
-                signal_eventfd(efdReceivers[i]);
-            }
-        }
-
-        // 6) Wait until ack_mask == receivers_mask
-        while (1) {
-            // wait for *some* ack
-            wait_eventfd(efdT1);
-            // read new ack_mask
-            if (msync(g_shared, g_shm_size, MS_SYNC | MS_INVALIDATE) < 0) {
-                perror("[T1] msync read ack");
-            }
-
-            uint32_t ack = g_shared->ack_mask;
-            if (ack == bitmask) {
-                // all targeted threads have acked
-                break;
-            }
-            else {
-                // not all have acked => keep waiting
-                // but we might want to re-check or do partial log
-                safe_print("[T1] Partial ack: ack_mask=0x%X, still waiting.\n", ack);
-            }
-        }
-
-        // final response: we just store the last thread's response, but we don't know which set last
-        safe_print("[T1] All threads in bitmask 0x%X acked. Last response:\n  '%s'\n",
-                   bitmask, g_shared->response);
-        safe_print("[T1] Response timestamp: %s\n", g_shared->response_timestamp);
+        uint64_t seq = ring_publish(bitmask, msg_ptr, 0);
+        safe_print("[T1] Published message %lu to bitmask 0x%X.\n", (unsigned long)seq, bitmask);
     }
 
-    // Cleanup
-    munmap(g_shared, g_shm_size);
-    close(efdT1);
-    for (int i = 0; i < N; i++) {
-        close(efdReceivers[i]);
-    }
-    free(efdReceivers);
+    // 4) Stop and join the receivers, then clean up
+    ring_publish(0, "", 1);
+    join_receivers(rxThreads, rxArgs);
+    munmap(g_ring, g_ring_size);
+    close_eventfds();
 
-    safe_print("[T1] Main done. (In real code, we'd stop threads & join them.)\n");
+    safe_print("[T1] Main done.\n");
     return 0;
 }
 
 
-// main wrapper to parse N from argv
+// main wrapper to parse N (and "bench") from argv
 int main(int argc, char *argv[]) {
-    if (argc > 1) {
-        N = atoi(argv[1]);
-        if (N < 1) {
-            safe_print("Usage: %s [NumReceivers >=1]\n", argv[0]);
+    int bench = 0;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "bench") == 0) {
+            bench = 1;
+            continue;
+        }
+        N = atoi(argv[a]);
+        if (N < 1 || N > MAX_RECEIVERS) {
+            safe_print("Usage: %s [NumReceivers 1..%d] [bench]\n", argv[0], MAX_RECEIVERS);
             return 1;
         }
     }
-    return main_impl();
+    return bench ? run_benchmark() : main_impl();
 }
@@ -0,0 +1,477 @@
+// Stackless counterpart to 03_co_routines.c: the same Fibonacci generator as a
+// C++20 coroutine, timed against a swapcontext() coroutine and the iterative
+// and recursive versions.
+//
+// A C++20 coroutine has no stack of its own. The compiler turns its body into a
+// state machine and keeps whatever lives across a co_await/co_yield in a heap
+// frame; resume() and suspend are ordinary calls and returns on the caller's
+// stack. The frame is allocated through promise_type::operator new when the
+// coroutine is created, so generator<T> routes it to a free list instead of
+// malloc().
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <ucontext.h>
+#include <sys/time.h>
+
+#include <coroutine>
+#include <new>
+#include <utility>
+
+#define STACK_SIZE 16384
+#define NUM_FIBONACCI 28
+#define NUM_ITERATIONS 10
+#define SWITCH_BENCH_VALUES 1000000     // next() calls, a resume and a suspend each
+#define FRAME_BENCH_GENERATORS 1000000  // generators created and destroyed
+
+// ----- Frame allocator -----
+// Frames are carved from FRAME_CHUNK_SIZE chunks and sorted into free lists by
+// size, rounded up to FRAME_ALIGN. A destroyed generator's frame goes back on its
+// list, and the next generator of the same type takes it from there: after
+// warm-up creating a generator is a pop and destroying it a push. Frames larger
+// than FRAME_MAX_SIZE fall back to operator new.
+// Each frame is preceded by a header recording where it came from, so a frame
+// goes back to its origin even if frame_pool.enabled changed while it was live.
+
+#define FRAME_ALIGN 16
+#define FRAME_MAX_SIZE 1024
+#define FRAME_CHUNK_SIZE (64 * 1024)
+#define FRAME_CLASSES (FRAME_MAX_SIZE / FRAME_ALIGN)
+#define FRAME_HEADER FRAME_ALIGN        // keeps the frame after it aligned
+
+struct FreeFrame {
+    FreeFrame* next;
+};
+
+struct FrameHeader {
+    size_t size_class;          // free list index + 1, 0 from operator new
+};
+
+static_assert(sizeof(FrameHeader) <= FRAME_HEADER, "frame header too large");
+
+struct FramePool {
+    FreeFrame* free_lists[FRAME_CLASSES];
+    char* chunk;                // unused tail of the current chunk
+    size_t chunk_left;
+    void** chunks;              // every chunk, to free them at exit
+    int num_chunks;
+    int max_chunks;
+    bool enabled;               // false: straight to operator new, for comparison
+    unsigned long allocations;
+    unsigned long reused;
+    size_t last_frame_size;     // as requested by the compiler
+};
+
+static FramePool frame_pool = {};
+
+static void* frame_pool_refill(size_t size) {
+    if (frame_pool.num_chunks == frame_pool.max_chunks) {
+        int max = frame_pool.max_chunks ? frame_pool.max_chunks * 2 : 16;
+        void** chunks = (void**)realloc(frame_pool.chunks, max * sizeof(void*));
+        if (!chunks) {
+            throw std::bad_alloc();
+        }
+        frame_pool.chunks = chunks;
+        frame_pool.max_chunks = max;
+    }
+    // The tail of the old chunk is dropped; it is smaller than one frame
+    char* chunk = (char*)aligned_alloc(FRAME_ALIGN, FRAME_CHUNK_SIZE);
+    if (!chunk) {
+        throw std::bad_alloc();
+    }
+    frame_pool.chunks[frame_pool.num_chunks++] = chunk;
+    frame_pool.chunk = chunk + size;
+    frame_pool.chunk_left = FRAME_CHUNK_SIZE - size;
+    return chunk;
+}
+
+void* frame_alloc(size_t size) {
+    frame_pool.allocations++;
+    frame_pool.last_frame_size = size;
+    size_t total = size + FRAME_HEADER;
+    FrameHeader* header;
+    if (!frame_pool.enabled || total > FRAME_MAX_SIZE) {
+        header = (FrameHeader*)::operator new(total);
+        header->size_class = 0;
+        return (char*)header + FRAME_HEADER;
+    }
+
+    size_t rounded = (total + FRAME_ALIGN - 1) & ~(size_t)(FRAME_ALIGN - 1);
+    size_t index = rounded / FRAME_ALIGN - 1;
+    FreeFrame** list = &frame_pool.free_lists[index];
+    if (*list) {
+        header = (FrameHeader*)*list;
+        *list = (*list)->next;
+        frame_pool.reused++;
+    } else if (frame_pool.chunk_left < rounded) {
+        header = (FrameHeader*)frame_pool_refill(rounded);
+    } else {
+        header = (FrameHeader*)frame_pool.chunk;
+        frame_pool.chunk += rounded;
+        frame_pool.chunk_left -= rounded;
+    }
+    header->size_class = index + 1;
+    return (char*)header + FRAME_HEADER;
+}
+
+// The header, not the current setting, says where the frame goes
+void frame_free(void* ptr) {
+    FrameHeader* header = (FrameHeader*)((char*)ptr - FRAME_HEADER);
+    if (header->size_class == 0) {
+        ::operator delete(header);
+        return;
+    }
+    size_t index = header->size_class - 1;
+    FreeFrame* frame = (FreeFrame*)header;
+    frame->next = frame_pool.free_lists[index];
+    frame_pool.free_lists[index] = frame;
+}
+
+void frame_pool_destroy() {
+    for (int i = 0; i < frame_pool.num_chunks; i++) {
+        free(frame_pool.chunks[i]);
+    }
+    free(frame_pool.chunks);
+    frame_pool = {};
+}
+
+// ----- Generator -----
+
+template <typename T>
+class generator {
+public:
+    struct promise_type {
+        T value;
+
+        generator get_return_object() {
+            return generator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        // Start suspended so the first next() runs up to the first co_yield
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        // Stay suspended at the end so done() can be checked; ~generator frees
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(T v) noexcept {
+            value = v;
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() { throw; }
+
+        static void* operator new(size_t size) { return frame_alloc(size); }
+        static void operator delete(void* ptr) { frame_free(ptr); }
+    };
+
+    explicit generator(std::coroutine_handle<promise_type> h) : handle(h) {}
+    generator(generator&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    generator(const generator&) = delete;
+    generator& operator=(const generator&) = delete;
+    ~generator() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    // Run to the next co_yield and return its value, or T() once finished
+    T next() {
+        if (handle.done()) {
+            return T();
+        }
+        handle.resume();
+        return handle.done() ? T() : handle.promise().value;
+    }
+
+    bool done() const { return handle.done(); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Generator function that yields Fibonacci numbers
+generator<unsigned long> fibonacci_generator() {
+    unsigned long a = 0;
+    unsigned long b = 1;
+
+    // Yield the first two Fibonacci numbers
+    co_yield a;
+    co_yield b;
+
+    // Generate and yield the rest of the sequence
+    while (true) {
+        unsigned long next = a + b;
+        a = b;
+        b = next;
+        co_yield next;
+    }
+}
+
+// ----- ucontext Coroutine -----
+// The stackful version from 03_co_routines.c, with its stack in the struct
+
+struct Coroutine {
+    ucontext_t caller;
+    ucontext_t callee;
+    char stack[STACK_SIZE] __attribute__((aligned(16)));
+    unsigned long value;
+    int is_done;
+};
+
+void coroutine_yield(Coroutine* co) {
+    swapcontext(&co->callee, &co->caller);
+}
+
+void ucontext_fibonacci(Coroutine* co) {
+    unsigned long a = 0;
+    unsigned long b = 1;
+
+    co->value = a;
+    coroutine_yield(co);
+
+    co->value = b;
+    coroutine_yield(co);
+
+    while (1) {
+        unsigned long next = a + b;
+        a = b;
+        b = next;
+
+        co->value = next;
+        coroutine_yield(co);
+    }
+}
+
+void coroutine_init(Coroutine* co) {
+    co->is_done = 0;
+    getcontext(&co->callee);
+    co->callee.uc_stack.ss_sp = co->stack;
+    co->callee.uc_stack.ss_size = STACK_SIZE;
+    co->callee.uc_link = NULL;
+
+    makecontext(&co->callee, (void (*)())ucontext_fibonacci, 1, co);
+}
+
+unsigned long coroutine_next(Coroutine* co) {
+    if (co->is_done) {
+        return 0;
+    }
+    swapcontext(&co->caller, &co->callee);
+    return co->value;
+}
+
+// ----- Traditional Recursive Implementation -----
+
+unsigned long fibonacci_recursive(int n) {
+    if (n <= 0) return 0;
+    if (n == 1) return 1;
+    return fibonacci_recursive(n-1) + fibonacci_recursive(n-2);
+}
+
+// ----- Traditional Iterative Implementation -----
+
+unsigned long fibonacci_iterative(int n) {
+    if (n <= 0) return 0;
+    if (n == 1) return 1;
+
+    unsigned long a = 0;
+    unsigned long b = 1;
+    unsigned long result = 0;
+
+    for (int i = 2; i <= n; i++) {
+        result = a + b;
+        a = b;
+        b = result;
+    }
+
+    return result;
+}
+
+// ----- Helper function to get current time in microseconds -----
+
+double get_time_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec * 1000000 + (double)tv.tv_usec;
+}
+
+double get_time_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// ----- Switch and creation cost -----
+
+// Keeps the compiler from dropping the loops being timed
+static volatile unsigned long sink;
+
+// Each next() is one switch in and one back out, as in 03_co_routines.c
+double measure_generator_switch_ns() {
+    generator<unsigned long> gen = fibonacci_generator();
+    unsigned long sum = 0;
+
+    double start = get_time_nsec();
+    for (int i = 0; i < SWITCH_BENCH_VALUES; i++) {
+        sum += gen.next();
+    }
+    double elapsed = get_time_nsec() - start;
+
+    sink = sum;
+    return elapsed / (2.0 * SWITCH_BENCH_VALUES);
+}
+
+double measure_ucontext_switch_ns() {
+    static Coroutine co;
+    unsigned long sum = 0;
+    coroutine_init(&co);
+
+    double start = get_time_nsec();
+    for (int i = 0; i < SWITCH_BENCH_VALUES; i++) {
+        sum += coroutine_next(&co);
+    }
+    double elapsed = get_time_nsec() - start;
+
+    sink = sum;
+    return elapsed / (2.0 * SWITCH_BENCH_VALUES);
+}
+
+// Creates a generator, takes one value and destroys it, so the frame is
+// allocated and freed each time
+double measure_generator_create_ns(bool pooled) {
+    frame_pool.enabled = pooled;
+    unsigned long sum = 0;
+
+    double start = get_time_nsec();
+    for (int i = 0; i < FRAME_BENCH_GENERATORS; i++) {
+        generator<unsigned long> gen = fibonacci_generator();
+        sum += gen.next();
+    }
+    double elapsed = get_time_nsec() - start;
+
+    sink = sum;
+    frame_pool.enabled = true;
+    return elapsed / FRAME_BENCH_GENERATORS;
+}
+
+// "label 2.50x slower". A time below the timer's resolution reads as zero and
+// gives no ratio.
+void print_ratio(const char* label, double time, double other) {
+    if (time <= 0 || other <= 0) {
+        printf("%s n/a (below timer resolution)\n", label);
+        return;
+    }
+    printf("%s %.2fx %s\n", label, time > other ? time / other : other / time,
+           time > other ? "slower" : "faster");
+}
+
+// ----- Main program with benchmarking -----
+
+int main() {
+    double start_time, end_time;
+    unsigned long result = 0;
+    double generator_time = 0, ucontext_time = 0, recursive_time = 0, iterative_time = 0;
+
+    frame_pool.enabled = true;
+
+    printf("Comparing Fibonacci calculation methods (averaged over %d iterations)\n\n", NUM_ITERATIONS);
+
+    // Run multiple iterations to get more reliable timing
+    for (int iter = 0; iter < NUM_ITERATIONS; iter++) {
+
+        // ----- Test C++20 Generator -----
+
+        start_time = get_time_usec();
+        {
+            generator<unsigned long> gen = fibonacci_generator();
+            for (int i = 0; i <= NUM_FIBONACCI; i++) {
+                result = gen.next();
+            }
+        }
+        end_time = get_time_usec();
+        generator_time += (end_time - start_time);
+
+        printf("Iteration %2d: Fibonacci(%d) using C++20 generator = %lu (%.2f μs)\n",
+               iter+1, NUM_FIBONACCI, result, end_time - start_time);
+
+        // ----- Test ucontext Coroutine -----
+
+        start_time = get_time_usec();
+
+        static Coroutine co;
+        coroutine_init(&co);
+        for (int i = 0; i <= NUM_FIBONACCI; i++) {
+            result = coroutine_next(&co);
+        }
+
+        end_time = get_time_usec();
+        ucontext_time += (end_time - start_time);
+
+        printf("Iteration %2d: Fibonacci(%d) using ucontext coroutine = %lu (%.2f μs)\n",
+               iter+1, NUM_FIBONACCI, result, end_time - start_time);
+
+        // ----- Test Iterative Implementation -----
+
+        start_time = get_time_usec();
+        result = fibonacci_iterative(NUM_FIBONACCI);
+        end_time = get_time_usec();
+        iterative_time += (end_time - start_time);
+
+        printf("Iteration %2d: Fibonacci(%d) using iterative = %lu (%.2f μs)\n",
+               iter+1, NUM_FIBONACCI, result, end_time - start_time);
+
+        // ----- Test Recursive Implementation (only for small n) -----
+
+        if (NUM_FIBONACCI <= 40) {  // Recursive is too slow for larger values
+            start_time = get_time_usec();
+            result = fibonacci_recursive(NUM_FIBONACCI);
+            end_time = get_time_usec();
+            recursive_time += (end_time - start_time);
+
+            printf("Iteration %2d: Fibonacci(%d) using recursive = %lu (%.2f μs)\n\n",
+                   iter+1, NUM_FIBONACCI, result, end_time - start_time);
+        }
+    }
+
+    // Calculate averages
+    generator_time /= NUM_ITERATIONS;
+    ucontext_time /= NUM_ITERATIONS;
+    iterative_time /= NUM_ITERATIONS;
+    recursive_time /= NUM_ITERATIONS;
+
+    printf("\n===== RESULTS (average over %d iterations) =====\n", NUM_ITERATIONS);
+    printf("C++20 generator:          %.2f μs\n", generator_time);
+    printf("Coroutine with ucontext:  %.2f μs\n", ucontext_time);
+    printf("Iterative implementation: %.2f μs\n", iterative_time);
+    printf("Recursive implementation: %.2f μs\n", recursive_time);
+
+    printf("\nPerformance comparison:\n");
+    print_ratio("- Generator vs ucontext: ", generator_time, ucontext_time);
+    print_ratio("- Generator vs Iterative:", generator_time, iterative_time);
+
+    if (NUM_FIBONACCI <= 40) {
+        print_ratio("- Generator vs Recursive:", generator_time, recursive_time);
+    }
+
+    printf("\n===== CONTEXT SWITCH (%d values, 2 switches each) =====\n",
+           SWITCH_BENCH_VALUES);
+    double ucontext_ns = measure_ucontext_switch_ns();
+    double generator_ns = measure_generator_switch_ns();
+    printf("swapcontext():       %8.1f ns per switch\n", ucontext_ns);
+    printf("generator resume():  %8.1f ns per switch (%.1fx faster)\n",
+           generator_ns, ucontext_ns / generator_ns);
+
+    printf("\n===== FRAME (%d generators created and destroyed) =====\n",
+           FRAME_BENCH_GENERATORS);
+    double pooled_ns = measure_generator_create_ns(true);
+    unsigned long allocations = frame_pool.allocations;
+    unsigned long reused = frame_pool.reused;
+    double heap_ns = measure_generator_create_ns(false);
+    printf("Generator frame:     %8zu bytes (ucontext coroutine: %zu bytes with its stack)\n",
+           frame_pool.last_frame_size, sizeof(Coroutine));
+    printf("Create, free list:   %8.1f ns (%lu of %lu frames reused, %d chunks)\n",
+           pooled_ns, reused, allocations, frame_pool.num_chunks);
+    printf("Create, new/delete:  %8.1f ns\n", heap_ns);
+
+    frame_pool_destroy();
+    return 0;
+}
@@ -1,23 +1,58 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ucontext.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 
+#include "co_switch.h"
+
 #define STACK_SIZE 16384
 #define NUM_FIBONACCI 28
 #define NUM_ITERATIONS 10
+#define SWITCH_BENCH_VALUES 1000000     // coroutine_next() calls, two switches each
+#define STACK_BENCH_COROUTINES 100000   // idle coroutines alive at once
 
 // ----- Coroutine Implementation -----
 
+typedef enum {
+    SWITCH_UCONTEXT,        // getcontext()/makecontext()/swapcontext()
+    SWITCH_ASM              // co_switch()
+} SwitchKind;
+
+#ifdef HAVE_ASM_SWITCH
+#define DEFAULT_SWITCH SWITCH_ASM
+#else
+#define DEFAULT_SWITCH SWITCH_UCONTEXT
+#endif
+
 typedef struct {
+    SwitchKind kind;
     ucontext_t caller;
     ucontext_t callee;
-    char stack[STACK_SIZE];
+    void* caller_sp;        // SWITCH_ASM: saved stack pointers
+    void* callee_sp;
+    StackPool* pool;
+    char* stack;
     unsigned long value;
     int is_done;
 } Coroutine;
 
+// Give control back to whoever called coroutine_next()
+void coroutine_yield(Coroutine* co) {
+#ifdef HAVE_ASM_SWITCH
+    if (co->kind == SWITCH_ASM) {
+        co_switch(&co->callee_sp, co->caller_sp);
+        return;
+    }
+#endif
+    swapcontext(&co->callee, &co->caller);
+}
+
 // Generator function that yields Fibonacci numbers
 void fibonacci_generator(Coroutine* co) {
     unsigned long a = 0;
@@ -25,10 +60,10 @@ void fibonacci_generator(Coroutine* co) {
     
     // Yield the first two Fibonacci numbers
     co->value = a;
-    swapcontext(&co->callee, &co->caller);
+    coroutine_yield(co);
     
     co->value = b;
-    swapcontext(&co->callee, &co->caller);
+    coroutine_yield(co);
     
     // Generate and yield the rest of the sequence
     while (1) {
@@ -37,23 +72,72 @@ void fibonacci_generator(Coroutine* co) {
         b = next;
         
         co->value = next;
-        swapcontext(&co->callee, &co->caller);
+        coroutine_yield(co);
     }
-    
-    // Never reached, but good practice
+}
+
+// Runs on the coroutine's stack. A coroutine has nowhere to return to, so once
+// the generator ends it keeps handing control back as done.
+void coroutine_entry(void* arg) {
+    Coroutine* co = (Coroutine*)arg;
+    fibonacci_generator(co);
     co->is_done = 1;
+    while (1) {
+        coroutine_yield(co);
+    }
 }
 
-// Initialize a coroutine
-void coroutine_init(Coroutine* co) {
+// Initialize a coroutine that switches with the given mechanism, taking its
+// stack from pool
+int coroutine_init_in(Coroutine* co, SwitchKind kind, StackPool* pool) {
     co->is_done = 0;
-    
+    co->kind = kind;
+    co->pool = pool;
+    co->stack = stack_alloc(pool);
+    if (!co->stack) {
+        return -1;
+    }
+
+#ifdef HAVE_ASM_SWITCH
+    if (kind == SWITCH_ASM) {
+        co->callee_sp = switch_frame_init(co->stack, pool->stack_size, coroutine_entry, co);
+        return 0;
+    }
+#endif
+    co->kind = SWITCH_UCONTEXT;
     getcontext(&co->callee);
     co->callee.uc_stack.ss_sp = co->stack;
-    co->callee.uc_stack.ss_size = STACK_SIZE;
+    co->callee.uc_stack.ss_size = pool->stack_size;
     co->callee.uc_link = NULL;
     
-    makecontext(&co->callee, (void (*)())fibonacci_generator, 1, co);
+    makecontext(&co->callee, (void (*)())coroutine_entry, 1, co);
+    return 0;
+}
+
+// Stacks of STACK_SIZE shared by every coroutine not given a pool
+StackPool* default_stack_pool() {
+    static StackPool pool;
+    if (pool.page_size == 0 && stack_pool_init(&pool, STACK_SIZE, 64) != 0) {
+        exit(1);
+    }
+    return &pool;
+}
+
+int coroutine_init_with(Coroutine* co, SwitchKind kind) {
+    return coroutine_init_in(co, kind, default_stack_pool());
+}
+
+// Initialize a coroutine, with the assembly switch where there is one
+int coroutine_init(Coroutine* co) {
+    return coroutine_init_with(co, DEFAULT_SWITCH);
+}
+
+// Give the stack back. The coroutine must not be resumed afterwards.
+void coroutine_destroy(Coroutine* co) {
+    if (co->stack) {
+        stack_release(co->pool, co->stack);
+        co->stack = NULL;
+    }
 }
 
 // Get next value from the coroutine
@@ -63,6 +147,12 @@ unsigned long coroutine_next(Coroutine* co) {
     }
     
     // Resume the coroutine execution
+#ifdef HAVE_ASM_SWITCH
+    if (co->kind == SWITCH_ASM) {
+        co_switch(&co->caller_sp, co->callee_sp);
+        return co->value;
+    }
+#endif
     swapcontext(&co->caller, &co->callee);
     
     return co->value;
@@ -103,12 +193,167 @@ double get_time_usec() {
     return (double)tv.tv_sec * 1000000 + (double)tv.tv_usec;
 }
 
+double get_time_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// ----- Context switch cost -----
+
+// Each coroutine_next() switches into the generator and back out
+double measure_switch_ns(SwitchKind kind) {
+    Coroutine co;
+    unsigned long sink = 0;
+    if (coroutine_init_with(&co, kind) != 0) {
+        return 0;
+    }
+
+    double start = get_time_nsec();
+    for (int i = 0; i < SWITCH_BENCH_VALUES; i++) {
+        sink += coroutine_next(&co);
+    }
+    double elapsed = get_time_nsec() - start;
+    coroutine_destroy(&co);
+
+    // Keep the loop from being optimized away
+    if (sink == 42) {
+        printf(" ");
+    }
+    return elapsed / (2.0 * SWITCH_BENCH_VALUES);
+}
+
+// ----- Stack cost -----
+
+// Resident set size in bytes, from /proc/self/statm
+long resident_bytes() {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (!f) {
+        return 0;
+    }
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Each guarded stack is two mappings, and the kernel caps a process at
+// vm.max_map_count of them
+int max_guarded_stacks() {
+    long limit = 65530;
+    FILE* f = fopen("/proc/sys/vm/max_map_count", "r");
+    if (f) {
+        if (fscanf(f, "%ld", &limit) != 1) {
+            limit = 65530;
+        }
+        fclose(f);
+    }
+    long stacks = (limit - 1000) / 2;       // leave room for everything else
+    return stacks < STACK_BENCH_COROUTINES ? (int)stacks : STACK_BENCH_COROUTINES;
+}
+
+double per_second(int count, double nsec) {
+    return nsec > 0 ? count * 1e9 / nsec : 0;
+}
+
+// Creates count idle coroutines, each resumed once so it sits suspended inside
+// the generator, then destroys and recreates them from the free list. Prints the
+// resident memory they cost and how fast stacks come and go.
+void measure_stacks() {
+    int count = max_guarded_stacks();
+    StackPool pool;
+    if (stack_pool_init(&pool, STACK_SIZE, count) != 0) {
+        return;
+    }
+    Coroutine* cos = calloc(count, sizeof(Coroutine));
+    if (!cos) {
+        perror("calloc");
+        stack_pool_destroy(&pool);
+        return;
+    }
+    // Fault in the Coroutine structs first so only the stacks are counted
+    memset(cos, 0xff, count * sizeof(Coroutine));
+    unsigned long sink = 0;
+
+    printf("\n===== COROUTINE STACKS (%d idle coroutines, %d KB stacks + guard page) =====\n",
+           count, STACK_SIZE / 1024);
+    if (count < STACK_BENCH_COROUTINES) {
+        printf("(vm.max_map_count allows %d guarded stacks; raise it for %d)\n",
+               count, STACK_BENCH_COROUTINES);
+    }
+
+    long rss_before = resident_bytes();
+    double start = get_time_nsec();
+    int created = 0;
+    while (created < count && coroutine_init_in(&cos[created], DEFAULT_SWITCH, &pool) == 0) {
+        created++;
+    }
+    double fresh_ns = get_time_nsec() - start;
+    for (int i = 0; i < created; i++) {
+        sink += coroutine_next(&cos[i]);
+    }
+    long rss_idle = resident_bytes();
+
+    start = get_time_nsec();
+    for (int i = 0; i < created; i++) {
+        coroutine_destroy(&cos[i]);
+    }
+    double release_ns = get_time_nsec() - start;
+    long rss_released = resident_bytes();
+
+    start = get_time_nsec();
+    for (int i = 0; i < created; i++) {
+        coroutine_init_in(&cos[i], DEFAULT_SWITCH, &pool);
+    }
+    double reuse_ns = get_time_nsec() - start;
+    for (int i = 0; i < created; i++) {
+        coroutine_destroy(&cos[i]);
+    }
+
+    // Same churn without the free list: mmap(), mprotect() and munmap() each time
+    StackPool unpooled;
+    stack_pool_init(&unpooled, STACK_SIZE, 0);
+    start = get_time_nsec();
+    for (int i = 0; i < created; i++) {
+        if (coroutine_init_in(&cos[i], DEFAULT_SWITCH, &unpooled) == 0) {
+            coroutine_destroy(&cos[i]);
+        }
+    }
+    double unpooled_ns = get_time_nsec() - start;
+
+    if (created > 0) {
+        printf("Coroutine struct:        %8zu bytes (not counted below)\n", sizeof(Coroutine));
+        printf("Reserved per stack:      %8zu KB\n", (pool.stack_size + pool.page_size) / 1024);
+        printf("RSS per idle coroutine:  %8.1f KB\n",
+               (rss_idle - rss_before) / 1024.0 / created);
+        printf("RSS per stack released:  %8.1f KB (%s)\n",
+               (rss_released - rss_before) / 1024.0 / created,
+               pool.release_advice == MADV_DONTNEED ? "MADV_DONTNEED"
+                   : "MADV_FREE, counted until reclaimed");
+        printf("Create, fresh mmap:      %10.0f /s\n", per_second(created, fresh_ns));
+        printf("Destroy to free list:    %10.0f /s\n", per_second(created, release_ns));
+        printf("Create from free list:   %10.0f /s (%lu mapped, %lu reused)\n",
+               per_second(created, reuse_ns), pool.mapped, pool.reused);
+        printf("Create+destroy unpooled: %10.0f /s\n", per_second(created, unpooled_ns));
+    }
+
+    stack_pool_destroy(&unpooled);
+    stack_pool_destroy(&pool);
+    free(cos);
+    if (sink == 42) {
+        printf(" ");
+    }
+}
+
 // ----- Main program with benchmarking -----
 
 int main() {
     double start_time, end_time;
     unsigned long result;
     double coroutine_time = 0, recursive_time = 0, iterative_time = 0;
+    double ucontext_time = 0;
     
     printf("Comparing Fibonacci calculation methods (averaged over %d iterations)\n\n", NUM_ITERATIONS);
     
@@ -120,7 +365,9 @@ int main() {
         start_time = get_time_usec();
         
         Coroutine co;
-        coroutine_init(&co);
+        if (coroutine_init(&co) != 0) {
+            return 1;
+        }
         
         // Skip to the nth Fibonacci number
         for (int i = 0; i <= NUM_FIBONACCI; i++) {
@@ -133,6 +380,25 @@ int main() {
         printf("Iteration %2d: Fibonacci(%d) using coroutine = %lu (%.2f μs)\n", 
                iter+1, NUM_FIBONACCI, result, end_time - start_time);
         
+        // ----- Same with swapcontext() -----
+        
+        coroutine_destroy(&co);
+        start_time = get_time_usec();
+        
+        if (coroutine_init_with(&co, SWITCH_UCONTEXT) != 0) {
+            return 1;
+        }
+        for (int i = 0; i <= NUM_FIBONACCI; i++) {
+            result = coroutine_next(&co);
+        }
+        
+        end_time = get_time_usec();
+        coroutine_destroy(&co);
+        ucontext_time += (end_time - start_time);
+        
+        printf("Iteration %2d: Fibonacci(%d) using ucontext coroutine = %lu (%.2f μs)\n", 
+               iter+1, NUM_FIBONACCI, result, end_time - start_time);
+        
         // ----- Test Iterative Implementation -----
         
         start_time = get_time_usec();
@@ -158,11 +424,19 @@ int main() {
     
     // Calculate averages
     coroutine_time /= NUM_ITERATIONS;
+    ucontext_time /= NUM_ITERATIONS;
     iterative_time /= NUM_ITERATIONS;
     recursive_time /= NUM_ITERATIONS;
     
     printf("\n===== RESULTS (average over %d iterations) =====\n", NUM_ITERATIONS);
-    printf("Coroutine implementation: %.2f μs\n", coroutine_time);
+    printf("Coroutine implementation: %.2f μs (%s switch)\n", coroutine_time,
+#ifdef HAVE_ASM_SWITCH
+           "assembly"
+#else
+           "ucontext"
+#endif
+           );
+    printf("Coroutine with ucontext:  %.2f μs\n", ucontext_time);
     printf("Iterative implementation: %.2f μs\n", iterative_time);
     printf("Recursive implementation: %.2f μs\n", recursive_time);
     
@@ -181,5 +455,18 @@ int main() {
                iterative_time > recursive_time ? "slower" : "faster");
     }
     
+    printf("\n===== CONTEXT SWITCH (%d values, 2 switches each) =====\n",
+           SWITCH_BENCH_VALUES);
+    double ucontext_ns = measure_switch_ns(SWITCH_UCONTEXT);
+    printf("swapcontext(): %8.1f ns per switch\n", ucontext_ns);
+#ifdef HAVE_ASM_SWITCH
+    double asm_ns = measure_switch_ns(SWITCH_ASM);
+    printf("co_switch():   %8.1f ns per switch (%.1fx faster)\n", asm_ns, ucontext_ns / asm_ns);
+#else
+    printf("co_switch():   not available on this architecture\n");
+#endif
+    
+    measure_stacks();
+    
     return 0;
 }
\ No newline at end of file
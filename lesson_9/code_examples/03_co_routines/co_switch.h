@@ -0,0 +1,288 @@
+// Coroutine building blocks shared by 03_co_routines and the green thread
+// backend of 05_event_driven_server: a hand-written context switch and a pool
+// of guarded, recycled stacks. Each example is a single translation unit, so
+// everything here is static and co_switch() is emitted once per program.
+#ifndef CO_SWITCH_H
+#define CO_SWITCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// ----- Context switch -----
+// swapcontext() saves and restores the signal mask, a system call each time, and
+// the whole register file. Switching between coroutines that are plain function
+// calls to each other only needs what a function must preserve for its caller:
+// co_switch() pushes the callee-saved registers, stores the stack pointer in
+// *save_sp, loads load_sp and pops the registers saved there. Everything else
+// the compiler already treats as clobbered by the call.
+
+#if defined(__x86_64__) || defined(__aarch64__) || defined(__arm__)
+#define HAVE_ASM_SWITCH 1
+#endif
+
+#ifdef HAVE_ASM_SWITCH
+
+void co_switch(void** save_sp, void* load_sp);
+void co_trampoline(void);
+
+#if defined(__x86_64__)
+
+// rbx, rbp, r12-r15, plus the SSE and x87 control words. The first
+// switch into a coroutine "returns" into co_trampoline, which calls
+// r13(r12).
+#define SWITCH_FRAME_WORDS 8
+#define FRAME_ARG 4                     // r12
+#define FRAME_ENTRY 3                   // r13
+#define FRAME_RETURN 7
+
+__asm__(
+    ".text\n"
+    ".globl co_switch\n"
+    ".type co_switch, @function\n"
+    "co_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size co_switch, .-co_switch\n"
+    ".globl co_trampoline\n"
+    ".type co_trampoline, @function\n"
+    "co_trampoline:\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n"
+    ".size co_trampoline, .-co_trampoline\n"
+);
+
+#elif defined(__aarch64__)
+
+// x19-x28, fp, lr and the low halves of d8-d15. The first switch returns
+// through lr into co_trampoline, which calls x20(x19).
+#define SWITCH_FRAME_WORDS 20
+#define FRAME_ARG 0                     // x19
+#define FRAME_ENTRY 1                   // x20
+#define FRAME_RETURN 11                 // x30
+
+__asm__(
+    ".text\n"
+    ".globl co_switch\n"
+    ".type co_switch, %function\n"
+    "co_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size co_switch, .-co_switch\n"
+    ".globl co_trampoline\n"
+    ".type co_trampoline, %function\n"
+    "co_trampoline:\n"
+    "    mov x0, x19\n"
+    "    blr x20\n"
+    "    brk #0\n"
+    ".size co_trampoline, .-co_trampoline\n"
+);
+
+#else  // __arm__
+
+// r3 (padding, keeps the frame a multiple of 8 bytes), r4-r11, lr and, with
+// a VFP unit, d8-d15. The first switch pops co_trampoline into pc, which
+// calls r5(r4). Works from ARM and Thumb-2 code alike.
+#if defined(__ARM_FP)
+#define SWITCH_VFP 1
+#define SWITCH_FRAME_WORDS 26
+#define FRAME_VFP_WORDS 16
+#else
+#define SWITCH_FRAME_WORDS 10
+#define FRAME_VFP_WORDS 0
+#endif
+#define FRAME_ARG (FRAME_VFP_WORDS + 1)         // r4
+#define FRAME_ENTRY (FRAME_VFP_WORDS + 2)       // r5
+#define FRAME_RETURN (FRAME_VFP_WORDS + 9)      // lr, popped into pc
+
+#ifdef SWITCH_VFP
+#define SWITCH_VPUSH "    vpush {d8-d15}\n"
+#define SWITCH_VPOP "    vpop {d8-d15}\n"
+#else
+#define SWITCH_VPUSH ""
+#define SWITCH_VPOP ""
+#endif
+
+__asm__(
+    ".text\n"
+    ".syntax unified\n"
+    ".globl co_switch\n"
+    ".type co_switch, %function\n"
+    "co_switch:\n"
+    "    push {r3-r11, lr}\n"
+    SWITCH_VPUSH
+    "    mov r2, sp\n"
+    "    str r2, [r0]\n"
+    "    mov sp, r1\n"
+    SWITCH_VPOP
+    "    pop {r3-r11, pc}\n"
+    ".size co_switch, .-co_switch\n"
+    ".globl co_trampoline\n"
+    ".type co_trampoline, %function\n"
+    "co_trampoline:\n"
+    "    mov r0, r4\n"
+    "    blx r5\n"
+    "    udf #0\n"
+    ".size co_trampoline, .-co_trampoline\n"
+);
+
+#endif
+
+// Lay out a frame at the top of stack as if co_switch() had saved it, so that
+// switching to the returned stack pointer starts entry(arg)
+static inline void* switch_frame_init(char* stack, size_t size, void (*entry)(void*), void* arg) {
+    // The trampoline runs with the stack pointer at top, 16-byte aligned
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+    uintptr_t* frame = (uintptr_t*)top - SWITCH_FRAME_WORDS;
+    for (int i = 0; i < SWITCH_FRAME_WORDS; i++) {
+        frame[i] = 0;
+    }
+#if defined(__x86_64__)
+    // Default control words: all exceptions masked, round to nearest
+    ((uint32_t*)frame)[0] = 0x1F80;
+    ((uint16_t*)frame)[2] = 0x037F;
+#endif
+    frame[FRAME_ARG] = (uintptr_t)arg;
+    frame[FRAME_ENTRY] = (uintptr_t)entry;
+    frame[FRAME_RETURN] = (uintptr_t)co_trampoline;
+    return frame;
+}
+
+#endif  // HAVE_ASM_SWITCH
+
+// ----- Stack allocator -----
+// Every stack is its own mapping with a PROT_NONE guard page below it, so running
+// off the end faults instead of scribbling over the neighbour. MAP_NORESERVE
+// leaves the pages uncommitted until the coroutine touches them: an idle
+// generator costs the one or two pages it has used, not STACK_SIZE. Released
+// stacks go on a free list after madvise() hands their pages back, which skips
+// the mmap()/mprotect()/munmap() system calls and the VMA churn on reuse.
+
+typedef struct {
+    size_t stack_size;      // usable bytes, a multiple of the page size
+    size_t page_size;
+    char** free_list;       // released stacks, by lowest usable address
+    int free_count;
+    int free_capacity;
+    int release_advice;     // MADV_FREE, or MADV_DONTNEED where the kernel lacks it
+    unsigned long mapped;   // stacks created with mmap()
+    unsigned long reused;   // stacks handed out again from the free list
+} StackPool;
+
+// Keep up to free_capacity released stacks for reuse; 0 unmaps on release
+static inline int stack_pool_init(StackPool* pool, size_t stack_size, int free_capacity) {
+    memset(pool, 0, sizeof(*pool));
+    pool->page_size = (size_t)sysconf(_SC_PAGESIZE);
+    pool->stack_size = (stack_size + pool->page_size - 1) & ~(pool->page_size - 1);
+    pool->free_capacity = free_capacity;
+#ifdef MADV_FREE
+    pool->release_advice = MADV_FREE;
+#else
+    pool->release_advice = MADV_DONTNEED;
+#endif
+    if (free_capacity > 0) {
+        pool->free_list = malloc(free_capacity * sizeof(char*));
+        if (!pool->free_list) {
+            perror("malloc");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static inline char* stack_alloc(StackPool* pool) {
+    if (pool->free_count > 0) {
+        pool->reused++;
+        return pool->free_list[--pool->free_count];
+    }
+
+    size_t total = pool->stack_size + pool->page_size;
+    char* base = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    // Stacks grow down, so the guard goes at the low end
+    if (mprotect(base, pool->page_size, PROT_NONE) != 0) {
+        perror("mprotect");
+        munmap(base, total);
+        return NULL;
+    }
+    pool->mapped++;
+    return base + pool->page_size;
+}
+
+static inline void stack_release(StackPool* pool, char* stack) {
+    if (pool->free_count == pool->free_capacity) {
+        munmap(stack - pool->page_size, pool->stack_size + pool->page_size);
+        return;
+    }
+
+    // MADV_FREE lets the kernel take the pages when it needs them and is cheaper
+    // than MADV_DONTNEED, which drops them now; both leave the mapping in place
+    if (madvise(stack, pool->stack_size, pool->release_advice) != 0 &&
+        errno == EINVAL && pool->release_advice != MADV_DONTNEED) {
+        pool->release_advice = MADV_DONTNEED;
+        madvise(stack, pool->stack_size, pool->release_advice);
+    }
+    pool->free_list[pool->free_count++] = stack;
+}
+
+static inline void stack_pool_destroy(StackPool* pool) {
+    for (int i = 0; i < pool->free_count; i++) {
+        munmap(pool->free_list[i] - pool->page_size, pool->stack_size + pool->page_size);
+    }
+    free(pool->free_list);
+    memset(pool, 0, sizeof(*pool));
+}
+
+#endif  // CO_SWITCH_H
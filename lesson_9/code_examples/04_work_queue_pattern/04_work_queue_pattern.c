@@ -1,31 +1,184 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <time.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <math.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #define MAX_QUEUE_SIZE 100
 #define NUM_WORKERS 4
 #define NUM_TASKS 20
+#define CACHE_LINE 64
 
-// Task structure
-typedef struct {
+#define BENCH_TASKS (1 << 20)       // Total tasks per benchmark run
+#define BENCH_MAX_THREADS 64
+#define BENCH_SAMPLE_EVERY 16       // Time one enqueue out of this many
+
+#define DEQUE_INITIAL_SIZE 1024     // Per worker, doubles when full
+#define STEAL_BENCH_FIB 32
+#define STEAL_BENCH_FIB_CUTOFF 10   // fib(n) below this runs serially
+#define STEAL_BENCH_SORT (1 << 22)  // Elements to quicksort
+#define STEAL_BENCH_SORT_CUTOFF 4096
+#define STEAL_BENCH_TINY (1 << 20)  // Fine-grained tasks per run
+
+#define TASK_PAYLOAD_SIZE 48        // Inline payload; a Task fills two cache lines on LP64
+#define TASK_CHUNK 64               // Tasks per heap allocation when a cache runs dry
+#define TASK_RETURN_BATCH 32        // Tasks handed back to another thread's cache at once
+
+#define BULK_BENCH_DEQUEUE 32       // Tasks a consumer takes at once in the bulk benchmark
+
+#define NUM_LANES 3                 // Priority lanes of QUEUE_LANES, 0 is the most urgent
+#define EDF_LANE NUM_LANES          // Index of the earliest-deadline-first lane
+#define HISTOGRAM_BUCKETS 32        // Bucket i counts delays in [2^(i-1), 2^i) microseconds
+#define LANE_BENCH_SECONDS 2
+#define LANE_BENCH_LOW_US 20        // Work per low-priority task
+#define LANE_BENCH_HIGH_RATE 1000   // High-priority tasks per second
+
+#define ELASTIC_TICK_MS 10          // How often the elastic pool looks at its queue
+#define ELASTIC_BENCH_CPU_US 200    // Work per task in the elastic benchmark
+#define ELASTIC_BENCH_IO_MS 20      // Simulated I/O per blocking task
+
+#define TOPO_BENCH_SET (256 * 1024) // Working set written by a producer, read by its task
+#define TOPO_BENCH_PASSES 4         // Reads of the working set per task
+#define TOPO_BENCH_SLOTS 2          // Working sets in flight per producer
+#define TOPO_BENCH_TASKS 1000       // Tasks per producer
+#define TOPO_BENCH_RUNS 3
+
+#define WAIT_SPIN_MAX_NS 100000     // Longest a consumer spins before it parks
+#define WAIT_SPIN_MIN_NS 2000       // Shortest spin once spinning is worth it at all
+#define WAIT_SPIN_PAUSES 64         // Polls with a pause instruction before yielding instead
+#define WAIT_BENCH_MS 500           // Per run
+#define WAIT_BENCH_CONSUMERS 2
+
+#define PARALLEL_CHUNK_NS 50000     // Target time per chunk of an automatic-grain loop
+#define PARALLEL_MIN_CHUNKS 4       // Automatic grain leaves at least this many per runner
+#define PARALLEL_PROBE_GRAIN 4096   // Largest first chunk, the one that gets timed
+#define PARALLEL_MAX_VALUE CACHE_LINE   // Largest parallel_reduce() value
+#define PARALLEL_BENCH_SIZE (1 << 23)   // Doubles in the parallel loop benchmark
+#define PARALLEL_BENCH_RUNS 5       // Best of
+
+#define PARK_STRESS_TASKS 50000     // Per run
+#define PARK_STRESS_BURST 16        // Tasks enqueued back to back
+#define PARK_STRESS_STALL_MS 2000   // No progress for this long counts as a lost wakeup
+
+struct TaskGroup;
+struct TaskCache;
+
+// Task structure. Tasks from task_alloc() carry their data inline in payload.
+// Aligned to a cache line so that neighbouring tasks in an array never share one,
+// whatever the pointer size; arrays of tasks come from task_array_alloc().
+typedef struct Task {
     int task_id;
+    int refs;                   // Owners of a task_alloc() task; the last one frees it
     void (*function)(void* data);
     void* data;
-} Task;
+    struct TaskGroup* group;    // Counted down when the task is done (pool and futures)
+    struct Task* next;          // Free list link while the task is not in use
+    struct TaskCache* cache;    // Cache the task came from (task_alloc() only)
+    int priority;               // QUEUE_LANES: lane, 0 is the most urgent
+    uint64_t deadline_ns;       // QUEUE_LANES: absolute CLOCK_MONOTONIC deadline, 0 for none
+    uint64_t enqueued_ns;       // When the task was queued (QUEUE_LANES, elastic_submit())
+    unsigned char payload[TASK_PAYLOAD_SIZE] __attribute__((aligned(16)));
+} __attribute__((aligned(CACHE_LINE))) Task;
+
+// Queue implementations behind the same enqueue_task()/dequeue_task() API
+typedef enum {
+    QUEUE_MUTEX,        // One mutex and two condvars, signalled on every operation
+    QUEUE_MPMC,         // Lock-free bounded ring, workers park only when it is empty
+    QUEUE_LANES         // Priority lanes plus an earliest-deadline-first lane
+} QueueKind;
+
+// What a consumer does when its queue is empty
+typedef enum {
+    WAIT_PARK,          // Sleep right away
+    WAIT_SPIN           // Poll for a self-tuned while, then sleep
+} WaitPolicy;
+
+// How QUEUE_LANES picks among its priority lanes. The EDF lane always goes first.
+typedef enum {
+    LANES_STRICT,       // Lowest-numbered non-empty lane
+    LANES_WEIGHTED      // Non-empty lanes share dequeues in proportion to their weights
+} LanePolicy;
+
+// Queueing delays on log2 microsecond buckets
+typedef struct {
+    long buckets[HISTOGRAM_BUCKETS];
+    long count;
+    double sum_ns;
+    uint64_t max_ns;
+} Histogram;
+
+typedef struct {
+    Task* tasks[MAX_QUEUE_SIZE];
+    int front;
+    int count;
+    int weight;
+    int credit;         // Smooth weighted round robin state
+    Histogram delay;
+} Lane;
+
+// One slot of the lock-free ring. The sequence number says whose turn it is:
+// == position: free for the producer claiming that position
+// == position + 1: holds a task for the consumer claiming that position
+typedef struct {
+    size_t sequence;
+    Task* task;
+} QueueSlot;
 
 // Work queue structure
 typedef struct {
+    QueueKind kind;
+    bool shutdown;
+
+    // QUEUE_MUTEX
     Task* tasks[MAX_QUEUE_SIZE];
     int front;
     int rear;
     int count;
-    bool shutdown;
     pthread_mutex_t mutex;
     pthread_cond_t not_empty;
     pthread_cond_t not_full;
+    int waiting_consumers;      // Threads in pthread_cond_wait(), so bulk
+    int waiting_producers;      // operations know how many to wake
+
+    // QUEUE_MPMC (Vyukov bounded MPMC queue). The two positions are claimed with
+    // CAS by producers and consumers respectively, so each gets its own cache line.
+    QueueSlot* slots;
+    size_t mask;
+    size_t enqueue_pos __attribute__((aligned(CACHE_LINE)));
+    size_t dequeue_pos __attribute__((aligned(CACHE_LINE)));
+
+    // Parking: a waiter announces itself, re-checks the ring and sleeps on the
+    // epoch futex word. The other side only bumps the epoch and calls futex_wake()
+    // when someone has announced, so a busy queue makes no system calls.
+    uint32_t not_empty_epoch __attribute__((aligned(CACHE_LINE)));
+    int idle_consumers;
+    uint32_t not_full_epoch;
+    int idle_producers;
+
+    // QUEUE_LANES, under the mutex. count above is the total over all lanes.
+    Lane lanes[NUM_LANES];
+    Task* edf[MAX_QUEUE_SIZE];          // Binary min-heap on deadline_ns
+    int edf_count;
+    Histogram edf_delay;
+    LanePolicy lane_policy;
+
+    // Consumers waiting for work, all kinds
+    WaitPolicy wait_policy __attribute__((aligned(CACHE_LINE)));
+    uint64_t wait_gap_ns;               // Moving average of recent waits for a task
+    long spin_hits;                     // Waits that ended while spinning
+    long parks;                         // Waits that went to sleep
 } WorkQueue;
 
 // Task data structure
@@ -34,17 +187,278 @@ typedef struct {
     int processing_time; // in milliseconds
 } TaskData;
 
+// ----- Intrusive tasks from per-thread caches -----
+// task_alloc() hands out tasks from the calling thread's cache, with room for the
+// task's data inline, so a task costs no malloc() once the caches are warm.
+// task_free() on the owning thread puts the task straight back; any other thread
+// collects tasks for the same owner and returns them TASK_RETURN_BATCH at a time
+// with a single CAS. The owner picks up everything returned with one exchange.
+
+typedef struct TaskChunk {
+    Task tasks[TASK_CHUNK];
+    struct TaskChunk* next;
+} TaskChunk;
+
+typedef struct TaskCache {
+    // Owner thread only
+    Task* free_list;
+    TaskChunk* chunks;
+
+    // Tasks freed by the owner that belong to another cache
+    struct TaskCache* batch_owner;
+    Task* batch_head;
+    Task* batch_tail;
+    int batch_count;
+
+    // Batches pushed by other threads (Treiber stack, emptied all at once)
+    Task* returned __attribute__((aligned(CACHE_LINE)));
+
+    // Caches outlive their threads (their tasks may still be in flight), so a
+    // new thread adopts a cache left behind by one that exited
+    bool in_use;
+    struct TaskCache* next_cache;
+} TaskCache;
+
+static pthread_mutex_t task_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static TaskCache* task_caches;
+static pthread_key_t task_cache_key;
+static pthread_once_t task_cache_once = PTHREAD_ONCE_INIT;
+static __thread TaskCache* task_cache;
+
+// aligned_alloc() requires a size that is a multiple of the alignment, which
+// an array of n objects is not in general
+void* cache_aligned_alloc(size_t size) {
+    return aligned_alloc(CACHE_LINE, (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1));
+}
+
+// Every heap allocation made for tasks, counted so the benchmarks can report it
+long task_heap_allocations;
+
+void* task_heap_alloc(size_t size) {
+    __atomic_add_fetch(&task_heap_allocations, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+// Zeroed tasks; malloc() and calloc() do not promise their alignment
+Task* task_array_alloc(size_t count) {
+    Task* tasks = (Task*)cache_aligned_alloc(count * sizeof(Task));
+    if (tasks != NULL) {
+        memset(tasks, 0, count * sizeof(Task));
+    }
+    return tasks;
+}
+
+// Hand a collected batch to its owner
+void task_cache_flush_batch(TaskCache* cache) {
+    if (cache->batch_count == 0) {
+        return;
+    }
+    TaskCache* owner = cache->batch_owner;
+    Task* head = __atomic_load_n(&owner->returned, __ATOMIC_RELAXED);
+    do {
+        cache->batch_tail->next = head;
+    } while (!__atomic_compare_exchange_n(&owner->returned, &head, cache->batch_head, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    cache->batch_owner = NULL;
+    cache->batch_head = NULL;
+    cache->batch_tail = NULL;
+    cache->batch_count = 0;
+}
+
+// Thread exit: return what is still batched and leave the cache for adoption
+void task_cache_thread_exit(void* arg) {
+    TaskCache* cache = (TaskCache*)arg;
+    task_cache_flush_batch(cache);
+    pthread_mutex_lock(&task_caches_lock);
+    cache->in_use = false;
+    pthread_mutex_unlock(&task_caches_lock);
+}
+
+void task_cache_init_key() {
+    pthread_key_create(&task_cache_key, task_cache_thread_exit);
+}
+
+TaskCache* task_cache_get() {
+    if (task_cache != NULL) {
+        return task_cache;
+    }
+    pthread_once(&task_cache_once, task_cache_init_key);
+
+    pthread_mutex_lock(&task_caches_lock);
+    TaskCache* cache = task_caches;
+    while (cache != NULL && cache->in_use) {
+        cache = cache->next_cache;
+    }
+    if (cache == NULL) {
+        size_t size = (sizeof(TaskCache) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+        __atomic_add_fetch(&task_heap_allocations, 1, __ATOMIC_RELAXED);
+        cache = (TaskCache*)cache_aligned_alloc(size);
+        if (cache == NULL) {
+            pthread_mutex_unlock(&task_caches_lock);
+            return NULL;
+        }
+        memset(cache, 0, size);
+        cache->next_cache = task_caches;
+        task_caches = cache;
+    }
+    cache->in_use = true;
+    pthread_mutex_unlock(&task_caches_lock);
+
+    pthread_setspecific(task_cache_key, cache);
+    task_cache = cache;
+    return cache;
+}
+
+// Cut a new chunk of tasks into the free list
+bool task_cache_refill(TaskCache* cache) {
+    size_t size = (sizeof(TaskChunk) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    __atomic_add_fetch(&task_heap_allocations, 1, __ATOMIC_RELAXED);
+    TaskChunk* chunk = (TaskChunk*)cache_aligned_alloc(size);
+    if (chunk == NULL) {
+        return false;
+    }
+    for (int i = 0; i < TASK_CHUNK; i++) {
+        chunk->tasks[i].cache = cache;
+        chunk->tasks[i].next = (i + 1 < TASK_CHUNK) ? &chunk->tasks[i + 1] : NULL;
+    }
+    chunk->next = cache->chunks;
+    cache->chunks = chunk;
+    cache->free_list = &chunk->tasks[0];
+    return true;
+}
+
+// Get a task whose data points at payload_size bytes of zeroed storage, inline
+// when it fits. Returns NULL when out of memory.
+Task* task_alloc(void (*function)(void* data), size_t payload_size) {
+    TaskCache* cache = task_cache_get();
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    Task* task = cache->free_list;
+    if (task == NULL) {
+        task = __atomic_exchange_n(&cache->returned, NULL, __ATOMIC_ACQUIRE);
+        if (task == NULL) {
+            if (!task_cache_refill(cache)) {
+                return NULL;
+            }
+            task = cache->free_list;
+        }
+    }
+
+    void* data = task->payload;
+    if (payload_size > TASK_PAYLOAD_SIZE) {
+        data = task_heap_alloc(payload_size);
+        if (data == NULL) {
+            cache->free_list = task;
+            return NULL;
+        }
+    }
+    cache->free_list = task->next;
+
+    task->task_id = 0;
+    task->refs = 1;
+    task->function = function;
+    task->data = data;
+    task->group = NULL;
+    task->next = NULL;
+    task->priority = 0;
+    task->deadline_ns = 0;
+    task->enqueued_ns = 0;
+    memset(data, 0, payload_size);
+    return task;
+}
+
+void task_free(Task* task);
+
+// Drop one reference to a task from task_alloc(), freeing it after the last
+void task_release(Task* task) {
+    if (__atomic_sub_fetch(&task->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        task_free(task);
+    }
+}
+
+// Give a task from task_alloc() back. Any thread may call this.
+void task_free(Task* task) {
+    if (task->data != task->payload) {
+        free(task->data);
+    }
+
+    TaskCache* mine = task_cache_get();
+    if (task->cache == mine) {
+        task->next = mine->free_list;
+        mine->free_list = task;
+        return;
+    }
+
+    if (mine == NULL) {
+        // No cache of our own to batch in: return this one task directly
+        Task* head = __atomic_load_n(&task->cache->returned, __ATOMIC_RELAXED);
+        do {
+            task->next = head;
+        } while (!__atomic_compare_exchange_n(&task->cache->returned, &head, task, true,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        return;
+    }
+
+    if (mine->batch_owner != task->cache) {
+        task_cache_flush_batch(mine);
+        mine->batch_owner = task->cache;
+    }
+    task->next = mine->batch_head;
+    mine->batch_head = task;
+    if (mine->batch_tail == NULL) {
+        mine->batch_tail = task;
+    }
+    if (++mine->batch_count == TASK_RETURN_BATCH) {
+        task_cache_flush_batch(mine);
+    }
+}
+
 // Create a new work queue
-WorkQueue* create_work_queue() {
-    WorkQueue* queue = (WorkQueue*)malloc(sizeof(WorkQueue));
+WorkQueue* create_work_queue(QueueKind kind) {
+    // The MPMC fields are cache line aligned, so plain malloc() is not enough
+    size_t size = (sizeof(WorkQueue) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    WorkQueue* queue = (WorkQueue*)cache_aligned_alloc(size);
     if (queue == NULL) {
         return NULL;
     }
-    
+    memset(queue, 0, size);
+    queue->kind = kind;
+
+    if (kind == QUEUE_MPMC) {
+        // Ring size must be a power of two; round MAX_QUEUE_SIZE up
+        size_t capacity = 1;
+        while (capacity < MAX_QUEUE_SIZE) {
+            capacity <<= 1;
+        }
+        queue->slots = (QueueSlot*)malloc(capacity * sizeof(QueueSlot));
+        if (queue->slots == NULL) {
+            free(queue);
+            return NULL;
+        }
+        for (size_t i = 0; i < capacity; i++) {
+            queue->slots[i].sequence = i;
+            queue->slots[i].task = NULL;
+        }
+        queue->mask = capacity - 1;
+    }
+    if (kind == QUEUE_LANES) {
+        // Strict by default; weights only matter after set_lane_policy()
+        for (int i = 0; i < NUM_LANES; i++) {
+            queue->lanes[i].weight = 1;
+        }
+        queue->lane_policy = LANES_STRICT;
+    }
+
     queue->front = 0;
     queue->rear = -1;
     queue->count = 0;
     queue->shutdown = false;
+
+    // Spinning waits for another CPU to produce; with a single CPU it only delays it
+    queue->wait_policy = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? WAIT_SPIN : WAIT_PARK;
+    queue->wait_gap_ns = WAIT_SPIN_MAX_NS / 2;
     
     pthread_mutex_init(&queue->mutex, NULL);
     pthread_cond_init(&queue->not_empty, NULL);
@@ -53,8 +467,26 @@ WorkQueue* create_work_queue() {
     return queue;
 }
 
+bool mpmc_try_enqueue(WorkQueue* queue, Task* task);
+Task* mpmc_try_dequeue(WorkQueue* queue);
+void task_discard(Task* task);
+void lanes_drain(WorkQueue* queue);
+
 // Clean up the work queue
 void destroy_work_queue(WorkQueue* queue) {
+    if (queue->kind == QUEUE_LANES) {
+        lanes_drain(queue);
+    }
+
+    if (queue->kind == QUEUE_MPMC) {
+        // No threads are left, so the ring can be drained without parking
+        Task* task;
+        while ((task = mpmc_try_dequeue(queue)) != NULL) {
+            task_discard(task);
+        }
+        free(queue->slots);
+    }
+
     pthread_mutex_lock(&queue->mutex);
     
     // Free any remaining tasks in the queue
@@ -63,8 +495,7 @@ void destroy_work_queue(WorkQueue* queue) {
         queue->front = (queue->front + 1) % MAX_QUEUE_SIZE;
         queue->count--;
         
-        free(task->data);
-        free(task);
+        task_discard(task);
     }
     
     pthread_mutex_unlock(&queue->mutex);
@@ -76,168 +507,4148 @@ void destroy_work_queue(WorkQueue* queue) {
     free(queue);
 }
 
-// Add a task to the queue
-bool enqueue_task(WorkQueue* queue, Task* task) {
-    pthread_mutex_lock(&queue->mutex);
-    
-    // Wait until there's space or the queue is shutting down
-    while (queue->count == MAX_QUEUE_SIZE && !queue->shutdown) {
-        pthread_cond_wait(&queue->not_full, &queue->mutex);
+// ----- Waiting for work -----
+// A consumer that finds its queue empty may poll it for a while before it parks:
+// when the next task is microseconds away, that saves the futex sleep on its
+// side, the futex wake on the producer's side and the wake-up latency. The spin
+// budget follows the queue's recent waits: twice their average, and no spinning
+// at all when tasks arrive too far apart for a spin to catch them. The average
+// keeps learning from parked waits, so spinning comes back when traffic does.
+
+uint64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Tell the CPU this is a spin loop: saves power and yields to an SMT sibling
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+void set_wait_policy(WorkQueue* queue, WaitPolicy policy) {
+    __atomic_store_n(&queue->wait_policy, policy, __ATOMIC_RELAXED);
+}
+
+// Peek without taking anything. Shutdown counts as work: the waiter must see it.
+bool queue_has_work(WorkQueue* queue) {
+    if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
+        return true;
     }
-    
-    // Don't add if we're shutting down
-    if (queue->shutdown) {
-        pthread_mutex_unlock(&queue->mutex);
+    if (queue->kind == QUEUE_MPMC) {
+        size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        QueueSlot* slot = &queue->slots[pos & queue->mask];
+        return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == pos + 1;
+    }
+    return __atomic_load_n(&queue->count, __ATOMIC_RELAXED) > 0;
+}
+
+// Feed one wait into the average. Updates from several consumers may race; the
+// average only has to be roughly right. Long waits are clamped so that a single
+// idle period does not switch spinning off for the next hundred tasks.
+void wait_record(WorkQueue* queue, uint64_t waited_ns) {
+    if (waited_ns > 4 * WAIT_SPIN_MAX_NS) {
+        waited_ns = 4 * WAIT_SPIN_MAX_NS;
+    }
+    int64_t average = (int64_t)__atomic_load_n(&queue->wait_gap_ns, __ATOMIC_RELAXED);
+    average += ((int64_t)waited_ns - average) / 8;
+    __atomic_store_n(&queue->wait_gap_ns, (uint64_t)average, __ATOMIC_RELAXED);
+}
+
+// Called with the queue found empty at begin. True if work showed up while
+// spinning; false means go and park.
+bool wait_spin(WorkQueue* queue, uint64_t begin) {
+    if (__atomic_load_n(&queue->wait_policy, __ATOMIC_RELAXED) != WAIT_SPIN) {
         return false;
     }
-    
-    // Add the task to the queue
-    queue->rear = (queue->rear + 1) % MAX_QUEUE_SIZE;
-    queue->tasks[queue->rear] = task;
-    queue->count++;
-    
-    // Signal that the queue is not empty
-    pthread_cond_signal(&queue->not_empty);
-    
-    pthread_mutex_unlock(&queue->mutex);
-    return true;
+    uint64_t budget = 2 * __atomic_load_n(&queue->wait_gap_ns, __ATOMIC_RELAXED);
+    if (budget > WAIT_SPIN_MAX_NS) {
+        return false;
+    }
+    if (budget < WAIT_SPIN_MIN_NS) {
+        budget = WAIT_SPIN_MIN_NS;
+    }
+
+    for (int i = 0; ; i++) {
+        if (queue_has_work(queue)) {
+            wait_record(queue, clock_ns() - begin);
+            __atomic_add_fetch(&queue->spin_hits, 1, __ATOMIC_RELAXED);
+            return true;
+        }
+        if (clock_ns() - begin > budget) {
+            return false;
+        }
+        // Past the first polls the producer may need this CPU
+        if (i < WAIT_SPIN_PAUSES) {
+            cpu_relax();
+        } else {
+            sched_yield();
+        }
+    }
 }
 
-// Get a task from the queue
-Task* dequeue_task(WorkQueue* queue) {
-    pthread_mutex_lock(&queue->mutex);
-    
-    // Wait until there's a task or the queue is shutting down
-    while (queue->count == 0 && !queue->shutdown) {
-        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+// Called after a parked consumer wakes up
+void wait_woken(WorkQueue* queue, uint64_t begin) {
+    __atomic_add_fetch(&queue->parks, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&queue->wait_policy, __ATOMIC_RELAXED) == WAIT_SPIN) {
+        wait_record(queue, clock_ns() - begin);
     }
-    
-    // If the queue is empty and shutting down, return NULL
-    if (queue->count == 0) {
+}
+
+// Mutex-based queues: called with the mutex held and the queue empty, returns
+// with the mutex held once there may be work or the queue shuts down.
+void wait_not_empty(WorkQueue* queue) {
+    uint64_t begin = clock_ns();
+    if (queue->wait_policy == WAIT_SPIN) {
         pthread_mutex_unlock(&queue->mutex);
-        return NULL;
+        bool found = wait_spin(queue, begin);
+        pthread_mutex_lock(&queue->mutex);
+        if (found || queue->count > 0 || queue->shutdown) {
+            return;
+        }
     }
-    
-    // Get the task from the queue
-    Task* task = queue->tasks[queue->front];
-    queue->front = (queue->front + 1) % MAX_QUEUE_SIZE;
-    queue->count--;
-    
-    // Signal that the queue is not full
-    pthread_cond_signal(&queue->not_full);
-    
-    pthread_mutex_unlock(&queue->mutex);
-    return task;
+    queue->waiting_consumers++;
+    pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    queue->waiting_consumers--;
+    wait_woken(queue, begin);
 }
 
-// Signal all threads to shut down
-void shutdown_work_queue(WorkQueue* queue) {
-    pthread_mutex_lock(&queue->mutex);
-    
-    queue->shutdown = true;
-    
-    // Wake up all waiting threads
-    pthread_cond_broadcast(&queue->not_empty);
-    pthread_cond_broadcast(&queue->not_full);
-    
-    pthread_mutex_unlock(&queue->mutex);
+// ----- Lock-free bounded MPMC queue -----
+
+long futex_wait(uint32_t* word, uint32_t expected) {
+    return syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
 }
 
-// Example task function - processes a value
-void process_task(void* arg) {
-    TaskData* data = (TaskData*)arg;
-    
-    // Get thread ID for demonstration
-    pthread_t thread_id = pthread_self();
-    
-    printf("Thread %lu processing task with value %d (sleep: %d ms)\n", 
-           (unsigned long)thread_id, data->value, data->processing_time);
-    
-    // Simulate processing time
-    usleep(data->processing_time * 1000);
-    
-    printf("Thread %lu completed task with value %d (result: %d)\n", 
-           (unsigned long)thread_id, data->value, data->value * data->value);
+long futex_wake(uint32_t* word, int count) {
+    return syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
 }
 
-// Worker thread function
-void* worker_thread(void* arg) {
-    WorkQueue* queue = (WorkQueue*)arg;
-    
-    pthread_t thread_id = pthread_self();
-    printf("Worker thread %lu started\n", (unsigned long)thread_id);
-    
+// Claim the next enqueue position and publish the task in its slot.
+// Returns false when the ring is full.
+bool mpmc_try_enqueue(WorkQueue* queue, Task* task) {
+    size_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+
     while (true) {
-        // Get the next task from the queue
-        Task* task = dequeue_task(queue);
-        
-        if (task == NULL) {
-            // Queue is being shut down
-            printf("Worker thread %lu shutting down\n", (unsigned long)thread_id);
-            break;
+        QueueSlot* slot = &queue->slots[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0) {
+            // Slot is free for this position; try to claim it
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                slot->task = task;
+                __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            // Lost the race, pos now holds the current value
+        } else if (diff < 0) {
+            // The consumer one lap behind has not freed this slot yet
+            return false;
+        } else {
+            // Another producer claimed this position first
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
         }
-        
-        // Execute the task
-        task->function(task->data);
-        
-        // Clean up
-        free(task);
     }
-    
-    return NULL;
 }
 
-int main() {
-    // Seed the random number generator
-    srand(time(NULL));
-    
-    // Create the work queue
-    WorkQueue* queue = create_work_queue();
-    
-    // Create worker threads
-    pthread_t workers[NUM_WORKERS];
-    printf("Creating %d worker threads\n", NUM_WORKERS);
-    
-    for (int i = 0; i < NUM_WORKERS; i++) {
-        if (pthread_create(&workers[i], NULL, worker_thread, queue) != 0) {
-            fprintf(stderr, "Error creating worker thread %d\n", i);
-            return 1;
+// Claim the next dequeue position and take the task from its slot.
+// Returns NULL when the ring is empty.
+Task* mpmc_try_dequeue(WorkQueue* queue) {
+    size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+
+    while (true) {
+        QueueSlot* slot = &queue->slots[pos & queue->mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                Task* task = slot->task;
+                // Hand the slot to the producer one lap ahead
+                __atomic_store_n(&slot->sequence, pos + queue->mask + 1, __ATOMIC_RELEASE);
+                return task;
+            }
+        } else if (diff < 0) {
+            // Nothing published at this position yet
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
         }
     }
-    
-    // Add tasks to the queue
-    printf("Adding %d tasks to the queue\n", NUM_TASKS);
-    
-    for (int i = 0; i < NUM_TASKS; i++) {
-        // Create task data with random processing time
-        TaskData* data = (TaskData*)malloc(sizeof(TaskData));
-        data->value = i + 1;
-        data->processing_time = 100 + rand() % 900;  // 100-1000ms
-        
-        // Create the task
-        Task* task = (Task*)malloc(sizeof(Task));
-        task->task_id = i + 1;
-        task->function = process_task;
-        task->data = data;
-        
-        // Add to queue
-        enqueue_task(queue, task);
-        
-        // Small delay between task creation
-        usleep(50000);  // 50ms
-    }
-    
-    // Wait for a bit to allow tasks to be processed
-    printf("Waiting for tasks to complete...\n");
-    sleep(5);
-    
-    // Shutdown the queue
-    printf("Shutting down the work queue\n");
+}
+
+// Claim up to count consecutive positions with a single CAS. Only the free
+// prefix is claimed: every slot in it is checked before the CAS, and nobody else
+// can write them once the positions are ours. Returns how many were enqueued.
+int mpmc_try_enqueue_bulk(WorkQueue* queue, Task** tasks, int count) {
+    size_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+
+    while (true) {
+        int n = 0;
+        while (n < count) {
+            QueueSlot* slot = &queue->slots[(pos + n) & queue->mask];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + n) {
+                break;
+            }
+            n++;
+        }
+        if (n == 0) {
+            // Full, unless another producer moved on and this view is stale
+            size_t now = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+            if (now == pos) {
+                return 0;
+            }
+            pos = now;
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + n, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            for (int i = 0; i < n; i++) {
+                QueueSlot* slot = &queue->slots[(pos + i) & queue->mask];
+                slot->task = tasks[i];
+                __atomic_store_n(&slot->sequence, pos + i + 1, __ATOMIC_RELEASE);
+            }
+            return n;
+        }
+    }
+}
+
+// Dequeue counterpart of mpmc_try_enqueue_bulk(). Returns how many were taken.
+int mpmc_try_dequeue_bulk(WorkQueue* queue, Task** tasks, int max) {
+    size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+
+    while (true) {
+        int n = 0;
+        while (n < max) {
+            QueueSlot* slot = &queue->slots[(pos + n) & queue->mask];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + n + 1) {
+                break;
+            }
+            n++;
+        }
+        if (n == 0) {
+            size_t now = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+            if (now == pos) {
+                return 0;
+            }
+            pos = now;
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + n, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            for (int i = 0; i < n; i++) {
+                QueueSlot* slot = &queue->slots[(pos + i) & queue->mask];
+                tasks[i] = slot->task;
+                __atomic_store_n(&slot->sequence, pos + i + queue->mask + 1, __ATOMIC_RELEASE);
+            }
+            return n;
+        }
+    }
+}
+
+// Wake up to count waiters parked on epoch with one system call, if anyone
+// announced they are waiting. There is deliberately no "wakeup already sent"
+// flag: a waiter that backs out after its re-check, or whose task another
+// consumer took first, would leave such a flag set with nobody to clear it, and
+// every later wakeup would be skipped while waiters sleep on a non-empty ring.
+void mpmc_wake_many(uint32_t* epoch, int* idle, int count) {
+    // Orders the slot publish above before the idle check; pairs with the
+    // waiter's announce-then-recheck
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(idle, __ATOMIC_RELAXED) > 0) {
+        __atomic_add_fetch(epoch, 1, __ATOMIC_RELEASE);
+        futex_wake(epoch, count);
+    }
+}
+
+void mpmc_wake(uint32_t* epoch, int* idle) {
+    mpmc_wake_many(epoch, idle, 1);
+}
+
+// Called between announcing and re-checking. Only the park stress test sets
+// it, to widen the window in which a wakeup can race with the re-check.
+void (*park_recheck_hook)(void) = NULL;
+
+uint32_t mpmc_announce(uint32_t* epoch, int* idle) {
+    __atomic_add_fetch(idle, 1, __ATOMIC_SEQ_CST);
+    uint32_t seen = __atomic_load_n(epoch, __ATOMIC_ACQUIRE);
+    if (park_recheck_hook) {
+        park_recheck_hook();
+    }
+    return seen;
+}
+
+// Sleep until the epoch moves on
+void mpmc_park(uint32_t* epoch, uint32_t seen, int* idle) {
+    futex_wait(epoch, seen);
+    __atomic_sub_fetch(idle, 1, __ATOMIC_RELAXED);
+}
+
+bool mpmc_enqueue(WorkQueue* queue, Task* task) {
+    while (true) {
+        if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        if (mpmc_try_enqueue(queue, task)) {
+            mpmc_wake(&queue->not_empty_epoch, &queue->idle_consumers);
+            return true;
+        }
+
+        // Full: announce, re-check, then sleep until a consumer frees a slot
+        uint32_t epoch = mpmc_announce(&queue->not_full_epoch, &queue->idle_producers);
+        if (mpmc_try_enqueue(queue, task)) {
+            __atomic_sub_fetch(&queue->idle_producers, 1, __ATOMIC_RELAXED);
+            mpmc_wake(&queue->not_empty_epoch, &queue->idle_consumers);
+            return true;
+        }
+        if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
+            __atomic_sub_fetch(&queue->idle_producers, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        mpmc_park(&queue->not_full_epoch, epoch, &queue->idle_producers);
+    }
+}
+
+Task* mpmc_dequeue(WorkQueue* queue) {
+    while (true) {
+        Task* task = mpmc_try_dequeue(queue);
+        if (task != NULL) {
+            mpmc_wake(&queue->not_full_epoch, &queue->idle_producers);
+            return task;
+        }
+
+        // Like the mutex queue, remaining tasks are still handed out after shutdown
+        if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
+            return mpmc_try_dequeue(queue);
+        }
+
+        // Empty: maybe spin, else announce, re-check, then sleep until a
+        // producer publishes
+        uint64_t begin = clock_ns();
+        if (wait_spin(queue, begin)) {
+            continue;
+        }
+        uint32_t epoch = mpmc_announce(&queue->not_empty_epoch, &queue->idle_consumers);
+        task = mpmc_try_dequeue(queue);
+        if (task != NULL) {
+            __atomic_sub_fetch(&queue->idle_consumers, 1, __ATOMIC_RELAXED);
+            mpmc_wake(&queue->not_full_epoch, &queue->idle_producers);
+            return task;
+        }
+        if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
+            __atomic_sub_fetch(&queue->idle_consumers, 1, __ATOMIC_RELAXED);
+            return mpmc_try_dequeue(queue);
+        }
+        mpmc_park(&queue->not_empty_epoch, epoch, &queue->idle_consumers);
+        wait_woken(queue, begin);
+    }
+}
+
+int mpmc_enqueue_bulk(WorkQueue* queue, Task** tasks, int count) {
+    int done = 0;
+    while (done < count) {
+        if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        int n = mpmc_try_enqueue_bulk(queue, tasks + done, count - done);
+        if (n > 0) {
+            done += n;
+            mpmc_wake_many(&queue->not_empty_epoch, &queue->idle_consumers, n);
+            continue;
+        }
+
+        uint32_t epoch = mpmc_announce(&queue->not_full_epoch, &queue->idle_producers);
+        n = mpmc_try_enqueue_bulk(queue, tasks + done, count - done);
+        if (n > 0) {
+            __atomic_sub_fetch(&queue->idle_producers, 1, __ATOMIC_RELAXED);
+            done += n;
+            mpmc_wake_many(&queue->not_empty_epoch, &queue->idle_consumers, n);
+            continue;
+        }
+        if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
+            __atomic_sub_fetch(&queue->idle_producers, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        mpmc_park(&queue->not_full_epoch, epoch, &queue->idle_producers);
+    }
+    return done;
+}
+
+int mpmc_dequeue_bulk(WorkQueue* queue, Task** tasks, int max) {
+    while (true) {
+        int n = mpmc_try_dequeue_bulk(queue, tasks, max);
+        if (n > 0) {
+            mpmc_wake_many(&queue->not_full_epoch, &queue->idle_producers, n);
+            return n;
+        }
+        if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
+            return mpmc_try_dequeue_bulk(queue, tasks, max);
+        }
+
+        uint64_t begin = clock_ns();
+        if (wait_spin(queue, begin)) {
+            continue;
+        }
+        uint32_t epoch = mpmc_announce(&queue->not_empty_epoch, &queue->idle_consumers);
+        n = mpmc_try_dequeue_bulk(queue, tasks, max);
+        if (n > 0) {
+            __atomic_sub_fetch(&queue->idle_consumers, 1, __ATOMIC_RELAXED);
+            mpmc_wake_many(&queue->not_full_epoch, &queue->idle_producers, n);
+            return n;
+        }
+        if (__atomic_load_n(&queue->shutdown, __ATOMIC_ACQUIRE)) {
+            __atomic_sub_fetch(&queue->idle_consumers, 1, __ATOMIC_RELAXED);
+            return mpmc_try_dequeue_bulk(queue, tasks, max);
+        }
+        mpmc_park(&queue->not_empty_epoch, epoch, &queue->idle_consumers);
+        wait_woken(queue, begin);
+    }
+}
+
+void mpmc_shutdown(WorkQueue* queue) {
+    __atomic_store_n(&queue->shutdown, true, __ATOMIC_SEQ_CST);
+
+    // Bump both epochs so nobody goes to sleep on a stale value, then wake everyone
+    __atomic_add_fetch(&queue->not_empty_epoch, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&queue->not_full_epoch, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&queue->not_empty_epoch, INT_MAX);
+    futex_wake(&queue->not_full_epoch, INT_MAX);
+}
+
+// ----- Priority and deadline lanes -----
+// QUEUE_LANES keeps one FIFO ring per priority lane and a min-heap of tasks that
+// carry a deadline, all under the queue mutex. Tasks with a deadline go to the
+// EDF lane, which is always served first; the rest go to lane task->priority.
+// Every lane records how long its tasks waited.
+
+
+void histogram_add(Histogram* histogram, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum_ns += ns;
+    if (ns > histogram->max_ns) {
+        histogram->max_ns = ns;
+    }
+}
+
+// Upper bound of the bucket holding the given percentile, in microseconds
+uint64_t histogram_percentile(const Histogram* histogram, double percentile) {
+    long target = (long)(histogram->count * percentile / 100.0);
+    long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen > target) {
+            return 1ull << i;
+        }
+    }
+    return 1ull << (HISTOGRAM_BUCKETS - 1);
+}
+
+// Choose strict or weighted-fair dequeue; weights are ignored for LANES_STRICT
+void set_lane_policy(WorkQueue* queue, LanePolicy policy, const int weights[NUM_LANES]) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->lane_policy = policy;
+    for (int i = 0; i < NUM_LANES; i++) {
+        queue->lanes[i].weight = (weights && weights[i] > 0) ? weights[i] : 1;
+        queue->lanes[i].credit = 0;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Copy the queueing delay histogram of a lane (EDF_LANE for the deadline lane)
+void lane_delay_histogram(WorkQueue* queue, int lane, Histogram* out) {
+    pthread_mutex_lock(&queue->mutex);
+    *out = lane == EDF_LANE ? queue->edf_delay : queue->lanes[lane].delay;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+void print_lane_histograms(WorkQueue* queue) {
+    printf("%-6s %10s %10s %10s %10s %10s\n", "lane", "tasks", "mean us", "p50 us<=",
+           "p99 us<=", "max us");
+    for (int lane = 0; lane <= EDF_LANE; lane++) {
+        Histogram h;
+        lane_delay_histogram(queue, lane, &h);
+        char name[8];
+        snprintf(name, sizeof(name), lane == EDF_LANE ? "edf" : "%d", lane);
+        printf("%-6s %10ld %10.1f %10llu %10llu %10.1f\n", name, h.count,
+               h.count ? h.sum_ns / h.count / 1e3 : 0.0,
+               (unsigned long long)histogram_percentile(&h, 50),
+               (unsigned long long)histogram_percentile(&h, 99), h.max_ns / 1e3);
+    }
+}
+
+int task_lane(Task* task) {
+    if (task->deadline_ns != 0) {
+        return EDF_LANE;
+    }
+    if (task->priority < 0) {
+        return 0;
+    }
+    return task->priority < NUM_LANES ? task->priority : NUM_LANES - 1;
+}
+
+bool lane_full(WorkQueue* queue, int lane) {
+    if (lane == EDF_LANE) {
+        return queue->edf_count == MAX_QUEUE_SIZE;
+    }
+    return queue->lanes[lane].count == MAX_QUEUE_SIZE;
+}
+
+void edf_push(WorkQueue* queue, Task* task) {
+    int i = queue->edf_count++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (queue->edf[parent]->deadline_ns <= task->deadline_ns) {
+            break;
+        }
+        queue->edf[i] = queue->edf[parent];
+        i = parent;
+    }
+    queue->edf[i] = task;
+}
+
+Task* edf_pop(WorkQueue* queue) {
+    Task* top = queue->edf[0];
+    Task* last = queue->edf[--queue->edf_count];
+    int n = queue->edf_count;
+    int i = 0;
+    while (true) {
+        int child = 2 * i + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n && queue->edf[child + 1]->deadline_ns < queue->edf[child]->deadline_ns) {
+            child++;
+        }
+        if (last->deadline_ns <= queue->edf[child]->deadline_ns) {
+            break;
+        }
+        queue->edf[i] = queue->edf[child];
+        i = child;
+    }
+    if (n > 0) {
+        queue->edf[i] = last;
+    }
+    return top;
+}
+
+// Called with the mutex held and the task's lane not full
+void lanes_push(WorkQueue* queue, Task* task) {
+    int lane = task_lane(task);
+    task->enqueued_ns = clock_ns();
+    if (lane == EDF_LANE) {
+        edf_push(queue, task);
+    } else {
+        Lane* l = &queue->lanes[lane];
+        l->tasks[(l->front + l->count) % MAX_QUEUE_SIZE] = task;
+        l->count++;
+    }
+    queue->count++;
+}
+
+// Called with the mutex held and count > 0
+Task* lanes_pop(WorkQueue* queue) {
+    Task* task;
+    Histogram* delay;
+
+    if (queue->edf_count > 0) {
+        task = edf_pop(queue);
+        delay = &queue->edf_delay;
+    } else {
+        int chosen = -1;
+        if (queue->lane_policy == LANES_STRICT) {
+            for (int i = 0; i < NUM_LANES && chosen == -1; i++) {
+                if (queue->lanes[i].count > 0) {
+                    chosen = i;
+                }
+            }
+        } else {
+            // Smooth weighted round robin over the non-empty lanes
+            int total = 0;
+            for (int i = 0; i < NUM_LANES; i++) {
+                Lane* l = &queue->lanes[i];
+                if (l->count == 0) {
+                    continue;
+                }
+                l->credit += l->weight;
+                total += l->weight;
+                if (chosen == -1 || l->credit > queue->lanes[chosen].credit) {
+                    chosen = i;
+                }
+            }
+            queue->lanes[chosen].credit -= total;
+        }
+
+        Lane* l = &queue->lanes[chosen];
+        task = l->tasks[l->front];
+        l->front = (l->front + 1) % MAX_QUEUE_SIZE;
+        l->count--;
+        delay = &l->delay;
+    }
+
+    queue->count--;
+    histogram_add(delay, clock_ns() - task->enqueued_ns);
+    return task;
+}
+
+bool lanes_enqueue(WorkQueue* queue, Task* task) {
+    int lane = task_lane(task);
+    pthread_mutex_lock(&queue->mutex);
+    while (lane_full(queue, lane) && !queue->shutdown) {
+        queue->waiting_producers++;
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+        queue->waiting_producers--;
+    }
+    if (queue->shutdown) {
+        pthread_mutex_unlock(&queue->mutex);
+        return false;
+    }
+    lanes_push(queue, task);
+    if (queue->waiting_consumers > 0) {
+        pthread_cond_signal(&queue->not_empty);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return true;
+}
+
+Task* lanes_dequeue(WorkQueue* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0 && !queue->shutdown) {
+        wait_not_empty(queue);
+    }
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->mutex);
+        return NULL;
+    }
+    Task* task = lanes_pop(queue);
+    // Producers may be waiting on different lanes, so wake them all
+    if (queue->waiting_producers > 0) {
+        pthread_cond_broadcast(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return task;
+}
+
+// No threads are left: discard whatever is still queued
+void lanes_drain(WorkQueue* queue) {
+    while (queue->count > 0) {
+        task_discard(lanes_pop(queue));
+    }
+}
+
+// ----- Queue API -----
+
+// Add a task to the queue
+bool enqueue_task(WorkQueue* queue, Task* task) {
+    if (queue->kind == QUEUE_MPMC) {
+        return mpmc_enqueue(queue, task);
+    }
+    if (queue->kind == QUEUE_LANES) {
+        return lanes_enqueue(queue, task);
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    
+    // Wait until there's space or the queue is shutting down
+    while (queue->count == MAX_QUEUE_SIZE && !queue->shutdown) {
+        queue->waiting_producers++;
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+        queue->waiting_producers--;
+    }
+    
+    // Don't add if we're shutting down
+    if (queue->shutdown) {
+        pthread_mutex_unlock(&queue->mutex);
+        return false;
+    }
+    
+    // Add the task to the queue
+    queue->rear = (queue->rear + 1) % MAX_QUEUE_SIZE;
+    queue->tasks[queue->rear] = task;
+    queue->count++;
+    
+    // Signal that the queue is not empty
+    pthread_cond_signal(&queue->not_empty);
+    
+    pthread_mutex_unlock(&queue->mutex);
+    return true;
+}
+
+// Get a task from the queue
+Task* dequeue_task(WorkQueue* queue) {
+    if (queue->kind == QUEUE_MPMC) {
+        return mpmc_dequeue(queue);
+    }
+    if (queue->kind == QUEUE_LANES) {
+        return lanes_dequeue(queue);
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    
+    // Wait until there's a task or the queue is shutting down
+    while (queue->count == 0 && !queue->shutdown) {
+        wait_not_empty(queue);
+    }
+    
+    // If the queue is empty and shutting down, return NULL
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->mutex);
+        return NULL;
+    }
+    
+    // Get the task from the queue
+    Task* task = queue->tasks[queue->front];
+    queue->front = (queue->front + 1) % MAX_QUEUE_SIZE;
+    queue->count--;
+    
+    // Signal that the queue is not full
+    pthread_cond_signal(&queue->not_full);
+    
+    pthread_mutex_unlock(&queue->mutex);
+    return task;
+}
+
+// Wake up to count of the waiters on cond. Called with the mutex held.
+void wake_waiters(pthread_cond_t* cond, int waiting, int count) {
+    if (waiting == 0) {
+        return;
+    }
+    if (count >= waiting) {
+        pthread_cond_broadcast(cond);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_cond_signal(cond);
+    }
+}
+
+// Add count tasks, as many per lock acquisition (or CAS) as there is room for,
+// waking at most one waiting worker per task added. Blocks while the queue is
+// full; returns how many were added, fewer than count only on shutdown.
+int enqueue_tasks_bulk(WorkQueue* queue, Task** tasks, int count) {
+    if (queue->kind == QUEUE_MPMC) {
+        return mpmc_enqueue_bulk(queue, tasks, count);
+    }
+    if (queue->kind == QUEUE_LANES) {
+        // Tasks may go to different lanes; no batching
+        int done = 0;
+        while (done < count && lanes_enqueue(queue, tasks[done])) {
+            done++;
+        }
+        return done;
+    }
+
+    int done = 0;
+    pthread_mutex_lock(&queue->mutex);
+    while (done < count) {
+        while (queue->count == MAX_QUEUE_SIZE && !queue->shutdown) {
+            queue->waiting_producers++;
+            pthread_cond_wait(&queue->not_full, &queue->mutex);
+            queue->waiting_producers--;
+        }
+        if (queue->shutdown) {
+            break;
+        }
+
+        int added = 0;
+        while (done < count && queue->count < MAX_QUEUE_SIZE) {
+            queue->rear = (queue->rear + 1) % MAX_QUEUE_SIZE;
+            queue->tasks[queue->rear] = tasks[done++];
+            queue->count++;
+            added++;
+        }
+        wake_waiters(&queue->not_empty, queue->waiting_consumers, added);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return done;
+}
+
+// Take up to max tasks at once. Blocks until at least one is available; returns
+// 0 once the queue is shut down and empty.
+int dequeue_tasks_bulk(WorkQueue* queue, Task** tasks, int max) {
+    if (queue->kind == QUEUE_MPMC) {
+        return mpmc_dequeue_bulk(queue, tasks, max);
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->count == 0 && !queue->shutdown) {
+        wait_not_empty(queue);
+    }
+
+    int taken = 0;
+    while (taken < max && queue->count > 0) {
+        if (queue->kind == QUEUE_LANES) {
+            tasks[taken++] = lanes_pop(queue);
+            continue;
+        }
+        tasks[taken++] = queue->tasks[queue->front];
+        queue->front = (queue->front + 1) % MAX_QUEUE_SIZE;
+        queue->count--;
+    }
+    if (queue->kind == QUEUE_LANES && taken > 0 && queue->waiting_producers > 0) {
+        pthread_cond_broadcast(&queue->not_full);
+    } else {
+        wake_waiters(&queue->not_full, queue->waiting_producers, taken);
+    }
+
+    pthread_mutex_unlock(&queue->mutex);
+    return taken;
+}
+
+// Signal all threads to shut down
+void shutdown_work_queue(WorkQueue* queue) {
+    if (queue->kind == QUEUE_MPMC) {
+        mpmc_shutdown(queue);
+        return;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    
+    queue->shutdown = true;
+    
+    // Wake up all waiting threads
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// ----- Completion: task groups and futures -----
+
+// Counts outstanding tasks; wait_all() returns when it reaches zero.
+// pending holds twice the count; bit 0 is set while a thread sleeps on it, so
+// finishing tasks only make a system call when someone is actually waiting.
+typedef struct TaskGroup {
+    int pending;
+} TaskGroup;
+
+#define GROUP_TASK 2
+#define GROUP_SLEEPER 1
+
+void task_group_init(TaskGroup* group) {
+    group->pending = 0;
+}
+
+void task_group_add(TaskGroup* group) {
+    __atomic_add_fetch(&group->pending, GROUP_TASK, __ATOMIC_RELAXED);
+}
+
+// One task of the group finished. After this the group may be gone (the waiter
+// returns), so only its address is used for the wakeup.
+void task_group_done(TaskGroup* group) {
+    if (__atomic_sub_fetch(&group->pending, GROUP_TASK, __ATOMIC_ACQ_REL) == GROUP_SLEEPER) {
+        futex_wake((uint32_t*)&group->pending, INT_MAX);
+    }
+}
+
+// Block until every task in group has finished, without polling
+void wait_all(TaskGroup* group) {
+    int pending = __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE);
+    while (pending >= GROUP_TASK) {
+        if (!(pending & GROUP_SLEEPER)) {
+            __atomic_compare_exchange_n(&group->pending, &pending, pending | GROUP_SLEEPER,
+                                        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        futex_wait((uint32_t*)&group->pending, pending);
+        pending = __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE);
+    }
+    group->pending = 0;
+}
+
+// A future lives in the payload of the task that computes it. The task holds two
+// references, one for the worker and one for the submitter's future_release().
+#define FUTURE_READY 1
+#define FUTURE_WAITERS 2            // Someone sleeps in future_get()
+#define FUTURE_CONTINUATION 4       // future_then() registered a callback
+#define FUTURE_CANCELLED 8          // Queue destroyed before the task ran
+
+typedef struct Future {
+    uint32_t state;                 // FUTURE_* bits; also the futex word
+    long result;
+    long (*function)(void* arg);
+    void* arg;
+    void (*continuation)(long result, void* arg);
+    void* continuation_arg;
+} Future;
+
+_Static_assert(sizeof(Future) <= TASK_PAYLOAD_SIZE, "a future must fit in a task payload");
+
+Task* future_task(Future* future) {
+    return (Task*)((char*)future - offsetof(Task, payload));
+}
+
+// Publish the result, then wake waiters, run the continuation and count the
+// task off its group, in that order: wait_all() returns after continuations ran
+void future_complete(Future* future, long result, uint32_t flags) {
+    future->result = result;
+    uint32_t old = __atomic_fetch_or(&future->state, FUTURE_READY | flags, __ATOMIC_ACQ_REL);
+    if (old & FUTURE_WAITERS) {
+        futex_wake(&future->state, INT_MAX);
+    }
+    if (old & FUTURE_CONTINUATION) {
+        future->continuation(result, future->continuation_arg);
+    }
+    TaskGroup* group = future_task(future)->group;
+    if (group) {
+        task_group_done(group);
+    }
+}
+
+void future_task_run(void* data) {
+    Future* future = (Future*)data;
+    future_complete(future, future->function(future->arg), 0);
+}
+
+// Queue function(arg) and return a future for its result, or NULL when the queue
+// is shut down or out of memory. If group is given, wait_all(group) covers it.
+Future* submit(WorkQueue* queue, TaskGroup* group, long (*function)(void* arg), void* arg) {
+    Task* task = task_alloc(future_task_run, sizeof(Future));
+    if (task == NULL) {
+        return NULL;
+    }
+    task->refs = 2;
+    task->enqueued_ns = clock_ns();
+    Future* future = (Future*)task->data;
+    future->function = function;
+    future->arg = arg;
+    task->group = group;
+
+    if (group) {
+        task_group_add(group);
+    }
+    if (!enqueue_task(queue, task)) {
+        if (group) {
+            task_group_done(group);
+        }
+        task_free(task);
+        return NULL;
+    }
+    return future;
+}
+
+bool future_ready(Future* future) {
+    return __atomic_load_n(&future->state, __ATOMIC_ACQUIRE) & FUTURE_READY;
+}
+
+bool future_cancelled(Future* future) {
+    return __atomic_load_n(&future->state, __ATOMIC_ACQUIRE) & FUTURE_CANCELLED;
+}
+
+// Block until the task has run and return its result (0 if cancelled)
+long future_get(Future* future) {
+    while (true) {
+        uint32_t state = __atomic_fetch_or(&future->state, FUTURE_WAITERS, __ATOMIC_ACQUIRE);
+        if (state & FUTURE_READY) {
+            return future->result;
+        }
+        futex_wait(&future->state, state | FUTURE_WAITERS);
+    }
+}
+
+// Run continuation(result, arg) when the task completes, on the worker that ran
+// it, or right here if it already has. One continuation per future.
+void future_then(Future* future, void (*continuation)(long result, void* arg), void* arg) {
+    future->continuation = continuation;
+    future->continuation_arg = arg;
+    uint32_t old = __atomic_fetch_or(&future->state, FUTURE_CONTINUATION, __ATOMIC_ACQ_REL);
+    if (old & FUTURE_READY) {
+        continuation(future->result, arg);
+    }
+}
+
+// The submitter is done with the future
+void future_release(Future* future) {
+    task_release(future_task(future));
+}
+
+// A queued task that will never run: cancel its future, if it has one
+void task_discard(Task* task) {
+    if (task->function == future_task_run) {
+        future_complete((Future*)task->data, 0, FUTURE_CANCELLED);
+    }
+    task_release(task);
+}
+
+// ----- Elastic worker pool -----
+// Runs the workers of a WorkQueue and keeps their number between min_workers and
+// max_workers. Every ELASTIC_TICK_MS a monitor thread looks at the queue depth
+// and the average time tasks waited; only after grow_ticks backlogged ticks in a
+// row does it add a worker, and only after shrink_ticks idle ticks in a row does
+// it retire one, so short spikes and lulls do not make it thrash.
+// A task that is about to block brackets the call with elastic_blocking_begin()
+// and elastic_blocking_end(); while it is blocked a replacement worker may run,
+// up to max_threads threads in total.
+
+typedef struct {
+    int min_workers;
+    int max_workers;        // Runnable (not blocked) workers
+    int max_threads;        // Hard limit including blocked workers
+    int grow_depth;         // Queued tasks per runnable worker that count as backlog
+    int grow_wait_us;       // Average wait above this counts as backlog
+    int grow_ticks;
+    int shrink_ticks;
+    int retire_ticks;       // Once shrinking, ticks between retirements
+} ElasticConfig;
+
+typedef struct {
+    WorkQueue* queue;
+    ElasticConfig config;
+
+    pthread_mutex_t lock;
+    pthread_cond_t exited;
+    int alive;
+    int blocked;
+    int retiring;           // Retire tasks queued but not yet taken
+    bool stopping;
+    pthread_t monitor;
+
+    // Updated by the workers without the lock
+    int idle;
+    long wait_ns;
+    long waited;
+
+    // Monitor state and statistics
+    int busy_ticks;
+    int idle_ticks;
+    long grown;
+    long shrunk;
+    long compensated;
+    int peak;
+    double last_wait_us;
+    int last_depth;
+} ElasticPool;
+
+static __thread ElasticPool* current_elastic;
+
+void elastic_default_config(ElasticConfig* config) {
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    config->min_workers = 1;
+    config->max_workers = cpus > 1 ? cpus : 2;
+    config->max_threads = config->max_workers * 4;
+    config->grow_depth = 4;
+    config->grow_wait_us = 1000;
+    config->grow_ticks = 2;             // 20 ms of backlog
+    config->shrink_ticks = 50;          // 500 ms of idleness
+    config->retire_ticks = 5;
+}
+
+// Tasks queued right now, for any queue kind
+int work_queue_depth(WorkQueue* queue) {
+    if (queue->kind == QUEUE_MPMC) {
+        size_t head = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        size_t tail = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        return tail > head ? (int)(tail - head) : 0;
+    }
+    return __atomic_load_n(&queue->count, __ATOMIC_RELAXED);
+}
+
+// Marker task: the worker that dequeues it exits
+void elastic_retire_task(void* arg) {
+    (void)arg;
+}
+
+void* elastic_worker_thread(void* arg) {
+    ElasticPool* pool = (ElasticPool*)arg;
+    current_elastic = pool;
+    bool retired = false;
+
+    while (true) {
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+        Task* task = dequeue_task(pool->queue);
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+        if (task == NULL) {
+            break;
+        }
+        if (task->function == elastic_retire_task) {
+            task_release(task);
+            retired = true;
+            break;
+        }
+        if (task->enqueued_ns != 0) {
+            __atomic_add_fetch(&pool->wait_ns, (long)(clock_ns() - task->enqueued_ns),
+                               __ATOMIC_RELAXED);
+            __atomic_add_fetch(&pool->waited, 1, __ATOMIC_RELAXED);
+        }
+        task->function(task->data);
+        task_release(task);
+    }
+
+    current_elastic = NULL;
+    pthread_mutex_lock(&pool->lock);
+    pool->alive--;
+    if (retired) {
+        pool->retiring--;
+        pool->shrunk++;
+    }
+    if (pool->alive == 0) {
+        pthread_cond_broadcast(&pool->exited);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Called with the lock held
+bool elastic_spawn(ElasticPool* pool) {
+    if (pool->alive >= pool->config.max_threads) {
+        return false;
+    }
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret = pthread_create(&thread, &attr, elastic_worker_thread, pool);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        return false;
+    }
+    pool->alive++;
+    if (pool->alive > pool->peak) {
+        pool->peak = pool->alive;
+    }
+    return true;
+}
+
+// Called with the lock held
+int elastic_runnable(ElasticPool* pool) {
+    return pool->alive - pool->blocked - pool->retiring;
+}
+
+// Called with the lock held
+void elastic_retire_one(ElasticPool* pool) {
+    Task* task = task_alloc(elastic_retire_task, 0);
+    if (task == NULL) {
+        return;
+    }
+    // Lowest priority, so it never overtakes real work in a lane queue
+    task->priority = NUM_LANES - 1;
+    pool->retiring++;
+    pthread_mutex_unlock(&pool->lock);
+    bool queued = enqueue_task(pool->queue, task);
+    pthread_mutex_lock(&pool->lock);
+    if (!queued) {
+        pool->retiring--;
+        task_free(task);
+    }
+}
+
+void elastic_tick(ElasticPool* pool) {
+    int depth = work_queue_depth(pool->queue);
+    long waited = __atomic_exchange_n(&pool->waited, 0, __ATOMIC_RELAXED);
+    long wait_ns = __atomic_exchange_n(&pool->wait_ns, 0, __ATOMIC_RELAXED);
+    double wait_us = waited ? wait_ns / (double)waited / 1e3 : 0;
+    int idle = __atomic_load_n(&pool->idle, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->last_depth = depth;
+    pool->last_wait_us = wait_us;
+    int runnable = elastic_runnable(pool);
+
+    bool backlog = depth > runnable * pool->config.grow_depth ||
+                   wait_us > pool->config.grow_wait_us;
+    bool quiet = depth == 0 && idle > 0 && wait_us < pool->config.grow_wait_us / 4.0;
+    pool->busy_ticks = backlog ? pool->busy_ticks + 1 : 0;
+    pool->idle_ticks = quiet ? pool->idle_ticks + 1 : 0;
+
+    if (runnable < pool->config.min_workers) {
+        elastic_spawn(pool);
+    } else if (pool->busy_ticks >= pool->config.grow_ticks &&
+               runnable < pool->config.max_workers) {
+        if (elastic_spawn(pool)) {
+            pool->grown++;
+        }
+        pool->busy_ticks = 0;
+    } else if (pool->idle_ticks >= pool->config.shrink_ticks &&
+               runnable > pool->config.min_workers) {
+        elastic_retire_one(pool);
+        pool->idle_ticks = pool->config.shrink_ticks - pool->config.retire_ticks;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void* elastic_monitor_thread(void* arg) {
+    ElasticPool* pool = (ElasticPool*)arg;
+    struct timespec tick = { 0, ELASTIC_TICK_MS * 1000000L };
+
+    while (!__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)) {
+        nanosleep(&tick, NULL);
+        elastic_tick(pool);
+    }
+    return NULL;
+}
+
+void destroy_elastic_pool(ElasticPool* pool);
+
+// Start min_workers workers on queue; the queue stays owned by the caller
+ElasticPool* create_elastic_pool(WorkQueue* queue, const ElasticConfig* config) {
+    ElasticPool* pool = (ElasticPool*)calloc(1, sizeof(ElasticPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->queue = queue;
+    pool->config = *config;
+    if (pool->config.max_workers < pool->config.min_workers) {
+        pool->config.max_workers = pool->config.min_workers;
+    }
+    if (pool->config.max_threads < pool->config.max_workers) {
+        pool->config.max_threads = pool->config.max_workers;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->exited, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < pool->config.min_workers; i++) {
+        elastic_spawn(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (pthread_create(&pool->monitor, NULL, elastic_monitor_thread, pool) != 0) {
+        fprintf(stderr, "Error creating elastic pool monitor\n");
+        destroy_elastic_pool(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Queue a task, recording when, so the pool can see how long tasks wait
+bool elastic_submit(ElasticPool* pool, Task* task) {
+    task->enqueued_ns = clock_ns();
+    return enqueue_task(pool->queue, task);
+}
+
+// The calling task is about to block (I/O, sleep). If that leaves queued work
+// without enough runnable workers, start a replacement right away.
+void elastic_blocking_begin() {
+    ElasticPool* pool = current_elastic;
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->blocked++;
+    int runnable = elastic_runnable(pool);
+    if (runnable < pool->config.min_workers ||
+        (runnable < pool->config.max_workers && work_queue_depth(pool->queue) > 0)) {
+        if (elastic_spawn(pool)) {
+            pool->compensated++;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Back from blocking. Surplus workers are retired later by the monitor.
+void elastic_blocking_end() {
+    ElasticPool* pool = current_elastic;
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->blocked--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Stop the monitor, shut the queue down and wait for every worker to finish
+// what is queued and exit
+void destroy_elastic_pool(ElasticPool* pool) {
+    __atomic_store_n(&pool->stopping, true, __ATOMIC_RELEASE);
+    if (pool->monitor) {
+        pthread_join(pool->monitor, NULL);
+    }
+    shutdown_work_queue(pool->queue);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->alive > 0) {
+        pthread_cond_wait(&pool->exited, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->exited);
+    free(pool);
+}
+
+// ----- CPU topology -----
+// Read from /sys/devices/system/cpu. Every level a CPU belongs to (core, L2, L3)
+// is named after the lowest CPU that shares it, so two CPUs share a core or a
+// cache exactly when those numbers match.
+
+#define TOPOLOGY_SYSFS "/sys/devices/system/cpu"
+
+// How far apart two CPUs are, nearest first
+typedef enum {
+    DISTANCE_SELF,                  // Same logical CPU
+    DISTANCE_SMT,                   // Hyperthreads of one core: share L1 and L2
+    DISTANCE_L2,
+    DISTANCE_L3,
+    DISTANCE_NODE,                  // Same NUMA node, no cache in common
+    DISTANCE_REMOTE,
+    NUM_DISTANCES
+} CpuDistance;
+
+typedef struct {
+    bool usable;                    // Online and in this process's affinity mask
+    int core;                       // -1 where sysfs does not say
+    int l2;
+    int l3;
+    int node;
+} CpuInfo;
+
+typedef struct {
+    int num_cpus;                   // Entries in cpus[], usable or not
+    int num_usable;
+    CpuInfo* cpus;
+} CpuTopology;
+
+// First number of a file such as "3" or "0-3,8-11"; lists are sorted, so this
+// is the lowest CPU in the list. -1 if the file does not exist.
+int read_sysfs_int(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int value;
+    if (fscanf(file, "%d", &value) != 1) {
+        value = -1;
+    }
+    fclose(file);
+    return value;
+}
+
+// Lowest CPU sharing the data (or unified) cache of this level with cpu
+int cpu_cache_id(int cpu, int level) {
+    char path[256];
+    for (int index = 0; ; index++) {
+        snprintf(path, sizeof(path), TOPOLOGY_SYSFS "/cpu%d/cache/index%d/level", cpu, index);
+        int cache_level = read_sysfs_int(path);
+        if (cache_level == -1) {
+            return -1;
+        }
+        if (cache_level != level) {
+            continue;
+        }
+
+        char type[32] = "";
+        snprintf(path, sizeof(path), TOPOLOGY_SYSFS "/cpu%d/cache/index%d/type", cpu, index);
+        FILE* file = fopen(path, "r");
+        if (file != NULL) {
+            if (fscanf(file, "%31s", type) != 1) {
+                type[0] = '\0';
+            }
+            fclose(file);
+        }
+        if (strcmp(type, "Instruction") == 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path),
+                 TOPOLOGY_SYSFS "/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+        return read_sysfs_int(path);
+    }
+}
+
+// The cpuN directory holds a nodeM link for the node the CPU belongs to
+int cpu_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), TOPOLOGY_SYSFS "/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return 0;
+    }
+    int node = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "node%d", &node) == 1) {
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+CpuTopology* read_cpu_topology() {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        perror("sched_getaffinity");
+        return NULL;
+    }
+
+    int num_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+    if (num_cpus < 1) {
+        num_cpus = 1;
+    }
+    if (num_cpus > CPU_SETSIZE) {
+        num_cpus = CPU_SETSIZE;
+    }
+
+    CpuTopology* topology = (CpuTopology*)malloc(sizeof(CpuTopology));
+    CpuInfo* cpus = (CpuInfo*)calloc(num_cpus, sizeof(CpuInfo));
+    if (topology == NULL || cpus == NULL) {
+        free(topology);
+        free(cpus);
+        return NULL;
+    }
+    topology->num_cpus = num_cpus;
+    topology->num_usable = 0;
+    topology->cpus = cpus;
+
+    char path[256];
+    for (int cpu = 0; cpu < num_cpus; cpu++) {
+        // cpu0 often has no "online" file: it cannot be taken offline
+        snprintf(path, sizeof(path), TOPOLOGY_SYSFS "/cpu%d/online", cpu);
+        bool online = read_sysfs_int(path) != 0;
+        cpus[cpu].usable = online && CPU_ISSET(cpu, &allowed);
+        if (cpus[cpu].usable) {
+            topology->num_usable++;
+        }
+
+        snprintf(path, sizeof(path), TOPOLOGY_SYSFS "/cpu%d/topology/thread_siblings_list", cpu);
+        cpus[cpu].core = read_sysfs_int(path);
+        if (cpus[cpu].core == -1) {
+            cpus[cpu].core = cpu;
+        }
+        cpus[cpu].l2 = cpu_cache_id(cpu, 2);
+        cpus[cpu].l3 = cpu_cache_id(cpu, 3);
+        cpus[cpu].node = cpu_node(cpu);
+    }
+
+    if (topology->num_usable == 0) {
+        fprintf(stderr, "No usable CPU found in " TOPOLOGY_SYSFS "\n");
+        free(cpus);
+        free(topology);
+        return NULL;
+    }
+    return topology;
+}
+
+void free_cpu_topology(CpuTopology* topology) {
+    if (topology != NULL) {
+        free(topology->cpus);
+        free(topology);
+    }
+}
+
+CpuDistance cpu_distance(const CpuTopology* topology, int a, int b) {
+    const CpuInfo* x = &topology->cpus[a];
+    const CpuInfo* y = &topology->cpus[b];
+    if (a == b) {
+        return DISTANCE_SELF;
+    }
+    if (x->core == y->core) {
+        return DISTANCE_SMT;
+    }
+    if (x->l2 != -1 && x->l2 == y->l2) {
+        return DISTANCE_L2;
+    }
+    if (x->l3 != -1 && x->l3 == y->l3) {
+        return DISTANCE_L3;
+    }
+    return x->node == y->node ? DISTANCE_NODE : DISTANCE_REMOTE;
+}
+
+void print_cpu_topology(const CpuTopology* topology) {
+    printf("%d CPUs usable of %d\n", topology->num_usable, topology->num_cpus);
+    printf("%6s %6s %6s %6s %6s\n", "cpu", "core", "L2", "L3", "node");
+    for (int cpu = 0; cpu < topology->num_cpus; cpu++) {
+        const CpuInfo* info = &topology->cpus[cpu];
+        if (info->usable) {
+            printf("%6d %6d %6d %6d %6d\n", cpu, info->core, info->l2, info->l3, info->node);
+        }
+    }
+}
+
+int compare_placement(const void* a, const void* b, void* arg) {
+    const CpuTopology* topology = (const CpuTopology*)arg;
+    const CpuInfo* x = &topology->cpus[*(const int*)a];
+    const CpuInfo* y = &topology->cpus[*(const int*)b];
+    if (x->node != y->node) return x->node - y->node;
+    if (x->l3 != y->l3) return x->l3 - y->l3;
+    if (x->l2 != y->l2) return x->l2 - y->l2;
+    if (x->core != y->core) return x->core - y->core;
+    return *(const int*)a - *(const int*)b;
+}
+
+// Usable CPUs in the order workers are placed on them: one hyperthread of every
+// core before any second one, and consecutive entries as close as possible so
+// neighbouring workers share caches. Returns num_usable CPU numbers.
+int* topology_placement(const CpuTopology* topology) {
+    int count = topology->num_usable;
+    int* sorted = (int*)malloc(count * sizeof(int));
+    int* order = (int*)malloc(count * sizeof(int));
+    if (sorted == NULL || order == NULL) {
+        free(sorted);
+        free(order);
+        return NULL;
+    }
+    int n = 0;
+    for (int cpu = 0; cpu < topology->num_cpus; cpu++) {
+        if (topology->cpus[cpu].usable) {
+            sorted[n++] = cpu;
+        }
+    }
+    qsort_r(sorted, count, sizeof(int), compare_placement, (void*)topology);
+
+    // Pass k takes the k-th hyperthread of each core
+    n = 0;
+    for (int pass = 0; n < count; pass++) {
+        int sibling = 0;
+        for (int i = 0; i < count; i++) {
+            if (i > 0 && topology->cpus[sorted[i]].core == topology->cpus[sorted[i - 1]].core) {
+                sibling++;
+            } else {
+                sibling = 0;
+            }
+            if (sibling == pass) {
+                order[n++] = sorted[i];
+            }
+        }
+    }
+    free(sorted);
+    return order;
+}
+
+// ----- Work-stealing thread pool -----
+// Each worker owns a Chase-Lev deque: the owner pushes and takes at the bottom
+// without contention, idle workers steal from the top of a random victim's deque.
+// Tasks submitted from inside the pool stay on the submitting worker's deque;
+// submissions from other threads go through a lock-free MPMC queue.
+// Task memory belongs to the submitter: the pool never frees a task.
+// Given a CPU topology the pool pins each worker to a CPU and gives it an inbox:
+// outside submitters use the inbox of the worker closest to the CPU they run on,
+// and thieves try SMT siblings first, then workers sharing L2, L3, the node.
+
+// Deque storage; replaced by a twice as large copy when full
+typedef struct DequeArray {
+    long size;
+    struct DequeArray* retired;     // Previous, smaller array (thieves may still read it)
+    Task* tasks[];
+} DequeArray;
+
+// Chase-Lev deque (in the C11 formulation of Le, Pop, Cohen and Zappa Nardelli)
+typedef struct {
+    long top __attribute__((aligned(CACHE_LINE)));      // Next to steal
+    long bottom __attribute__((aligned(CACHE_LINE)));   // Next free slot
+    DequeArray* array;
+} Deque;
+
+// Outcome of a steal attempt that did not return a task
+#define STEAL_EMPTY NULL
+#define STEAL_ABORT ((Task*)1)      // Lost a race, the victim may still have work
+
+struct ThreadPool;
+
+typedef struct {
+    struct ThreadPool* pool;
+    int index;
+    pthread_t thread;
+    Deque deque;
+    uint32_t rng;
+    long executed;
+    long steals;
+    long near_steals;               // Steals from a worker sharing a cache with this one
+
+    // Only with a topology
+    int cpu;                        // Pinned to this CPU, -1 if not pinned
+    WorkQueue* inbox;               // Outside submissions from nearby CPUs
+    int* victims;                   // Other workers, nearest first
+    int victims_within[NUM_DISTANCES];  // victims[] entries at this distance or closer
+} Worker;
+
+typedef struct ThreadPool {
+    Worker* workers;
+    int num_workers;
+    WorkQueue* injected;            // Submissions from threads outside the pool
+    bool shutdown;
+    const CpuTopology* topology;    // NULL: no pinning, random stealing
+    int* cpu_worker;                // Closest worker to each CPU, for submitters
+
+    // Parking, same protocol as the MPMC queue
+    uint32_t epoch __attribute__((aligned(CACHE_LINE)));
+    int idle_workers;
+} ThreadPool;
+
+// The worker running on this thread, if any
+static __thread Worker* current_worker;
+
+DequeArray* deque_array_create(long size) {
+    DequeArray* array = (DequeArray*)malloc(sizeof(DequeArray) + size * sizeof(Task*));
+    if (array == NULL) {
+        return NULL;
+    }
+    array->size = size;
+    array->retired = NULL;
+    return array;
+}
+
+bool deque_init(Deque* deque) {
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->array = deque_array_create(DEQUE_INITIAL_SIZE);
+    return deque->array != NULL;
+}
+
+void deque_destroy(Deque* deque) {
+    DequeArray* array = deque->array;
+    while (array != NULL) {
+        DequeArray* retired = array->retired;
+        free(array);
+        array = retired;
+    }
+    deque->array = NULL;
+}
+
+// Owner only. Copies the live range into an array twice the size.
+DequeArray* deque_grow(Deque* deque, DequeArray* old, long top, long bottom) {
+    DequeArray* array = deque_array_create(old->size * 2);
+    if (array == NULL) {
+        return NULL;
+    }
+    for (long i = top; i < bottom; i++) {
+        array->tasks[i & (array->size - 1)] = old->tasks[i & (old->size - 1)];
+    }
+    array->retired = old;
+    __atomic_store_n(&deque->array, array, __ATOMIC_RELEASE);
+    return array;
+}
+
+// Owner only
+bool deque_push(Deque* deque, Task* task) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    DequeArray* array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+    if (bottom - top > array->size - 1) {
+        array = deque_grow(deque, array, top, bottom);
+        if (array == NULL) {
+            return false;
+        }
+    }
+    __atomic_store_n(&array->tasks[bottom & (array->size - 1)], task, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Owner only: newest task first
+Task* deque_take(Deque* deque) {
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    DequeArray* array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        // Empty
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Task* task = __atomic_load_n(&array->tasks[bottom & (array->size - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // Last task: race the thieves for it
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            task = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+// Any thread: oldest task first
+Task* deque_steal(Deque* deque) {
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+    if (top >= bottom) {
+        return STEAL_EMPTY;
+    }
+
+    DequeArray* array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+    Task* task = __atomic_load_n(&array->tasks[top & (array->size - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return STEAL_ABORT;
+    }
+    return task;
+}
+
+uint32_t worker_random(Worker* worker) {
+    // xorshift32
+    uint32_t x = worker->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    worker->rng = x;
+    return x;
+}
+
+// Take from the shared submission queue, letting a blocked submitter continue
+Task* pool_take_injected(ThreadPool* pool) {
+    Task* task = mpmc_try_dequeue(pool->injected);
+    if (task != NULL) {
+        mpmc_wake(&pool->injected->not_full_epoch, &pool->injected->idle_producers);
+    }
+    return task;
+}
+
+// Steal from a worker's deque, or failing that from its inbox
+Task* pool_steal_from(Worker* victim) {
+    Task* task = deque_steal(&victim->deque);
+    if (task == STEAL_EMPTY && victim->inbox != NULL) {
+        task = mpmc_try_dequeue(victim->inbox);
+    }
+    return task;
+}
+
+// Try the victims one distance at a time, at a random start within each
+Task* pool_steal_nearest(Worker* self) {
+    int from = 0;
+    for (int distance = 0; distance < NUM_DISTANCES; distance++) {
+        int to = self->victims_within[distance];
+        int n = to - from;
+        if (n == 0) {
+            continue;
+        }
+        uint32_t start = worker_random(self);
+        bool retry = true;
+        while (retry) {
+            retry = false;
+            for (int i = 0; i < n; i++) {
+                Worker* victim = &self->pool->workers[self->victims[from + (start + i) % n]];
+                Task* task = pool_steal_from(victim);
+                if (task == STEAL_ABORT) {
+                    retry = true;
+                } else if (task != STEAL_EMPTY) {
+                    self->steals++;
+                    if (distance <= DISTANCE_L3) {
+                        self->near_steals++;
+                    }
+                    return task;
+                }
+            }
+        }
+        from = to;
+    }
+    return NULL;
+}
+
+// Try every other worker once, starting at a random victim
+Task* pool_steal(ThreadPool* pool, Worker* self) {
+    if (self && self->victims) {
+        return pool_steal_nearest(self);
+    }
+    int n = pool->num_workers;
+    uint32_t start = self ? worker_random(self) : (uint32_t)rand();
+    bool retry = true;
+
+    while (retry) {
+        retry = false;
+        for (int i = 0; i < n; i++) {
+            Worker* victim = &pool->workers[(start + i) % n];
+            if (victim == self) {
+                continue;
+            }
+            Task* task = pool_steal_from(victim);
+            if (task == STEAL_ABORT) {
+                retry = true;
+            } else if (task != STEAL_EMPTY) {
+                if (self) {
+                    self->steals++;
+                }
+                return task;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Own deque first, then outside submissions, then other workers
+Task* pool_find_task(ThreadPool* pool, Worker* self) {
+    Task* task = NULL;
+    if (self) {
+        task = deque_take(&self->deque);
+        if (task == NULL && self->inbox != NULL) {
+            task = mpmc_try_dequeue(self->inbox);
+        }
+    }
+    if (task == NULL) {
+        task = pool_take_injected(pool);
+    }
+    if (task == NULL) {
+        task = pool_steal(pool, self);
+    }
+    return task;
+}
+
+void pool_run_task(Worker* self, Task* task) {
+    // Read the group first: once it is signalled the task may be gone
+    TaskGroup* group = task->group;
+    task->function(task->data);
+    if (self) {
+        self->executed++;
+    }
+    if (group) {
+        task_group_done(group);
+    }
+}
+
+void pool_notify(ThreadPool* pool) {
+    mpmc_wake(&pool->epoch, &pool->idle_workers);
+}
+
+void* pool_worker_thread(void* arg) {
+    Worker* self = (Worker*)arg;
+    ThreadPool* pool = self->pool;
+    current_worker = self;
+
+    while (true) {
+        Task* task = pool_find_task(pool, self);
+        if (task != NULL) {
+            pool_run_task(self, task);
+            continue;
+        }
+
+        // Nothing anywhere: announce, look once more, then sleep
+        uint32_t epoch = mpmc_announce(&pool->epoch, &pool->idle_workers);
+        task = pool_find_task(pool, self);
+        if (task != NULL) {
+            __atomic_sub_fetch(&pool->idle_workers, 1, __ATOMIC_RELAXED);
+            pool_run_task(self, task);
+            continue;
+        }
+        if (__atomic_load_n(&pool->shutdown, __ATOMIC_ACQUIRE)) {
+            __atomic_sub_fetch(&pool->idle_workers, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        mpmc_park(&pool->epoch, epoch, &pool->idle_workers);
+    }
+
+    current_worker = NULL;
+    return NULL;
+}
+
+void destroy_thread_pool(ThreadPool* pool);
+ThreadPool* create_thread_pool_on(int num_workers, const CpuTopology* topology);
+
+// Worker i goes on the i-th CPU of the placement. Each worker lists the others by
+// distance for stealing, and each CPU gets the closest worker for submissions,
+// spreading CPUs evenly over equally close workers.
+bool pool_place_workers(ThreadPool* pool) {
+    const CpuTopology* topology = pool->topology;
+    int n = pool->num_workers;
+    int* placement = topology_placement(topology);
+    pool->cpu_worker = (int*)malloc(topology->num_cpus * sizeof(int));
+    int* assigned = (int*)calloc(n, sizeof(int));
+    if (placement == NULL || pool->cpu_worker == NULL || assigned == NULL) {
+        free(placement);
+        free(assigned);
+        return false;
+    }
+
+    for (int i = 0; i < n; i++) {
+        Worker* worker = &pool->workers[i];
+        worker->cpu = placement[i % topology->num_usable];
+        worker->inbox = create_work_queue(QUEUE_MPMC);
+        worker->victims = (int*)malloc(n * sizeof(int));
+        if (worker->inbox == NULL || worker->victims == NULL) {
+            free(placement);
+            free(assigned);
+            return false;
+        }
+    }
+    free(placement);
+
+    for (int i = 0; i < n; i++) {
+        Worker* worker = &pool->workers[i];
+        int count = 0;
+        for (int distance = 0; distance < NUM_DISTANCES; distance++) {
+            for (int j = 0; j < n; j++) {
+                if (j != i && cpu_distance(topology, worker->cpu,
+                                           pool->workers[j].cpu) == (CpuDistance)distance) {
+                    worker->victims[count++] = j;
+                }
+            }
+            worker->victims_within[distance] = count;
+        }
+    }
+
+    for (int cpu = 0; cpu < topology->num_cpus; cpu++) {
+        int best = 0;
+        CpuDistance best_distance = NUM_DISTANCES;
+        for (int i = 0; i < n; i++) {
+            CpuDistance distance = cpu_distance(topology, cpu, pool->workers[i].cpu);
+            if (distance < best_distance ||
+                (distance == best_distance && assigned[i] < assigned[best])) {
+                best = i;
+                best_distance = distance;
+            }
+        }
+        pool->cpu_worker[cpu] = best;
+        assigned[best]++;
+    }
+    free(assigned);
+    return true;
+}
+
+// A pool that ignores where its threads run
+ThreadPool* create_thread_pool(int num_workers) {
+    return create_thread_pool_on(num_workers, NULL);
+}
+
+// With a topology the workers are pinned and placed as described above. The pool
+// does not copy the topology, it must outlive the pool.
+ThreadPool* create_thread_pool_on(int num_workers, const CpuTopology* topology) {
+    ThreadPool* pool = (ThreadPool*)cache_aligned_alloc(sizeof(ThreadPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(ThreadPool));
+    pool->num_workers = num_workers;
+    pool->topology = topology;
+    pool->injected = create_work_queue(QUEUE_MPMC);
+    pool->workers = (Worker*)cache_aligned_alloc(num_workers * sizeof(Worker));
+    if (pool->injected == NULL || pool->workers == NULL) {
+        free(pool->workers);
+        if (pool->injected) {
+            destroy_work_queue(pool->injected);
+        }
+        free(pool);
+        return NULL;
+    }
+    memset(pool->workers, 0, num_workers * sizeof(Worker));
+
+    for (int i = 0; i < num_workers; i++) {
+        Worker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->rng = 2654435761u * (i + 1);
+        worker->cpu = -1;
+        if (!deque_init(&worker->deque)) {
+            pool->num_workers = i;
+            destroy_thread_pool(pool);
+            return NULL;
+        }
+    }
+    if (topology != NULL && !pool_place_workers(pool)) {
+        fprintf(stderr, "Error placing pool workers\n");
+        destroy_thread_pool(pool);
+        return NULL;
+    }
+
+    // Start the threads only once every deque exists, they steal from each other
+    for (int i = 0; i < num_workers; i++) {
+        Worker* worker = &pool->workers[i];
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (worker->cpu != -1) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(worker->cpu, &cpuset);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+        }
+        int result = pthread_create(&worker->thread, &attr, pool_worker_thread, worker);
+        pthread_attr_destroy(&attr);
+        if (result != 0) {
+            fprintf(stderr, "Error creating pool worker %d\n", i);
+            destroy_thread_pool(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+// Queue a task. Called from a worker of this pool it goes on that worker's deque,
+// from elsewhere into the inbox of the worker nearest to the calling CPU.
+bool pool_submit(ThreadPool* pool, Task* task) {
+    Worker* self = current_worker;
+    bool queued = false;
+    if (self != NULL && self->pool == pool) {
+        queued = deque_push(&self->deque, task);
+    } else if (pool->cpu_worker != NULL) {
+        int cpu = sched_getcpu();
+        if (cpu >= 0 && cpu < pool->topology->num_cpus) {
+            queued = mpmc_try_enqueue(pool->workers[pool->cpu_worker[cpu]].inbox, task);
+        }
+        if (!queued) {
+            // Inbox full: the shared queue applies backpressure
+            queued = enqueue_task(pool->injected, task);
+        }
+    } else {
+        queued = enqueue_task(pool->injected, task);
+    }
+    if (queued) {
+        pool_notify(pool);
+    }
+    return queued;
+}
+
+// Submit a subtask that pool_wait(group) will wait for
+bool pool_spawn(ThreadPool* pool, TaskGroup* group, Task* task) {
+    task->group = group;
+    __atomic_add_fetch(&group->pending, GROUP_TASK, __ATOMIC_RELAXED);
+    if (!pool_submit(pool, task)) {
+        __atomic_sub_fetch(&group->pending, GROUP_TASK, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+// Wait for every task spawned in group. A worker does not block: it runs other
+// tasks meanwhile, usually its own subtasks straight off its deque. Any other
+// thread sleeps until the last task finishes.
+void pool_wait(ThreadPool* pool, TaskGroup* group) {
+    Worker* self = current_worker;
+    if (self == NULL || self->pool != pool) {
+        wait_all(group);
+        return;
+    }
+
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+        Task* task = pool_find_task(pool, self);
+        if (task != NULL) {
+            pool_run_task(self, task);
+        } else {
+            // The remaining subtasks are running elsewhere
+            sched_yield();
+        }
+    }
+}
+
+// Stop the workers. Tasks still queued are not run.
+void destroy_thread_pool(ThreadPool* pool) {
+    __atomic_store_n(&pool->shutdown, true, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pool->epoch, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&pool->epoch, INT_MAX);
+
+    for (int i = 0; i < pool->num_workers; i++) {
+        if (pool->workers[i].thread) {
+            pthread_join(pool->workers[i].thread, NULL);
+        }
+    }
+    // Queued tasks are the submitters' memory; keep destroy_work_queue() off them
+    for (int i = 0; i < pool->num_workers; i++) {
+        Worker* worker = &pool->workers[i];
+        deque_destroy(&worker->deque);
+        if (worker->inbox != NULL) {
+            while (mpmc_try_dequeue(worker->inbox) != NULL) {
+            }
+            destroy_work_queue(worker->inbox);
+        }
+        free(worker->victims);
+    }
+    free(pool->workers);
+    free(pool->cpu_worker);
+
+    while (mpmc_try_dequeue(pool->injected) != NULL) {
+    }
+    destroy_work_queue(pool->injected);
+    free(pool);
+}
+
+// ----- Parallel loops -----
+// parallel_for() and parallel_reduce() split [begin, end) over the pool's
+// workers. One runner task per worker works through the range:
+// SCHEDULE_STATIC: runner t takes chunks t, t + runners, t + 2 * runners, ...
+//                  of grain iterations (by default one equal block each)
+// SCHEDULE_DYNAMIC: runners claim the next grain iterations from a shared
+//                  counter until none are left, so fast workers take more
+// With grain 0 the chunk size is automatic: for dynamic loops the first chunk
+// is timed and the rest are sized to take about PARALLEL_CHUNK_NS each, but
+// never so big that a runner gets fewer than PARALLEL_MIN_CHUNKS of them.
+// Reductions accumulate into one partial per worker, each on its own cache
+// lines, and the caller combines the partials at the end.
+
+typedef enum {
+    SCHEDULE_STATIC,
+    SCHEDULE_DYNAMIC
+} LoopSchedule;
+
+// How to reduce a value of up to PARALLEL_MAX_VALUE bytes
+typedef struct {
+    size_t size;
+    const void* identity;
+    void (*combine)(void* into, const void* from);
+} Reduction;
+
+// A worker's partial result, padded so that no two workers write the same line
+typedef struct {
+    unsigned char value[PARALLEL_MAX_VALUE];
+} __attribute__((aligned(CACHE_LINE))) LoopPartial;
+
+typedef struct {
+    // parallel_for() sets body, parallel_reduce() reduce_body and partials
+    void (*body)(long begin, long end, void* arg);
+    void (*reduce_body)(long begin, long end, void* partial, void* arg);
+    void* arg;
+    LoopPartial* partials;      // Indexed by worker
+    long begin;
+    long end;
+    long chunk;                 // SCHEDULE_STATIC
+    int runners;
+    LoopSchedule schedule;
+
+    // SCHEDULE_DYNAMIC, written by every runner
+    long next __attribute__((aligned(CACHE_LINE)));     // First unclaimed iteration
+    long grain;
+    bool tuned;                 // The first chunk has been timed
+} ParallelLoop;
+
+typedef struct {
+    Task task;
+    ParallelLoop* loop;
+    int index;
+} LoopRunner;
+
+void loop_run_range(ParallelLoop* loop, long begin, long end) {
+    if (loop->partials != NULL) {
+        // Runners only ever run on the pool's workers
+        loop->reduce_body(begin, end, loop->partials[current_worker->index].value, loop->arg);
+    } else {
+        loop->body(begin, end, loop->arg);
+    }
+}
+
+// Grain for chunks of about PARALLEL_CHUNK_NS, from one timed chunk
+long loop_tuned_grain(ParallelLoop* loop, long iterations, uint64_t ns) {
+    long balanced = (loop->end - loop->begin) / ((long)loop->runners * PARALLEL_MIN_CHUNKS);
+    long grain = ns > 0 ? (long)((double)PARALLEL_CHUNK_NS * iterations / ns) : balanced;
+    if (grain > balanced) {
+        grain = balanced;
+    }
+    return grain < 1 ? 1 : grain;
+}
+
+void loop_runner_task(void* arg) {
+    LoopRunner* runner = (LoopRunner*)arg;
+    ParallelLoop* loop = runner->loop;
+
+    if (loop->schedule == SCHEDULE_STATIC) {
+        long stride = loop->chunk * loop->runners;
+        for (long begin = loop->begin + runner->index * loop->chunk; begin < loop->end;
+             begin += stride) {
+            long end = loop->end - begin > loop->chunk ? begin + loop->chunk : loop->end;
+            loop_run_range(loop, begin, end);
+        }
+        return;
+    }
+
+    while (true) {
+        long grain = __atomic_load_n(&loop->grain, __ATOMIC_RELAXED);
+        long begin = __atomic_fetch_add(&loop->next, grain, __ATOMIC_RELAXED);
+        if (begin >= loop->end) {
+            break;
+        }
+        long end = loop->end - begin > grain ? begin + grain : loop->end;
+        if (__atomic_load_n(&loop->tuned, __ATOMIC_RELAXED)) {
+            loop_run_range(loop, begin, end);
+            continue;
+        }
+        uint64_t start = clock_ns();
+        loop_run_range(loop, begin, end);
+        if (!__atomic_exchange_n(&loop->tuned, true, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&loop->grain, loop_tuned_grain(loop, end - begin, clock_ns() - start),
+                             __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Spawn the runners and wait for them. False if a runner could not be submitted;
+// the ones that were still run to completion first.
+bool loop_run(ThreadPool* pool, ParallelLoop* loop, long grain) {
+    long iterations = loop->end - loop->begin;
+    loop->runners = pool->num_workers;
+    if (grain > 0 && iterations / grain < loop->runners) {
+        loop->runners = (int)((iterations + grain - 1) / grain);
+    }
+
+    if (loop->schedule == SCHEDULE_STATIC) {
+        loop->chunk = grain > 0 ? grain : (iterations + loop->runners - 1) / loop->runners;
+    } else {
+        loop->next = loop->begin;
+        loop->grain = grain;
+        loop->tuned = grain > 0;
+        if (grain == 0) {
+            // Small enough that timing it is cheap, big enough to time
+            loop->grain = iterations / ((long)loop->runners * PARALLEL_MIN_CHUNKS * 4);
+            if (loop->grain > PARALLEL_PROBE_GRAIN) {
+                loop->grain = PARALLEL_PROBE_GRAIN;
+            }
+            if (loop->grain < 1) {
+                loop->grain = 1;
+            }
+        }
+    }
+
+    LoopRunner* runners = (LoopRunner*)cache_aligned_alloc(loop->runners * sizeof(LoopRunner));
+    if (runners == NULL) {
+        return false;
+    }
+    TaskGroup group;
+    task_group_init(&group);
+    bool ok = true;
+    for (int i = 0; i < loop->runners && ok; i++) {
+        runners[i] = (LoopRunner){ .loop = loop, .index = i };
+        runners[i].task = (Task){ .function = loop_runner_task, .data = &runners[i] };
+        ok = pool_spawn(pool, &group, &runners[i].task);
+    }
+    pool_wait(pool, &group);
+    free(runners);
+    return ok;
+}
+
+// Call body on subranges covering [begin, end). grain 0 picks the chunk size.
+bool parallel_for(ThreadPool* pool, long begin, long end, long grain, LoopSchedule schedule,
+                  void (*body)(long begin, long end, void* arg), void* arg) {
+    if (end <= begin) {
+        return true;
+    }
+    if (pool->num_workers == 1 || (grain > 0 && end - begin <= grain)) {
+        body(begin, end, arg);
+        return true;
+    }
+    ParallelLoop loop = { .body = body, .arg = arg, .begin = begin, .end = end,
+                          .schedule = schedule };
+    return loop_run(pool, &loop, grain);
+}
+
+// Like parallel_for(), with body adding its subrange into partial. The partials
+// start as the identity; their combination goes to result.
+bool parallel_reduce(ThreadPool* pool, long begin, long end, long grain, LoopSchedule schedule,
+                     const Reduction* reduction,
+                     void (*body)(long begin, long end, void* partial, void* arg), void* arg,
+                     void* result) {
+    if (reduction->size > PARALLEL_MAX_VALUE) {
+        fprintf(stderr, "parallel_reduce: values are limited to %d bytes\n",
+                PARALLEL_MAX_VALUE);
+        return false;
+    }
+    memcpy(result, reduction->identity, reduction->size);
+    if (end <= begin) {
+        return true;
+    }
+    if (pool->num_workers == 1 || (grain > 0 && end - begin <= grain)) {
+        body(begin, end, result, arg);
+        return true;
+    }
+
+    LoopPartial* partials =
+        (LoopPartial*)cache_aligned_alloc(pool->num_workers * sizeof(LoopPartial));
+    if (partials == NULL) {
+        return false;
+    }
+    for (int i = 0; i < pool->num_workers; i++) {
+        memcpy(partials[i].value, reduction->identity, reduction->size);
+    }
+    ParallelLoop loop = { .reduce_body = body, .arg = arg, .partials = partials,
+                          .begin = begin, .end = end, .schedule = schedule };
+    bool ok = loop_run(pool, &loop, grain);
+    for (int i = 0; i < pool->num_workers; i++) {
+        reduction->combine(result, partials[i].value);
+    }
+    free(partials);
+    return ok;
+}
+
+// Example task function - processes a value
+void process_task(void* arg) {
+    TaskData* data = (TaskData*)arg;
+    
+    // Get thread ID for demonstration
+    pthread_t thread_id = pthread_self();
+    
+    printf("Thread %lu processing task with value %d (sleep: %d ms)\n", 
+           (unsigned long)thread_id, data->value, data->processing_time);
+    
+    // Simulate processing time; the task sleeps, so let an elastic pool
+    // run another worker meanwhile
+    elastic_blocking_begin();
+    usleep(data->processing_time * 1000);
+    elastic_blocking_end();
+    
+    printf("Thread %lu completed task with value %d (result: %d)\n", 
+           (unsigned long)thread_id, data->value, data->value * data->value);
+}
+
+// The same work returning its result through a future
+long square_task(void* arg) {
+    TaskData* data = (TaskData*)arg;
+    process_task(data);
+    return (long)data->value * data->value;
+}
+
+// Continuation: runs on the worker as each task completes
+void add_result(long result, void* arg) {
+    __atomic_add_fetch((long*)arg, result, __ATOMIC_RELAXED);
+}
+
+// Worker thread function
+void* worker_thread(void* arg) {
+    WorkQueue* queue = (WorkQueue*)arg;
+    
+    pthread_t thread_id = pthread_self();
+    printf("Worker thread %lu started\n", (unsigned long)thread_id);
+    
+    while (true) {
+        // Get the next task from the queue
+        Task* task = dequeue_task(queue);
+        
+        if (task == NULL) {
+            // Queue is being shut down
+            printf("Worker thread %lu shutting down\n", (unsigned long)thread_id);
+            break;
+        }
+        
+        // Execute the task
+        task->function(task->data);
+        
+        // Clean up
+        task_release(task);
+    }
+    
+    return NULL;
+}
+
+// ----- Benchmark -----
+// P producers push no-op tasks into one queue drained by P consumers. Tasks are
+// preallocated so only the queue is measured. Reports overall tasks/sec and the
+// latency of individual enqueue_task() calls.
+
+typedef struct {
+    WorkQueue* queue;
+    Task* tasks;
+    int count;
+    double* samples;            // Enqueue latencies in ns
+    int sample_count;
+} BenchProducer;
+
+typedef struct {
+    WorkQueue* queue;
+    long completed;
+} BenchConsumer;
+
+double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void noop_task(void* data) {
+    (void)data;
+}
+
+void* bench_producer(void* arg) {
+    BenchProducer* producer = (BenchProducer*)arg;
+
+    for (int i = 0; i < producer->count; i++) {
+        if (i % BENCH_SAMPLE_EVERY == 0) {
+            double start = now_ns();
+            enqueue_task(producer->queue, &producer->tasks[i]);
+            producer->samples[producer->sample_count++] = now_ns() - start;
+        } else {
+            enqueue_task(producer->queue, &producer->tasks[i]);
+        }
+    }
+    return NULL;
+}
+
+void* bench_consumer(void* arg) {
+    BenchConsumer* consumer = (BenchConsumer*)arg;
+    Task* task;
+
+    while ((task = dequeue_task(consumer->queue)) != NULL) {
+        task->function(task->data);
+        consumer->completed++;
+    }
+    return NULL;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+int bench_run(QueueKind kind, int threads, int total_tasks) {
+    WorkQueue* queue = create_work_queue(kind);
+    Task* tasks = task_array_alloc(total_tasks);
+    double* samples = (double*)malloc(sizeof(double) * (total_tasks / BENCH_SAMPLE_EVERY + threads));
+    if (queue == NULL || tasks == NULL || samples == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    for (int i = 0; i < total_tasks; i++) {
+        tasks[i].task_id = i;
+        tasks[i].function = noop_task;
+    }
+
+    BenchProducer producers[BENCH_MAX_THREADS];
+    BenchConsumer consumers[BENCH_MAX_THREADS];
+    pthread_t producer_ids[BENCH_MAX_THREADS];
+    pthread_t consumer_ids[BENCH_MAX_THREADS];
+    int per_producer = total_tasks / threads;
+    double* next_samples = samples;
+
+    for (int i = 0; i < threads; i++) {
+        consumers[i].queue = queue;
+        consumers[i].completed = 0;
+        pthread_create(&consumer_ids[i], NULL, bench_consumer, &consumers[i]);
+    }
+
+    double start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        producers[i].queue = queue;
+        producers[i].tasks = tasks + i * per_producer;
+        producers[i].count = per_producer;
+        producers[i].samples = next_samples;
+        producers[i].sample_count = 0;
+        next_samples += per_producer / BENCH_SAMPLE_EVERY + 1;
+        pthread_create(&producer_ids[i], NULL, bench_producer, &producers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(producer_ids[i], NULL);
+    }
+    // Consumers drain what is left and then see the shutdown
+    shutdown_work_queue(queue);
+    long completed = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(consumer_ids[i], NULL);
+        completed += consumers[i].completed;
+    }
+    double elapsed = now_ns() - start;
+
+    // Gather the per-producer samples into one sorted array
+    int count = 0;
+    for (int i = 0; i < threads; i++) {
+        memmove(samples + count, producers[i].samples, producers[i].sample_count * sizeof(double));
+        count += producers[i].sample_count;
+    }
+    qsort(samples, count, sizeof(double), compare_doubles);
+
+    printf("%-6s %8d %14.0f %12.0f %12.0f %10s\n", kind == QUEUE_MPMC ? "mpmc" : "mutex",
+           threads, completed / (elapsed / 1e9), samples[count / 2],
+           samples[(int)(count * 0.99)],
+           completed == (long)per_producer * threads ? "ok" : "LOST");
+
+    free(samples);
+    free(tasks);
+    destroy_work_queue(queue);
+    return 0;
+}
+
+int run_benchmark(int total_tasks) {
+    printf("Work queue benchmark: %d no-op tasks, as many producers as consumers, "
+           "%d CPUs\n", total_tasks, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-6s %8s %14s %12s %12s %10s\n", "queue", "threads", "tasks/s",
+           "enq p50 ns", "enq p99 ns", "check");
+
+    for (int threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2) {
+        if (bench_run(QUEUE_MUTEX, threads, total_tasks) == -1 ||
+            bench_run(QUEUE_MPMC, threads, total_tasks) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// ----- Benchmark: work-stealing pool -----
+// Recursive fork/join (fib, quicksort) on the pool, and many tiny independent
+// tasks on the pool versus the shared WorkQueue.
+
+typedef struct {
+    ThreadPool* pool;
+    int n;
+    long result;
+} FibArgs;
+
+typedef struct {
+    ThreadPool* pool;
+    int* values;
+    long count;
+} SortArgs;
+
+long fib_serial(int n) {
+    return n < 2 ? n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+void fib_task(void* arg) {
+    FibArgs* args = (FibArgs*)arg;
+    if (args->n < STEAL_BENCH_FIB_CUTOFF) {
+        args->result = fib_serial(args->n);
+        return;
+    }
+
+    // fib(n - 1) may be stolen, fib(n - 2) runs here. With the deque and the
+    // shared queue both full, fib(n - 1) runs here too.
+    FibArgs left = { args->pool, args->n - 1, 0 };
+    FibArgs right = { args->pool, args->n - 2, 0 };
+    Task task = { .function = fib_task, .data = &left };
+    TaskGroup group;
+    task_group_init(&group);
+    if (!pool_spawn(args->pool, &group, &task)) {
+        fib_task(&left);
+    }
+    fib_task(&right);
+    pool_wait(args->pool, &group);
+    args->result = left.result + right.result;
+}
+
+int compare_ints(const void* a, const void* b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+void sort_task(void* arg) {
+    SortArgs* args = (SortArgs*)arg;
+    int* v = args->values;
+    long n = args->count;
+    if (n < STEAL_BENCH_SORT_CUTOFF) {
+        qsort(v, n, sizeof(int), compare_ints);
+        return;
+    }
+
+    // Hoare partition around the median of three
+    int a = v[0], b = v[n / 2], c = v[n - 1];
+    int pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+    long i = -1, j = n;
+    while (true) {
+        do { i++; } while (v[i] < pivot);
+        do { j--; } while (v[j] > pivot);
+        if (i >= j) {
+            break;
+        }
+        int tmp = v[i];
+        v[i] = v[j];
+        v[j] = tmp;
+    }
+
+    SortArgs left = { args->pool, v, j + 1 };
+    SortArgs right = { args->pool, v + j + 1, n - j - 1 };
+    Task task = { .function = sort_task, .data = &left };
+    TaskGroup group;
+    task_group_init(&group);
+    if (!pool_spawn(args->pool, &group, &task)) {
+        sort_task(&left);
+    }
+    sort_task(&right);
+    pool_wait(args->pool, &group);
+}
+
+// Roughly 100 ns of work
+void tiny_task(void* arg) {
+    volatile unsigned x = (unsigned)(uintptr_t)arg;
+    for (int i = 0; i < 32; i++) {
+        x = x * 1103515245u + 12345u;
+    }
+}
+
+typedef struct {
+    ThreadPool* pool;
+    Task* tasks;
+    int count;
+} SpawnAllArgs;
+
+// Root of the fine-grained benchmark: spawns everything from inside the pool
+void spawn_all_task(void* arg) {
+    SpawnAllArgs* args = (SpawnAllArgs*)arg;
+    TaskGroup group;
+    task_group_init(&group);
+    for (int i = 0; i < args->count; i++) {
+        if (!pool_spawn(args->pool, &group, &args->tasks[i])) {
+            args->tasks[i].function(args->tasks[i].data);
+        }
+    }
+    pool_wait(args->pool, &group);
+}
+
+// Run one task on the pool from this (outside) thread and wait for it
+void pool_run_root(ThreadPool* pool, Task* root) {
+    TaskGroup group;
+    task_group_init(&group);
+    if (!pool_spawn(pool, &group, root)) {
+        root->function(root->data);
+    }
+    pool_wait(pool, &group);
+}
+
+long pool_executed(ThreadPool* pool, long* steals) {
+    long executed = 0;
+    *steals = 0;
+    for (int i = 0; i < pool->num_workers; i++) {
+        executed += pool->workers[i].executed;
+        *steals += pool->workers[i].steals;
+    }
+    return executed;
+}
+
+void print_fork_join_row(const char* name, int workers, double ms, double serial_ms,
+                         ThreadPool* pool) {
+    long steals;
+    long executed = pool_executed(pool, &steals);
+    printf("%-22s %7d %10.1f %8.2fx %12.0f %10ld\n", name, workers, ms, serial_ms / ms,
+           executed / (ms / 1e3), steals);
+}
+
+// Tasks per second for the tiny tasks on the shared WorkQueue
+double tiny_on_work_queue(QueueKind kind, int workers, Task* tasks, int count) {
+    WorkQueue* queue = create_work_queue(kind);
+    BenchConsumer consumers[BENCH_MAX_THREADS];
+    pthread_t ids[BENCH_MAX_THREADS];
+
+    double start = now_ns();
+    for (int i = 0; i < workers; i++) {
+        consumers[i].queue = queue;
+        consumers[i].completed = 0;
+        pthread_create(&ids[i], NULL, bench_consumer, &consumers[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        enqueue_task(queue, &tasks[i]);
+    }
+    shutdown_work_queue(queue);
+    for (int i = 0; i < workers; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double elapsed = now_ns() - start;
+
+    destroy_work_queue(queue);
+    return count / (elapsed / 1e9);
+}
+
+double tiny_on_pool(int workers, Task* tasks, int count) {
+    double start = now_ns();
+    ThreadPool* pool = create_thread_pool(workers);
+    if (pool == NULL) {
+        return 0;
+    }
+    SpawnAllArgs args = { pool, tasks, count };
+    Task root = { .function = spawn_all_task, .data = &args };
+    pool_run_root(pool, &root);
+    destroy_thread_pool(pool);
+    return count / ((now_ns() - start) / 1e9);
+}
+
+int run_steal_benchmark() {
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int max_workers = cpus > 4 ? cpus : 4;
+    if (max_workers > BENCH_MAX_THREADS) {
+        max_workers = BENCH_MAX_THREADS;
+    }
+
+    int* original = (int*)malloc(STEAL_BENCH_SORT * sizeof(int));
+    int* values = (int*)malloc(STEAL_BENCH_SORT * sizeof(int));
+    Task* tasks = task_array_alloc(STEAL_BENCH_TINY);
+    if (original == NULL || values == NULL || tasks == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    srand(1);
+    for (int i = 0; i < STEAL_BENCH_SORT; i++) {
+        original[i] = rand();
+    }
+    for (int i = 0; i < STEAL_BENCH_TINY; i++) {
+        tasks[i].task_id = i;
+        tasks[i].function = tiny_task;
+        tasks[i].data = (void*)(uintptr_t)i;
+    }
+
+    // Serial baselines for the speedup column
+    double start = now_ns();
+    volatile long fib_expected = fib_serial(STEAL_BENCH_FIB);
+    double fib_serial_ms = (now_ns() - start) / 1e6;
+    memcpy(values, original, STEAL_BENCH_SORT * sizeof(int));
+    start = now_ns();
+    qsort(values, STEAL_BENCH_SORT, sizeof(int), compare_ints);
+    double sort_serial_ms = (now_ns() - start) / 1e6;
+
+    printf("Work-stealing pool: fork/join, %d CPUs (speedup is against a plain serial run)\n",
+           cpus);
+    printf("%-22s %7s %10s %9s %12s %10s\n", "benchmark", "workers", "time ms", "speedup",
+           "tasks/s", "steals");
+
+    char name[32];
+    for (int workers = 1; workers <= max_workers; workers *= 2) {
+        ThreadPool* pool = create_thread_pool(workers);
+        if (pool == NULL) {
+            fprintf(stderr, "Error creating thread pool\n");
+            return -1;
+        }
+        FibArgs fib = { pool, STEAL_BENCH_FIB, 0 };
+        Task root = { .function = fib_task, .data = &fib };
+        start = now_ns();
+        pool_run_root(pool, &root);
+        double ms = (now_ns() - start) / 1e6;
+        snprintf(name, sizeof(name), "fib(%d)%s", STEAL_BENCH_FIB,
+                 fib.result == fib_expected ? "" : " WRONG");
+        print_fork_join_row(name, workers, ms, fib_serial_ms, pool);
+        destroy_thread_pool(pool);
+    }
+    for (int workers = 1; workers <= max_workers; workers *= 2) {
+        ThreadPool* pool = create_thread_pool(workers);
+        if (pool == NULL) {
+            fprintf(stderr, "Error creating thread pool\n");
+            return -1;
+        }
+        memcpy(values, original, STEAL_BENCH_SORT * sizeof(int));
+        SortArgs sort = { pool, values, STEAL_BENCH_SORT };
+        Task root = { .function = sort_task, .data = &sort };
+        start = now_ns();
+        pool_run_root(pool, &root);
+        double ms = (now_ns() - start) / 1e6;
+        bool sorted = true;
+        for (int i = 1; i < STEAL_BENCH_SORT && sorted; i++) {
+            sorted = values[i - 1] <= values[i];
+        }
+        snprintf(name, sizeof(name), "quicksort %dM%s", STEAL_BENCH_SORT >> 20,
+                 sorted ? "" : " WRONG");
+        print_fork_join_row(name, workers, ms, sort_serial_ms, pool);
+        destroy_thread_pool(pool);
+    }
+
+    printf("\nFine-grained: %d tasks of ~100 ns, tasks/s including thread start/stop\n",
+           STEAL_BENCH_TINY);
+    printf("%7s %14s %14s %14s\n", "workers", "mutex queue", "mpmc queue", "pool");
+    for (int workers = 1; workers <= max_workers; workers *= 2) {
+        printf("%7d %14.0f %14.0f %14.0f\n", workers,
+               tiny_on_work_queue(QUEUE_MUTEX, workers, tasks, STEAL_BENCH_TINY),
+               tiny_on_work_queue(QUEUE_MPMC, workers, tasks, STEAL_BENCH_TINY),
+               tiny_on_pool(workers, tasks, STEAL_BENCH_TINY));
+    }
+
+    free(tasks);
+    free(values);
+    free(original);
+    return 0;
+}
+
+// ----- Benchmark: task allocation -----
+// Producers create tasks carrying a TaskData and consumers run and free them, the
+// original way (malloc() for Task and TaskData, free() on the consumer) and with
+// task_alloc()/task_free(). Both go through the MPMC queue.
+
+typedef struct {
+    WorkQueue* queue;
+    int count;
+    bool pooled;
+} AllocProducer;
+
+typedef struct {
+    WorkQueue* queue;
+    bool pooled;
+    long sum;
+} AllocConsumer;
+
+void sum_task(void* arg) {
+    TaskData* data = (TaskData*)arg;
+    data->processing_time = data->value * 2;
+}
+
+void* alloc_producer(void* arg) {
+    AllocProducer* producer = (AllocProducer*)arg;
+
+    for (int i = 0; i < producer->count; i++) {
+        Task* task;
+        if (producer->pooled) {
+            task = task_alloc(sum_task, sizeof(TaskData));
+        } else {
+            __atomic_add_fetch(&task_heap_allocations, 1, __ATOMIC_RELAXED);
+            task = task_array_alloc(1);
+            if (task != NULL) {
+                task->function = sum_task;
+                task->data = task_heap_alloc(sizeof(TaskData));
+            }
+        }
+        if (task == NULL || task->data == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            break;
+        }
+        ((TaskData*)task->data)->value = i;
+        enqueue_task(producer->queue, task);
+    }
+    return NULL;
+}
+
+void* alloc_consumer(void* arg) {
+    AllocConsumer* consumer = (AllocConsumer*)arg;
+    Task* task;
+
+    while ((task = dequeue_task(consumer->queue)) != NULL) {
+        task->function(task->data);
+        consumer->sum += ((TaskData*)task->data)->processing_time;
+        if (consumer->pooled) {
+            task_free(task);
+        } else {
+            free(task->data);
+            free(task);
+        }
+    }
+    return NULL;
+}
+
+void alloc_bench_run(bool pooled, int threads, int total_tasks) {
+    WorkQueue* queue = create_work_queue(QUEUE_MPMC);
+    AllocProducer producers[BENCH_MAX_THREADS];
+    AllocConsumer consumers[BENCH_MAX_THREADS];
+    pthread_t producer_ids[BENCH_MAX_THREADS];
+    pthread_t consumer_ids[BENCH_MAX_THREADS];
+    int per_producer = total_tasks / threads;
+
+    long allocations = __atomic_load_n(&task_heap_allocations, __ATOMIC_RELAXED);
+    double start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        consumers[i].queue = queue;
+        consumers[i].pooled = pooled;
+        consumers[i].sum = 0;
+        pthread_create(&consumer_ids[i], NULL, alloc_consumer, &consumers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        producers[i].queue = queue;
+        producers[i].count = per_producer;
+        producers[i].pooled = pooled;
+        pthread_create(&producer_ids[i], NULL, alloc_producer, &producers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(producer_ids[i], NULL);
+    }
+    shutdown_work_queue(queue);
+    long sum = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(consumer_ids[i], NULL);
+        sum += consumers[i].sum;
+    }
+    double elapsed = now_ns() - start;
+    allocations = __atomic_load_n(&task_heap_allocations, __ATOMIC_RELAXED) - allocations;
+
+    long tasks = (long)per_producer * threads;
+    long expected = (long)per_producer * (per_producer - 1) * threads;
+    printf("%-10s %8d %14.0f %12ld %12.4f %8s\n", pooled ? "task_alloc" : "malloc", threads,
+           tasks / (elapsed / 1e9), allocations, (double)allocations / tasks,
+           sum == expected ? "ok" : "WRONG");
+    destroy_work_queue(queue);
+}
+
+void run_alloc_benchmark(int total_tasks) {
+    printf("Task allocation: %d tasks through the MPMC queue, producers = consumers\n",
+           total_tasks);
+    printf("%-10s %8s %14s %12s %12s %8s\n", "tasks", "threads", "tasks/s", "heap allocs",
+           "allocs/task", "check");
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        alloc_bench_run(false, threads, total_tasks);
+        alloc_bench_run(true, threads, total_tasks);
+    }
+}
+
+// ----- Benchmark: bulk enqueue/dequeue -----
+// Producers hand over batches of tiny tasks, either one enqueue_task() per task
+// or one enqueue_tasks_bulk() per batch; consumers respectively use
+// dequeue_task() or dequeue_tasks_bulk(). The tasks do nothing, so what is
+// measured is the synchronization. CPU time covers all threads.
+
+typedef struct {
+    WorkQueue* queue;
+    Task* tasks;
+    int count;
+    int batch;
+    bool bulk;
+} BulkProducer;
+
+void* bulk_producer(void* arg) {
+    BulkProducer* producer = (BulkProducer*)arg;
+    Task* batch[producer->batch];
+
+    for (int i = 0; i < producer->count; i += producer->batch) {
+        int n = producer->count - i < producer->batch ? producer->count - i : producer->batch;
+        if (producer->bulk) {
+            for (int j = 0; j < n; j++) {
+                batch[j] = &producer->tasks[i + j];
+            }
+            enqueue_tasks_bulk(producer->queue, batch, n);
+        } else {
+            for (int j = 0; j < n; j++) {
+                enqueue_task(producer->queue, &producer->tasks[i + j]);
+            }
+        }
+    }
+    return NULL;
+}
+
+void* bulk_consumer(void* arg) {
+    BenchConsumer* consumer = (BenchConsumer*)arg;
+    Task* tasks[BULK_BENCH_DEQUEUE];
+    int n;
+
+    while ((n = dequeue_tasks_bulk(consumer->queue, tasks, BULK_BENCH_DEQUEUE)) > 0) {
+        for (int i = 0; i < n; i++) {
+            tasks[i]->function(tasks[i]->data);
+        }
+        consumer->completed += n;
+    }
+    return NULL;
+}
+
+double process_cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Returns tasks/sec; *cpu_per_task gets CPU ns per task
+double bulk_bench_run(QueueKind kind, bool bulk, int threads, int batch, Task* tasks,
+                      int total_tasks, double* cpu_per_task) {
+    WorkQueue* queue = create_work_queue(kind);
+    BulkProducer producers[BENCH_MAX_THREADS];
+    BenchConsumer consumers[BENCH_MAX_THREADS];
+    pthread_t producer_ids[BENCH_MAX_THREADS];
+    pthread_t consumer_ids[BENCH_MAX_THREADS];
+    int per_producer = total_tasks / threads;
+
+    double cpu = process_cpu_ns();
+    double start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        consumers[i].queue = queue;
+        consumers[i].completed = 0;
+        pthread_create(&consumer_ids[i], NULL, bulk ? bulk_consumer : bench_consumer,
+                       &consumers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        producers[i].queue = queue;
+        producers[i].tasks = tasks + i * per_producer;
+        producers[i].count = per_producer;
+        producers[i].batch = batch;
+        producers[i].bulk = bulk;
+        pthread_create(&producer_ids[i], NULL, bulk_producer, &producers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(producer_ids[i], NULL);
+    }
+    shutdown_work_queue(queue);
+    long completed = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(consumer_ids[i], NULL);
+        completed += consumers[i].completed;
+    }
+    double elapsed = now_ns() - start;
+    *cpu_per_task = (process_cpu_ns() - cpu) / completed;
+
+    destroy_work_queue(queue);
+    if (completed != (long)per_producer * threads) {
+        fprintf(stderr, "Lost tasks: %ld of %ld\n", completed, (long)per_producer * threads);
+    }
+    return completed / (elapsed / 1e9);
+}
+
+int run_bulk_benchmark(int total_tasks) {
+    static const int batches[] = { 1, 16, 64, 256 };
+    int threads = 2;
+    Task* tasks = task_array_alloc(total_tasks);
+    if (tasks == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    for (int i = 0; i < total_tasks; i++) {
+        tasks[i].task_id = i;
+        tasks[i].function = noop_task;
+    }
+
+    printf("Bulk enqueue/dequeue: %d no-op tasks, %d producers, %d consumers "
+           "(consumers take up to %d at once)\n",
+           total_tasks, threads, threads, BULK_BENCH_DEQUEUE);
+    printf("%-6s %6s %16s %12s %16s %12s\n", "queue", "batch", "single tasks/s",
+           "cpu ns/task", "bulk tasks/s", "cpu ns/task");
+    for (int k = 0; k < 2; k++) {
+        QueueKind kind = k == 0 ? QUEUE_MUTEX : QUEUE_MPMC;
+        for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+            double single_cpu, bulk_cpu;
+            double single = bulk_bench_run(kind, false, threads, batches[i], tasks,
+                                           total_tasks, &single_cpu);
+            double bulk = bulk_bench_run(kind, true, threads, batches[i], tasks,
+                                         total_tasks, &bulk_cpu);
+            printf("%-6s %6d %16.0f %12.0f %16.0f %12.0f\n",
+                   kind == QUEUE_MPMC ? "mpmc" : "mutex", batches[i], single, single_cpu,
+                   bulk, bulk_cpu);
+        }
+    }
+
+    free(tasks);
+    return 0;
+}
+
+// ----- Benchmark: priority lanes -----
+// Two producers keep the queue full of low-priority tasks that each take
+// LANE_BENCH_LOW_US of CPU while a third submits LANE_BENCH_HIGH_RATE short
+// high-priority tasks per second. Reports how long the high-priority tasks wait
+// with one FIFO ring, strict lanes, weighted lanes and deadlines.
+
+typedef enum { LANE_BENCH_FIFO, LANE_BENCH_STRICT, LANE_BENCH_WEIGHTED, LANE_BENCH_EDF } LaneBenchMode;
+
+typedef struct {
+    uint64_t submitted_ns;
+} LaneBenchData;
+
+typedef struct {
+    WorkQueue* queue;
+    LaneBenchMode mode;
+    volatile bool running;
+    double* high_delays;        // us, filled by the high-priority tasks
+    long high_capacity;
+    long high_count;
+    long low_done;
+} LaneBench;
+
+static LaneBench* lane_bench;
+
+void spin_us(int us) {
+    uint64_t end = clock_ns() + us * 1000ull;
+    while (clock_ns() < end) {
+    }
+}
+
+void lane_low_task(void* arg) {
+    (void)arg;
+    spin_us(LANE_BENCH_LOW_US);
+    __atomic_add_fetch(&lane_bench->low_done, 1, __ATOMIC_RELAXED);
+}
+
+void lane_high_task(void* arg) {
+    LaneBenchData* data = (LaneBenchData*)arg;
+    long i = __atomic_fetch_add(&lane_bench->high_count, 1, __ATOMIC_RELAXED);
+    if (i < lane_bench->high_capacity) {
+        lane_bench->high_delays[i] = (clock_ns() - data->submitted_ns) / 1e3;
+    }
+}
+
+void* lane_consumer(void* arg) {
+    WorkQueue* queue = (WorkQueue*)arg;
+    Task* task;
+    while ((task = dequeue_task(queue)) != NULL) {
+        task->function(task->data);
+        task_release(task);
+    }
+    return NULL;
+}
+
+void* lane_low_producer(void* arg) {
+    LaneBench* bench = (LaneBench*)arg;
+    while (bench->running) {
+        Task* task = task_alloc(lane_low_task, sizeof(LaneBenchData));
+        if (task == NULL) {
+            break;
+        }
+        task->priority = NUM_LANES - 1;
+        if (!enqueue_task(bench->queue, task)) {
+            task_free(task);
+            break;
+        }
+    }
+    return NULL;
+}
+
+void* lane_high_producer(void* arg) {
+    LaneBench* bench = (LaneBench*)arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (bench->running) {
+        Task* task = task_alloc(lane_high_task, sizeof(LaneBenchData));
+        if (task == NULL) {
+            break;
+        }
+        task->priority = 0;
+        uint64_t now = clock_ns();
+        if (bench->mode == LANE_BENCH_EDF) {
+            task->deadline_ns = now + 1000000;     // 1 ms from now
+        }
+        ((LaneBenchData*)task->data)->submitted_ns = now;
+        if (!enqueue_task(bench->queue, task)) {
+            task_free(task);
+            break;
+        }
+
+        next.tv_nsec += 1000000000L / LANE_BENCH_HIGH_RATE;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+void lane_bench_run(LaneBenchMode mode, int workers, Histogram* lane_delays) {
+    static const char* names[] = { "fifo", "strict", "weighted 8:2:1", "edf (1 ms)" };
+    static const int weights[NUM_LANES] = { 8, 2, 1 };
+
+    LaneBench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.mode = mode;
+    bench.running = true;
+    bench.high_capacity = (long)LANE_BENCH_HIGH_RATE * LANE_BENCH_SECONDS * 2;
+    bench.high_delays = (double*)malloc(bench.high_capacity * sizeof(double));
+    bench.queue = create_work_queue(mode == LANE_BENCH_FIFO ? QUEUE_MUTEX : QUEUE_LANES);
+    if (bench.high_delays == NULL || bench.queue == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    if (mode == LANE_BENCH_WEIGHTED) {
+        set_lane_policy(bench.queue, LANES_WEIGHTED, weights);
+    }
+    lane_bench = &bench;
+
+    pthread_t consumer_ids[BENCH_MAX_THREADS];
+    pthread_t low_ids[2];
+    pthread_t high_id;
+    for (int i = 0; i < workers; i++) {
+        pthread_create(&consumer_ids[i], NULL, lane_consumer, bench.queue);
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_create(&low_ids[i], NULL, lane_low_producer, &bench);
+    }
+    pthread_create(&high_id, NULL, lane_high_producer, &bench);
+
+    sleep(LANE_BENCH_SECONDS);
+    bench.running = false;
+    shutdown_work_queue(bench.queue);
+    pthread_join(high_id, NULL);
+    for (int i = 0; i < 2; i++) {
+        pthread_join(low_ids[i], NULL);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_join(consumer_ids[i], NULL);
+    }
+
+    long count = bench.high_count < bench.high_capacity ? bench.high_count : bench.high_capacity;
+    qsort(bench.high_delays, count, sizeof(double), compare_doubles);
+    printf("%-16s %10ld %10.1f %10.1f %10.1f %14.0f\n", names[mode], count,
+           count ? bench.high_delays[count / 2] : 0.0,
+           count ? bench.high_delays[(long)(count * 0.99)] : 0.0,
+           count ? bench.high_delays[count - 1] : 0.0,
+           bench.low_done / (double)LANE_BENCH_SECONDS);
+
+    if (lane_delays != NULL) {
+        for (int lane = 0; lane <= EDF_LANE; lane++) {
+            lane_delay_histogram(bench.queue, lane, &lane_delays[lane]);
+        }
+    }
+    destroy_work_queue(bench.queue);
+    free(bench.high_delays);
+    lane_bench = NULL;
+}
+
+void run_lane_benchmark(int workers) {
+    Histogram delays[3][EDF_LANE + 1];
+
+    printf("Priority lanes: %d workers saturated by %d us low-priority tasks, "
+           "%d high-priority tasks/s, %d s per run\n",
+           workers, LANE_BENCH_LOW_US, LANE_BENCH_HIGH_RATE, LANE_BENCH_SECONDS);
+    printf("%-16s %10s %10s %10s %10s %14s\n", "queue", "high tasks", "p50 us", "p99 us",
+           "max us", "low tasks/s");
+    lane_bench_run(LANE_BENCH_FIFO, workers, NULL);
+    lane_bench_run(LANE_BENCH_STRICT, workers, delays[0]);
+    lane_bench_run(LANE_BENCH_WEIGHTED, workers, delays[1]);
+    lane_bench_run(LANE_BENCH_EDF, workers, delays[2]);
+
+    // The queue's own per-lane histograms for the lane runs
+    static const char* runs[] = { "strict", "weighted", "edf" };
+    printf("\nQueueing delay recorded by the queue, per lane\n");
+    printf("%-9s %-5s %10s %10s %10s %10s %10s\n", "run", "lane", "tasks", "mean us",
+           "p50 us<=", "p99 us<=", "max us");
+    for (int run = 0; run < 3; run++) {
+        for (int lane = 0; lane <= EDF_LANE; lane++) {
+            Histogram* h = &delays[run][lane];
+            if (h->count == 0) {
+                continue;
+            }
+            char name[8];
+            snprintf(name, sizeof(name), lane == EDF_LANE ? "edf" : "%d", lane);
+            printf("%-9s %-5s %10ld %10.1f %10llu %10llu %10.1f\n", runs[run], name, h->count,
+                   h->sum_ns / h->count / 1e3,
+                   (unsigned long long)histogram_percentile(h, 50),
+                   (unsigned long long)histogram_percentile(h, 99), h->max_ns / 1e3);
+        }
+    }
+}
+
+// ----- Benchmark: elastic pool -----
+// Drives an elastic pool through idle, CPU-bound, blocking and idle phases and
+// prints how the worker count follows the load.
+
+typedef struct {
+    const char* name;
+    int seconds_x10;            // Phase length in tenths of a second
+    int rate;                   // Tasks per second
+    void (*function)(void* data);
+} ElasticPhase;
+
+void elastic_cpu_task(void* arg) {
+    (void)arg;
+    spin_us(ELASTIC_BENCH_CPU_US);
+}
+
+void elastic_io_task(void* arg) {
+    (void)arg;
+    elastic_blocking_begin();
+    usleep(ELASTIC_BENCH_IO_MS * 1000);
+    elastic_blocking_end();
+}
+
+void run_elastic_benchmark() {
+    // The CPU phase asks for 90% of the machine, the blocking phase keeps about
+    // four tasks asleep at any time
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const ElasticPhase phases[] = {
+        { "idle",      5, 0, NULL },
+        { "cpu",      15, cpus * 900000 / ELASTIC_BENCH_CPU_US, elastic_cpu_task },
+        { "blocking", 15, 4000 / ELASTIC_BENCH_IO_MS, elastic_io_task },
+        { "idle",     20, 0, NULL },
+    };
+
+    ElasticConfig config;
+    elastic_default_config(&config);
+    if (config.max_workers < 4) {
+        config.max_workers = 4;
+        config.max_threads = 16;
+    }
+    WorkQueue* queue = create_work_queue(QUEUE_MPMC);
+    ElasticPool* pool = queue ? create_elastic_pool(queue, &config) : NULL;
+    if (pool == NULL) {
+        fprintf(stderr, "Error creating elastic pool\n");
+        return;
+    }
+
+    printf("Elastic pool: %d-%d runnable workers, at most %d threads, %d ms ticks, "
+           "grow after %d backlogged ticks, shrink after %d idle ticks\n",
+           config.min_workers, config.max_workers, config.max_threads, ELASTIC_TICK_MS,
+           config.grow_ticks, config.shrink_ticks);
+    printf("%7s %-9s %6s %9s %6s %8s %6s %7s %12s\n", "time ms", "phase", "depth",
+           "wait us", "alive", "blocked", "grown", "shrunk", "compensated");
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    int elapsed_ms = 0;
+    for (size_t p = 0; p < sizeof(phases) / sizeof(phases[0]); p++) {
+        const ElasticPhase* phase = &phases[p];
+        double owed = 0;
+        for (int ms = 0; ms < phase->seconds_x10 * 100; ms++, elapsed_ms++) {
+            // Submit this millisecond's share of the phase's rate
+            owed += phase->rate / 1000.0;
+            while (owed >= 1) {
+                Task* task = task_alloc(phase->function, 0);
+                if (task == NULL || !elastic_submit(pool, task)) {
+                    fprintf(stderr, "Error submitting task\n");
+                    break;
+                }
+                owed -= 1;
+            }
+
+            if (elapsed_ms % 100 == 0) {
+                pthread_mutex_lock(&pool->lock);
+                printf("%7d %-9s %6d %9.0f %6d %8d %6ld %7ld %12ld\n", elapsed_ms, phase->name,
+                       pool->last_depth, pool->last_wait_us, pool->alive, pool->blocked,
+                       pool->grown, pool->shrunk, pool->compensated);
+                pthread_mutex_unlock(&pool->lock);
+            }
+
+            next.tv_nsec += 1000000L;
+            if (next.tv_nsec >= 1000000000L) {
+                next.tv_nsec -= 1000000000L;
+                next.tv_sec++;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        }
+    }
+
+    printf("Peak threads: %d\n", pool->peak);
+    destroy_elastic_pool(pool);
+    destroy_work_queue(queue);
+}
+
+// ----- Benchmark: topology-aware placement -----
+// One producer per usable CPU writes a working set and submits a task that reads
+// it back several times. Placed near its producer the task finds the data in a
+// shared cache; anywhere else it pulls every line across the machine. Run with
+// the pool pinned and topology-aware, then with free-floating workers.
+
+typedef struct {
+    Task task;
+    uint64_t* data;
+    uint64_t sum;
+    bool busy;                  // Submitted and not yet run
+} TopologySlot;
+
+typedef struct {
+    ThreadPool* pool;
+    int cpu;
+    TopologySlot slots[TOPO_BENCH_SLOTS];
+} TopologyProducer;
+
+void topology_sum_task(void* arg) {
+    TopologySlot* slot = (TopologySlot*)arg;
+    size_t words = TOPO_BENCH_SET / sizeof(uint64_t);
+    uint64_t sum = 0;
+    for (int pass = 0; pass < TOPO_BENCH_PASSES; pass++) {
+        for (size_t i = 0; i < words; i++) {
+            sum += slot->data[i];
+        }
+    }
+    slot->sum = sum;
+    __atomic_store_n(&slot->busy, false, __ATOMIC_RELEASE);
+}
+
+void* topology_producer(void* arg) {
+    TopologyProducer* producer = (TopologyProducer*)arg;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(producer->cpu, &cpuset);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+
+    size_t words = TOPO_BENCH_SET / sizeof(uint64_t);
+    for (int i = 0; i < TOPO_BENCH_TASKS; i++) {
+        TopologySlot* slot = &producer->slots[i % TOPO_BENCH_SLOTS];
+        while (__atomic_load_n(&slot->busy, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+        for (size_t w = 0; w < words; w++) {
+            slot->data[w] = w + i;
+        }
+        slot->busy = true;
+        slot->task = (Task){ .function = topology_sum_task, .data = slot };
+        if (!pool_submit(producer->pool, &slot->task)) {
+            fprintf(stderr, "Error submitting task\n");
+            slot->busy = false;
+            break;
+        }
+    }
+
+    // The slots live here: wait until the pool is done with them
+    for (int s = 0; s < TOPO_BENCH_SLOTS; s++) {
+        while (__atomic_load_n(&producer->slots[s].busy, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// Tasks per second, -1 on error
+double topology_bench_run(const CpuTopology* topology, const int* cpus, int count, bool aware,
+                          long* steals, long* near_steals) {
+    TopologyProducer* producers =
+        (TopologyProducer*)cache_aligned_alloc(count * sizeof(TopologyProducer));
+    if (producers == NULL) {
+        return -1;
+    }
+    memset(producers, 0, count * sizeof(TopologyProducer));
+    bool ok = true;
+    for (int p = 0; p < count; p++) {
+        producers[p].cpu = cpus[p];
+        for (int s = 0; s < TOPO_BENCH_SLOTS; s++) {
+            producers[p].slots[s].data = (uint64_t*)cache_aligned_alloc(TOPO_BENCH_SET);
+            ok = ok && producers[p].slots[s].data != NULL;
+        }
+    }
+
+    ThreadPool* pool = ok ? create_thread_pool_on(count, aware ? topology : NULL) : NULL;
+    double rate = -1;
+    if (pool != NULL) {
+        pthread_t threads[count];
+        int started = 0;
+        double start = now_ns();
+        for (; started < count; started++) {
+            producers[started].pool = pool;
+            if (pthread_create(&threads[started], NULL, topology_producer,
+                               &producers[started]) != 0) {
+                fprintf(stderr, "Error creating producer %d\n", started);
+                break;
+            }
+        }
+        for (int p = 0; p < started; p++) {
+            pthread_join(threads[p], NULL);
+        }
+        if (started == count) {
+            rate = (double)count * TOPO_BENCH_TASKS / ((now_ns() - start) / 1e9);
+        }
+
+        *steals = 0;
+        *near_steals = 0;
+        for (int i = 0; i < pool->num_workers; i++) {
+            *steals += pool->workers[i].steals;
+            *near_steals += pool->workers[i].near_steals;
+        }
+        destroy_thread_pool(pool);
+    }
+
+    for (int p = 0; p < count; p++) {
+        for (int s = 0; s < TOPO_BENCH_SLOTS; s++) {
+            free(producers[p].slots[s].data);
+        }
+    }
+    free(producers);
+    return rate;
+}
+
+int run_topology_benchmark() {
+    CpuTopology* topology = read_cpu_topology();
+    if (topology == NULL) {
+        return -1;
+    }
+    print_cpu_topology(topology);
+
+    // Producers sit where the workers would be placed, one per usable CPU
+    int* cpus = topology_placement(topology);
+    if (cpus == NULL) {
+        free_cpu_topology(topology);
+        return -1;
+    }
+    int count = topology->num_usable;
+    printf("\n%d producers and %d workers, %d KB written then read %d times per task\n",
+           count, count, TOPO_BENCH_SET / 1024, TOPO_BENCH_PASSES);
+    printf("%-10s %6s %12s %10s %10s %12s\n", "placement", "run", "tasks/s", "MB/s",
+           "steals", "near steals");
+
+    int status = 0;
+    for (int run = 1; run <= TOPO_BENCH_RUNS && status == 0; run++) {
+        for (int aware = 0; aware <= 1; aware++) {
+            long steals = 0;
+            long near_steals = 0;
+            double rate = topology_bench_run(topology, cpus, count, aware, &steals,
+                                             &near_steals);
+            if (rate < 0) {
+                fprintf(stderr, "Error running the topology benchmark\n");
+                status = -1;
+                break;
+            }
+            printf("%-10s %6d %12.0f %10.0f %10ld %12ld\n", aware ? "topology" : "oblivious",
+                   run, rate, rate * TOPO_BENCH_SET / (1024 * 1024), steals, near_steals);
+        }
+    }
+    if (count == 1) {
+        printf("Only one CPU: both placements run everything on it, expect no difference\n");
+    }
+
+    free(cpus);
+    free_cpu_topology(topology);
+    return status;
+}
+
+// ----- Benchmark: spin-then-park waiting -----
+// A producer sends tasks in bursts and in a sparse trickle. Consumers time each
+// task from enqueue to dequeue; the process CPU time shows what the spinning
+// costs. Each traffic pattern runs with both wait policies on both queues.
+
+typedef struct {
+    const char* name;
+    int burst;                  // Tasks per burst
+    int spacing_us;             // Between the tasks of a burst
+    int pause_us;               // Between bursts
+} WaitPattern;
+
+typedef struct {
+    WorkQueue* queue;
+    double* latencies;          // Microseconds, one per task taken
+    int count;
+} WaitConsumer;
+
+void* wait_consumer(void* arg) {
+    WaitConsumer* consumer = (WaitConsumer*)arg;
+    Task* task;
+    while ((task = dequeue_task(consumer->queue)) != NULL) {
+        consumer->latencies[consumer->count++] = (clock_ns() - task->enqueued_ns) / 1e3;
+    }
+    return NULL;
+}
+
+// Sleeps for the pause but spins through the short spacing, which sleeping
+// could not time
+void wait_bench_delay(int us) {
+    if (us >= 50) {
+        usleep(us);
+    } else if (us > 0) {
+        spin_us(us);
+    }
+}
+
+int wait_bench_run(QueueKind kind, WaitPolicy policy, const WaitPattern* pattern) {
+    // Upper bound on the tasks sent in WAIT_BENCH_MS
+    long per_burst_us = (long)pattern->burst * pattern->spacing_us + pattern->pause_us;
+    int max_tasks = (int)((long)WAIT_BENCH_MS * 1000 / per_burst_us + 1) * pattern->burst;
+    Task* tasks = task_array_alloc(max_tasks);
+    WorkQueue* queue = create_work_queue(kind);
+    WaitConsumer consumers[WAIT_BENCH_CONSUMERS];
+    pthread_t threads[WAIT_BENCH_CONSUMERS];
+    int started = 0;
+    int status = -1;
+
+    memset(consumers, 0, sizeof(consumers));
+    if (tasks == NULL || queue == NULL) {
+        goto out;
+    }
+    set_wait_policy(queue, policy);
+    for (; started < WAIT_BENCH_CONSUMERS; started++) {
+        consumers[started].queue = queue;
+        consumers[started].latencies = (double*)malloc(max_tasks * sizeof(double));
+        if (consumers[started].latencies == NULL ||
+            pthread_create(&threads[started], NULL, wait_consumer, &consumers[started]) != 0) {
+            free(consumers[started].latencies);
+            consumers[started].latencies = NULL;
+            goto out;
+        }
+    }
+    usleep(10000);  // Let the consumers go idle
+
+    double cpu_start = process_cpu_ns();
+    uint64_t start = clock_ns();
+    uint64_t end = start + (uint64_t)WAIT_BENCH_MS * 1000000;
+    int sent = 0;
+    while (clock_ns() < end && sent + pattern->burst <= max_tasks) {
+        for (int i = 0; i < pattern->burst; i++) {
+            if (i > 0) {
+                wait_bench_delay(pattern->spacing_us);
+            }
+            Task* task = &tasks[sent++];
+            *task = (Task){ .function = noop_task };
+            task->enqueued_ns = clock_ns();
+            if (!enqueue_task(queue, task)) {
+                fprintf(stderr, "Error enqueuing task\n");
+                goto out;
+            }
+        }
+        wait_bench_delay(pattern->pause_us);
+    }
+    shutdown_work_queue(queue);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double wall_ms = (clock_ns() - start) / 1e6;
+    double cpu_ms = (process_cpu_ns() - cpu_start) / 1e6;
+    started = 0;
+
+    // Merge everyone's latencies for the percentiles
+    int total = 0;
+    for (int i = 0; i < WAIT_BENCH_CONSUMERS; i++) {
+        memmove(consumers[0].latencies + total, consumers[i].latencies,
+                consumers[i].count * sizeof(double));
+        total += consumers[i].count;
+    }
+    qsort(consumers[0].latencies, total, sizeof(double), compare_doubles);
+    printf("%-6s %-8s %-5s %8d %9.1f %9.1f %9.1f %8ld %7ld %7.1f\n",
+           kind == QUEUE_MPMC ? "mpmc" : "mutex", pattern->name,
+           policy == WAIT_SPIN ? "spin" : "park", total,
+           consumers[0].latencies[total / 2], consumers[0].latencies[(int)(total * 0.99)],
+           consumers[0].latencies[total - 1], queue->spin_hits, queue->parks,
+           cpu_ms * 100 / wall_ms);
+    status = 0;
+
+out:
+    if (started > 0) {
+        shutdown_work_queue(queue);
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    for (int i = 0; i < WAIT_BENCH_CONSUMERS; i++) {
+        free(consumers[i].latencies);
+    }
+    if (queue != NULL) {
+        destroy_work_queue(queue);
+    }
+    free(tasks);
+    return status;
+}
+
+int run_wait_benchmark() {
+    const WaitPattern patterns[] = {
+        { "bursty", 32, 5, 1000 },
+        { "sparse", 1, 0, 2000 },
+    };
+    const QueueKind kinds[] = { QUEUE_MUTEX, QUEUE_MPMC };
+
+    printf("%d consumers, %d ms per run; wake-up latency is enqueue to dequeue\n",
+           WAIT_BENCH_CONSUMERS, WAIT_BENCH_MS);
+    printf("%-6s %-8s %-5s %8s %9s %9s %9s %8s %7s %7s\n", "queue", "traffic", "wait",
+           "tasks", "p50 us", "p99 us", "max us", "spun", "parked", "CPU %");
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+            if (wait_bench_run(kinds[k], WAIT_PARK, &patterns[p]) == -1 ||
+                wait_bench_run(kinds[k], WAIT_SPIN, &patterns[p]) == -1) {
+                fprintf(stderr, "Error running the wait benchmark\n");
+                return -1;
+            }
+        }
+    }
+    if (sysconf(_SC_NPROCESSORS_ONLN) == 1) {
+        printf("Single CPU: a spinning consumer keeps the producer off the CPU, so spinning "
+               "is off by default here\n");
+    }
+    return 0;
+}
+
+// ----- Benchmark: parallel loops -----
+// The scale and sum kernels of lesson_11's 02_mem_align over an array of
+// doubles, serially and through parallel_for()/parallel_reduce() on pools of
+// growing size. Times are the best of PARALLEL_BENCH_RUNS.
+
+typedef struct {
+    double* data;
+    double factor;
+} ScaleArgs;
+
+void scale_range(long begin, long end, void* arg) {
+    ScaleArgs* args = (ScaleArgs*)arg;
+    for (long i = begin; i < end; i++) {
+        args->data[i] *= args->factor;
+    }
+}
+
+void sum_range(long begin, long end, void* partial, void* arg) {
+    const double* data = (const double*)arg;
+    double sum = 0.0;
+    for (long i = begin; i < end; i++) {
+        sum += data[i];
+    }
+    *(double*)partial += sum;
+}
+
+void combine_doubles(void* into, const void* from) {
+    *(double*)into += *(const double*)from;
+}
+
+static const double zero_double = 0.0;
+static const Reduction sum_of_doubles = { sizeof(double), &zero_double, combine_doubles };
+
+typedef struct {
+    const char* name;
+    LoopSchedule schedule;
+    long grain;
+} ParallelVariant;
+
+// Milliseconds for one kernel run; a NULL pool runs it serially
+double parallel_bench_once(ThreadPool* pool, bool sum, const ParallelVariant* variant,
+                           double* data, double* result) {
+    ScaleArgs args = { data, 1.01 };
+    double start = now_ns();
+    bool ok = true;
+    if (pool == NULL && sum) {
+        *result = 0.0;
+        sum_range(0, PARALLEL_BENCH_SIZE, result, data);
+    } else if (pool == NULL) {
+        scale_range(0, PARALLEL_BENCH_SIZE, &args);
+    } else if (sum) {
+        ok = parallel_reduce(pool, 0, PARALLEL_BENCH_SIZE, variant->grain, variant->schedule,
+                             &sum_of_doubles, sum_range, data, result);
+    } else {
+        ok = parallel_for(pool, 0, PARALLEL_BENCH_SIZE, variant->grain, variant->schedule,
+                          scale_range, &args);
+    }
+    return ok ? (now_ns() - start) / 1e6 : -1;
+}
+
+double parallel_bench_best(ThreadPool* pool, bool sum, const ParallelVariant* variant,
+                           double* data, double* result) {
+    double best = -1;
+    for (int run = 0; run < PARALLEL_BENCH_RUNS; run++) {
+        double ms = parallel_bench_once(pool, sum, variant, data, result);
+        if (ms < 0) {
+            return -1;
+        }
+        if (best < 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+int run_parallel_benchmark() {
+    const ParallelVariant variants[] = {
+        { "static", SCHEDULE_STATIC, 0 },
+        { "dynamic", SCHEDULE_DYNAMIC, 0 },
+        { "dyn/256", SCHEDULE_DYNAMIC, 256 },
+    };
+    const int num_variants = sizeof(variants) / sizeof(variants[0]);
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus < 2 ? 4 : 2 * cpus;
+
+    double* data = (double*)cache_aligned_alloc(PARALLEL_BENCH_SIZE * sizeof(double));
+    if (data == NULL) {
+        fprintf(stderr, "Error allocating the benchmark array\n");
+        return -1;
+    }
+    for (long i = 0; i < PARALLEL_BENCH_SIZE; i++) {
+        data[i] = (double)i / PARALLEL_BENCH_SIZE;
+    }
+
+    printf("%d doubles (%d MB), %d CPUs; ms and speedup over the serial loop\n",
+           PARALLEL_BENCH_SIZE, (int)(PARALLEL_BENCH_SIZE * sizeof(double) >> 20), cpus);
+    printf("dyn/256 claims 256 iterations at a time instead of the automatic grain\n");
+    for (int kernel = 0; kernel < 2; kernel++) {
+        bool sum = kernel == 1;
+        double expected = 0.0;
+        double serial = parallel_bench_best(NULL, sum, NULL, data, &expected);
+
+        printf("\n%s: serial %.2f ms\n", sum ? "sum" : "scale", serial);
+        printf("%7s", "threads");
+        for (int v = 0; v < num_variants; v++) {
+            printf(" %10s %7s", variants[v].name, "");
+        }
+        printf("\n");
+
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            ThreadPool* pool = create_thread_pool(threads);
+            if (pool == NULL) {
+                fprintf(stderr, "Error creating a pool of %d workers\n", threads);
+                free(data);
+                return -1;
+            }
+            printf("%7d", threads);
+            for (int v = 0; v < num_variants; v++) {
+                double result = 0.0;
+                double ms = parallel_bench_best(pool, sum, &variants[v], data, &result);
+                if (ms < 0) {
+                    fprintf(stderr, "Error running a parallel loop\n");
+                    destroy_thread_pool(pool);
+                    free(data);
+                    return -1;
+                }
+                // Another summation order rounds differently
+                if (sum && fabs(result - expected) > 1e-9 * fabs(expected)) {
+                    fprintf(stderr, "Wrong sum %f, expected %f\n", result, expected);
+                }
+                printf(" %10.2f %6.2fx", ms, serial / ms);
+            }
+            printf("\n");
+            destroy_thread_pool(pool);
+        }
+    }
+
+    free(data);
+    return 0;
+}
+
+// ----- Stress test: parking -----
+// Keeps producers and consumers going through announce, re-check and park,
+// with park_recheck_hook giving the CPU away inside that window so wakeups race
+// with re-checks. A lost wakeup shows up as progress stopping with work queued.
+
+static long park_stress_done;
+
+void park_stress_yield(void) {
+    static __thread unsigned calls;
+    if (++calls % 64 == 0) {
+        usleep(100);
+    } else {
+        sched_yield();
+    }
+}
+
+void* park_stress_consumer(void* arg) {
+    WorkQueue* queue = (WorkQueue*)arg;
+    Task* tasks[BULK_BENCH_DEQUEUE];
+    bool bulk = false;
+    while (true) {
+        // Alternate between the single and bulk paths
+        int n;
+        if (bulk) {
+            n = dequeue_tasks_bulk(queue, tasks, BULK_BENCH_DEQUEUE);
+        } else {
+            tasks[0] = dequeue_task(queue);
+            n = tasks[0] != NULL;
+        }
+        if (n == 0) {
+            return NULL;
+        }
+        bulk = !bulk;
+        __atomic_add_fetch(&park_stress_done, n, __ATOMIC_RELAXED);
+    }
+}
+
+typedef struct {
+    WorkQueue* queue;
+    Task* tasks;
+    int count;
+} ParkStressProducer;
+
+// Bursts with pauses in between, so consumers drain the queue and park; every
+// eighth burst is bigger than the queue, so the producer parks too
+void* park_stress_producer(void* arg) {
+    ParkStressProducer* producer = (ParkStressProducer*)arg;
+    Task* batch[2 * MAX_QUEUE_SIZE];
+    int bursts = 0;
+    for (int i = 0; i < producer->count; bursts++) {
+        int n = bursts % 8 == 7 ? 2 * MAX_QUEUE_SIZE : PARK_STRESS_BURST;
+        if (n > producer->count - i) {
+            n = producer->count - i;
+        }
+        for (int j = 0; j < n; j++) {
+            batch[j] = &producer->tasks[i + j];
+            *batch[j] = (Task){ .function = noop_task };
+        }
+        i += n;
+        // Every other burst in one call, so the bulk wake path is covered too
+        if (bursts % 2) {
+            if (enqueue_tasks_bulk(producer->queue, batch, n) != n) {
+                return NULL;
+            }
+        } else {
+            for (int j = 0; j < n; j++) {
+                if (!enqueue_task(producer->queue, batch[j])) {
+                    return NULL;
+                }
+            }
+        }
+        park_stress_yield();
+    }
+    return NULL;
+}
+
+// Wait until done reaches target. Returns false if it stops moving for
+// PARK_STRESS_STALL_MS.
+bool park_stress_watch(long* done, long target) {
+    long last = -1;
+    uint64_t last_change = clock_ns();
+    while (true) {
+        long now = __atomic_load_n(done, __ATOMIC_RELAXED);
+        if (now >= target) {
+            return true;
+        }
+        if (now != last) {
+            last = now;
+            last_change = clock_ns();
+        } else if (clock_ns() - last_change > (uint64_t)PARK_STRESS_STALL_MS * 1000000) {
+            return false;
+        }
+        usleep(1000);
+    }
+}
+
+// consumers consumers and one producer on a tiny MPMC queue, parking only
+int park_stress_queue(int consumers) {
+    WorkQueue* queue = create_work_queue(QUEUE_MPMC);
+    Task* tasks = task_array_alloc(PARK_STRESS_TASKS);
+    pthread_t threads[WAIT_BENCH_CONSUMERS + 1];
+    if (queue == NULL || tasks == NULL || consumers > WAIT_BENCH_CONSUMERS) {
+        free(tasks);
+        return -1;
+    }
+    set_wait_policy(queue, WAIT_PARK);
+    park_stress_done = 0;
+
+    ParkStressProducer producer = { queue, tasks, PARK_STRESS_TASKS };
+    for (int i = 0; i < consumers; i++) {
+        pthread_create(&threads[i], NULL, park_stress_consumer, queue);
+    }
+    pthread_create(&threads[consumers], NULL, park_stress_producer, &producer);
+
+    uint64_t start = clock_ns();
+    if (!park_stress_watch(&park_stress_done, PARK_STRESS_TASKS)) {
+        // The threads are stuck for good; leave them and report
+        size_t depth = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED) -
+                       __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        printf("queue, %d consumer(s): HUNG after %ld of %d tasks (depth=%zu, idle consumers=%d, "
+               "idle producers=%d)\n", consumers, park_stress_done, PARK_STRESS_TASKS, depth,
+               queue->idle_consumers, queue->idle_producers);
+        return -1;
+    }
+    double ms = (clock_ns() - start) / 1e6;
     shutdown_work_queue(queue);
+    for (int i = 0; i <= consumers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    printf("queue, %d consumer(s): %d tasks in %.0f ms, %ld consumer parks\n",
+           consumers, PARK_STRESS_TASKS, ms, queue->parks);
+    destroy_work_queue(queue);
+    free(tasks);
+    return 0;
+}
+
+typedef struct {
+    ThreadPool* pool;
+    Task* tasks;
+    int count;
+} ParkStressSubmitter;
+
+void* park_stress_submitter(void* arg) {
+    ParkStressSubmitter* submitter = (ParkStressSubmitter*)arg;
+    for (int i = 0; i < submitter->count; i++) {
+        TaskGroup group;
+        task_group_init(&group);
+        submitter->tasks[i] = (Task){ .function = noop_task };
+        if (!pool_spawn(submitter->pool, &group, &submitter->tasks[i])) {
+            return NULL;
+        }
+        pool_wait(submitter->pool, &group);
+        __atomic_add_fetch(&park_stress_done, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// A thread outside a one-worker pool submits a task and waits for it, so the
+// worker parks between almost every two tasks
+int park_stress_pool() {
+    ThreadPool* pool = create_thread_pool(1);
+    Task* tasks = task_array_alloc(PARK_STRESS_TASKS);
+    if (pool == NULL || tasks == NULL) {
+        free(tasks);
+        return -1;
+    }
+
+    // The watchdog runs here, so the submitter gets its own thread
+    park_stress_done = 0;
+    ParkStressSubmitter submitter = { pool, tasks, PARK_STRESS_TASKS };
+    pthread_t thread;
+    pthread_create(&thread, NULL, park_stress_submitter, &submitter);
+
+    uint64_t start = clock_ns();
+    if (!park_stress_watch(&park_stress_done, PARK_STRESS_TASKS)) {
+        printf("pool, 1 worker: HUNG after %ld of %d tasks (idle workers=%d)\n",
+               park_stress_done, PARK_STRESS_TASKS, pool->idle_workers);
+        return -1;
+    }
+    double ms = (clock_ns() - start) / 1e6;
+    pthread_join(thread, NULL);
+    printf("pool, 1 worker: %d tasks in %.0f ms\n", PARK_STRESS_TASKS, ms);
+    destroy_thread_pool(pool);
+    free(tasks);
+    return 0;
+}
+
+int run_park_stress() {
+    park_recheck_hook = park_stress_yield;
+    printf("Parking stress: yields between announce and re-check, fails if progress stops "
+           "for %d ms\n", PARK_STRESS_STALL_MS);
+    for (int consumers = 1; consumers <= WAIT_BENCH_CONSUMERS; consumers++) {
+        if (park_stress_queue(consumers) == -1) {
+            return -1;
+        }
+    }
+    if (park_stress_pool() == -1) {
+        return -1;
+    }
+    park_recheck_hook = NULL;
+    printf("No lost wakeups\n");
+    return 0;
+}
+
+void usage(const char* prog) {
+    printf("Usage: %s [options]\n"
+           "  (no option)          run the demo with %d workers and %d tasks\n"
+           "  -q, --queue NAME     mutex (default), mpmc or lanes\n"
+           "  -b, --bench          compare both queues with 1-%d producers/consumers\n"
+           "  -n, --tasks N        benchmark: tasks per run (default %d)\n"
+           "  -s, --steal-bench    work-stealing pool: fork/join and fine-grained tasks\n"
+           "  -a, --alloc-bench    malloc() per task versus task_alloc() from per-thread caches\n"
+           "  -B, --bulk-bench     per-task versus bulk enqueue/dequeue for batches of tasks\n"
+           "  -l, --lane-bench     high-priority waiting time under a saturating low-priority load\n"
+           "  -e, --elastic        demo: 1-%d elastic workers instead of a fixed %d\n"
+           "  -E, --elastic-bench  worker count following idle, CPU-bound and blocking load\n"
+           "  -T, --topology-bench cache-sensitive tasks with topology-aware placement on and off\n"
+           "  -w, --wait-bench     wake-up latency and CPU use of parking versus spin-then-park\n"
+           "  -P, --parallel-bench parallel_for()/parallel_reduce() speedup on array kernels\n"
+           "  -k, --park-stress    race wakeups against parking; fails on a lost wakeup\n",
+           prog, NUM_WORKERS, NUM_TASKS, BENCH_MAX_THREADS, BENCH_TASKS, NUM_WORKERS,
+           NUM_WORKERS);
+}
+
+int main(int argc, char* argv[]) {
+    QueueKind kind = QUEUE_MUTEX;
+    bool bench = false;
+    bool steal_bench = false;
+    bool alloc_bench = false;
+    bool bulk_bench = false;
+    bool lane_bench_mode = false;
+    bool elastic = false;
+    bool elastic_bench = false;
+    bool topology_bench = false;
+    bool wait_bench = false;
+    bool parallel_bench = false;
+    bool park_stress = false;
+    int bench_tasks = BENCH_TASKS;
+
+    static struct option long_options[] = {
+        {"queue", required_argument, 0, 'q'},
+        {"bench", no_argument,       0, 'b'},
+        {"tasks", required_argument, 0, 'n'},
+        {"steal-bench", no_argument, 0, 's'},
+        {"alloc-bench", no_argument, 0, 'a'},
+        {"bulk-bench", no_argument,  0, 'B'},
+        {"lane-bench", no_argument,  0, 'l'},
+        {"elastic", no_argument,     0, 'e'},
+        {"elastic-bench", no_argument, 0, 'E'},
+        {"topology-bench", no_argument, 0, 'T'},
+        {"wait-bench", no_argument,  0, 'w'},
+        {"parallel-bench", no_argument, 0, 'P'},
+        {"park-stress", no_argument, 0, 'k'},
+        {"help",  no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "q:bn:saBleETwPkh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'q':
+                if (strcmp(optarg, "mutex") == 0) {
+                    kind = QUEUE_MUTEX;
+                } else if (strcmp(optarg, "mpmc") == 0) {
+                    kind = QUEUE_MPMC;
+                } else if (strcmp(optarg, "lanes") == 0) {
+                    kind = QUEUE_LANES;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'b': bench = true; break;
+            case 'n': bench_tasks = atoi(optarg); break;
+            case 's': steal_bench = true; break;
+            case 'a': alloc_bench = true; break;
+            case 'B': bulk_bench = true; break;
+            case 'l': lane_bench_mode = true; break;
+            case 'e': elastic = true; break;
+            case 'E': elastic_bench = true; break;
+            case 'T': topology_bench = true; break;
+            case 'w': wait_bench = true; break;
+            case 'P': parallel_bench = true; break;
+            case 'k': park_stress = true; break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (bench_tasks < BENCH_MAX_THREADS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (bench) {
+        return run_benchmark(bench_tasks) == -1 ? 1 : 0;
+    }
+    if (steal_bench) {
+        return run_steal_benchmark() == -1 ? 1 : 0;
+    }
+    if (bulk_bench) {
+        return run_bulk_benchmark(bench_tasks) == -1 ? 1 : 0;
+    }
+    if (elastic_bench) {
+        run_elastic_benchmark();
+        return 0;
+    }
+    if (parallel_bench) {
+        return run_parallel_benchmark() == -1 ? 1 : 0;
+    }
+    if (wait_bench) {
+        return run_wait_benchmark() == -1 ? 1 : 0;
+    }
+    if (park_stress) {
+        return run_park_stress() == -1 ? 1 : 0;
+    }
+    if (topology_bench) {
+        return run_topology_benchmark() == -1 ? 1 : 0;
+    }
+    if (lane_bench_mode) {
+        run_lane_benchmark(2);
+        return 0;
+    }
+    if (alloc_bench) {
+        run_alloc_benchmark(bench_tasks);
+        return 0;
+    }
+
+    // Seed the random number generator
+    srand(time(NULL));
     
-    // Wait for all worker threads to finish
-    for (int i = 0; i < NUM_WORKERS; i++) {
-        pthread_join(workers[i], NULL);
+    // Create the work queue
+    WorkQueue* queue = create_work_queue(kind);
+    if (queue == NULL) {
+        fprintf(stderr, "Error creating work queue\n");
+        return 1;
+    }
+    
+    // Create worker threads
+    pthread_t workers[NUM_WORKERS];
+    ElasticPool* pool = NULL;
+    if (elastic) {
+        // Starts with one worker and adds more as the tasks block
+        ElasticConfig config;
+        elastic_default_config(&config);
+        config.max_workers = NUM_WORKERS;
+        config.max_threads = NUM_WORKERS;
+        printf("Creating an elastic pool of 1-%d worker threads\n", NUM_WORKERS);
+        pool = create_elastic_pool(queue, &config);
+        if (pool == NULL) {
+            fprintf(stderr, "Error creating elastic pool\n");
+            return 1;
+        }
+    } else {
+        printf("Creating %d worker threads\n", NUM_WORKERS);
+        for (int i = 0; i < NUM_WORKERS; i++) {
+            if (pthread_create(&workers[i], NULL, worker_thread, queue) != 0) {
+                fprintf(stderr, "Error creating worker thread %d\n", i);
+                return 1;
+            }
+        }
+    }
+    
+    // Add tasks to the queue
+    printf("Adding %d tasks to the queue\n", NUM_TASKS);
+    
+    TaskData data[NUM_TASKS];
+    Future* futures[NUM_TASKS];
+    TaskGroup group;
+    task_group_init(&group);
+    long sum = 0;
+    int submitted = 0;
+    double start = now_ns();
+
+    for (int i = 0; i < NUM_TASKS; i++) {
+        // Random processing time
+        data[i].value = i + 1;
+        data[i].processing_time = 100 + rand() % 900;  // 100-1000ms
+        
+        // Add to queue; the future gets the result, the continuation sums it
+        futures[i] = submit(queue, &group, square_task, &data[i]);
+        if (futures[i] == NULL) {
+            fprintf(stderr, "Error submitting task %d\n", i + 1);
+            break;
+        }
+        future_then(futures[i], add_result, &sum);
+        submitted++;
+        
+        // Small delay between task creation
+        usleep(50000);  // 50ms
+    }
+    
+    // Wait exactly as long as the tasks take
+    printf("Waiting for tasks to complete...\n");
+    wait_all(&group);
+    printf("All %d tasks completed, makespan %.0f ms\n", submitted, (now_ns() - start) / 1e6);
+
+    for (int i = 0; i < submitted; i++) {
+        printf("Task %d: %d squared is %ld\n", i + 1, data[i].value, future_get(futures[i]));
+        future_release(futures[i]);
+    }
+    printf("Sum of squares (from continuations): %ld\n", sum);
+    
+    // Shutdown the queue
+    printf("Shutting down the work queue\n");
+    if (pool != NULL) {
+        printf("Elastic pool: peak %d threads, %ld started for blocked workers, "
+               "%ld added, %ld retired\n", pool->peak, pool->compensated, pool->grown,
+               pool->shrunk);
+        destroy_elastic_pool(pool);
+    } else {
+        shutdown_work_queue(queue);
+        
+        // Wait for all worker threads to finish
+        for (int i = 0; i < NUM_WORKERS; i++) {
+            pthread_join(workers[i], NULL);
+        }
     }
     
     // Clean up
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,32 +9,325 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <stddef.h>
+
+#include "../03_co_routines/co_switch.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if defined(__has_include)
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#endif
+#endif
+
+// openat2() confines HTTP lookups to the served directory (Linux 5.6)
+#if defined(RESOLVE_BENEATH) && defined(__NR_openat2)
+#define HAVE_OPENAT2 1
+#endif
+
+// The io_uring backend needs multishot recv (Linux 6.0 headers); older headers build epoll only
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_IO_URING 1
+#endif
 
 // Constants
 #define MAX_EVENTS 64
-#define MAX_CLIENTS 1024
-#define BUFFER_SIZE 1024
+#define MAX_FD_TABLE (1 << 20)  // Upper bound for the fd table, even if RLIMIT_NOFILE is higher
 #define SERVER_PORT 8080
-#define NUM_CLIENTS 10
-#define MAX_REQUESTS_PER_CLIENT 5
+#define MAX_REACTORS 64
+#define GENERATION_MASK 0xFFFFFF  // Generations fit in 24 bits so io_uring user_data can carry them
 
-// Client state
+// Per-connection ring buffers start small, double when full and never exceed the maximum
+#define RING_INITIAL_CAPACITY 4096
+#define RING_MAX_CAPACITY (1024 * 1024)
+#define OUTPUT_HIGH_WATER (256 * 1024)  // Stop reading a client with this much unsent output
+#define OUTPUT_LOW_WATER (64 * 1024)    // ...and resume once it drains below this
+
+// Slab allocator: Client objects and ring buffers up to BUFFER_CLASSES doublings of
+// RING_INITIAL_CAPACITY come from per-reactor free lists carved out of 2MB slabs.
+// Larger rings are rare and go to malloc.
+#define SLAB_BYTES (2 * 1024 * 1024)
+#define CACHE_LINE 64
+#define BUFFER_CLASSES 5                // 4K, 8K, 16K, 32K, 64K
+
+// Connection timeouts run on a hierarchical timing wheel driven by a timerfd.
+// Four levels of 64 slots at 100ms per tick reach about 19 days.
+#define TIMER_TICK_MS 100
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_MAX_TICKS ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+#define READ_TIMEOUT_SEC 30         // New connection sends nothing
+#define WRITE_TIMEOUT_SEC 30        // Pending output makes no progress
+#define KEEPALIVE_TIMEOUT_SEC 120   // Connection sits idle between messages
+
+// HTTP static file mode (--http DIR)
+#define HTTP_MAX_REQUEST 4096           // Request line plus headers
+#define HTTP_MAX_PATH 1024
+#define HTTP_COPY_CHUNK (64 * 1024)     // read()+write() body path, for comparison
+#define FILE_CACHE_BUCKETS 1024
+#define FILE_CACHE_MAX 1024             // Cached open files per reactor
+#define FILE_CACHE_TTL_MS 1000          // Re-stat a cached file after this long
+
+// Pub/sub mode (--pubsub): frames are a 4-byte big-endian length and a payload.
+// An empty frame subscribes the connection; any other frame is published.
+#define PUBSUB_MAX_MESSAGE (1024 * 1024)
+#define PUBSUB_QUEUE_LIMIT 256          // Messages queued per subscriber before the slow policy applies
+#define PUBSUB_MAX_IOV 64               // Queued messages sent per writev()
+
+// io_uring backend sizing (per reactor)
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 1024                 // Provided receive buffers, power of two
+#define URING_BUFFER_SIZE 4096
+#define URING_MAX_LINKED_SENDS 16          // Longest chain of linked send SQEs
+#define URING_HIGH_WATER_BUFFERS 64        // Pause a client's recv with this many buffers unsent
+#define URING_LOW_WATER_BUFFERS 16
+
+// Green thread backend
+#define GREEN_STACK_SIZE (64 * 1024)        // Reserved per coroutine, committed as touched
+#define GREEN_STACK_CACHE 1024              // Released stacks kept per reactor for reuse
+#define GREEN_BUFFER_SIZE 4096              // Echo buffer, on the coroutine's stack
+
+// Benchmark defaults (./05_event_driven_server --bench --idle N --hot N --seconds N)
+#define BENCH_IDLE_CLIENTS 10000
+#define BENCH_HOT_CLIENTS 4
+#define BENCH_SECONDS 5
+#define BENCH_MESSAGE_SIZE 64
+#define BENCH_MAX_MESSAGE_SIZE (64 * 1024 * 1024)
+#define BENCH_RESERVED_FDS 64
+#define BENCH_MAX_SAMPLES (256 * 1024)  // Latency samples kept per hot client
+
+// Byte ring with a power-of-two capacity. head and tail only ever grow;
+// masking them with capacity - 1 gives the position in data.
+typedef struct {
+    char* data;
+    size_t capacity;    // 0 until the first byte arrives
+    size_t head;        // Total bytes consumed
+    size_t tail;        // Total bytes produced
+} RingBuffer;
+
+// Timer linked into a TimerWheel slot. Resetting a timer to a later deadline only
+// updates deadline; the node is moved when its slot comes up, so resetting on
+// every read costs a store, not a list operation.
+typedef struct TimerNode {
+    struct TimerNode* next;     // NULL while not linked
+    struct TimerNode* prev;
+    uint64_t expires;           // Tick of the slot the node is linked in
+    uint64_t deadline;          // Tick it really expires, >= expires
+} TimerNode;
+
+typedef struct {
+    TimerNode slots[WHEEL_LEVELS][WHEEL_SLOTS];    // List heads
+    uint64_t now;               // Next tick to process
+    unsigned long count;        // Linked timers
+} TimerWheel;
+
+typedef void (*TimerCallback)(void* context, TimerNode* node);
+
+// Open file shared by every response that sends it. The cache holds one reference
+// and each response in progress another; the fd is closed with the last one.
+typedef struct FileEntry {
+    struct FileEntry* next;     // Hash chain
+    char* path;                 // Relative to the served directory
+    int fd;
+    off_t size;
+    ino_t ino;
+    struct timespec mtime;
+    uint64_t checked_ms;        // When the stat result was last confirmed
+    int refs;
+} FileEntry;
+
+typedef struct {
+    FileEntry* buckets[FILE_CACHE_BUCKETS];
+    int count;
+    unsigned long hits;
+    unsigned long misses;
+} FileCache;
+
+typedef enum { BODY_SENDFILE, BODY_COPY } BodyMode;
+
+typedef enum { PROTOCOL_ECHO, PROTOCOL_HTTP, PROTOCOL_PUBSUB } Protocol;
+
+// Published message. One copy is shared by every subscriber queue it sits in and
+// by the inboxes of the other reactors; refs is atomic since they all let go of it
+// on their own threads. The frame is sent as received, length prefix included.
 typedef struct {
+    int refs;
+    uint32_t size;              // Frame bytes
+    char frame[];
+} Message;
+
+typedef enum { SLOW_DROP, SLOW_DISCONNECT } SlowPolicy;
+
+// Client state
+typedef struct Client {
     int socket;
-    char read_buffer[BUFFER_SIZE];
-    int read_size;
-    char write_buffer[BUFFER_SIZE];
-    int write_size;
-    int write_offset;
+    uint32_t generation;  // Distinguishes this client from a later one reusing the same fd (24 bits)
+    uint32_t events;      // epoll interest currently registered
+    int reading_paused;   // Backpressure: EPOLLIN is off until output drains
+    int has_read;         // Read timeout until the first bytes, keepalive timeout after
+    TimerNode timer;
+    // Echo has nothing to parse, so bytes are received straight into the
+    // output ring and sent from there: no copy from a read buffer.
+    RingBuffer out;
+
+    // io_uring backend: received buffers waiting to be sent, linked through
+    // the reactor's buf_next[] (-1 when empty). They are sent in place, no copy.
+    int send_head;
+    int send_tail;
+    int queued_buffers;     // Queued plus in flight
+    int sends_in_flight;
+    int recv_armed;
+
+    // HTTP mode: headers go out through the out ring, the body straight from the file
+    char* request;          // Received request bytes (HTTP_MAX_REQUEST), pipelined ones included
+    size_t request_len;
+    FileEntry* file;        // Body in progress
+    off_t body_offset;
+    off_t body_end;
+    int keep_alive;         // Keep the connection once the response is out
+
+    // Pub/sub mode. Publishers reuse request as their receive buffer.
+    Message* incoming;      // Frame being received
+    uint32_t incoming_have;
+    int subscribed;
+    struct Client* sub_prev;    // Reactor's subscriber list
+    struct Client* sub_next;
+    Message** queue;        // Ring of queue_capacity messages waiting to be sent
+    unsigned queue_head;
+    unsigned queue_tail;
+    size_t queue_offset;    // Bytes of the head message already sent
+    int flush_pending;      // Listed in the reactor's flush list
 } Client;
 
+typedef enum { BACKEND_EPOLL, BACKEND_IO_URING, BACKEND_GREEN } Backend;
+
+typedef enum { TIMEOUT_READ, TIMEOUT_WRITE, TIMEOUT_KEEPALIVE } TimeoutKind;
+
+// Fixed size object pool owned by one reactor thread, so it needs no locking.
+// Free objects are linked through their first word. Slabs are carved lazily
+// with a bump pointer, so memory is only touched when it is first handed out.
+typedef struct {
+    size_t object_size;     // Rounded up to a cache line
+    void* free_list;
+    char* bump;             // Next uncarved object in the newest slab
+    char* bump_end;
+    void** slabs;
+    int slab_count;
+    int slab_capacity;
+    int huge_slabs;         // Slabs backed by MAP_HUGETLB pages
+
+    // Counters, printed at shutdown
+    unsigned long in_use;
+    unsigned long high_water;
+} SlabPool;
+
+struct Uring;
+
+// Reactor state: every reactor thread owns its own SO_REUSEPORT listen socket,
+// epoll instance and connection table, so reactors never share locks.
+typedef struct {
+    int id;
+    int cpu;                    // CPU to pin the thread to, -1 to leave it unpinned
+    pthread_t thread;
+    int listen_fd;
+    int epoll_fd;
+    volatile int ready;         // 1 once listening, -1 if startup failed
+    Client** clients;           // Connection table indexed by fd
+    uint32_t next_generation;
+    struct Uring* uring;        // Set when the reactor runs the io_uring backend
+    SlabPool client_pool;
+    SlabPool buffer_pools[BUFFER_CLASSES];
+    TimerWheel wheel;
+    int timer_fd;               // Ticks the wheel, -1 when no timeout is enabled
+    uint64_t timer_start_ms;
+    uint64_t timer_expirations; // io_uring backend: read target for the timerfd
+    FileCache files;            // HTTP mode
+    char* copy_buffer;          // HTTP mode, BODY_COPY only
+
+    // Pub/sub mode
+    Client* subscribers;
+    int subscriber_count;
+    int* flush_fds;             // Subscribers with new messages, sent after the event batch
+    uint32_t* flush_generations;
+    int flush_count;
+    pthread_mutex_t inbox_lock; // Messages published on other reactors
+    Message** inbox;
+    Message** inbox_spare;      // Swapped with inbox when draining it
+    int inbox_count;
+    int inbox_capacity;
+    int spare_capacity;
+    int inbox_fd;               // eventfd, signalled when the inbox becomes non-empty
+    unsigned long published;
+    unsigned long deliveries;
+    unsigned long drops;
+    unsigned long slow_disconnects;
+    unsigned long queued;       // Messages sitting in subscriber queues right now
+    unsigned long peak_queued;
+
+    // Counters, printed at shutdown so imbalance between reactors is visible
+    volatile unsigned long events_handled;
+    volatile unsigned long syscalls;    // Syscalls made by the event loop
+    volatile int active_clients;
+    unsigned long connections_accepted;
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    unsigned long timeouts[3];  // Indexed by TimeoutKind
+    unsigned long accept_wakeups;       // Listener events that led to accept calls
+    unsigned long accept_errors;
+    int largest_accept_batch;
+} Reactor;
+
 // Global variables
 volatile sig_atomic_t running = 1;
-Client* clients[MAX_CLIENTS];
+int max_clients = 0;                   // Size of each connection table, decided by the fd limit
+volatile int linear_lookup = 0;        // Benchmark only: emulate the old linear scan
+int quiet = 0;                         // Benchmarks: suppress per-connection error reports
+Reactor reactors[MAX_REACTORS];
+int num_reactors = 1;
+Backend backend = BACKEND_EPOLL;
+int use_slab = 1;                      // 0: Client objects and ring buffers come from malloc
+int use_hugepages = 0;                 // Back slabs with explicit huge pages when available
+int timeout_ms[3];                     // Per TimeoutKind, 0 disables it
+int shared_listener = 0;               // One listen socket polled by all reactors with EPOLLEXCLUSIVE
+int shared_listen_fd = -1;
+int listen_backlog = SOMAXCONN;
+Protocol protocol = PROTOCOL_ECHO;
+int http_root_fd = -1;                 // Directory served in HTTP mode
+volatile BodyMode body_mode = BODY_SENDFILE;
+int queue_limit = PUBSUB_QUEUE_LIMIT;
+unsigned queue_capacity;               // queue_limit rounded up to a power of two
+SlowPolicy slow_policy = SLOW_DROP;
+long message_bytes;                    // Live Message allocations (atomic), and their peak
+long peak_message_bytes;
+
+void file_release(FileEntry* file);
+void pubsub_release_client(Reactor* reactor, Client* client);
+#ifdef HAVE_IO_URING
+void uring_release_client(Reactor* reactor, Client* client);
+#endif
 
 // Handle signals for graceful shutdown
 void signal_handler(int sig) {
@@ -56,444 +350,4853 @@ int set_nonblocking(int fd) {
     return 0;
 }
 
-// Create a client structure
-Client* create_client(int socket_fd) {
-    Client* client = (Client*)malloc(sizeof(Client));
-    if (!client) {
-        perror("malloc client");
+// ----- Slab allocator -----
+
+void slab_pool_init(SlabPool* pool, size_t object_size) {
+    memset(pool, 0, sizeof(SlabPool));
+    pool->object_size = (object_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+}
+
+// Map a slab, preferring explicit huge pages when asked for. Without reserved huge
+// pages (/proc/sys/vm/nr_hugepages) fall back to a 2MB aligned mapping that
+// transparent huge pages can back.
+void* slab_map(SlabPool* pool) {
+    if (use_hugepages) {
+        void* slab = mmap(NULL, SLAB_BYTES, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab != MAP_FAILED) {
+            pool->huge_slabs++;
+            return slab;
+        }
+    }
+
+    // Over-map and trim, so the slab starts on a 2MB boundary
+    char* raw = (char*)mmap(NULL, 2 * SLAB_BYTES, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        perror("mmap slab");
         return NULL;
     }
-    
-    memset(client, 0, sizeof(Client));
-    client->socket = socket_fd;
-    
-    return client;
+    char* slab = (char*)(((uintptr_t)raw + SLAB_BYTES - 1) & ~(uintptr_t)(SLAB_BYTES - 1));
+    if (slab > raw) {
+        munmap(raw, slab - raw);
+    }
+    munmap(slab + SLAB_BYTES, raw + SLAB_BYTES - slab);
+
+    if (use_hugepages) {
+        madvise(slab, SLAB_BYTES, MADV_HUGEPAGE);
+    }
+    return slab;
 }
 
-// Clean up client resources
-void close_client(Client* client, int epoll_fd) {
-    if (!client) return;
-    
-    if (client->socket >= 0) {
-        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->socket, NULL);
-        close(client->socket);
-        
-        // Remove from client array
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (clients[i] && clients[i]->socket == client->socket) {
-                clients[i] = NULL;
-                break;
-            }
+// Add a slab and make it the bump region. Returns -1 when out of memory.
+int slab_pool_grow(SlabPool* pool) {
+    if (pool->slab_count == pool->slab_capacity) {
+        int capacity = pool->slab_capacity ? pool->slab_capacity * 2 : 16;
+        void** slabs = (void**)realloc(pool->slabs, capacity * sizeof(void*));
+        if (!slabs) {
+            perror("realloc slabs");
+            return -1;
         }
+        pool->slabs = slabs;
+        pool->slab_capacity = capacity;
     }
-    
-    free(client);
+
+    char* slab = (char*)slab_map(pool);
+    if (!slab) {
+        return -1;
+    }
+    pool->slabs[pool->slab_count++] = slab;
+    pool->bump = slab;
+    pool->bump_end = slab + (SLAB_BYTES / pool->object_size) * pool->object_size;
+    return 0;
 }
 
-// Handle a read event
-void handle_read_event(Client* client, int epoll_fd) {
-    // Read data from the client socket
-    ssize_t bytes_read = read(client->socket, 
-                              client->read_buffer + client->read_size, 
-                              BUFFER_SIZE - client->read_size);
-    
-    if (bytes_read <= 0) {
-        if (bytes_read == 0) {
-            printf("Client disconnected\n");
-        } else {
-            perror("read");
+// Take an object from the pool: the free list first, then the uncarved part of the
+// newest slab, then a new slab. With --allocator malloc this is plain malloc, but
+// the counters are still kept so both allocators can be compared.
+void* slab_alloc(SlabPool* pool) {
+    void* object;
+
+    if (!use_slab) {
+        object = malloc(pool->object_size);
+        if (!object) {
+            perror("malloc");
+            return NULL;
         }
-        close_client(client, epoll_fd);
-        return;
+    } else if (pool->free_list) {
+        object = pool->free_list;
+        pool->free_list = *(void**)object;
+    } else {
+        if (pool->bump == pool->bump_end && slab_pool_grow(pool) == -1) {
+            return NULL;
+        }
+        object = pool->bump;
+        pool->bump += pool->object_size;
     }
-    
-    client->read_size += bytes_read;
-    
-    // Process the message (in a real application, you'd parse the message here)
-    // For this example, we'll just echo it back
-    
-    // Copy read buffer to write buffer
-    memcpy(client->write_buffer, client->read_buffer, client->read_size);
-    client->write_size = client->read_size;
-    client->write_offset = 0;
-    client->read_size = 0;
-    
-    // Modify EPOLL to watch for write events
-    struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-    ev.data.fd = client->socket;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->socket, &ev) == -1) {
-        perror("epoll_ctl: mod");
-        close_client(client, epoll_fd);
+
+    pool->in_use++;
+    if (pool->in_use > pool->high_water) {
+        pool->high_water = pool->in_use;
+    }
+    return object;
+}
+
+void slab_free(SlabPool* pool, void* object) {
+    if (!object) return;
+
+    pool->in_use--;
+    if (!use_slab) {
+        free(object);
         return;
     }
+    *(void**)object = pool->free_list;
+    pool->free_list = object;
 }
 
-// Handle a write event
-void handle_write_event(Client* client, int epoll_fd) {
-    // If we have data to write
-    if (client->write_offset < client->write_size) {
-        // Write data to the client socket
-        ssize_t bytes_written = write(client->socket, 
-                                     client->write_buffer + client->write_offset, 
-                                     client->write_size - client->write_offset);
-        
-        if (bytes_written <= 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // Socket is not ready for writing, try again later
-                return;
-            }
-            
-            perror("write");
-            close_client(client, epoll_fd);
+// Unmap every slab. The counters are left in place for the shutdown report.
+void slab_pool_destroy(SlabPool* pool) {
+    for (int i = 0; i < pool->slab_count; i++) {
+        munmap(pool->slabs[i], SLAB_BYTES);
+    }
+    free(pool->slabs);
+    pool->slabs = NULL;
+    pool->slab_capacity = 0;
+    pool->free_list = NULL;
+    pool->bump = NULL;
+    pool->bump_end = NULL;
+}
+
+void reactor_pools_init(Reactor* reactor) {
+    slab_pool_init(&reactor->client_pool, sizeof(Client));
+    for (int i = 0; i < BUFFER_CLASSES; i++) {
+        slab_pool_init(&reactor->buffer_pools[i], (size_t)RING_INITIAL_CAPACITY << i);
+    }
+}
+
+void reactor_pools_destroy(Reactor* reactor) {
+    slab_pool_destroy(&reactor->client_pool);
+    for (int i = 0; i < BUFFER_CLASSES; i++) {
+        slab_pool_destroy(&reactor->buffer_pools[i]);
+    }
+}
+
+// Ring capacities are powers of two from RING_INITIAL_CAPACITY, so each size class
+// is one doubling. Returns BUFFER_CLASSES for rings too large for the pools.
+static inline int buffer_class(size_t capacity) {
+    int cls = 0;
+    while (cls < BUFFER_CLASSES && ((size_t)RING_INITIAL_CAPACITY << cls) < capacity) {
+        cls++;
+    }
+    return cls;
+}
+
+char* buffer_alloc(Reactor* reactor, size_t capacity) {
+    int cls = buffer_class(capacity);
+    if (cls < BUFFER_CLASSES) {
+        return (char*)slab_alloc(&reactor->buffer_pools[cls]);
+    }
+
+    char* data = (char*)malloc(capacity);
+    if (!data) {
+        perror("malloc ring");
+    }
+    return data;
+}
+
+void buffer_free(Reactor* reactor, char* data, size_t capacity) {
+    if (!data) return;
+
+    int cls = buffer_class(capacity);
+    if (cls < BUFFER_CLASSES) {
+        slab_free(&reactor->buffer_pools[cls], data);
+    } else {
+        free(data);
+    }
+}
+
+// ----- Timing wheel -----
+//
+// Level 0 has one slot per tick; each slot of level N covers 64^N ticks. A timer
+// goes into the lowest level whose range covers its distance from now, and timers
+// of a higher level slot are cascaded down when level 0 wraps around to it.
+// Insert, reset and delete are O(1) and never allocate; a tick only touches one
+// level 0 slot, plus one higher level slot every 64 ticks.
+
+void wheel_init(TimerWheel* wheel) {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int i = 0; i < WHEEL_SLOTS; i++) {
+            TimerNode* head = &wheel->slots[level][i];
+            head->next = head;
+            head->prev = head;
+        }
+    }
+    wheel->now = 0;
+    wheel->count = 0;
+}
+
+static inline void timer_unlink(TimerNode* node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = NULL;
+    node->prev = NULL;
+}
+
+// Link the node into the slot for its deadline
+void wheel_link(TimerWheel* wheel, TimerNode* node) {
+    uint64_t expires = node->deadline;
+    if (expires < wheel->now) {
+        expires = wheel->now;
+    } else if (expires - wheel->now >= WHEEL_MAX_TICKS) {
+        // Parked in the last slot and moved again when it comes up
+        expires = wheel->now + WHEEL_MAX_TICKS - 1;
+    }
+    node->expires = expires;
+
+    uint64_t delta = expires - wheel->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    TimerNode* head = &wheel->slots[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+
+    node->next = head;
+    node->prev = head->prev;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void wheel_del(TimerWheel* wheel, TimerNode* node) {
+    if (node->next) {
+        timer_unlink(node);
+        wheel->count--;
+    }
+}
+
+// Arm or re-arm a timer. Moving it later only records the new deadline.
+void wheel_reset(TimerWheel* wheel, TimerNode* node, uint64_t deadline) {
+    if (node->next) {
+        if (deadline >= node->expires) {
+            node->deadline = deadline;
             return;
         }
-        
-        client->write_offset += bytes_written;
-        
-        // If we've written everything
-        if (client->write_offset >= client->write_size) {
-            client->write_size = 0;
-            client->write_offset = 0;
-            
-            // Modify EPOLL to only watch for read events
-            struct epoll_event ev;
-            ev.events = EPOLLIN | EPOLLET;
-            ev.data.fd = client->socket;
-            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->socket, &ev) == -1) {
-                perror("epoll_ctl: mod");
-                close_client(client, epoll_fd);
+        timer_unlink(node);
+    } else {
+        wheel->count++;
+    }
+    node->deadline = deadline;
+    wheel_link(wheel, node);
+}
+
+// Move every timer of a slot to its place relative to the current tick
+static void wheel_cascade(TimerWheel* wheel, int level, int index) {
+    TimerNode* head = &wheel->slots[level][index];
+    while (head->next != head) {
+        TimerNode* node = head->next;
+        timer_unlink(node);
+        wheel_link(wheel, node);
+    }
+}
+
+// Process ticks up to and including target. Timers whose deadline has passed are
+// removed and handed to expire, which may reset or delete any timer, including
+// the one it was given. Returns the number of expired timers.
+unsigned long wheel_advance(TimerWheel* wheel, uint64_t target, TimerCallback expire, void* context) {
+    unsigned long expired = 0;
+
+    while (wheel->now <= target) {
+        uint64_t tick = wheel->now;
+        int index = (int)(tick & (WHEEL_SLOTS - 1));
+
+        // Level 0 wrapped around: bring the next slot of each higher level down
+        for (int level = 1; index == 0 && level < WHEEL_LEVELS; level++) {
+            index = (int)((tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+            wheel_cascade(wheel, level, index);
+        }
+        index = (int)(tick & (WHEEL_SLOTS - 1));
+        wheel->now = tick + 1;
+
+        // Detach the slot first: a timer reset to exactly 64 ticks from now maps
+        // back to this same slot
+        TimerNode pending;
+        TimerNode* head = &wheel->slots[0][index];
+        if (head->next == head) {
+            continue;
+        }
+        pending.next = head->next;
+        pending.prev = head->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        head->next = head;
+        head->prev = head;
+
+        while (pending.next != &pending) {
+            TimerNode* node = pending.next;
+            timer_unlink(node);
+            if (node->deadline > tick) {
+                // Reset after it was linked: it goes where its deadline says
+                wheel_link(wheel, node);
+                continue;
             }
+            wheel->count--;
+            expired++;
+            expire(context, node);
         }
     }
+
+    return expired;
 }
 
-// Server thread function
-void* server_thread(void* arg) {
-    int server_fd, epoll_fd;
-    struct sockaddr_in server_addr;
-    struct epoll_event events[MAX_EVENTS];
+// ----- Ring buffers -----
 
-    // Create server socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) {
-        perror("socket");
+static inline size_t ring_used(const RingBuffer* rb) {
+    return rb->tail - rb->head;
+}
+
+static inline size_t ring_free(const RingBuffer* rb) {
+    return rb->capacity - ring_used(rb);
+}
+
+// Make sure the ring has free space, doubling it (up to RING_MAX_CAPACITY) when full.
+// Returns the free space; 0 means the ring is at its limit.
+size_t ring_make_room(Reactor* reactor, RingBuffer* rb) {
+    if (rb->capacity > 0 && ring_free(rb) > 0) {
+        return ring_free(rb);
+    }
+
+    size_t new_capacity = rb->capacity ? rb->capacity * 2 : RING_INITIAL_CAPACITY;
+    if (new_capacity > RING_MAX_CAPACITY) {
+        return 0;
+    }
+
+    char* data = buffer_alloc(reactor, new_capacity);
+    if (!data) {
+        return 0;
+    }
+
+    // The ring is full (or empty), so its contents are two runs at most
+    size_t used = ring_used(rb);
+    if (used > 0) {
+        size_t start = rb->head & (rb->capacity - 1);
+        size_t first = rb->capacity - start;
+        if (first > used) {
+            first = used;
+        }
+        memcpy(data, rb->data + start, first);
+        memcpy(data + first, rb->data, used - first);
+    }
+
+    buffer_free(reactor, rb->data, rb->capacity);
+    rb->data = data;
+    rb->capacity = new_capacity;
+    rb->head = 0;
+    rb->tail = used;
+
+    return new_capacity - used;
+}
+
+// Describe the free space as up to two iovecs, for readv()
+int ring_free_iov(RingBuffer* rb, struct iovec iov[2]) {
+    size_t space = ring_free(rb);
+    size_t start = rb->tail & (rb->capacity - 1);
+    size_t first = rb->capacity - start;
+    if (first > space) {
+        first = space;
+    }
+
+    iov[0].iov_base = rb->data + start;
+    iov[0].iov_len = first;
+    if (space == first) {
+        return 1;
+    }
+    iov[1].iov_base = rb->data;
+    iov[1].iov_len = space - first;
+    return 2;
+}
+
+// Describe the pending bytes as up to two iovecs, for writev()
+int ring_used_iov(RingBuffer* rb, struct iovec iov[2]) {
+    size_t used = ring_used(rb);
+    size_t start = rb->head & (rb->capacity - 1);
+    size_t first = rb->capacity - start;
+    if (first > used) {
+        first = used;
+    }
+
+    iov[0].iov_base = rb->data + start;
+    iov[0].iov_len = first;
+    if (used == first) {
+        return 1;
+    }
+    iov[1].iov_base = rb->data;
+    iov[1].iov_len = used - first;
+    return 2;
+}
+
+void ring_release(Reactor* reactor, RingBuffer* rb) {
+    buffer_free(reactor, rb->data, rb->capacity);
+    memset(rb, 0, sizeof(RingBuffer));
+}
+
+// Size the connection tables from the process fd limit.
+// The soft limit is raised to the hard limit first, since every client costs one fd.
+int init_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("getrlimit");
+        return -1;
+    }
+
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > MAX_FD_TABLE) {
+            rl.rlim_cur = MAX_FD_TABLE;
+        }
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+            perror("setrlimit");
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+
+    rlim_t size = rl.rlim_cur;
+    if (size == RLIM_INFINITY || size > MAX_FD_TABLE) {
+        size = MAX_FD_TABLE;
+    }
+
+    max_clients = (int)size;
+    return 0;
+}
+
+// Pack fd and generation into the epoll user data, so a stale event can be detected.
+// Generation 0 is reserved for the listening socket.
+static inline uint64_t client_tag(int fd, uint32_t generation) {
+    return ((uint64_t)generation << 32) | (uint32_t)fd;
+}
+
+// Find the client for an event: O(1) through the fd table
+Client* lookup_client(Reactor* reactor, int fd, uint32_t generation) {
+    Client** clients = reactor->clients;
+
+    if (linear_lookup) {
+        // What the server used to do: scan the whole table for the socket
+        for (int j = 0; j < max_clients; j++) {
+            if (clients[j] && clients[j]->socket == fd) {
+                return clients[j];
+            }
+        }
         return NULL;
     }
-    
-    // Set socket options
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-        perror("setsockopt");
-        close(server_fd);
+
+    if (fd < 0 || fd >= max_clients) {
         return NULL;
     }
-    
-    // Make server socket non-blocking
-    if (set_nonblocking(server_fd) == -1) {
-        close(server_fd);
+
+    Client* client = clients[fd];
+    if (!client || client->generation != generation) {
         return NULL;
     }
-    
-    // Configure server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVER_PORT);
-    
-    // Bind the socket
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        perror("bind");
-        close(server_fd);
+    return client;
+}
+
+// Create a client structure
+Client* create_client(Reactor* reactor, int socket_fd) {
+    Client* client = (Client*)slab_alloc(&reactor->client_pool);
+    if (!client) {
         return NULL;
     }
     
-    // Listen for connections
-    if (listen(server_fd, SOMAXCONN) == -1) {
-        perror("listen");
-        close(server_fd);
-        return NULL;
+    memset(client, 0, sizeof(Client));
+    client->socket = socket_fd;
+    client->send_head = -1;
+    client->send_tail = -1;
+
+    // Skip 0, it tags the listening socket
+    reactor->next_generation = (reactor->next_generation + 1) & GENERATION_MASK;
+    if (reactor->next_generation == 0) {
+        reactor->next_generation = 1;
     }
+    client->generation = reactor->next_generation;
     
-    printf("Server started on port %d\n", SERVER_PORT);
+    return client;
+}
+
+// Clean up client resources
+void close_client(Reactor* reactor, Client* client) {
+    if (!client) return;
     
-    // Create epoll instance
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1) {
-        perror("epoll_create1");
-        close(server_fd);
-        return NULL;
+    if (client->socket >= 0) {
+        if (reactor->epoll_fd >= 0) {
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, client->socket, NULL);
+            reactor->syscalls++;
+        }
+#ifdef HAVE_IO_URING
+        if (reactor->uring) {
+            // In-flight requests hold their own reference to the socket, so close()
+            // alone would not end the connection: shut it down to complete them.
+            uring_release_client(reactor, client);
+            shutdown(client->socket, SHUT_RDWR);
+            reactor->syscalls++;
+        }
+#endif
+        
+        // Remove from the fd table
+        if (client->socket < max_clients && reactor->clients[client->socket] == client) {
+            reactor->clients[client->socket] = NULL;
+            reactor->active_clients--;
+        }
+
+        close(client->socket);
+        reactor->syscalls++;
     }
     
-    // Add server socket to epoll
-    struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLET;
-    ev.data.fd = server_fd;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
-        perror("epoll_ctl: server_fd");
-        close(server_fd);
-        close(epoll_fd);
-        return NULL;
+    wheel_del(&reactor->wheel, &client->timer);
+    if (client->file) {
+        file_release(client->file);
     }
+    buffer_free(reactor, client->request, HTTP_MAX_REQUEST);
+    pubsub_release_client(reactor, client);
+    ring_release(reactor, &client->out);
+    slab_free(&reactor->client_pool, client);
+}
+
+// ----- Connection timeouts -----
+
+uint64_t monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Which timeout applies to the client in its current state
+static inline TimeoutKind client_timeout_kind(const Client* client) {
+    if (ring_used(&client->out) > 0 || client->queued_buffers > 0 || client->file ||
+        client->queue_head != client->queue_tail) {
+        return TIMEOUT_WRITE;
+    }
+    return client->has_read ? TIMEOUT_KEEPALIVE : TIMEOUT_READ;
+}
+
+// Restart the client's timer after progress or a change of state
+void client_touch(Reactor* reactor, Client* client) {
+    if (reactor->timer_fd < 0) {
+        return;
+    }
+
+    int ms = timeout_ms[client_timeout_kind(client)];
+    if (ms == 0) {
+        wheel_del(&reactor->wheel, &client->timer);
+        return;
+    }
+    // Rounded up, so a timer never fires early
+    wheel_reset(&reactor->wheel, &client->timer,
+                reactor->wheel.now + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+}
+
+void expire_client(void* context, TimerNode* node) {
+    Reactor* reactor = (Reactor*)context;
+    Client* client = (Client*)((char*)node - offsetof(Client, timer));
+
+    reactor->timeouts[client_timeout_kind(client)]++;
+    close_client(reactor, client);
+}
+
+// Catch the wheel up with the clock. Ticks are counted from the clock rather than
+// from timerfd expirations, so a late wakeup still expires everything due.
+void reactor_run_timers(Reactor* reactor) {
+    uint64_t target = (monotonic_ms() - reactor->timer_start_ms) / TIMER_TICK_MS;
+    wheel_advance(&reactor->wheel, target, expire_client, reactor);
+}
+
+// Create the reactor's wheel, and the timerfd ticking it if any timeout is enabled
+int reactor_timers_setup(Reactor* reactor) {
+    wheel_init(&reactor->wheel);
+    reactor->timer_fd = -1;
+
+    if (timeout_ms[TIMEOUT_READ] == 0 && timeout_ms[TIMEOUT_WRITE] == 0 &&
+        timeout_ms[TIMEOUT_KEEPALIVE] == 0) {
+        return 0;
+    }
+
+    // Blocking, so io_uring waits for the read instead of failing it with EAGAIN.
+    // The epoll backend only reads after EPOLLIN.
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (fd == -1) {
+        perror("timerfd_create");
+        return -1;
+    }
+
+    struct itimerspec its;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = TIMER_TICK_MS * 1000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+        perror("timerfd_settime");
+        close(fd);
+        return -1;
+    }
+
+    reactor->timer_fd = fd;
+    reactor->timer_start_ms = monotonic_ms();
+    return 0;
+}
+
+// Register the interest the client needs right now: EPOLLOUT only while output is
+// pending, EPOLLIN only while reading is not paused. Skips epoll_ctl when nothing changed.
+// Re-arming EPOLLIN with EPOLL_CTL_MOD reports data that arrived while it was off.
+int update_interest(Reactor* reactor, Client* client) {
+    uint32_t events = EPOLLET;
+    if (!client->reading_paused) {
+        events |= EPOLLIN;
+    }
+    if (ring_used(&client->out) > 0 || client->file || client->queue_head != client->queue_tail) {
+        events |= EPOLLOUT;
+    }
+
+    if (events == client->events) {
+        return 0;
+    }
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = client_tag(client->socket, client->generation);
+    reactor->syscalls++;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, client->socket, &ev) == -1) {
+        perror("epoll_ctl: mod");
+        close_client(reactor, client);
+        return -1;
+    }
+    client->events = events;
+
+    return 0;
+}
+
+// Send pending output until the socket would block, and lift the backpressure
+// once the peer has drained enough. Returns -1 if the client was closed.
+int flush_output(Reactor* reactor, Client* client) {
+    RingBuffer* out = &client->out;
+
+    while (ring_used(out) > 0) {
+        struct iovec iov[2];
+        int iovcnt = ring_used_iov(out, iov);
+        ssize_t bytes_written = writev(client->socket, iov, iovcnt);
+        reactor->syscalls++;
+
+        if (bytes_written > 0) {
+            out->head += bytes_written;
+            reactor->bytes_written += bytes_written;
+            client_touch(reactor, client);
+            continue;
+        }
+
+        if (bytes_written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Socket buffer is full; EPOLLOUT tells us when to continue
+            break;
+        }
+
+        if (errno != ECONNRESET && errno != EPIPE && !quiet) {
+            perror("write");
+        }
+        close_client(reactor, client);
+        return -1;
+    }
+
+    if (client->reading_paused && ring_used(out) <= OUTPUT_LOW_WATER) {
+        client->reading_paused = 0;
+    }
+
+    return 0;
+}
+
+// Handle a read event. With EPOLLET the socket has to be drained until EAGAIN,
+// otherwise the remaining bytes are stranded until the peer sends again.
+// Returns -1 if the client was closed.
+int handle_read_event(Reactor* reactor, Client* client) {
+    RingBuffer* out = &client->out;
+    int drained;
+
+    do {
+        drained = 0;
+
+        while (!client->reading_paused) {
+            if (ring_make_room(reactor, out) == 0) {
+                client->reading_paused = 1;
+                break;
+            }
+
+            struct iovec iov[2];
+            int iovcnt = ring_free_iov(out, iov);
+            ssize_t bytes_read = readv(client->socket, iov, iovcnt);
+            reactor->syscalls++;
+
+            if (bytes_read > 0) {
+                out->tail += bytes_read;
+                reactor->bytes_read += bytes_read;
+                client->has_read = 1;
+                client_touch(reactor, client);
+
+                // Backpressure: a peer that does not read its replies stops being read
+                if (ring_used(out) >= OUTPUT_HIGH_WATER) {
+                    client->reading_paused = 1;
+                }
+                continue;
+            }
+
+            if (bytes_read == 0) {
+                close_client(reactor, client);
+                return -1;
+            }
+
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                drained = 1;
+                break;
+            }
+
+            // A reset is just an abrupt disconnect
+            if (errno != ECONNRESET && !quiet) {
+                perror("read");
+            }
+            close_client(reactor, client);
+            return -1;
+        }
+
+        // Echo the data back right away; this usually saves an EPOLLOUT round trip
+        if (flush_output(reactor, client) == -1) {
+            return -1;
+        }
+
+        // Reading stopped at the high-water mark but the output drained again:
+        // no new edge will be reported for the bytes still queued, so keep going.
+    } while (!drained && !client->reading_paused);
+
+    return update_interest(reactor, client);
+}
+
+// Handle a write event. Returns -1 if the client was closed.
+int handle_write_event(Reactor* reactor, Client* client) {
+    int was_paused = client->reading_paused;
+
+    if (flush_output(reactor, client) == -1) {
+        return -1;
+    }
+
+    // The backlog drained: pick up whatever arrived while reading was paused
+    if (was_paused && !client->reading_paused) {
+        return handle_read_event(reactor, client);
+    }
+
+    return update_interest(reactor, client);
+}
+
+// ----- HTTP static file mode -----
+//
+// Minimal HTTP/1.1 with keep-alive and pipelining, GET and HEAD only. Response
+// headers are built in the out ring and sent with sendmsg(MSG_MORE) so they share
+// a segment with the start of the body; the body goes from the page cache to the
+// socket with sendfile() and never passes through user space. BODY_COPY replaces
+// sendfile() with pread()+write() for comparison.
+
+static inline uint32_t path_hash(const char* path) {
+    uint32_t hash = 2166136261u;    // FNV-1a
+    while (*path) {
+        hash = (hash ^ (unsigned char)*path++) * 16777619u;
+    }
+    return hash;
+}
+
+void file_release(FileEntry* file) {
+    if (--file->refs == 0) {
+        close(file->fd);
+        free(file->path);
+        free(file);
+    }
+}
+
+// Drop every cached file; responses in progress keep theirs until they finish
+void file_cache_clear(FileCache* cache) {
+    for (int i = 0; i < FILE_CACHE_BUCKETS; i++) {
+        while (cache->buckets[i]) {
+            FileEntry* file = cache->buckets[i];
+            cache->buckets[i] = file->next;
+            file_release(file);
+        }
+    }
+    cache->count = 0;
+}
+
+static int stat_matches(const FileEntry* file, const struct stat* st) {
+    return file->ino == st->st_ino && file->size == st->st_size &&
+           file->mtime.tv_sec == st->st_mtim.tv_sec && file->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// A request path is a relative name made only of real components: no leading
+// '/', no empty segment, no "." or "..". openat() would take an absolute path
+// straight past http_root_fd, and ".." would climb out of it.
+int http_path_allowed(const char* path) {
+    const char* p = path;
+    while (1) {
+        size_t len = strcspn(p, "/");
+        if (len == 0 || (len == 1 && p[0] == '.') ||
+            (len == 2 && p[0] == '.' && p[1] == '.')) {
+            return 0;
+        }
+        if (p[len] == '\0') {
+            return 1;
+        }
+        p += len + 1;
+    }
+}
+
+// Open path below http_root_fd without letting a symlink lead out of it.
+// Without openat2() the path is walked one directory at a time, each opened
+// with O_NOFOLLOW, so no component at all may be a symlink, even one that
+// stays inside the directory. http_path_allowed() has ruled out "..".
+static int open_beneath(const char* path) {
+#ifdef HAVE_OPENAT2
+    static int have_openat2 = 1;
+    if (have_openat2) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = O_RDONLY | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+        int fd = (int)syscall(__NR_openat2, http_root_fd, path, &how, sizeof(how));
+        if (fd != -1 || errno != ENOSYS) {
+            return fd;
+        }
+        have_openat2 = 0;
+    }
+#endif
+    char name[NAME_MAX + 1];
+    int dir = http_root_fd;
+    while (1) {
+        size_t len = strcspn(path, "/");
+        if (len > NAME_MAX) {
+            if (dir != http_root_fd) {
+                close(dir);
+            }
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(name, path, len);
+        name[len] = '\0';
+        int last = path[len] == '\0';
+        int fd = openat(dir, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW |
+                                   (last ? 0 : O_DIRECTORY));
+        // O_DIRECTORY reports a symlinked directory as ENOTDIR; call it ELOOP
+        // like the last component
+        struct stat st;
+        if (fd == -1 && errno == ENOTDIR &&
+            fstatat(dir, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode)) {
+            errno = ELOOP;
+        }
+        if (dir != http_root_fd) {
+            int saved = errno;
+            close(dir);
+            errno = saved;
+        }
+        if (fd == -1 || last) {
+            return fd;
+        }
+        dir = fd;
+        path += len + 1;
+    }
+}
+
+// Look up a regular file below the served directory, opening it on a miss.
+// Cached entries are re-stat'ed at most every FILE_CACHE_TTL_MS, so a replaced
+// artifact is picked up without a stat() per request. The re-stat does not
+// follow a final symlink; one that appeared since the open forces a fresh
+// open_beneath(). Returns a new reference,
+// or NULL with errno set.
+FileEntry* file_cache_get(Reactor* reactor, const char* path) {
+    FileCache* cache = &reactor->files;
+    FileEntry** slot = &cache->buckets[path_hash(path) % FILE_CACHE_BUCKETS];
+    uint64_t now = monotonic_ms();
+    struct stat st;
+
+    for (FileEntry** link = slot; *link; link = &(*link)->next) {
+        FileEntry* file = *link;
+        if (strcmp(file->path, path) != 0) {
+            continue;
+        }
+        if (now - file->checked_ms < FILE_CACHE_TTL_MS ||
+            (fstatat(http_root_fd, path, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+             stat_matches(file, &st))) {
+            file->checked_ms = now;
+            file->refs++;
+            cache->hits++;
+            return file;
+        }
+        // Changed or gone: forget it and look again
+        *link = file->next;
+        cache->count--;
+        file_release(file);
+        break;
+    }
+
+    cache->misses++;
+    int fd = open_beneath(path);
+    if (fd == -1) {
+        // EXDEV: the path resolved outside the directory; ELOOP: through a
+        // symlink we refuse to follow
+        if (errno == EXDEV || errno == ELOOP) {
+            errno = EACCES;
+        }
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = ENOENT;
+        return NULL;
+    }
+
+    FileEntry* file = (FileEntry*)malloc(sizeof(FileEntry));
+    char* copy = strdup(path);
+    if (!file || !copy) {
+        free(file);
+        free(copy);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (cache->count >= FILE_CACHE_MAX) {
+        file_cache_clear(cache);
+    }
+
+    file->path = copy;
+    file->fd = fd;
+    file->size = st.st_size;
+    file->ino = st.st_ino;
+    file->mtime = st.st_mtim;
+    file->checked_ms = now;
+    file->refs = 2;     // The cache's and the caller's
+    file->next = *slot;
+    *slot = file;
+    cache->count++;
+    return file;
+}
+
+// Append bytes to the out ring
+int ring_append(Reactor* reactor, RingBuffer* rb, const char* data, size_t len) {
+    while (len > 0) {
+        size_t room = ring_make_room(reactor, rb);
+        if (room == 0) {
+            return -1;
+        }
+        struct iovec iov[2];
+        int iovcnt = ring_free_iov(rb, iov);
+        for (int i = 0; i < iovcnt && len > 0; i++) {
+            size_t n = iov[i].iov_len < len ? iov[i].iov_len : len;
+            memcpy(iov[i].iov_base, data, n);
+            rb->tail += n;
+            data += n;
+            len -= n;
+        }
+    }
+    return 0;
+}
+
+// Queue a response: headers into the out ring, the body (if any) as a file range
+int http_start_response(Reactor* reactor, Client* client, int status, const char* reason,
+                        FileEntry* file, int head_only) {
+    char header[256];
+    const char* text = file ? "" : reason;
+    long long length = file ? (long long)file->size : (long long)strlen(reason) + 1;
+
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Length: %lld\r\n"
+                     "Content-Type: %s\r\n"
+                     "Connection: %s\r\n"
+                     "\r\n%s%s",
+                     status, reason, length,
+                     file ? "application/octet-stream" : "text/plain",
+                     client->keep_alive ? "keep-alive" : "close",
+                     head_only ? "" : text, (file || head_only) ? "" : "\n");
+
+    if (ring_append(reactor, &client->out, header, n) == -1) {
+        if (file) {
+            file_release(file);
+        }
+        return -1;
+    }
+
+    if (file && !head_only && file->size > 0) {
+        client->file = file;
+        client->body_offset = 0;
+        client->body_end = file->size;
+    } else if (file) {
+        file_release(file);
+    }
+    return 0;
+}
+
+// Find the value of a header in a NUL-terminated header block, case-insensitively
+static const char* http_header(const char* headers, const char* name, size_t* len) {
+    size_t name_len = strlen(name);
+    const char* line = strstr(headers, "\r\n");
+
+    while (line && line[2] != '\r' && line[2] != '\0') {
+        line += 2;
+        const char* end = strstr(line, "\r\n");
+        if (!end) {
+            break;
+        }
+        if ((size_t)(end - line) > name_len && line[name_len] == ':' &&
+            strncasecmp(line, name, name_len) == 0) {
+            const char* value = line + name_len + 1;
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            *len = end - value;
+            return value;
+        }
+        line = end;
+    }
+    return NULL;
+}
+
+// Parse one complete request from the front of client->request and queue its
+// response. Returns 1 if a response was queued, 0 if the request is incomplete,
+// -1 on a request too large to buffer.
+int http_parse_request(Reactor* reactor, Client* client) {
+    char* request = client->request;
+    char* end = (char*)memmem(request, client->request_len, "\r\n\r\n", 4);
+    if (!end) {
+        return client->request_len == HTTP_MAX_REQUEST ? -1 : 0;
+    }
+
+    size_t consumed = end + 4 - request;
+    end[2] = '\0';      // Terminates the header block for http_header()
+
+    char method[8];
+    char target[HTTP_MAX_PATH];
+    int minor = 0;
+    int valid = sscanf(request, "%7s %1023s HTTP/1.%d", method, target, &minor) == 3;
+
+    // HTTP/1.1 keeps the connection unless told otherwise, HTTP/1.0 the other way round
+    size_t len;
+    const char* connection = http_header(request, "Connection", &len);
+    client->keep_alive = valid && (connection ? (len == 10 && strncasecmp(connection, "keep-alive", 10) == 0)
+                                              : minor >= 1);
+    if (connection && len == 5 && strncasecmp(connection, "close", 5) == 0) {
+        client->keep_alive = 0;
+    }
+
+    // Keep pipelined requests for later
+    memmove(request, request + consumed, client->request_len - consumed);
+    client->request_len -= consumed;
+
+    int head_only = valid && strcmp(method, "HEAD") == 0;
+    int ret;
+    if (!valid || target[0] != '/') {
+        ret = http_start_response(reactor, client, 400, "Bad Request", NULL, 0);
+    } else if (strcmp(method, "GET") != 0 && !head_only) {
+        ret = http_start_response(reactor, client, 405, "Method Not Allowed", NULL, 0);
+    } else {
+        // Drop the query, then refuse anything that could leave the directory
+        char* path = target + 1;
+        path[strcspn(path, "?#")] = '\0';
+        int escapes = *path != '\0' && !http_path_allowed(path);
+
+        FileEntry* file = NULL;
+        errno = ENOENT;
+        if (!escapes && *path != '\0') {
+            file = file_cache_get(reactor, path);
+        }
+        if (file) {
+            ret = http_start_response(reactor, client, 200, "OK", file, head_only);
+        } else if (escapes || errno == EACCES) {
+            ret = http_start_response(reactor, client, 403, "Forbidden", NULL, head_only);
+        } else {
+            ret = http_start_response(reactor, client, 404, "Not Found", NULL, head_only);
+        }
+    }
+
+    return ret == -1 ? -1 : 1;
+}
+
+// Send queued headers, then the body. Returns 1 once the whole response is out,
+// 0 if the socket is full, -1 if the client was closed.
+int http_flush(Reactor* reactor, Client* client) {
+    RingBuffer* out = &client->out;
+
+    while (ring_used(out) > 0) {
+        struct msghdr msg;
+        struct iovec iov[2];
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = ring_used_iov(out, iov);
+
+        // MSG_MORE holds the headers back until the body joins them
+        ssize_t n = sendmsg(client->socket, &msg, MSG_NOSIGNAL | (client->file ? MSG_MORE : 0));
+        reactor->syscalls++;
+        if (n > 0) {
+            out->head += n;
+            reactor->bytes_written += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (errno != ECONNRESET && errno != EPIPE && !quiet) {
+            perror("sendmsg");
+        }
+        close_client(reactor, client);
+        return -1;
+    }
+
+    while (client->file && client->body_offset < client->body_end) {
+        size_t remaining = client->body_end - client->body_offset;
+        ssize_t n;
+
+        if (body_mode == BODY_SENDFILE) {
+            n = sendfile(client->socket, client->file->fd, &client->body_offset, remaining);
+        } else {
+            // Baseline: every byte is copied into user space and back out
+            size_t chunk = remaining < HTTP_COPY_CHUNK ? remaining : HTTP_COPY_CHUNK;
+            n = pread(client->file->fd, reactor->copy_buffer, chunk, client->body_offset);
+            if (n > 0) {
+                n = send(client->socket, reactor->copy_buffer, n, MSG_NOSIGNAL);
+                reactor->syscalls++;
+                if (n > 0) {
+                    client->body_offset += n;
+                }
+            } else if (n == 0) {
+                // The file shrank under us
+                n = -1;
+                errno = EIO;
+            }
+        }
+        reactor->syscalls++;
+
+        if (n > 0) {
+            reactor->bytes_written += n;
+            client_touch(reactor, client);
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n == 0) {
+            errno = EIO;    // sendfile() hit the end of a file that shrank
+        }
+        if (errno != ECONNRESET && errno != EPIPE && !quiet) {
+            perror("sendfile");
+        }
+        close_client(reactor, client);
+        return -1;
+    }
+
+    if (client->file) {
+        file_release(client->file);
+        client->file = NULL;
+    }
+    if (!client->keep_alive) {
+        close_client(reactor, client);
+        return -1;
+    }
+    client_touch(reactor, client);
+    return 1;
+}
+
+// Serve requests until the socket is drained or a response waits for the socket
+// to become writable. Pipelined requests are answered one after the other.
+// Returns -1 if the client was closed.
+int http_handle_read(Reactor* reactor, Client* client) {
+    if (!client->request) {
+        client->request = buffer_alloc(reactor, HTTP_MAX_REQUEST);
+        if (!client->request) {
+            close_client(reactor, client);
+            return -1;
+        }
+    }
+
+    for (;;) {
+        // One response at a time; http_handle_write() comes back here when it is out
+        if (ring_used(&client->out) > 0 || client->file) {
+            int flushed = http_flush(reactor, client);
+            if (flushed == -1) {
+                return -1;
+            }
+            if (flushed == 0) {
+                break;
+            }
+        }
+
+        int parsed = http_parse_request(reactor, client);
+        if (parsed == -1) {
+            close_client(reactor, client);
+            return -1;
+        }
+        if (parsed == 1) {
+            continue;
+        }
+
+        ssize_t n = read(client->socket, client->request + client->request_len,
+                         HTTP_MAX_REQUEST - client->request_len);
+        reactor->syscalls++;
+        if (n > 0) {
+            client->request_len += n;
+            client->has_read = 1;
+            reactor->bytes_read += n;
+            client_touch(reactor, client);
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n == -1 && errno != ECONNRESET && !quiet) {
+            perror("read");
+        }
+        close_client(reactor, client);
+        return -1;
+    }
+
+    return update_interest(reactor, client);
+}
+
+// The socket has room again: continue the response, then any requests behind it
+int http_handle_write(Reactor* reactor, Client* client) {
+    return http_handle_read(reactor, client);
+}
+
+// ----- Pub/sub mode -----
+//
+// A published message is received once into a Message and then only referenced:
+// every subscriber queue holds a pointer to it, and the frames are sent straight
+// from the shared copy with writev(). Subscribers on other reactors are reached
+// through their reactor's inbox, so each reactor only touches its own clients.
+// New messages are queued during an event batch and sent once the batch is done,
+// so several messages to one subscriber go out in one writev().
+// A subscriber whose queue reaches queue_limit is slow: depending on the policy
+// new messages to it are dropped, or it is disconnected. Others are not held up.
+
+Message* message_alloc(uint32_t payload) {
+    uint32_t size = payload + 4;
+    Message* msg = (Message*)malloc(sizeof(Message) + size);
+    if (!msg) {
+        perror("malloc message");
+        return NULL;
+    }
+    msg->refs = 1;
+    msg->size = size;
+    uint32_t length = htonl(payload);
+    memcpy(msg->frame, &length, 4);
+
+    long bytes = __atomic_add_fetch(&message_bytes, (long)(sizeof(Message) + size), __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&peak_message_bytes, __ATOMIC_RELAXED);
+    while (bytes > peak &&
+           !__atomic_compare_exchange_n(&peak_message_bytes, &peak, bytes, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    return msg;
+}
+
+static inline void message_ref(Message* msg) {
+    __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+}
+
+void message_release(Message* msg) {
+    if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_sub_fetch(&message_bytes, (long)(sizeof(Message) + msg->size), __ATOMIC_RELAXED);
+        free(msg);
+    }
+}
+
+int pubsub_subscribe(Reactor* reactor, Client* client) {
+    if (client->subscribed) {
+        return 0;
+    }
+    client->queue = (Message**)buffer_alloc(reactor, queue_capacity * sizeof(Message*));
+    if (!client->queue) {
+        return -1;
+    }
+    client->subscribed = 1;
+    client->sub_prev = NULL;
+    client->sub_next = reactor->subscribers;
+    if (reactor->subscribers) {
+        reactor->subscribers->sub_prev = client;
+    }
+    reactor->subscribers = client;
+    reactor->subscriber_count++;
+    return 0;
+}
+
+// Drop the frame being received and, for a subscriber, its queue
+void pubsub_release_client(Reactor* reactor, Client* client) {
+    if (client->incoming) {
+        message_release(client->incoming);
+        client->incoming = NULL;
+    }
+    if (!client->subscribed) {
+        return;
+    }
+
+    if (client->sub_prev) {
+        client->sub_prev->sub_next = client->sub_next;
+    } else {
+        reactor->subscribers = client->sub_next;
+    }
+    if (client->sub_next) {
+        client->sub_next->sub_prev = client->sub_prev;
+    }
+    reactor->subscriber_count--;
+
+    while (client->queue_head != client->queue_tail) {
+        message_release(client->queue[client->queue_head++ & (queue_capacity - 1)]);
+        reactor->queued--;
+    }
+    buffer_free(reactor, (char*)client->queue, queue_capacity * sizeof(Message*));
+    client->queue = NULL;
+    client->subscribed = 0;
+}
+
+// Queue a message on every local subscriber. The publisher itself, if it is
+// subscribed, is never disconnected here: its read handler is still running.
+void pubsub_deliver(Reactor* reactor, Message* msg, Client* publisher) {
+    Client* next;
+
+    for (Client* client = reactor->subscribers; client; client = next) {
+        next = client->sub_next;
+
+        if (client->queue_tail - client->queue_head >= (unsigned)queue_limit) {
+            if (slow_policy == SLOW_DISCONNECT && client != publisher) {
+                reactor->slow_disconnects++;
+                close_client(reactor, client);
+            } else {
+                reactor->drops++;
+            }
+            continue;
+        }
+
+        message_ref(msg);
+        client->queue[client->queue_tail++ & (queue_capacity - 1)] = msg;
+        reactor->queued++;
+
+        if (!client->flush_pending) {
+            client->flush_pending = 1;
+            reactor->flush_fds[reactor->flush_count] = client->socket;
+            reactor->flush_generations[reactor->flush_count] = client->generation;
+            reactor->flush_count++;
+        }
+    }
+
+    if (reactor->queued > reactor->peak_queued) {
+        reactor->peak_queued = reactor->queued;
+    }
+}
+
+// Hand a message to every reactor: other reactors through their inbox, waking
+// them only when the inbox was empty, this one directly
+void pubsub_publish(Reactor* reactor, Message* msg, Client* publisher) {
+    reactor->published++;
+
+    for (int i = 0; i < num_reactors; i++) {
+        Reactor* other = &reactors[i];
+        if (other == reactor) {
+            continue;
+        }
+
+        pthread_mutex_lock(&other->inbox_lock);
+        if (other->inbox_count == other->inbox_capacity) {
+            int capacity = other->inbox_capacity ? other->inbox_capacity * 2 : 64;
+            Message** inbox = (Message**)realloc(other->inbox, capacity * sizeof(Message*));
+            if (!inbox) {
+                pthread_mutex_unlock(&other->inbox_lock);
+                perror("realloc inbox");
+                continue;
+            }
+            other->inbox = inbox;
+            other->inbox_capacity = capacity;
+        }
+        message_ref(msg);
+        int was_empty = (other->inbox_count == 0);
+        other->inbox[other->inbox_count++] = msg;
+        pthread_mutex_unlock(&other->inbox_lock);
+
+        if (was_empty) {
+            uint64_t one = 1;
+            if (write(other->inbox_fd, &one, sizeof(one)) == -1) {
+                perror("write inbox eventfd");
+            }
+            reactor->syscalls++;
+        }
+    }
+
+    pubsub_deliver(reactor, msg, publisher);
+    message_release(msg);
+}
+
+// Deliver what other reactors published
+void pubsub_drain_inbox(Reactor* reactor) {
+    uint64_t count;
+    if (read(reactor->inbox_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read inbox eventfd");
+    }
+    reactor->syscalls++;
+
+    pthread_mutex_lock(&reactor->inbox_lock);
+    Message** messages = reactor->inbox;
+    int n = reactor->inbox_count;
+    int capacity = reactor->inbox_capacity;
+    reactor->inbox = reactor->inbox_spare;
+    reactor->inbox_capacity = reactor->spare_capacity;
+    reactor->inbox_count = 0;
+    pthread_mutex_unlock(&reactor->inbox_lock);
+
+    reactor->inbox_spare = messages;
+    reactor->spare_capacity = capacity;
+
+    for (int i = 0; i < n; i++) {
+        pubsub_deliver(reactor, messages[i], NULL);
+        message_release(messages[i]);
+    }
+}
+
+// Send queued frames straight from the shared messages. Returns -1 if the client was closed.
+int pubsub_flush(Reactor* reactor, Client* client) {
+    while (client->queue_head != client->queue_tail) {
+        struct iovec iov[PUBSUB_MAX_IOV];
+        int iovcnt = 0;
+
+        for (unsigned i = client->queue_head; i != client->queue_tail && iovcnt < PUBSUB_MAX_IOV; i++) {
+            Message* msg = client->queue[i & (queue_capacity - 1)];
+            size_t skip = (i == client->queue_head) ? client->queue_offset : 0;
+            iov[iovcnt].iov_base = msg->frame + skip;
+            iov[iovcnt].iov_len = msg->size - skip;
+            iovcnt++;
+        }
+
+        ssize_t n = writev(client->socket, iov, iovcnt);
+        reactor->syscalls++;
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno != ECONNRESET && errno != EPIPE && !quiet) {
+                perror("writev");
+            }
+            close_client(reactor, client);
+            return -1;
+        }
+        reactor->bytes_written += n;
+
+        // Retire the messages that went out completely
+        size_t sent = n;
+        while (sent > 0) {
+            Message* msg = client->queue[client->queue_head & (queue_capacity - 1)];
+            size_t left = msg->size - client->queue_offset;
+            if (sent < left) {
+                client->queue_offset += sent;
+                break;
+            }
+            sent -= left;
+            client->queue_offset = 0;
+            client->queue_head++;
+            reactor->queued--;
+            reactor->deliveries++;
+            message_release(msg);
+        }
+        client_touch(reactor, client);
+    }
+
+    return update_interest(reactor, client);
+}
+
+// Send everything queued during the last event batch
+void pubsub_flush_pending(Reactor* reactor) {
+    for (int i = 0; i < reactor->flush_count; i++) {
+        Client* client = lookup_client(reactor, reactor->flush_fds[i], reactor->flush_generations[i]);
+        if (client) {
+            client->flush_pending = 0;
+            pubsub_flush(reactor, client);
+        }
+    }
+    reactor->flush_count = 0;
+}
+
+// Read frames: an empty one subscribes, others are published. Payload bytes are
+// copied once, from the receive buffer into the Message every subscriber shares.
+// Returns -1 if the client was closed.
+int pubsub_handle_read(Reactor* reactor, Client* client) {
+    if (!client->request) {
+        client->request = buffer_alloc(reactor, HTTP_MAX_REQUEST);
+        if (!client->request) {
+            close_client(reactor, client);
+            return -1;
+        }
+    }
+
+    for (;;) {
+        ssize_t n = read(client->socket, client->request + client->request_len,
+                         HTTP_MAX_REQUEST - client->request_len);
+        reactor->syscalls++;
+        if (n == 0 || (n == -1 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            if (n == -1 && errno != ECONNRESET && !quiet) {
+                perror("read");
+            }
+            close_client(reactor, client);
+            return -1;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        client->request_len += n;
+        client->has_read = 1;
+        reactor->bytes_read += n;
+        client_touch(reactor, client);
+
+        size_t pos = 0;
+        while (pos < client->request_len) {
+            if (!client->incoming) {
+                if (client->request_len - pos < 4) {
+                    break;
+                }
+                uint32_t length;
+                memcpy(&length, client->request + pos, 4);
+                length = ntohl(length);
+                pos += 4;
+
+                if (length == 0) {
+                    if (pubsub_subscribe(reactor, client) == -1) {
+                        close_client(reactor, client);
+                        return -1;
+                    }
+                    continue;
+                }
+                if (length > PUBSUB_MAX_MESSAGE) {
+                    if (!quiet) {
+                        fprintf(stderr, "pubsub: %u byte message too large\n", length);
+                    }
+                    close_client(reactor, client);
+                    return -1;
+                }
+                client->incoming = message_alloc(length);
+                if (!client->incoming) {
+                    close_client(reactor, client);
+                    return -1;
+                }
+                client->incoming_have = 4;
+            }
+
+            Message* msg = client->incoming;
+            size_t take = client->request_len - pos;
+            if (take > msg->size - client->incoming_have) {
+                take = msg->size - client->incoming_have;
+            }
+            memcpy(msg->frame + client->incoming_have, client->request + pos, take);
+            client->incoming_have += take;
+            pos += take;
+
+            if (client->incoming_have == msg->size) {
+                client->incoming = NULL;
+                pubsub_publish(reactor, msg, client);
+            }
+        }
+
+        memmove(client->request, client->request + pos, client->request_len - pos);
+        client->request_len -= pos;
+    }
+
+    return update_interest(reactor, client);
+}
+
+int pubsub_handle_write(Reactor* reactor, Client* client) {
+    return pubsub_flush(reactor, client);
+}
+
+// Reactor state for pub/sub, set up for every reactor before any thread starts
+// because reactors publish into each other's inboxes
+int pubsub_setup(Reactor* reactor) {
+    reactor->inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->inbox_fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+    pthread_mutex_init(&reactor->inbox_lock, NULL);
+
+    reactor->flush_fds = (int*)malloc(sizeof(int) * max_clients);
+    reactor->flush_generations = (uint32_t*)malloc(sizeof(uint32_t) * max_clients);
+    if (!reactor->flush_fds || !reactor->flush_generations) {
+        perror("malloc flush list");
+        return -1;
+    }
+    return 0;
+}
+
+// After every reactor thread has stopped
+void pubsub_teardown(Reactor* reactor) {
+    for (int i = 0; i < reactor->inbox_count; i++) {
+        message_release(reactor->inbox[i]);
+    }
+    free(reactor->inbox);
+    free(reactor->inbox_spare);
+    free(reactor->flush_fds);
+    free(reactor->flush_generations);
+    reactor->inbox = NULL;
+    reactor->inbox_spare = NULL;
+    reactor->flush_fds = NULL;
+    reactor->flush_generations = NULL;
+    reactor->inbox_count = 0;
+    if (reactor->inbox_fd >= 0) {
+        close(reactor->inbox_fd);
+        reactor->inbox_fd = -1;
+    }
+    pthread_mutex_destroy(&reactor->inbox_lock);
+}
+
+// Pin the calling thread to one CPU
+int pin_to_cpu(int cpu) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set);
+    if (err != 0) {
+        fprintf(stderr, "Failed to pin to CPU %d: %s\n", cpu, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// Create a non-blocking listen socket. With reuseport, SO_REUSEPORT lets every reactor
+// bind its own socket to the same port; the kernel then spreads incoming connections
+// across them. Otherwise this is the one socket all reactors share.
+int create_listen_socket(int reuseport) {
+    int server_fd;
+    struct sockaddr_in server_addr;
+
+    // Create server socket
+    server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    
+    // Set socket options
+    int opt = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+        perror("setsockopt SO_REUSEADDR");
+        close(server_fd);
+        return -1;
+    }
+
+    if (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+        perror("setsockopt SO_REUSEPORT");
+        close(server_fd);
+        return -1;
+    }
+    
+    // Make server socket non-blocking
+    if (set_nonblocking(server_fd) == -1) {
+        close(server_fd);
+        return -1;
+    }
+    
+    // Configure server address
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(SERVER_PORT);
+    
+    // Bind the socket
+    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+        perror("bind");
+        close(server_fd);
+        return -1;
+    }
+    
+    // Listen for connections
+    if (listen(server_fd, listen_backlog) == -1) {
+        perror("listen");
+        close(server_fd);
+        return -1;
+    }
+
+    return server_fd;
+}
+
+// Put an accepted socket into the fd table. Shared by both backends.
+// Returns NULL (and closes the socket) if the client cannot be tracked.
+// Connections are counted rather than logged; printing per connection would cap
+// the accept rate at the speed of stdout.
+Client* register_client(Reactor* reactor, int client_fd) {
+    // The fd limit bounds the table, so this only triggers if MAX_FD_TABLE capped it
+    if (client_fd >= max_clients) {
+        printf("Maximum clients reached, rejecting connection\n");
+        close(client_fd);
+        return NULL;
+    }
+    
+    // Replies go out as soon as they are ready; Nagle would hold back the
+    // second of two small writes until the peer's delayed ACK
+    int nodelay = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    reactor->syscalls++;
+
+    // Create client structure
+    Client* client = create_client(reactor, client_fd);
+    if (!client) {
+        close(client_fd);
+        return NULL;
+    }
+    
+    // Add to the fd table
+    reactor->clients[client_fd] = client;
+    reactor->active_clients++;
+    reactor->connections_accepted++;
+    client_touch(reactor, client);
+
+    return client;
+}
+
+// Accept every queued connection in one wakeup. accept4() returns the socket
+// already non-blocking and close-on-exec, which saves two fcntl() calls each.
+// With a shared listener another reactor may have emptied the queue first;
+// that is just an EAGAIN.
+void epoll_accept(Reactor* reactor) {
+    int batch = 0;
+
+    while (running) {
+        int client_fd = accept4(reactor->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        reactor->syscalls++;
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                reactor->accept_errors++;
+                if (!quiet) {
+                    perror("accept4");
+                }
+            }
+            break;
+        }
+        batch++;
+
+        Client* client = register_client(reactor, client_fd);
+        if (!client) {
+            continue;
+        }
+
+        // Add client socket to epoll
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = client_tag(client_fd, client->generation);
+        client->events = ev.events;
+        reactor->syscalls++;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+            perror("epoll_ctl: client_fd");
+            close_client(reactor, client);
+        }
+    }
+
+    reactor->accept_wakeups++;
+    if (batch > reactor->largest_accept_batch) {
+        reactor->largest_accept_batch = batch;
+    }
+}
+
+int client_handle_read(Reactor* reactor, Client* client) {
+    switch (protocol) {
+        case PROTOCOL_HTTP:   return http_handle_read(reactor, client);
+        case PROTOCOL_PUBSUB: return pubsub_handle_read(reactor, client);
+        default:              return handle_read_event(reactor, client);
+    }
+}
+
+int client_handle_write(Reactor* reactor, Client* client) {
+    switch (protocol) {
+        case PROTOCOL_HTTP:   return http_handle_write(reactor, client);
+        case PROTOCOL_PUBSUB: return pubsub_handle_write(reactor, client);
+        default:              return handle_write_event(reactor, client);
+    }
+}
+
+// epoll backend: edge-triggered readiness, the socket calls are ours
+void epoll_event_loop(Reactor* reactor) {
+    int server_fd = reactor->listen_fd;
+    int epoll_fd = reactor->epoll_fd;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (running) {
+        int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);  // 1 second timeout
+        reactor->syscalls++;
+        if (nfds == -1) {
+            if (errno == EINTR) {
+                // Interrupted system call (signal), just retry
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        
+        for (int i = 0; i < nfds; i++) {
+            if (events[i].data.u64 == client_tag(server_fd, 0)) {
+                epoll_accept(reactor);
+            } else if (reactor->timer_fd >= 0 && events[i].data.u64 == client_tag(reactor->timer_fd, 0)) {
+                uint64_t expirations;
+                if (read(reactor->timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    reactor_run_timers(reactor);
+                }
+                reactor->syscalls++;
+            } else if (protocol == PROTOCOL_PUBSUB && events[i].data.u64 == client_tag(reactor->inbox_fd, 0)) {
+                pubsub_drain_inbox(reactor);
+            } else {
+                // Handle client event
+                uint64_t tag = events[i].data.u64;
+                Client* client = lookup_client(reactor, (int)(uint32_t)tag, (uint32_t)(tag >> 32));
+                
+                if (!client) {
+                    // Stale event for a client closed earlier in this batch
+                    continue;
+                }
+
+                reactor->events_handled++;
+                
+                // Handle the event
+                if (events[i].events & EPOLLIN) {
+                    if (client_handle_read(reactor, client) == -1) {
+                        continue;
+                    }
+                }
+                
+                if (events[i].events & EPOLLOUT) {
+                    if (client_handle_write(reactor, client) == -1) {
+                        continue;
+                    }
+                }
+                
+                if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    close_client(reactor, client);
+                }
+            }
+        }
+
+        if (reactor->flush_count > 0) {
+            pubsub_flush_pending(reactor);
+        }
+    }
+}
+
+// Create the epoll instance and watch the listen socket
+int epoll_setup(Reactor* reactor) {
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+    
+    // Add server socket to epoll
+    // A shared listener is level-triggered with EPOLLEXCLUSIVE: a new connection
+    // wakes one of the waiting reactors instead of all of them.
+    struct epoll_event ev;
+    ev.events = shared_listener ? (EPOLLIN | EPOLLEXCLUSIVE) : (EPOLLIN | EPOLLET);
+    ev.data.u64 = client_tag(reactor->listen_fd, 0);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &ev) == -1) {
+        perror("epoll_ctl: server_fd");
+        close(epoll_fd);
+        return -1;
+    }
+
+    if (protocol == PROTOCOL_PUBSUB) {
+        ev.events = EPOLLIN;
+        ev.data.u64 = client_tag(reactor->inbox_fd, 0);
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reactor->inbox_fd, &ev) == -1) {
+            perror("epoll_ctl: inbox_fd");
+            close(epoll_fd);
+            return -1;
+        }
+    }
+
+    // The wheel ticks in the same epoll set
+    if (reactor->timer_fd >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.u64 = client_tag(reactor->timer_fd, 0);
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reactor->timer_fd, &ev) == -1) {
+            perror("epoll_ctl: timer_fd");
+            close(epoll_fd);
+            return -1;
+        }
+    }
+
+    reactor->epoll_fd = epoll_fd;
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+
+// ----- io_uring backend -----
+//
+// Accepts come from one multishot accept, each client has one multishot recv that
+// picks buffers from a provided buffer ring, and received buffers are echoed with
+// linked send SQEs straight out of those buffers. The Client bookkeeping (fd table,
+// generations, counters, close_client) is the same as for epoll.
+
+enum { URING_OP_ACCEPT = 1, URING_OP_RECV, URING_OP_SEND, URING_OP_CANCEL, URING_OP_TIMER };
+
+typedef struct Uring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // Provided receive buffers
+    struct io_uring_buf_ring* buf_ring;
+    size_t buf_ring_size;
+    unsigned num_buffers;
+    char* buffers;
+    uint16_t buf_tail;
+    int buffers_free;
+    int* buf_next;          // Links buffers into per-client send queues
+    unsigned* buf_len;      // Bytes received into each buffer
+
+    // Clients whose recv ended for lack of buffers; re-armed when buffers return
+    int* rearm_fds;
+    uint32_t* rearm_generations;
+    int rearm_count;
+} Uring;
+
+// user_data layout: op in bits 0-3, buffer id in 4-19, fd in 20-39, generation in 40-63
+static inline uint64_t uring_tag(int op, int fd, uint32_t generation, unsigned bid) {
+    return (uint64_t)op | ((uint64_t)(bid & 0xFFFF) << 4) |
+           ((uint64_t)(fd & 0xFFFFF) << 20) | ((uint64_t)(generation & GENERATION_MASK) << 40);
+}
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                          void* arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Hand a buffer back to the kernel through the provided buffer ring
+void uring_recycle_buffer(Uring* u, unsigned bid) {
+    struct io_uring_buf* buf = &u->buf_ring->bufs[u->buf_tail & (u->num_buffers - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(u->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = (uint16_t)bid;
+    u->buf_tail++;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+    u->buffers_free++;
+}
+
+void uring_teardown(Uring* u) {
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+    if (u->sqes && u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring && u->sq_ring != MAP_FAILED) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->buf_ring && u->buf_ring != MAP_FAILED) {
+        munmap(u->buf_ring, u->buf_ring_size);
+    }
+    free(u->buffers);
+    free(u->buf_next);
+    free(u->buf_len);
+    free(u->rearm_fds);
+    free(u->rearm_generations);
+    memset(u, 0, sizeof(Uring));
+    u->fd = -1;
+}
+
+// Create the ring, map the queues and register num_buffers provided buffers (group 0).
+// Returns -1 with errno set if the kernel cannot do any of it.
+int uring_setup(Uring* u, unsigned entries, unsigned num_buffers, int rearm_capacity) {
+    struct io_uring_params params;
+
+    memset(u, 0, sizeof(Uring));
+    u->fd = -1;
+
+    // Multishot requests post many CQEs per SQE, so give the CQ extra room
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    u->fd = io_uring_setup(entries, &params);
+    if (u->fd < 0) {
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        uring_teardown(u);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq_ring_size > u->sq_ring_size) {
+        u->sq_ring_size = u->cq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        uring_teardown(u);
+        return -1;
+    }
+    u->cq_ring = u->sq_ring;  // IORING_FEAT_SINGLE_MMAP
+
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        uring_teardown(u);
+        return -1;
+    }
+
+    char* sq = (char*)u->sq_ring;
+    u->sq_head = (unsigned*)(sq + params.sq_off.head);
+    u->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    u->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    u->sq_array = (unsigned*)(sq + params.sq_off.array);
+    u->sq_entries = params.sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+
+    char* cq = (char*)u->cq_ring;
+    u->cq_head = (unsigned*)(cq + params.cq_off.head);
+    u->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    u->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // Provided buffer ring: the kernel picks a buffer per received chunk
+    u->num_buffers = num_buffers;
+    u->buf_ring_size = num_buffers * sizeof(struct io_uring_buf);
+    u->buf_ring = (struct io_uring_buf_ring*)mmap(NULL, u->buf_ring_size, PROT_READ | PROT_WRITE,
+                                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buf_ring == MAP_FAILED) {
+        uring_teardown(u);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = num_buffers;
+    reg.bgid = 0;
+    if (io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_teardown(u);
+        return -1;
+    }
+
+    u->buffers = (char*)malloc((size_t)num_buffers * URING_BUFFER_SIZE);
+    u->buf_next = (int*)malloc(num_buffers * sizeof(int));
+    u->buf_len = (unsigned*)calloc(num_buffers, sizeof(unsigned));
+    u->rearm_fds = (int*)malloc(rearm_capacity * sizeof(int));
+    u->rearm_generations = (uint32_t*)malloc(rearm_capacity * sizeof(uint32_t));
+    if (!u->buffers || !u->buf_next || !u->buf_len || !u->rearm_fds || !u->rearm_generations) {
+        uring_teardown(u);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (unsigned bid = 0; bid < num_buffers; bid++) {
+        uring_recycle_buffer(u, bid);
+    }
+
+    return 0;
+}
+
+// Submit queued SQEs; optionally wait up to timeout_ms for at least one completion
+int uring_submit(Reactor* reactor, int wait, int timeout_ms) {
+    Uring* u = reactor->uring;
+    unsigned to_submit = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    unsigned flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+    int ret = io_uring_enter(u->fd, to_submit, wait ? 1 : 0, flags, &arg, sizeof(arg));
+    reactor->syscalls++;
+
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+        perror("io_uring_enter");
+        return -1;
+    }
+    return 0;
+}
+
+// Get a zeroed SQE, submitting first if the queue is full
+struct io_uring_sqe* uring_get_sqe(Reactor* reactor) {
+    Uring* u = reactor->uring;
+
+    while (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if (uring_submit(reactor, 0, 0) == -1) {
+            return NULL;
+        }
+    }
+
+    unsigned index = u->sq_local_tail & *u->sq_mask;
+    struct io_uring_sqe* sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    u->sq_local_tail++;
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+void uring_arm_accept(Reactor* reactor) {
+    struct io_uring_sqe* sqe = uring_get_sqe(reactor);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = reactor->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = uring_tag(URING_OP_ACCEPT, reactor->listen_fd, 0, 0);
+}
+
+// Read the timerfd through the ring; the completion ticks the wheel
+void uring_arm_timer(Reactor* reactor) {
+    struct io_uring_sqe* sqe = uring_get_sqe(reactor);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = reactor->timer_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&reactor->timer_expirations;
+    sqe->len = sizeof(reactor->timer_expirations);
+    sqe->user_data = uring_tag(URING_OP_TIMER, reactor->timer_fd, 0, 0);
+}
+
+void uring_arm_recv(Reactor* reactor, Client* client) {
+    struct io_uring_sqe* sqe = uring_get_sqe(reactor);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = uring_tag(URING_OP_RECV, client->socket, client->generation, 0);
+    client->recv_armed = 1;
+}
+
+// Backpressure: cancel the multishot recv of a client that does not read its replies
+void uring_pause_recv(Reactor* reactor, Client* client) {
+    struct io_uring_sqe* sqe = uring_get_sqe(reactor);
+    if (!sqe) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = uring_tag(URING_OP_RECV, client->socket, client->generation, 0);
+    sqe->user_data = uring_tag(URING_OP_CANCEL, client->socket, client->generation, 0);
+    client->reading_paused = 1;
+}
+
+// Send the client's queued buffers as one chain of linked SQEs. Only one chain is
+// in flight per client, which keeps the echoed bytes in order.
+void uring_flush_sends(Reactor* reactor, Client* client) {
+    Uring* u = reactor->uring;
+    struct io_uring_sqe* prev = NULL;
+
+    if (client->sends_in_flight > 0) {
+        return;
+    }
+
+    while (client->send_head != -1 && client->sends_in_flight < URING_MAX_LINKED_SENDS) {
+        int bid = client->send_head;
+        struct io_uring_sqe* sqe = uring_get_sqe(reactor);
+        if (!sqe) {
+            break;
+        }
+
+        client->send_head = u->buf_next[bid];
+        if (client->send_head == -1) {
+            client->send_tail = -1;
+        }
+
+        // Cork all but the last send of the chain so they leave as full segments
+        if (prev) {
+            prev->flags |= IOSQE_IO_LINK;
+            prev->msg_flags |= MSG_MORE;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = client->socket;
+        sqe->addr = (uint64_t)(uintptr_t)(u->buffers + (size_t)bid * URING_BUFFER_SIZE);
+        sqe->len = u->buf_len[bid];
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = uring_tag(URING_OP_SEND, client->socket, client->generation, bid);
+        client->sends_in_flight++;
+        prev = sqe;
+    }
+}
+
+// Give back the buffers a closing client still had queued (called from close_client).
+// Buffers with sends in flight come back through their completions.
+void uring_release_client(Reactor* reactor, Client* client) {
+    Uring* u = reactor->uring;
+
+    while (client->send_head != -1) {
+        int bid = client->send_head;
+        client->send_head = u->buf_next[bid];
+        uring_recycle_buffer(u, bid);
+    }
+    client->send_tail = -1;
+}
+
+void uring_handle_accept(Reactor* reactor, struct io_uring_cqe* cqe) {
+    if (cqe->res >= 0) {
+        Client* client = register_client(reactor, cqe->res);
+        if (client) {
+            uring_arm_recv(reactor, client);
+        }
+    } else if (cqe->res != -ECANCELED) {
+        reactor->accept_errors++;
+        if (!quiet) {
+            fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        }
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && running) {
+        uring_arm_accept(reactor);
+    }
+}
+
+void uring_handle_recv(Reactor* reactor, struct io_uring_cqe* cqe, int fd, uint32_t generation) {
+    Uring* u = reactor->uring;
+    Client* client = lookup_client(reactor, fd, generation);
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        u->buffers_free--;
+
+        if (!client || cqe->res <= 0) {
+            uring_recycle_buffer(u, bid);
+        } else {
+            // Queue the buffer itself for sending: echo without copying
+            u->buf_len[bid] = cqe->res;
+            u->buf_next[bid] = -1;
+            if (client->send_tail == -1) {
+                client->send_head = bid;
+            } else {
+                u->buf_next[client->send_tail] = bid;
+            }
+            client->send_tail = bid;
+            client->queued_buffers++;
+            client->has_read = 1;
+            reactor->bytes_read += cqe->res;
+            reactor->events_handled++;
+            client_touch(reactor, client);
+
+            uring_flush_sends(reactor, client);
+
+            if (client->queued_buffers >= URING_HIGH_WATER_BUFFERS && !client->reading_paused &&
+                (cqe->flags & IORING_CQE_F_MORE)) {
+                uring_pause_recv(reactor, client);
+            }
+        }
+    }
+
+    if (!client || (cqe->flags & IORING_CQE_F_MORE)) {
+        return;
+    }
+
+    // The multishot recv ended
+    client->recv_armed = 0;
+
+    if (cqe->res == 0) {
+        close_client(reactor, client);
+    } else if (cqe->res == -ENOBUFS) {
+        // Out of provided buffers: retry once sends return some
+        u->rearm_fds[u->rearm_count] = client->socket;
+        u->rearm_generations[u->rearm_count] = client->generation;
+        u->rearm_count++;
+    } else if (cqe->res == -ECANCELED) {
+        // Paused for backpressure; re-armed when its sends drain
+        if (!client->reading_paused) {
+            uring_arm_recv(reactor, client);
+        }
+    } else if (cqe->res < 0) {
+        if (cqe->res != -ECONNRESET && !quiet) {
+            fprintf(stderr, "recv: %s\n", strerror(-cqe->res));
+        }
+        close_client(reactor, client);
+    } else {
+        // Ended with data (e.g. the kernel capped the CQEs for this request)
+        uring_arm_recv(reactor, client);
+    }
+}
+
+void uring_handle_send(Reactor* reactor, struct io_uring_cqe* cqe, int fd, uint32_t generation,
+                       unsigned bid) {
+    Uring* u = reactor->uring;
+    Client* client = lookup_client(reactor, fd, generation);
+    unsigned len = u->buf_len[bid];
+
+    uring_recycle_buffer(u, bid);
+
+    if (!client) {
+        return;
+    }
+
+    client->sends_in_flight--;
+    client->queued_buffers--;
+
+    if (cqe->res < 0 || (unsigned)cqe->res < len) {
+        // The rest of the chain completes with -ECANCELED; the client is gone by then
+        if (cqe->res != -ECONNRESET && cqe->res != -EPIPE && cqe->res != -ECANCELED && !quiet) {
+            fprintf(stderr, "send: %s\n", cqe->res < 0 ? strerror(-cqe->res) : "short write");
+        }
+        close_client(reactor, client);
+        return;
+    }
+    reactor->bytes_written += cqe->res;
+    client_touch(reactor, client);
+
+    if (client->sends_in_flight == 0) {
+        uring_flush_sends(reactor, client);
+    }
+
+    if (client->reading_paused && client->queued_buffers <= URING_LOW_WATER_BUFFERS) {
+        client->reading_paused = 0;
+        if (!client->recv_armed) {
+            uring_arm_recv(reactor, client);
+        }
+    }
+}
+
+// Re-arm receives that stopped for lack of buffers, as far as buffers allow
+void uring_rearm_starved(Reactor* reactor) {
+    Uring* u = reactor->uring;
+    int kept = 0;
+
+    for (int i = 0; i < u->rearm_count; i++) {
+        Client* client = lookup_client(reactor, u->rearm_fds[i], u->rearm_generations[i]);
+        if (!client || client->recv_armed) {
+            continue;
+        }
+        if (u->buffers_free > 0) {
+            uring_arm_recv(reactor, client);
+        } else {
+            u->rearm_fds[kept] = u->rearm_fds[i];
+            u->rearm_generations[kept] = u->rearm_generations[i];
+            kept++;
+        }
+    }
+    u->rearm_count = kept;
+}
+
+void uring_event_loop(Reactor* reactor) {
+    Uring* u = reactor->uring;
+
+    uring_arm_accept(reactor);
+    if (reactor->timer_fd >= 0) {
+        uring_arm_timer(reactor);
+    }
+
+    while (running) {
+        // One syscall submits everything queued and waits for completions
+        if (uring_submit(reactor, 1, 1000) == -1) {
+            break;
+        }
+
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            struct io_uring_cqe cqe = u->cqes[head & *u->cq_mask];
+            head++;
+
+            int op = (int)(cqe.user_data & 0xF);
+            unsigned bid = (unsigned)((cqe.user_data >> 4) & 0xFFFF);
+            int fd = (int)((cqe.user_data >> 20) & 0xFFFFF);
+            uint32_t generation = (uint32_t)(cqe.user_data >> 40);
+
+            switch (op) {
+                case URING_OP_ACCEPT: uring_handle_accept(reactor, &cqe); break;
+                case URING_OP_RECV:   uring_handle_recv(reactor, &cqe, fd, generation); break;
+                case URING_OP_SEND:   uring_handle_send(reactor, &cqe, fd, generation, bid); break;
+                case URING_OP_TIMER:
+                    reactor_run_timers(reactor);
+                    if (running) {
+                        uring_arm_timer(reactor);
+                    }
+                    break;
+                default: break;
+            }
+
+            // Release CQ slots as we go; handlers may submit and trigger more completions
+            __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+            if (head == tail) {
+                tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+            }
+        }
+
+        if (u->rearm_count > 0) {
+            uring_rearm_starved(reactor);
+        }
+    }
+}
+
+int uring_setup_reactor(Reactor* reactor) {
+    Uring* u = (Uring*)malloc(sizeof(Uring));
+    if (!u) {
+        return -1;
+    }
+
+    if (uring_setup(u, URING_ENTRIES, URING_BUFFERS, max_clients) == -1) {
+        fprintf(stderr, "Reactor %d: io_uring setup failed (%s), using epoll\n",
+                reactor->id, strerror(errno));
+        free(u);
+        return -1;
+    }
+
+    reactor->uring = u;
+    return 0;
+}
+
+void uring_teardown_reactor(Reactor* reactor) {
+    // Closing the ring cancels whatever is still in flight
+    uring_teardown(reactor->uring);
+    free(reactor->uring);
+    reactor->uring = NULL;
+}
+
+// Check that the kernel supports everything the backend relies on by running a
+// multishot recv with a provided buffer on a socketpair (needs Linux 6.0+).
+// Returns 1 if usable, otherwise 0 with the reason in errno.
+int io_uring_usable() {
+    Reactor probe;
+    Uring u;
+    int sv[2];
+    int usable = 0;
+
+    memset(&probe, 0, sizeof(probe));
+    if (uring_setup(&u, 8, 8, 1) == -1) {
+        return 0;
+    }
+    probe.uring = &u;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        uring_teardown(&u);
+        return 0;
+    }
+
+    struct io_uring_sqe* sqe = uring_get_sqe(&probe);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+
+    if (write(sv[1], "x", 1) == 1 && uring_submit(&probe, 1, 1000) == 0) {
+        unsigned head = *u.cq_head;
+        if (head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &u.cqes[head & *u.cq_mask];
+            usable = (cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) &&
+                      (cqe->flags & IORING_CQE_F_BUFFER));
+            if (!usable) {
+                errno = cqe->res < 0 ? -cqe->res : EOPNOTSUPP;
+            }
+        } else {
+            errno = ETIME;
+        }
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    uring_teardown(&u);
+    return usable;
+}
+
+#else
+
+// Built against kernel headers without multishot recv: epoll only
+int io_uring_usable() {
+    errno = ENOSYS;
+    return 0;
+}
+int uring_setup_reactor(Reactor* reactor) { return -1; }
+void uring_event_loop(Reactor* reactor) {}
+void uring_teardown_reactor(Reactor* reactor) {}
+
+#endif
+
+// ----- Green threads -----
+// BACKEND_GREEN runs every connection as a coroutine with its own small stack,
+// written as straight-line blocking code. green_read(), green_write(),
+// green_accept() and green_sleep() try the non-blocking call first; when it
+// would block they park the coroutine and switch to the reactor's scheduler,
+// which runs whatever is runnable and otherwise sleeps in epoll_wait(). Each
+// reactor thread schedules its own coroutines (M coroutines on N reactor
+// threads); a coroutine never moves to another thread.
+// Sockets are added to epoll once, edge-triggered for both directions, so
+// parking costs no epoll_ctl(). A coroutine always retries its call before
+// parking again, so no edge is lost.
+// Stacks come from a per-reactor StackPool: each has a PROT_NONE guard page, so
+// an overflow faults instead of corrupting a neighbour, and a finished
+// connection's stack is recycled for the next accept() without mmap()/munmap().
+
+// co_switch() and the stack pool come from 03_co_routines (co_switch.h)
+#ifdef HAVE_ASM_SWITCH
+
+typedef struct {
+    void* sp;
+} GreenContext;
+
+void green_context_init(GreenContext* context, char* stack, size_t size,
+                        void (*entry)(void*), void* arg) {
+    context->sp = switch_frame_init(stack, size, entry, arg);
+}
+
+static inline void green_context_switch(GreenContext* from, GreenContext* to) {
+    co_switch(&from->sp, to->sp);
+}
+
+#else
+
+// Other architectures fall back to ucontext
+#include <ucontext.h>
+
+typedef struct {
+    ucontext_t uc;
+} GreenContext;
+
+void green_context_init(GreenContext* context, char* stack, size_t size,
+                        void (*entry)(void*), void* arg) {
+    getcontext(&context->uc);
+    context->uc.uc_stack.ss_sp = stack;
+    context->uc.uc_stack.ss_size = size;
+    context->uc.uc_link = NULL;
+    // The entry finds its coroutine through the scheduler, arg is not needed
+    (void)arg;
+    makecontext(&context->uc, (void (*)(void))entry, 0);
+}
+
+static inline void green_context_switch(GreenContext* from, GreenContext* to) {
+    swapcontext(&from->uc, &to->uc);
+}
+
+#endif
+
+typedef struct GreenThread {
+    GreenContext context;
+    char* stack;
+    void (*entry)(void* arg);
+    void* arg;
+    int fd;                         // Socket to close if the server stops first, -1 if none
+    int done;
+    uint64_t wake_ms;               // green_sleep() deadline
+    struct GreenThread* next;       // Run queue
+    struct GreenThread* all_prev;   // Every live coroutine of the scheduler
+    struct GreenThread* all_next;
+} GreenThread;
+
+typedef struct {
+    Reactor* reactor;
+    GreenContext context;           // The scheduler loop itself
+    GreenThread* current;
+    GreenThread* run_head;
+    GreenThread* run_tail;
+    GreenThread* all;
+    GreenThread** waiting;          // Indexed by fd: the coroutine parked on it
+    uint32_t* waiting_events;       // What it waits for
+    GreenThread** sleepers;         // Min-heap on wake_ms
+    int sleeper_count;
+    int sleeper_capacity;
+    StackPool stacks;
+} GreenScheduler;
+
+static __thread GreenScheduler* green;
+
+void green_sleep(int ms);
+
+void green_make_runnable(GreenThread* gt) {
+    gt->next = NULL;
+    if (green->run_tail) {
+        green->run_tail->next = gt;
+    } else {
+        green->run_head = gt;
+    }
+    green->run_tail = gt;
+}
+
+// Back to the scheduler; the caller has arranged for someone to wake it
+void green_park() {
+    GreenThread* self = green->current;
+    green_context_switch(&self->context, &green->context);
+}
+
+void green_yield() {
+    green_make_runnable(green->current);
+    green_park();
+}
+
+void green_entry(void* arg) {
+    (void)arg;
+    GreenThread* self = green->current;
+    self->entry(self->arg);
+    self->done = 1;
+    green_park();
+}
+
+GreenThread* green_spawn(void (*entry)(void* arg), void* arg, int fd) {
+    char* stack = stack_alloc(&green->stacks);
+    if (!stack) {
+        return NULL;
+    }
+    // The GreenThread lives at the top of its own stack, above the first frame,
+    // so a connection costs one pooled stack and no malloc()
+    size_t usable = (green->stacks.stack_size - sizeof(GreenThread)) & ~(size_t)15;
+    GreenThread* gt = (GreenThread*)(stack + usable);
+    memset(gt, 0, sizeof(*gt));
+    gt->stack = stack;
+    gt->entry = entry;
+    gt->arg = arg;
+    gt->fd = fd;
+    green_context_init(&gt->context, stack, usable, green_entry, NULL);
+
+    gt->all_next = green->all;
+    if (green->all) {
+        green->all->all_prev = gt;
+    }
+    green->all = gt;
+    green_make_runnable(gt);
+    return gt;
+}
+
+void green_free(GreenThread* gt) {
+    if (gt->all_prev) {
+        gt->all_prev->all_next = gt->all_next;
+    } else {
+        green->all = gt->all_next;
+    }
+    if (gt->all_next) {
+        gt->all_next->all_prev = gt->all_prev;
+    }
+    // gt is on the stack, gone once it is released
+    stack_release(&green->stacks, gt->stack);
+}
+
+// Park until fd reports one of events (or an error/hangup)
+void green_wait_fd(int fd, uint32_t events) {
+    green->waiting[fd] = green->current;
+    green->waiting_events[fd] = events;
+    green_park();
+}
+
+// Watch a socket for the rest of its life
+int green_register(int fd) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = (uint64_t)fd;
+    green->reactor->syscalls++;
+    return epoll_ctl(green->reactor->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+ssize_t green_read(int fd, void* buffer, size_t size) {
+    Reactor* reactor = green->reactor;
+    while (1) {
+        ssize_t n = read(fd, buffer, size);
+        reactor->syscalls++;
+        if (n >= 0) {
+            reactor->bytes_read += n;
+            return n;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        green_wait_fd(fd, EPOLLIN);
+    }
+}
+
+// Writes everything, parking whenever the socket buffer is full
+ssize_t green_write(int fd, const void* buffer, size_t size) {
+    Reactor* reactor = green->reactor;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, (const char*)buffer + written, size - written);
+        reactor->syscalls++;
+        if (n >= 0) {
+            written += n;
+            reactor->bytes_written += n;
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        green_wait_fd(fd, EPOLLOUT);
+    }
+    return (ssize_t)written;
+}
+
+int green_accept(int listen_fd) {
+    Reactor* reactor = green->reactor;
+    while (running) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        reactor->syscalls++;
+        if (fd >= 0) {
+            return fd;
+        }
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            reactor->accept_errors++;
+            if (!quiet) {
+                perror("accept4");
+            }
+            // Out of fds, say: give the other coroutines a chance to close some
+            green_sleep(100);
+            continue;
+        }
+        reactor->accept_wakeups++;
+        green_wait_fd(listen_fd, EPOLLIN);
+    }
+    return -1;
+}
+
+void green_sleeper_swap(int a, int b) {
+    GreenThread* t = green->sleepers[a];
+    green->sleepers[a] = green->sleepers[b];
+    green->sleepers[b] = t;
+}
+
+void green_sleep(int ms) {
+    if (green->sleeper_count == green->sleeper_capacity) {
+        int capacity = green->sleeper_capacity ? green->sleeper_capacity * 2 : 64;
+        GreenThread** sleepers = (GreenThread**)realloc(green->sleepers,
+                                                        capacity * sizeof(GreenThread*));
+        if (!sleepers) {
+            green_yield();
+            return;
+        }
+        green->sleepers = sleepers;
+        green->sleeper_capacity = capacity;
+    }
+
+    GreenThread* self = green->current;
+    self->wake_ms = monotonic_ms() + ms;
+    int i = green->sleeper_count++;
+    green->sleepers[i] = self;
+    while (i > 0 && green->sleepers[(i - 1) / 2]->wake_ms > self->wake_ms) {
+        green_sleeper_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    green_park();
+}
+
+// Make the sleepers that are due runnable; returns ms until the next one, -1 if none
+int green_wake_sleepers() {
+    uint64_t now = monotonic_ms();
+    while (green->sleeper_count > 0 && green->sleepers[0]->wake_ms <= now) {
+        green_make_runnable(green->sleepers[0]);
+        green->sleepers[0] = green->sleepers[--green->sleeper_count];
+        int i = 0;
+        while (1) {
+            int smallest = i;
+            int left = 2 * i + 1;
+            int right = left + 1;
+            if (left < green->sleeper_count &&
+                green->sleepers[left]->wake_ms < green->sleepers[smallest]->wake_ms) {
+                smallest = left;
+            }
+            if (right < green->sleeper_count &&
+                green->sleepers[right]->wake_ms < green->sleepers[smallest]->wake_ms) {
+                smallest = right;
+            }
+            if (smallest == i) {
+                break;
+            }
+            green_sleeper_swap(i, smallest);
+            i = smallest;
+        }
+    }
+    return green->sleeper_count > 0 ? (int)(green->sleepers[0]->wake_ms - now) : -1;
+}
+
+void green_close(int fd) {
+    Reactor* reactor = green->reactor;
+    green->waiting[fd] = NULL;
+    green->current->fd = -1;
+    close(fd);  // Also drops it from the epoll set
+    reactor->syscalls++;
+    reactor->active_clients--;
+}
+
+// The whole echo server, one coroutine per connection
+void green_echo_client(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    char buffer[GREEN_BUFFER_SIZE];
+    ssize_t n;
+
+    while ((n = green_read(fd, buffer, sizeof(buffer))) > 0) {
+        if (green_write(fd, buffer, n) == -1) {
+            break;
+        }
+    }
+    green_close(fd);
+}
+
+void green_acceptor(void* arg) {
+    Reactor* reactor = (Reactor*)arg;
+    while (running) {
+        int fd = green_accept(reactor->listen_fd);
+        if (fd == -1) {
+            break;
+        }
+        if (fd >= max_clients) {
+            close(fd);
+            continue;
+        }
+        reactor->connections_accepted++;
+        reactor->active_clients++;
+        if (green_register(fd) == -1 ||
+            !green_spawn(green_echo_client, (void*)(intptr_t)fd, fd)) {
+            if (!quiet) {
+                perror("green: new connection");
+            }
+            close(fd);
+            reactor->active_clients--;
+        }
+    }
+}
+
+int green_setup(Reactor* reactor) {
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = shared_listener ? (EPOLLIN | EPOLLEXCLUSIVE) : (EPOLLIN | EPOLLET);
+    ev.data.u64 = (uint64_t)reactor->listen_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &ev) == -1) {
+        perror("epoll_ctl: server_fd");
+        close(reactor->epoll_fd);
+        reactor->epoll_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// The scheduler: run everything runnable, then wait for sockets and sleepers
+void green_event_loop(Reactor* reactor) {
+    GreenScheduler scheduler;
+    struct epoll_event events[MAX_EVENTS];
+
+    memset(&scheduler, 0, sizeof(scheduler));
+    scheduler.reactor = reactor;
+    scheduler.waiting = (GreenThread**)calloc(max_clients, sizeof(GreenThread*));
+    scheduler.waiting_events = (uint32_t*)calloc(max_clients, sizeof(uint32_t));
+    green = &scheduler;
+    if (!scheduler.waiting || !scheduler.waiting_events ||
+        stack_pool_init(&scheduler.stacks, GREEN_STACK_SIZE, GREEN_STACK_CACHE) == -1 ||
+        !green_spawn(green_acceptor, reactor, -1)) {
+        perror("green scheduler");
+        running = 0;
+    }
+
+    while (running) {
+        while (scheduler.run_head) {
+            GreenThread* gt = scheduler.run_head;
+            scheduler.run_head = gt->next;
+            if (!scheduler.run_head) {
+                scheduler.run_tail = NULL;
+            }
+            scheduler.current = gt;
+            green_context_switch(&scheduler.context, &gt->context);
+            scheduler.current = NULL;
+            if (gt->done) {
+                green_free(gt);
+            }
+        }
+
+        int timeout = green_wake_sleepers();
+        if (scheduler.run_head) {
+            continue;
+        }
+        if (timeout < 0 || timeout > 1000) {
+            timeout = 1000;     // Notice shutdown within a second
+        }
+        int nfds = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, timeout);
+        reactor->syscalls++;
+        if (nfds == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < nfds; i++) {
+            int fd = (int)events[i].data.u64;
+            GreenThread* gt = scheduler.waiting[fd];
+            if (gt && (events[i].events & (scheduler.waiting_events[fd] | EPOLLERR |
+                                           EPOLLHUP | EPOLLRDHUP))) {
+                scheduler.waiting[fd] = NULL;
+                green_make_runnable(gt);
+                reactor->events_handled++;
+            }
+        }
+    }
+
+    // Coroutines still parked never resume: close their sockets, drop their stacks
+    while (scheduler.all) {
+        GreenThread* gt = scheduler.all;
+        if (gt->fd >= 0) {
+            close(gt->fd);
+            reactor->active_clients--;
+        }
+        green_free(gt);
+    }
+    free(scheduler.waiting);
+    free(scheduler.waiting_events);
+    free(scheduler.sleepers);
+    stack_pool_destroy(&scheduler.stacks);
+    green = NULL;
+}
+
+// Server thread function: one reactor's event loop
+void* server_thread(void* arg) {
+    Reactor* reactor = (Reactor*)arg;
+
+    if (reactor->cpu >= 0 && pin_to_cpu(reactor->cpu) == -1) {
+        reactor->ready = -1;
+        return NULL;
+    }
+
+    reactor_pools_init(reactor);
+
+    if (http_root_fd >= 0) {
+        reactor->copy_buffer = (char*)malloc(HTTP_COPY_CHUNK);
+        if (!reactor->copy_buffer) {
+            perror("malloc copy buffer");
+            reactor->ready = -1;
+            return NULL;
+        }
+    }
+
+    reactor->clients = (Client**)calloc(max_clients, sizeof(Client*));
+    if (!reactor->clients) {
+        perror("calloc clients");
+        reactor->ready = -1;
+        return NULL;
+    }
+
+    reactor->listen_fd = shared_listener ? shared_listen_fd : create_listen_socket(1);
+    if (reactor->listen_fd == -1) {
+        reactor->ready = -1;
+        return NULL;
+    }
+
+    // Green threads have no timeouts, so they get no timerfd that nobody reads
+    int use_green = (backend == BACKEND_GREEN);
+    reactor->timer_fd = -1;
+    if (!use_green && reactor_timers_setup(reactor) == -1) {
+        if (!shared_listener) {
+            close(reactor->listen_fd);
+        }
+        reactor->ready = -1;
+        return NULL;
+    }
+
+    int use_uring = (backend == BACKEND_IO_URING && uring_setup_reactor(reactor) == 0);
+    if (!use_uring && (use_green ? green_setup(reactor) : epoll_setup(reactor)) == -1) {
+        if (reactor->timer_fd >= 0) {
+            close(reactor->timer_fd);
+        }
+        if (!shared_listener) {
+            close(reactor->listen_fd);
+        }
+        reactor->ready = -1;
+        return NULL;
+    }
+    
+    const char* name = use_uring ? "io_uring" : use_green ? "green threads" : "epoll";
+    if (reactor->cpu >= 0) {
+        printf("Reactor %d (%s) started on port %d, pinned to CPU %d (up to %d fds)\n",
+               reactor->id, name, SERVER_PORT, reactor->cpu, max_clients);
+    } else {
+        printf("Reactor %d (%s) started on port %d (up to %d fds)\n",
+               reactor->id, name, SERVER_PORT, max_clients);
+    }
+
+    reactor->ready = 1;
+
+    if (use_uring) {
+        uring_event_loop(reactor);
+    } else if (use_green) {
+        green_event_loop(reactor);
+    } else {
+        epoll_event_loop(reactor);
+    }
+    
+    // Close all client connections
+    for (int i = 0; i < max_clients; i++) {
+        if (reactor->clients[i]) {
+            close_client(reactor, reactor->clients[i]);
+        }
+    }
+    
+    if (!shared_listener) {
+        close(reactor->listen_fd);
+    }
+    if (reactor->epoll_fd >= 0) {
+        close(reactor->epoll_fd);
+    }
+    if (use_uring) {
+        uring_teardown_reactor(reactor);
+    }
+    if (reactor->timer_fd >= 0) {
+        close(reactor->timer_fd);
+    }
+    free(reactor->clients);
+    reactor->clients = NULL;
+    file_cache_clear(&reactor->files);
+    free(reactor->copy_buffer);
+    reactor->copy_buffer = NULL;
+    reactor_pools_destroy(reactor);
+    
+    return NULL;
+}
+
+// Start num_reactors reactor threads. cpus[] (ncpus entries) lists the CPUs to pin to,
+// round-robin; with no list, reactors are pinned to CPUs 0..N-1 when there is more than one.
+int start_reactors(const int* cpus, int ncpus) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (shared_listener) {
+        shared_listen_fd = create_listen_socket(0);
+        if (shared_listen_fd == -1) {
+            num_reactors = 0;
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < num_reactors; i++) {
+        Reactor* reactor = &reactors[i];
+        memset(reactor, 0, sizeof(Reactor));
+        reactor->id = i;
+        reactor->listen_fd = -1;
+        reactor->epoll_fd = -1;
+        reactor->inbox_fd = -1;
+
+        if (ncpus > 0) {
+            reactor->cpu = cpus[i % ncpus];
+        } else if (num_reactors > 1) {
+            reactor->cpu = i % (online > 0 ? online : 1);
+        } else {
+            reactor->cpu = -1;
+        }
+
+        // Every inbox has to exist before the first reactor can publish
+        if (protocol == PROTOCOL_PUBSUB && pubsub_setup(reactor) == -1) {
+            num_reactors = 0;
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < num_reactors; i++) {
+        Reactor* reactor = &reactors[i];
+        if (pthread_create(&reactor->thread, NULL, server_thread, reactor) != 0) {
+            perror("pthread_create: reactor");
+            return -1;
+        }
+
+        while (reactor->ready == 0) {
+            usleep(1000);
+        }
+        if (reactor->ready < 0) {
+            pthread_join(reactor->thread, NULL);
+            num_reactors = i;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void print_pubsub_counters() {
+    printf("Pub/sub: queue limit %d, slow subscribers %s\n", queue_limit,
+           slow_policy == SLOW_DROP ? "lose messages" : "are disconnected");
+    printf("%-8s %12s %12s %12s %10s %12s %12s\n", "reactor", "published", "deliveries",
+           "drops", "slow kicks", "peak queued", "subscribers");
+    for (int i = 0; i < num_reactors; i++) {
+        Reactor* r = &reactors[i];
+        printf("%-8d %12lu %12lu %12lu %10lu %12lu %12d\n", r->id, r->published, r->deliveries,
+               r->drops, r->slow_disconnects, r->peak_queued, r->subscriber_count);
+    }
+    printf("Peak message memory: %ld bytes\n", peak_message_bytes);
+}
+
+// How well accepts were batched (epoll backend; io_uring accepts are multishot)
+void print_accept_counters() {
+    printf("Listener: %s, backlog %d\n",
+           shared_listener ? "shared (EPOLLEXCLUSIVE)" : "per reactor (SO_REUSEPORT)", listen_backlog);
+    printf("%-8s %12s %12s %10s %10s %8s\n",
+           "reactor", "accepted", "wakeups", "avg batch", "max batch", "errors");
+    for (int i = 0; i < num_reactors; i++) {
+        Reactor* r = &reactors[i];
+        printf("%-8d %12lu %12lu %10.1f %10d %8lu\n", r->id, r->connections_accepted,
+               r->accept_wakeups,
+               r->accept_wakeups ? (double)r->connections_accepted / r->accept_wakeups : 0.0,
+               r->largest_accept_batch, r->accept_errors);
+    }
+}
+
+void print_pool_row(int reactor, const char* name, const SlabPool* pool) {
+    if (pool->high_water == 0) {
+        return;
+    }
+    printf("%-8d %-8s %8zu %10lu %10lu %6d %6d\n", reactor, name, pool->object_size,
+           pool->in_use, pool->high_water, pool->slab_count, pool->huge_slabs);
+}
+
+// Allocator counters per reactor and pool; unused pools are left out
+void print_pool_counters() {
+    printf("Allocator: %s%s\n", use_slab ? "slab" : "malloc",
+           use_slab && use_hugepages ? " (huge pages)" : "");
+    printf("%-8s %-8s %8s %10s %10s %6s %6s\n",
+           "reactor", "pool", "size", "in use", "high water", "slabs", "huge");
+    for (int i = 0; i < num_reactors; i++) {
+        Reactor* r = &reactors[i];
+        print_pool_row(r->id, "client", &r->client_pool);
+        for (int c = 0; c < BUFFER_CLASSES; c++) {
+            char name[16];
+            snprintf(name, sizeof(name), "ring%zuk", ((size_t)RING_INITIAL_CAPACITY << c) / 1024);
+            print_pool_row(r->id, name, &r->buffer_pools[c]);
+        }
+    }
+}
+
+// Stop all reactors and wait for their threads
+void join_reactors() {
+    running = 0;
+
+    for (int i = 0; i < num_reactors; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    if (shared_listen_fd >= 0) {
+        close(shared_listen_fd);
+        shared_listen_fd = -1;
+    }
+    for (int i = 0; i < num_reactors && protocol == PROTOCOL_PUBSUB; i++) {
+        pubsub_teardown(&reactors[i]);
+    }
+}
+
+// Stop all reactors and print per-reactor counters
+void stop_reactors() {
+    printf("Server shutting down...\n");
+    join_reactors();
+
+    printf("%-8s %6s %12s %12s %14s %14s %26s\n",
+           "reactor", "cpu", "accepted", "events", "bytes in", "bytes out",
+           "timeouts read/write/idle");
+    for (int i = 0; i < num_reactors; i++) {
+        Reactor* r = &reactors[i];
+        char timeouts[64];
+        snprintf(timeouts, sizeof(timeouts), "%lu/%lu/%lu", r->timeouts[TIMEOUT_READ],
+                 r->timeouts[TIMEOUT_WRITE], r->timeouts[TIMEOUT_KEEPALIVE]);
+        printf("%-8d %6d %12lu %12lu %14lu %14lu %26s\n",
+               r->id, r->cpu, r->connections_accepted, r->events_handled,
+               r->bytes_read, r->bytes_written, timeouts);
+    }
+
+    print_accept_counters();
+    if (protocol == PROTOCOL_PUBSUB) {
+        print_pubsub_counters();
+    }
+    print_pool_counters();
+    
+    printf("Server shutdown complete\n");
+}
+
+// Sum a counter over all reactors
+unsigned long total_events_handled() {
+    unsigned long total = 0;
+    for (int i = 0; i < num_reactors; i++) {
+        total += reactors[i].events_handled;
+    }
+    return total;
+}
+
+int total_active_clients() {
+    int total = 0;
+    for (int i = 0; i < num_reactors; i++) {
+        total += reactors[i].active_clients;
+    }
+    return total;
+}
+
+// Parse a CPU list like "0,2,4-7" into cpus[]; returns the number of entries or -1
+int parse_cpu_list(const char* list, int* cpus, int max) {
+    int count = 0;
+    const char* p = list;
+
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return -1;
+        }
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (count == max) {
+                return -1;
+            }
+            cpus[count++] = (int)cpu;
+        }
+        p = end;
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0') {
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+// ----- Benchmark: many idle connections plus a few hot ones -----
+
+volatile int bench_running = 0;
+size_t bench_message_size = BENCH_MESSAGE_SIZE;
+
+typedef struct {
+    int sockfd;
+    unsigned long round_trips;
+    double* latencies;      // Round trip times in microseconds (ring of BENCH_MAX_SAMPLES)
+} BenchClient;
+
+double get_time_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// Open a blocking connection to the local server
+int connect_to_server() {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(SERVER_PORT);
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
+        perror("connect");
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+// Send one message and read its echo back. Sending and receiving are interleaved
+// with poll(), so messages larger than the socket buffers cannot deadlock against
+// the server's backpressure. Returns -1 on error.
+int echo_round_trip(int sockfd, const char* send_buffer, char* recv_buffer) {
+    size_t sent = 0;
+    size_t received = 0;
+
+    while (received < bench_message_size) {
+        struct pollfd pfd;
+        pfd.fd = sockfd;
+        pfd.events = POLLIN | (sent < bench_message_size ? POLLOUT : 0);
+
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return -1;
+        }
+
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(sockfd, send_buffer + sent, bench_message_size - sent,
+                             MSG_DONTWAIT);
+            if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("send");
+                return -1;
+            }
+            if (n > 0) {
+                sent += n;
+            }
+        }
+
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(sockfd, recv_buffer + received, bench_message_size - received,
+                             MSG_DONTWAIT);
+            if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                perror("recv");
+                return -1;
+            }
+            if (n > 0) {
+                received += n;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Hot client: ping-pong fixed size messages as fast as the server answers.
+void* bench_hot_client(void* arg) {
+    BenchClient* bc = (BenchClient*)arg;
+    char* send_buffer = (char*)malloc(bench_message_size);
+    char* recv_buffer = (char*)malloc(bench_message_size);
+    if (!send_buffer || !recv_buffer) {
+        perror("malloc bench buffers");
+        free(send_buffer);
+        free(recv_buffer);
+        return NULL;
+    }
+    memset(send_buffer, 'x', bench_message_size);
+
+    while (bench_running) {
+        double start = get_time_sec();
+        if (echo_round_trip(bc->sockfd, send_buffer, recv_buffer) == -1) {
+            break;
+        }
+        bc->latencies[bc->round_trips % BENCH_MAX_SAMPLES] = (get_time_sec() - start) * 1e6;
+        bc->round_trips++;
+    }
+
+    free(send_buffer);
+    free(recv_buffer);
+    return NULL;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Sum the syscall counters of all reactors
+unsigned long total_syscalls() {
+    unsigned long total = 0;
+    for (int i = 0; i < num_reactors; i++) {
+        total += reactors[i].syscalls;
+    }
+    return total;
+}
+
+// Run the hot clients for a while and return server events per second
+double bench_phase(const char* label, BenchClient* hot_clients, int hot, int seconds) {
+    pthread_t tids[hot];
+
+    for (int i = 0; i < hot; i++) {
+        hot_clients[i].round_trips = 0;
+    }
+
+    unsigned long start_events = total_events_handled();
+    unsigned long start_syscalls = total_syscalls();
+    double start = get_time_sec();
+    bench_running = 1;
+
+    for (int i = 0; i < hot; i++) {
+        pthread_create(&tids[i], NULL, bench_hot_client, &hot_clients[i]);
+    }
+
+    sleep(seconds);
+    bench_running = 0;
+
+    unsigned long round_trips = 0;
+    for (int i = 0; i < hot; i++) {
+        pthread_join(tids[i], NULL);
+        round_trips += hot_clients[i].round_trips;
+    }
+
+    double elapsed = get_time_sec() - start;
+    double events_per_sec = (total_events_handled() - start_events) / elapsed;
+    unsigned long syscalls = total_syscalls() - start_syscalls;
+
+    // Merge the latency samples for percentiles
+    size_t count = 0;
+    double* samples = (double*)malloc(sizeof(double) * BENCH_MAX_SAMPLES * hot);
+    for (int i = 0; i < hot && samples; i++) {
+        size_t n = hot_clients[i].round_trips < BENCH_MAX_SAMPLES ?
+                   hot_clients[i].round_trips : BENCH_MAX_SAMPLES;
+        memcpy(samples + count, hot_clients[i].latencies, n * sizeof(double));
+        count += n;
+    }
+    double p50 = 0, p99 = 0;
+    if (count > 0) {
+        qsort(samples, count, sizeof(double), compare_doubles);
+        p50 = samples[count / 2];
+        p99 = samples[(size_t)(count * 0.99)];
+    }
+    free(samples);
+
+    printf("%-22s %11.0f %11.0f %9.1f %9.1f %9.1f %9.2f\n",
+           label, events_per_sec, round_trips / elapsed,
+           2.0 * round_trips * bench_message_size / elapsed / (1024 * 1024),
+           p50, p99, round_trips ? (double)syscalls / round_trips : 0.0);
+    return events_per_sec;
+}
+
+// Connections of a benchmark run: idle ones that never send and hot clients
+typedef struct {
+    int* idle_fds;
+    int opened;
+    BenchClient* hot_clients;
+    int hot_opened;
+} BenchConnections;
+
+// Open the connections and wait for the server to accept them all
+void bench_connect(BenchConnections* conns, int idle, int hot, BenchClient* hot_clients) {
+    // Both ends of every connection live in this process
+    int fit = (max_clients - BENCH_RESERVED_FDS) / 2 - hot;
+    if (idle > fit) {
+        printf("fd limit %d only fits %d idle connections (asked for %d)\n",
+               max_clients, fit, idle);
+        idle = fit > 0 ? fit : 0;
+    }
+
+    // Open the idle connections; they stay registered in epoll but never send
+    int* idle_fds = (int*)malloc(sizeof(int) * (idle > 0 ? idle : 1));
+    int opened = 0;
+    for (int i = 0; i < idle && running && idle_fds; i++) {
+        int fd = connect_to_server();
+        if (fd == -1) {
+            break;
+        }
+        idle_fds[opened++] = fd;
+    }
+
+    int hot_opened = 0;
+    for (int i = 0; i < hot; i++) {
+        hot_clients[i].latencies = (double*)malloc(sizeof(double) * BENCH_MAX_SAMPLES);
+        if (!hot_clients[i].latencies) {
+            perror("malloc latencies");
+            break;
+        }
+        hot_clients[i].sockfd = connect_to_server();
+        if (hot_clients[i].sockfd == -1) {
+            free(hot_clients[i].latencies);
+            break;
+        }
+        hot_opened++;
+    }
+
+    // Wait for the server to accept everything before measuring
+    while (running && total_active_clients() < opened + hot_opened) {
+        usleep(10000);
+    }
+
+    conns->idle_fds = idle_fds;
+    conns->opened = opened;
+    conns->hot_clients = hot_clients;
+    conns->hot_opened = hot_opened;
+}
+
+void bench_disconnect(BenchConnections* conns) {
+    for (int i = 0; i < conns->hot_opened; i++) {
+        close(conns->hot_clients[i].sockfd);
+        free(conns->hot_clients[i].latencies);
+    }
+    for (int i = 0; i < conns->opened; i++) {
+        close(conns->idle_fds[i]);
+    }
+    free(conns->idle_fds);
+}
+
+int run_benchmark(int idle, int hot, int seconds) {
+    BenchClient hot_clients[hot];
+    BenchConnections conns;
+    bench_connect(&conns, idle, hot, hot_clients);
+    int opened = conns.opened;
+    int hot_opened = conns.hot_opened;
+
+    printf("Benchmark: %d idle + %d hot connections, %d s per run, %zu byte messages\n",
+           opened, hot_opened, seconds, bench_message_size);
+
+    printf("%-22s %11s %11s %9s %9s %9s %9s\n",
+           "", "events/s", "requests/s", "MB/s", "p50 us", "p99 us", "sys/req");
+    linear_lookup = 1;
+    double before = bench_phase("before (linear scan)", hot_clients, hot_opened, seconds);
+    linear_lookup = 0;
+    double after = bench_phase("after (fd table)", hot_clients, hot_opened, seconds);
+
+    if (before > 0) {
+        printf("Speedup: %.2fx\n", after / before);
+    }
+
+    bench_disconnect(&conns);
+    return 0;
+}
+
+// ----- Benchmark: green threads versus callbacks -----
+// The same idle + hot echo load against the callback server on epoll and the
+// coroutine server, each started fresh. Memory is the growth of this process's
+// resident set from opening the connections, the client side included.
+
+long resident_kb() {
+    long size = 0, pages = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &size, &pages) != 2) {
+            pages = 0;
+        }
+        fclose(f);
+    }
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int run_green_benchmark(const int* cpus, int ncpus, int idle, int hot, int seconds) {
+    const Backend backends[] = { BACKEND_EPOLL, BACKEND_GREEN };
+    const char* labels[] = { "callbacks (epoll)", "green threads" };
+    long rss[2] = { 0, 0 };
+    int connections[2] = { 0, 0 };
+
+    for (int b = 0; b < 2; b++) {
+        backend = backends[b];
+        running = 1;
+        if (start_reactors(cpus, ncpus) == -1) {
+            join_reactors();
+            return -1;
+        }
+
+        long before = resident_kb();
+        BenchClient hot_clients[hot];
+        BenchConnections conns;
+        bench_connect(&conns, idle, hot, hot_clients);
+        rss[b] = resident_kb() - before;
+        connections[b] = conns.opened + conns.hot_opened;
+
+        if (b == 0) {
+            printf("Benchmark: %d idle + %d hot connections, %d s per run, %zu byte messages\n",
+                   conns.opened, conns.hot_opened, seconds, bench_message_size);
+            printf("%-22s %11s %11s %9s %9s %9s %9s\n",
+                   "", "events/s", "requests/s", "MB/s", "p50 us", "p99 us", "sys/req");
+        }
+        bench_phase(labels[b], conns.hot_clients, conns.hot_opened, seconds);
+        bench_disconnect(&conns);
+        join_reactors();
+    }
+
+    printf("\n%-22s %12s %14s\n", "memory", "RSS growth", "per connection");
+    for (int b = 0; b < 2; b++) {
+        printf("%-22s %9ld KB %11.1f KB\n", labels[b], rss[b],
+               connections[b] ? (double)rss[b] / connections[b] : 0.0);
+    }
+    return 0;
+}
+
+// ----- Benchmark: connection churn -----
+// Stresses the allocator: every connection allocates a Client and a ring buffer
+// on the server and frees them again. Run it once with --allocator malloc and
+// once with the default slab allocator to compare.
+
+// Churn client: connect, echo one message, close, as fast as possible.
+// SO_LINGER with a zero timeout closes with RST, so no TIME_WAIT sockets pile up
+// and the ephemeral ports last for the whole run.
+void* bench_churn_client(void* arg) {
+    BenchClient* bc = (BenchClient*)arg;
+    char* send_buffer = (char*)malloc(bench_message_size);
+    char* recv_buffer = (char*)malloc(bench_message_size);
+    if (!send_buffer || !recv_buffer) {
+        perror("malloc bench buffers");
+        free(send_buffer);
+        free(recv_buffer);
+        return NULL;
+    }
+    memset(send_buffer, 'x', bench_message_size);
+
+    struct linger linger = {1, 0};
+    while (bench_running) {
+        double start = get_time_sec();
+        int sockfd = connect_to_server();
+        if (sockfd == -1) {
+            break;
+        }
+        setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        int ret = echo_round_trip(sockfd, send_buffer, recv_buffer);
+        close(sockfd);
+        if (ret == -1) {
+            break;
+        }
+        bc->latencies[bc->round_trips % BENCH_MAX_SAMPLES] = (get_time_sec() - start) * 1e6;
+        bc->round_trips++;
+    }
+
+    free(send_buffer);
+    free(recv_buffer);
+    return NULL;
+}
+
+int run_churn_benchmark(int threads, int seconds) {
+    BenchClient clients[threads];
+    pthread_t tids[threads];
+    int started = 0;
+
+    printf("Churn benchmark: %d threads, %d s, %zu byte messages, %s allocator\n",
+           threads, seconds, bench_message_size, use_slab ? "slab" : "malloc");
+
+    double start = get_time_sec();
+    bench_running = 1;
+    for (int i = 0; i < threads; i++) {
+        clients[i].sockfd = -1;
+        clients[i].round_trips = 0;
+        clients[i].latencies = (double*)malloc(sizeof(double) * BENCH_MAX_SAMPLES);
+        if (!clients[i].latencies) {
+            perror("malloc latencies");
+            break;
+        }
+        pthread_create(&tids[i], NULL, bench_churn_client, &clients[i]);
+        started++;
+    }
+
+    sleep(seconds);
+    bench_running = 0;
+
+    unsigned long connections = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+        connections += clients[i].round_trips;
+    }
+    double elapsed = get_time_sec() - start;
+
+    size_t count = 0;
+    double* samples = (double*)malloc(sizeof(double) * BENCH_MAX_SAMPLES * threads);
+    for (int i = 0; i < started && samples; i++) {
+        size_t n = clients[i].round_trips < BENCH_MAX_SAMPLES ?
+                   clients[i].round_trips : BENCH_MAX_SAMPLES;
+        memcpy(samples + count, clients[i].latencies, n * sizeof(double));
+        count += n;
+    }
+    double p50 = 0, p99 = 0;
+    if (count > 0) {
+        qsort(samples, count, sizeof(double), compare_doubles);
+        p50 = samples[count / 2];
+        p99 = samples[(size_t)(count * 0.99)];
+    }
+    free(samples);
+
+    printf("%12s %12s %9s %9s\n", "connections", "conns/s", "p50 us", "p99 us");
+    printf("%12lu %12.0f %9.1f %9.1f\n", connections, connections / elapsed, p50, p99);
+
+    // Let the server see the last resets before the pool counters are printed
+    for (int i = 0; i < 100 && total_active_clients() > 0; i++) {
+        usleep(10000);
+    }
+
+    for (int i = 0; i < started; i++) {
+        free(clients[i].latencies);
+    }
+    return 0;
+}
+
+// ----- Benchmark: connect storm -----
+// Open loop: each thread starts connections on a fixed schedule whether or not the
+// earlier ones have been served, so a slow accept path shows up as queueing and,
+// once the backlog is full, as accept queue overflows. Each connection sends one
+// byte and closes with RST once the echo arrives. Accept latency is measured from
+// connect() completing, when the connection sits in the accept queue, to the echo
+// arriving, so it includes one echo round trip.
+
+#define STORM_RATE 50000
+
+typedef struct {
+    double rate;                // Connects per second for this thread
+    int max_in_flight;
+    unsigned long attempted;
+    unsigned long completed;
+    unsigned long failed;
+    unsigned long skipped;      // Not started because max_in_flight was reached
+    double* latencies;          // Microseconds (ring of BENCH_MAX_SAMPLES)
+} StormClient;
+
+// Read the listen queue counters from /proc/net/netstat
+int read_listen_overflows(unsigned long* overflows, unsigned long* drops) {
+    FILE* f = fopen("/proc/net/netstat", "r");
+    if (!f) {
+        return -1;
+    }
+
+    char names[4096];
+    char values[4096];
+    int found = -1;
+    while (fgets(names, sizeof(names), f) && fgets(values, sizeof(values), f)) {
+        if (strncmp(names, "TcpExt:", 7) != 0) {
+            continue;
+        }
+        char* name_save;
+        char* value_save;
+        char* name = strtok_r(names, " \n", &name_save);
+        char* value = strtok_r(values, " \n", &value_save);
+        while (name && value) {
+            if (strcmp(name, "ListenOverflows") == 0) {
+                *overflows = strtoul(value, NULL, 10);
+                found = 0;
+            } else if (strcmp(name, "ListenDrops") == 0) {
+                *drops = strtoul(value, NULL, 10);
+            }
+            name = strtok_r(NULL, " \n", &name_save);
+            value = strtok_r(NULL, " \n", &value_save);
+        }
+    }
+
+    fclose(f);
+    return found;
+}
+
+void* bench_storm_client(void* arg) {
+    StormClient* sc = (StormClient*)arg;
+    double* connected_at = (double*)calloc(max_clients, sizeof(double));  // By fd, 0 while connecting
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!connected_at || epoll_fd == -1) {
+        perror("storm setup");
+        free(connected_at);
+        if (epoll_fd != -1) {
+            close(epoll_fd);
+        }
+        return NULL;
+    }
+
+    struct linger linger = {1, 0};
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(SERVER_PORT);
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    struct epoll_event events[MAX_EVENTS];
+    int in_flight = 0;
+    double interval = 1.0 / sc->rate;
+    double next = get_time_sec();
+
+    while (bench_running) {
+        // Start every connection that is due
+        double now = get_time_sec();
+        while (next <= now) {
+            next += interval;
+            if (in_flight >= sc->max_in_flight) {
+                sc->skipped++;
+                continue;
+            }
+
+            sc->attempted++;
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd == -1 || fd >= max_clients) {
+                sc->failed++;
+                if (fd != -1) {
+                    close(fd);
+                }
+                continue;
+            }
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+            if (connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1 &&
+                errno != EINPROGRESS) {
+                sc->failed++;
+                close(fd);
+                continue;
+            }
+
+            struct epoll_event ev;
+            ev.events = EPOLLOUT;
+            ev.data.fd = fd;
+            connected_at[fd] = 0;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+            in_flight++;
+        }
+
+        int timeout = (int)((next - get_time_sec()) * 1000);
+        int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout > 0 ? timeout : 0);
+
+        for (int i = 0; i < nfds; i++) {
+            int fd = events[i].data.fd;
+            int done = 0;
+            now = get_time_sec();
+
+            if (connected_at[fd] == 0) {
+                // Handshake finished: the connection is now in the accept queue
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0 || send(fd, "x", 1, MSG_NOSIGNAL) != 1) {
+                    sc->failed++;
+                    done = 1;
+                } else {
+                    connected_at[fd] = now;
+                    struct epoll_event ev;
+                    ev.events = EPOLLIN;
+                    ev.data.fd = fd;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+                }
+            } else {
+                char byte;
+                if (recv(fd, &byte, 1, 0) == 1) {
+                    sc->latencies[sc->completed % BENCH_MAX_SAMPLES] = (now - connected_at[fd]) * 1e6;
+                    sc->completed++;
+                } else {
+                    sc->failed++;
+                }
+                done = 1;
+            }
+
+            if (done) {
+                close(fd);  // Also removes it from the epoll set
+                in_flight--;
+            }
+        }
+    }
+
+    // Abandon whatever is still in flight
+    for (int fd = 0; fd < max_clients && in_flight > 0; fd++) {
+        struct epoll_event ev;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev) == 0) {
+            close(fd);
+            in_flight--;
+        }
+    }
+
+    close(epoll_fd);
+    free(connected_at);
+    return NULL;
+}
+
+int run_storm_benchmark(int threads, int seconds, double rate) {
+    StormClient clients[threads];
+    pthread_t tids[threads];
+    int started = 0;
+    unsigned long overflows_before = 0, drops_before = 0;
+    int have_counters = (read_listen_overflows(&overflows_before, &drops_before) == 0);
+
+    printf("Connect storm: %d threads, %.0f connects/s, %d s, %d reactors, listener %s, backlog %d\n",
+           threads, rate, seconds, num_reactors, shared_listener ? "shared" : "reuseport",
+           listen_backlog);
+
+    double start = get_time_sec();
+    bench_running = 1;
+    for (int i = 0; i < threads; i++) {
+        memset(&clients[i], 0, sizeof(StormClient));
+        clients[i].rate = rate / threads;
+        // Both ends of every connection live in this process
+        clients[i].max_in_flight = (max_clients - BENCH_RESERVED_FDS) / 2 / threads;
+        clients[i].latencies = (double*)malloc(sizeof(double) * BENCH_MAX_SAMPLES);
+        if (!clients[i].latencies) {
+            perror("malloc latencies");
+            break;
+        }
+        pthread_create(&tids[i], NULL, bench_storm_client, &clients[i]);
+        started++;
+    }
+
+    sleep(seconds);
+    bench_running = 0;
+
+    StormClient total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+        total.attempted += clients[i].attempted;
+        total.completed += clients[i].completed;
+        total.failed += clients[i].failed;
+        total.skipped += clients[i].skipped;
+    }
+    double elapsed = get_time_sec() - start;
+
+    size_t count = 0;
+    double* samples = (double*)malloc(sizeof(double) * BENCH_MAX_SAMPLES * threads);
+    for (int i = 0; i < started && samples; i++) {
+        size_t n = clients[i].completed < BENCH_MAX_SAMPLES ? clients[i].completed : BENCH_MAX_SAMPLES;
+        memcpy(samples + count, clients[i].latencies, n * sizeof(double));
+        count += n;
+    }
+    double p50 = 0, p99 = 0, p999 = 0, max = 0;
+    if (count > 0) {
+        qsort(samples, count, sizeof(double), compare_doubles);
+        p50 = samples[count / 2];
+        p99 = samples[(size_t)(count * 0.99)];
+        p999 = samples[(size_t)(count * 0.999)];
+        max = samples[count - 1];
+    }
+    free(samples);
+
+    printf("%10s %10s %8s %8s %11s %9s %9s %9s %9s\n", "attempted", "completed", "failed",
+           "skipped", "connects/s", "p50 us", "p99 us", "p99.9 us", "max us");
+    printf("%10lu %10lu %8lu %8lu %11.0f %9.1f %9.1f %9.1f %9.1f\n", total.attempted,
+           total.completed, total.failed, total.skipped, total.completed / elapsed,
+           p50, p99, p999, max);
+
+    unsigned long overflows_after = 0, drops_after = 0;
+    if (have_counters && read_listen_overflows(&overflows_after, &drops_after) == 0) {
+        printf("Accept queue overflows: %lu (listen drops %lu)\n",
+               overflows_after - overflows_before, drops_after - drops_before);
+    } else {
+        printf("Accept queue overflows: unavailable (/proc/net/netstat)\n");
+    }
+
+    for (int i = 0; i < started; i++) {
+        free(clients[i].latencies);
+    }
+    return 0;
+}
+
+// ----- Benchmark: HTTP static files -----
+// Keep-alive clients fetch the same file over and over, first with the body
+// copied through user space (pread()+send()) and then with sendfile().
+// Server CPU is the CPU time of the reactor threads during the run.
+
+#define HTTP_BENCH_RECV_BUFFER (256 * 1024)
+
+typedef struct {
+    const char* name;
+    size_t size;
+} HttpBenchFile;
+
+static const HttpBenchFile http_bench_files[] = {
+    { "4k.bin", 4 * 1024 },
+    { "1m.bin", 1024 * 1024 },
+    { "100m.bin", 100 * 1024 * 1024 },
+};
+
+char http_bench_dir[64];
+const char* http_bench_path;
+
+// Fetch one file over a keep-alive connection and discard the body.
+// Returns the body size, or -1 on error.
+long long http_get(int sockfd, const char* path, char* buffer, size_t size) {
+    char request[256];
+    int n = snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+    if (send(sockfd, request, n, MSG_NOSIGNAL) != n) {
+        return -1;
+    }
+
+    // Read until the end of the headers
+    size_t have = 0;
+    char* body;
+    for (;;) {
+        ssize_t got = recv(sockfd, buffer + have, size - have - 1, 0);
+        if (got <= 0) {
+            return -1;
+        }
+        have += got;
+        buffer[have] = '\0';
+        body = strstr(buffer, "\r\n\r\n");
+        if (body) {
+            break;
+        }
+    }
+
+    const char* length = strcasestr(buffer, "Content-Length:");
+    if (strncmp(buffer, "HTTP/1.1 200", 12) != 0 || !length) {
+        return -1;
+    }
+    long long total = strtoll(length + 15, NULL, 10);
+    long long received = (long long)(buffer + have - (body + 4));
+
+    while (received < total) {
+        ssize_t got = recv(sockfd, buffer, size, 0);
+        if (got <= 0) {
+            return -1;
+        }
+        received += got;
+    }
+    return total;
+}
+
+void* bench_http_client(void* arg) {
+    BenchClient* bc = (BenchClient*)arg;
+    char* buffer = (char*)malloc(HTTP_BENCH_RECV_BUFFER);
+    if (!buffer) {
+        perror("malloc bench buffer");
+        return NULL;
+    }
+
+    while (bench_running) {
+        double start = get_time_sec();
+        if (http_get(bc->sockfd, http_bench_path, buffer, HTTP_BENCH_RECV_BUFFER) == -1) {
+            fprintf(stderr, "GET /%s failed\n", http_bench_path);
+            break;
+        }
+        bc->latencies[bc->round_trips % BENCH_MAX_SAMPLES] = (get_time_sec() - start) * 1e6;
+        bc->round_trips++;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// CPU time used by the reactor threads so far, in seconds
+double reactor_cpu_time() {
+    double total = 0;
+    for (int i = 0; i < num_reactors; i++) {
+        clockid_t clock;
+        struct timespec ts;
+        if (pthread_getcpuclockid(reactors[i].thread, &clock) == 0 &&
+            clock_gettime(clock, &ts) == 0) {
+            total += ts.tv_sec + ts.tv_nsec / 1e9;
+        }
+    }
+    return total;
+}
+
+// Create the benchmark files in a fresh directory under /tmp and serve it
+int http_bench_prepare() {
+    strcpy(http_bench_dir, "/tmp/05_http_bench_XXXXXX");
+    if (!mkdtemp(http_bench_dir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+
+    char* chunk = (char*)malloc(1024 * 1024);
+    if (!chunk) {
+        perror("malloc");
+        return -1;
+    }
+    memset(chunk, 'a', 1024 * 1024);
+
+    for (size_t i = 0; i < sizeof(http_bench_files) / sizeof(http_bench_files[0]); i++) {
+        char path[128];
+        snprintf(path, sizeof(path), "%s/%s", http_bench_dir, http_bench_files[i].name);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            perror("open bench file");
+            free(chunk);
+            return -1;
+        }
+        size_t left = http_bench_files[i].size;
+        while (left > 0) {
+            size_t n = left < 1024 * 1024 ? left : 1024 * 1024;
+            if (write(fd, chunk, n) != (ssize_t)n) {
+                perror("write bench file");
+                close(fd);
+                free(chunk);
+                return -1;
+            }
+            left -= n;
+        }
+        close(fd);
+    }
+    free(chunk);
+
+    protocol = PROTOCOL_HTTP;
+    http_root_fd = open(http_bench_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (http_root_fd == -1) {
+        perror("open bench directory");
+        return -1;
+    }
+    return 0;
+}
+
+void http_bench_cleanup() {
+    for (size_t i = 0; i < sizeof(http_bench_files) / sizeof(http_bench_files[0]); i++) {
+        unlinkat(http_root_fd, http_bench_files[i].name, 0);
+    }
+    close(http_root_fd);
+    http_root_fd = -1;
+    rmdir(http_bench_dir);
+}
+
+int run_http_benchmark(int hot, int seconds) {
+    BenchClient clients[hot];
+    int opened = 0;
+
+    for (int i = 0; i < hot; i++) {
+        clients[i].latencies = (double*)malloc(sizeof(double) * BENCH_MAX_SAMPLES);
+        if (!clients[i].latencies) {
+            perror("malloc latencies");
+            break;
+        }
+        clients[i].sockfd = connect_to_server();
+        if (clients[i].sockfd == -1) {
+            free(clients[i].latencies);
+            break;
+        }
+        opened++;
+    }
+
+    printf("HTTP static files: %d keep-alive connections, %d s per run\n", opened, seconds);
+    printf("%-9s %-11s %11s %9s %10s %10s %9s\n",
+           "file", "body", "requests/s", "MB/s", "p50 us", "p99 us", "srv CPU");
+
+    for (size_t f = 0; f < sizeof(http_bench_files) / sizeof(http_bench_files[0]) && running; f++) {
+        for (int mode = 0; mode < 2 && running; mode++) {
+            pthread_t tids[opened];
+            body_mode = mode == 0 ? BODY_COPY : BODY_SENDFILE;
+            http_bench_path = http_bench_files[f].name;
+
+            for (int i = 0; i < opened; i++) {
+                clients[i].round_trips = 0;
+            }
+            double start_cpu = reactor_cpu_time();
+            double start = get_time_sec();
+            bench_running = 1;
+            for (int i = 0; i < opened; i++) {
+                pthread_create(&tids[i], NULL, bench_http_client, &clients[i]);
+            }
+
+            sleep(seconds);
+            bench_running = 0;
+
+            unsigned long requests = 0;
+            for (int i = 0; i < opened; i++) {
+                pthread_join(tids[i], NULL);
+                requests += clients[i].round_trips;
+            }
+            double elapsed = get_time_sec() - start;
+            double cpu = reactor_cpu_time() - start_cpu;
+
+            size_t count = 0;
+            double* samples = (double*)malloc(sizeof(double) * BENCH_MAX_SAMPLES * opened);
+            for (int i = 0; i < opened && samples; i++) {
+                size_t n = clients[i].round_trips < BENCH_MAX_SAMPLES ?
+                           clients[i].round_trips : BENCH_MAX_SAMPLES;
+                memcpy(samples + count, clients[i].latencies, n * sizeof(double));
+                count += n;
+            }
+            double p50 = 0, p99 = 0;
+            if (count > 0) {
+                qsort(samples, count, sizeof(double), compare_doubles);
+                p50 = samples[count / 2];
+                p99 = samples[(size_t)(count * 0.99)];
+            }
+            free(samples);
 
-    // Initialize clients array
-    memset(clients, 0, sizeof(clients));
-    
-    // Event loop
-    while (running) {
-        int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 1000);  // 1 second timeout
-        if (nfds == -1) {
-            if (errno == EINTR) {
-                // Interrupted system call (signal), just retry
-                continue;
+            printf("%-9s %-11s %11.0f %9.1f %10.1f %10.1f %8.0f%%\n",
+                   http_bench_files[f].name, mode == 0 ? "read+write" : "sendfile",
+                   requests / elapsed,
+                   (double)requests * http_bench_files[f].size / elapsed / (1024 * 1024),
+                   p50, p99, 100.0 * cpu / elapsed);
+        }
+    }
+
+    for (int i = 0; i < opened; i++) {
+        close(clients[i].sockfd);
+        free(clients[i].latencies);
+    }
+    return 0;
+}
+
+// ----- Benchmark: pub/sub fan-out -----
+// One publisher sends timestamped messages at a fixed rate to N subscribers, read
+// by a few threads. Broadcast latency is the time from publishing a message to its
+// delivery to the last (non-slow) subscriber. 1% of the subscribers never read,
+// to show that slow subscribers do not hold the others up.
+
+#define PUBSUB_RATE 1000
+#define PUBSUB_BENCH_MIN_MESSAGE 16     // Sequence number and timestamp
+
+typedef struct {
+    int fd;
+    unsigned char header[4];
+    int header_have;
+    uint32_t payload;           // Payload bytes of the current frame
+    uint32_t payload_have;
+    unsigned char stamp[PUBSUB_BENCH_MIN_MESSAGE];
+} BenchSubscriber;
+
+typedef struct {
+    BenchSubscriber* subscribers;
+    int count;
+} BenchReader;
+
+uint64_t* pubsub_publish_ns;            // By sequence number
+int* pubsub_delivered;                  // Deliveries so far (atomic)
+uint64_t* pubsub_last_ns;               // Latest delivery (atomic max)
+unsigned long pubsub_max_messages;
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Parse whatever arrived on one subscriber and record completed messages
+void bench_subscriber_consume(BenchSubscriber* sub, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        if (sub->header_have < 4) {
+            sub->header[sub->header_have++] = *data++;
+            len--;
+            if (sub->header_have == 4) {
+                uint32_t length;
+                memcpy(&length, sub->header, 4);
+                sub->payload = ntohl(length);
+                sub->payload_have = 0;
             }
-            perror("epoll_wait");
-            break;
+            continue;
         }
-        
-        for (int i = 0; i < nfds; i++) {
-            if (events[i].data.fd == server_fd) {
-                // Accept new connections
-                struct sockaddr_in client_addr;
-                socklen_t client_len = sizeof(client_addr);
-                
-                while (running) {  // Accept all pending connections
-                    int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-                    if (client_fd == -1) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                            // No more connections to accept
-                            break;
-                        } else {
-                            perror("accept");
-                            break;
-                        }
-                    }
-                    
-                    // Set client socket to non-blocking
-                    if (set_nonblocking(client_fd) == -1) {
-                        close(client_fd);
-                        continue;
-                    }
-                    
-                    // Store client information
-                    char client_ip[INET_ADDRSTRLEN];
-                    inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-                    printf("New connection from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
-                    
-                    // Create client structure
-                    Client* client = create_client(client_fd);
-                    if (!client) {
-                        close(client_fd);
-                        continue;
-                    }
-                    
-                    // Add to clients array
-                    int slot = -1;
-                    for (int j = 0; j < MAX_CLIENTS; j++) {
-                        if (clients[j] == NULL) {
-                            clients[j] = client;
-                            slot = j;
-                            break;
-                        }
-                    }
-                    
-                    if (slot == -1) {
-                        // No available slots
-                        printf("Maximum clients reached, rejecting connection\n");
-                        close_client(client, epoll_fd);
-                        continue;
-                    }
-                    
-                    // Add client socket to epoll
-                    struct epoll_event ev;
-                    ev.events = EPOLLIN | EPOLLET;
-                    ev.data.fd = client_fd;
-                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
-                        perror("epoll_ctl: client_fd");
-                        close_client(client, epoll_fd);
-                        continue;
-                    }
-                }
-            } else {
-                // Handle client event
-                int fd = events[i].data.fd;
-                
-                // Find the client
-                Client* client = NULL;
-                for (int j = 0; j < MAX_CLIENTS; j++) {
-                    if (clients[j] && clients[j]->socket == fd) {
-                        client = clients[j];
-                        break;
-                    }
-                }
-                
-                if (!client) {
-                    // This shouldn't happen, but just in case
-                    printf("Unknown client socket: %d\n", fd);
-                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
-                    close(fd);
-                    continue;
-                }
-                
-                // Handle the event
-                if (events[i].events & EPOLLIN) {
-                    handle_read_event(client, epoll_fd);
-                }
-                
-                if (events[i].events & EPOLLOUT) {
-                    handle_write_event(client, epoll_fd);
-                }
-                
-                if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
-                    printf("Socket error or disconnect\n");
-                    close_client(client, epoll_fd);
+
+        size_t take = sub->payload - sub->payload_have;
+        if (take > len) {
+            take = len;
+        }
+        for (size_t i = 0; i < take && sub->payload_have + i < PUBSUB_BENCH_MIN_MESSAGE; i++) {
+            sub->stamp[sub->payload_have + i] = data[i];
+        }
+        sub->payload_have += take;
+        data += take;
+        len -= take;
+
+        if (sub->payload_have == sub->payload) {
+            uint64_t seq;
+            memcpy(&seq, sub->stamp, sizeof(seq));
+            if (seq < pubsub_max_messages) {
+                uint64_t now = monotonic_ns();
+                __atomic_add_fetch(&pubsub_delivered[seq], 1, __ATOMIC_RELAXED);
+                uint64_t last = __atomic_load_n(&pubsub_last_ns[seq], __ATOMIC_RELAXED);
+                while (now > last &&
+                       !__atomic_compare_exchange_n(&pubsub_last_ns[seq], &last, now, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
                 }
             }
+            sub->header_have = 0;
         }
     }
-    
-    // Cleanup
-    printf("Server shutting down...\n");
-    
-    // Close all client connections
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i]) {
-            close_client(clients[i], epoll_fd);
+}
+
+void* bench_pubsub_reader(void* arg) {
+    BenchReader* reader = (BenchReader*)arg;
+    unsigned char* buffer = (unsigned char*)malloc(64 * 1024);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!buffer || epoll_fd == -1) {
+        perror("pubsub reader setup");
+        free(buffer);
+        return NULL;
+    }
+
+    for (int i = 0; i < reader->count; i++) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &reader->subscribers[i];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reader->subscribers[i].fd, &ev);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (bench_running) {
+        int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < nfds; i++) {
+            BenchSubscriber* sub = (BenchSubscriber*)events[i].data.ptr;
+            ssize_t n;
+            while ((n = recv(sub->fd, buffer, 64 * 1024, MSG_DONTWAIT)) > 0) {
+                bench_subscriber_consume(sub, buffer, n);
+            }
+            if (n == 0) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sub->fd, NULL);
+            }
         }
     }
-    
-    close(server_fd);
+
     close(epoll_fd);
-    
-    printf("Server shutdown complete\n");
+    free(buffer);
     return NULL;
 }
 
-// Client thread function
-void* client_thread(void* arg) {
-    int client_id = *((int*)arg);
-    free(arg);
-    
-    // Wait for server to start
-    sleep(1);
-    
-    // Create client socket
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd == -1) {
-        perror("socket");
-        return NULL;
+// Publish numbered, timestamped messages at rate per second until told to stop.
+// Returns the number published.
+unsigned long bench_pubsub_publish(int sockfd, double rate) {
+    size_t frame_size = 4 + bench_message_size;
+    unsigned char* frame = (unsigned char*)calloc(1, frame_size);
+    if (!frame) {
+        perror("calloc frame");
+        return 0;
     }
-    
-    // Configure server address
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
-    
-    // Convert IP address from text to binary
-    if (inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr) <= 0) {
-        perror("inet_pton");
-        close(sockfd);
-        return NULL;
+    uint32_t length = htonl((uint32_t)bench_message_size);
+    memcpy(frame, &length, 4);
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    long interval = (long)(1e9 / rate);
+    unsigned long seq = 0;
+
+    while (bench_running && seq < pubsub_max_messages) {
+        uint64_t now = monotonic_ns();
+        pubsub_publish_ns[seq] = now;
+        memcpy(frame + 4, &seq, sizeof(uint64_t));
+        memcpy(frame + 12, &now, sizeof(uint64_t));
+        if (send(sockfd, frame, frame_size, MSG_NOSIGNAL) != (ssize_t)frame_size) {
+            perror("send publish");
+            break;
+        }
+        seq++;
+
+        next.tv_nsec += interval;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
     }
-    
-    // Connect to server
-    if (connect(sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        perror("connect");
-        close(sockfd);
-        return NULL;
+
+    free(frame);
+    return seq;
+}
+
+int total_subscribers() {
+    int total = 0;
+    for (int i = 0; i < num_reactors; i++) {
+        total += reactors[i].subscriber_count;
     }
-    
-    printf("Client %d connected to server\n", client_id);
-    
-    // Send requests to the server
-    char send_buffer[BUFFER_SIZE];
-    char recv_buffer[BUFFER_SIZE];
-    
-    for (int request = 0; request < MAX_REQUESTS_PER_CLIENT; request++) {
-        // Generate a message
-        snprintf(send_buffer, BUFFER_SIZE, "Hello from client %d, request %d", 
-                 client_id, request);
-        
-        // Send the message
-        ssize_t bytes_sent = send(sockfd, send_buffer, strlen(send_buffer), 0);
-        if (bytes_sent <= 0) {
-            perror("send");
+    return total;
+}
+
+int pubsub_bench_run(int subscribers, int readers, int seconds, double rate) {
+    int slow = subscribers / 100;
+    int fast = subscribers - slow;
+    BenchSubscriber* subs = (BenchSubscriber*)calloc(subscribers, sizeof(BenchSubscriber));
+    if (!subs) {
+        perror("calloc subscribers");
+        return -1;
+    }
+
+    // Subscribe everyone; the slow ones get a tiny receive buffer and are never read
+    int opened = 0;
+    static const unsigned char subscribe[4] = {0, 0, 0, 0};
+    for (int i = 0; i < subscribers && running; i++) {
+        int fd = connect_to_server();
+        if (fd == -1) {
             break;
         }
-        
-        printf("Client %d sent: %s\n", client_id, send_buffer);
-        
-        // Receive the response
-        ssize_t bytes_received = recv(sockfd, recv_buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_received <= 0) {
-            if (bytes_received == 0) {
-                printf("Server closed connection\n");
-            } else {
-                perror("recv");
-            }
+        if (i >= fast) {
+            int size = 4096;
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        }
+        if (send(fd, subscribe, 4, MSG_NOSIGNAL) != 4) {
+            close(fd);
             break;
         }
-        
-        // Null-terminate the received data
-        recv_buffer[bytes_received] = '\0';
-        
-        printf("Client %d received: %s\n", client_id, recv_buffer);
-        
-        // Wait a random time before the next request
-        usleep((rand() % 1000 + 500) * 1000);  // 500-1500ms
+        subs[opened++].fd = fd;
     }
-    
-    printf("Client %d finished\n", client_id);
-    close(sockfd);
-    
-    return NULL;
+    if (opened < subscribers) {
+        fast = opened - slow > 0 ? opened - slow : opened;
+    }
+    while (running && total_subscribers() < opened) {
+        usleep(10000);
+    }
+
+    pubsub_max_messages = (unsigned long)(rate * seconds) + 1;
+    pubsub_publish_ns = (uint64_t*)calloc(pubsub_max_messages, sizeof(uint64_t));
+    pubsub_delivered = (int*)calloc(pubsub_max_messages, sizeof(int));
+    pubsub_last_ns = (uint64_t*)calloc(pubsub_max_messages, sizeof(uint64_t));
+    int publisher = connect_to_server();
+    if (!pubsub_publish_ns || !pubsub_delivered || !pubsub_last_ns || publisher == -1) {
+        perror("pubsub bench setup");
+        return -1;
+    }
+
+    // Reset the server's peaks for this run
+    __atomic_store_n(&peak_message_bytes, __atomic_load_n(&message_bytes, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    unsigned long drops = 0, kicks = 0;
+    for (int i = 0; i < num_reactors; i++) {
+        reactors[i].peak_queued = reactors[i].queued;
+        drops += reactors[i].drops;
+        kicks += reactors[i].slow_disconnects;
+    }
+
+    BenchReader reader_args[readers];
+    pthread_t tids[readers];
+    int per_reader = (fast + readers - 1) / readers;
+    bench_running = 1;
+    for (int i = 0; i < readers; i++) {
+        int first = i * per_reader;
+        reader_args[i].subscribers = subs + (first < fast ? first : fast);
+        reader_args[i].count = first >= fast ? 0 : (fast - first < per_reader ? fast - first : per_reader);
+        pthread_create(&tids[i], NULL, bench_pubsub_reader, &reader_args[i]);
+    }
+
+    unsigned long published = bench_pubsub_publish(publisher, rate);
+
+    // Give the last messages time to arrive
+    usleep(200000);
+    bench_running = 0;
+    for (int i = 0; i < readers; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    size_t complete = 0;
+    double* samples = (double*)malloc(sizeof(double) * (published ? published : 1));
+    for (unsigned long seq = 0; seq < published && samples; seq++) {
+        if (pubsub_delivered[seq] >= fast) {
+            samples[complete++] = (pubsub_last_ns[seq] - pubsub_publish_ns[seq]) / 1000.0;
+        }
+    }
+    double p50 = 0, p99 = 0, max = 0;
+    if (complete > 0) {
+        qsort(samples, complete, sizeof(double), compare_doubles);
+        p50 = samples[complete / 2];
+        p99 = samples[(size_t)(complete * 0.99)];
+        max = samples[complete - 1];
+    }
+    free(samples);
+
+    unsigned long peak_queued = 0;
+    for (int i = 0; i < num_reactors; i++) {
+        peak_queued += reactors[i].peak_queued;
+        drops -= reactors[i].drops;
+        kicks -= reactors[i].slow_disconnects;
+    }
+    long peak_bytes = __atomic_load_n(&peak_message_bytes, __ATOMIC_RELAXED);
+
+    // Shared: the messages themselves plus one pointer per queue entry.
+    // Copied: what a private copy of the frame per subscriber would take.
+    printf("%11d %9lu %9zu %9.1f %9.1f %9.1f %8lu %6lu %11lu %9.1f %9zu\n",
+           opened, published, complete, p50, p99, max, -drops, -kicks, peak_queued,
+           peak_queued ? (double)peak_bytes / peak_queued + sizeof(Message*) : 0.0,
+           4 + bench_message_size);
+
+    close(publisher);
+    for (int i = 0; i < opened; i++) {
+        close(subs[i].fd);
+    }
+    while (running && total_subscribers() > 0) {
+        usleep(10000);
+    }
+    free(subs);
+    free(pubsub_publish_ns);
+    free(pubsub_delivered);
+    free(pubsub_last_ns);
+    return 0;
+}
+
+int run_pubsub_benchmark(int readers, int seconds, double rate) {
+    static const int sizes[] = { 1000, 10000 };
+
+    printf("Pub/sub fan-out: %zu byte messages at %.0f/s, %d s, %d reader threads, "
+           "1%% slow subscribers, queue limit %d (%s)\n",
+           bench_message_size, rate, seconds, readers, queue_limit,
+           slow_policy == SLOW_DROP ? "drop" : "disconnect");
+    printf("%11s %9s %9s %9s %9s %9s %8s %6s %11s %9s %9s\n", "subscribers", "messages",
+           "complete", "p50 us", "p99 us", "max us", "drops", "kicks", "peak queued",
+           "B/queued", "B/copy");
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && running; i++) {
+        // Both ends of every connection live in this process
+        int subscribers = sizes[i];
+        int fit = (max_clients - BENCH_RESERVED_FDS) / 2 - 1;
+        if (subscribers > fit) {
+            printf("fd limit %d only fits %d subscribers (asked for %d)\n",
+                   max_clients, fit, subscribers);
+            subscribers = fit;
+        }
+        if (pubsub_bench_run(subscribers, readers, seconds, rate) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// ----- Benchmark: timing wheel -----
+// Drives a wheel without sockets, so connection counts beyond the fd limit can be
+// simulated. Every timer has the same timeout; each tick a random 1% of them are
+// reset, as a read would, and the wheel advances one tick. Expired timers are
+// re-armed straight away, standing in for a new connection.
+
+#define TIMER_BENCH_TIMEOUT_TICKS 300   // 30 s keepalive
+#define TIMER_BENCH_TICKS 6000          // 10 minutes of simulated time
+
+void timer_bench_expire(void* context, TimerNode* node) {
+    TimerWheel* wheel = (TimerWheel*)context;
+    wheel_reset(wheel, node, wheel->now + TIMER_BENCH_TIMEOUT_TICKS);
+}
+
+int run_timer_benchmark() {
+    static const int sizes[] = { 1000, 10000, 100000 };
+    TimerWheel* wheel = (TimerWheel*)malloc(sizeof(TimerWheel));
+    if (!wheel) {
+        perror("malloc wheel");
+        return -1;
+    }
+
+    printf("Timer wheel: %d tick timeout, %d ticks, 1%% of timers reset per tick\n",
+           TIMER_BENCH_TIMEOUT_TICKS, TIMER_BENCH_TICKS);
+    printf("%10s %10s %10s %13s\n", "timers", "ns/reset", "ns/tick", "expired/tick");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        TimerNode* nodes = (TimerNode*)calloc(n, sizeof(TimerNode));
+        if (!nodes) {
+            perror("calloc timers");
+            free(wheel);
+            return -1;
+        }
+
+        wheel_init(wheel);
+        uint32_t seed = 12345;
+        for (int i = 0; i < n; i++) {
+            seed = seed * 1664525 + 1013904223;
+            wheel_reset(wheel, &nodes[i], seed % TIMER_BENCH_TIMEOUT_TICKS + 1);
+        }
+
+        int resets_per_tick = n / 100;
+        double reset_time = 0;
+        double tick_time = 0;
+        unsigned long expired = 0;
+
+        for (int t = 0; t < TIMER_BENCH_TICKS; t++) {
+            double start = get_time_sec();
+            for (int i = 0; i < resets_per_tick; i++) {
+                seed = seed * 1664525 + 1013904223;
+                wheel_reset(wheel, &nodes[seed % n], wheel->now + TIMER_BENCH_TIMEOUT_TICKS);
+            }
+            double mid = get_time_sec();
+            expired += wheel_advance(wheel, wheel->now, timer_bench_expire, wheel);
+            double end = get_time_sec();
+
+            reset_time += mid - start;
+            tick_time += end - mid;
+        }
+
+        printf("%10d %10.1f %10.0f %13.1f\n", n,
+               reset_time * 1e9 / ((double)resets_per_tick * TIMER_BENCH_TICKS),
+               tick_time * 1e9 / TIMER_BENCH_TICKS, (double)expired / TIMER_BENCH_TICKS);
+        free(nodes);
+    }
+
+    free(wheel);
+    return 0;
+}
+
+void usage(const char* prog) {
+    printf("Usage: %s [options]\n"
+           "  (no mode)            serve until SIGINT/SIGTERM; drive it with 05_load_generator\n"
+           "  --bench              self-contained idle + hot connection benchmark\n"
+           "  --churn              open/echo/close connections in a tight loop (--hot threads)\n"
+           "  --storm              open-loop connect storm (--hot threads), reports accept latency\n"
+           "  --http DIR           serve files from DIR over HTTP/1.1 instead of echoing\n"
+           "  --http-copy          HTTP: send bodies with pread()+send() instead of sendfile()\n"
+           "  --http-bench         sendfile() vs read()+write() on 4 KB, 1 MB and 100 MB files\n"
+           "  --pubsub             pub/sub: an empty length-prefixed frame subscribes,\n"
+           "                       any other frame is delivered to every subscriber\n"
+           "  --queue-limit N      pub/sub: messages queued per subscriber (default %d)\n"
+           "  --slow-policy NAME   pub/sub: drop (default) or disconnect slow subscribers\n"
+           "  --pubsub-bench       broadcast latency and memory at 1k and 10k subscribers\n"
+           "  --reactors N         number of reactor threads (default 1)\n"
+           "  --cpus LIST          CPUs to pin reactors to, e.g. 0,2-3 (one reactor each)\n"
+           "  --backend NAME       epoll (default), io_uring (falls back to epoll if unsupported) or\n"
+           "                       green: echo with one coroutine per connection, no timeouts\n"
+           "  --green-bench        idle + hot echo load on epoll callbacks versus green threads\n"
+           "  --listener KIND      reuseport (default): one listen socket per reactor, or\n"
+           "                       shared: one socket watched by every reactor with EPOLLEXCLUSIVE\n"
+           "  --backlog N          listen backlog (default SOMAXCONN)\n"
+           "  --allocator NAME     slab (default) or malloc, for Client objects and ring buffers\n"
+           "  --hugepages          back slabs with huge pages (MAP_HUGETLB, else transparent)\n"
+           "  --read-timeout S     close connections silent for S seconds after connecting\n"
+           "  --write-timeout S    close connections whose output makes no progress for S seconds\n"
+           "  --keepalive-timeout S  close connections idle for S seconds between messages\n"
+           "                       (serve defaults %d/%d/%d, benchmarks default to off, 0 disables)\n"
+           "  --timer-bench        timing wheel benchmark with up to 100k simulated connections\n"
+           "  --idle N             bench: idle connections (default %d)\n"
+           "  --hot N              bench: hot connections, churn: threads (default %d)\n"
+           "  --seconds N          bench: seconds per run (default %d)\n"
+           "  --message-size N     bench: bytes per echo message (default %d)\n"
+           "  --rate N             storm: connects per second (default %d),\n"
+           "                       pubsub bench: messages per second (default %d)\n",
+           prog, PUBSUB_QUEUE_LIMIT, READ_TIMEOUT_SEC, WRITE_TIMEOUT_SEC, KEEPALIVE_TIMEOUT_SEC,
+           BENCH_IDLE_CLIENTS, BENCH_HOT_CLIENTS, BENCH_SECONDS, BENCH_MESSAGE_SIZE, STORM_RATE, PUBSUB_RATE);
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    enum { MODE_SERVE, MODE_BENCH, MODE_CHURN, MODE_TIMER_BENCH, MODE_STORM, MODE_HTTP_BENCH, MODE_PUBSUB_BENCH, MODE_GREEN_BENCH } mode = MODE_SERVE;
+    int idle = BENCH_IDLE_CLIENTS;
+    int hot = BENCH_HOT_CLIENTS;
+    int seconds = BENCH_SECONDS;
+    int cpus[MAX_REACTORS];
+    int ncpus = 0;
+    int reactors_given = 0;
+    double timeouts[3] = { -1, -1, -1 };    // Seconds, -1 until given
+    double rate = 0;                        // Per benchmark default until given
+    const char* http_dir = NULL;
+
+    static struct option long_options[] = {
+        {"bench",    no_argument,       0, 'b'},
+        {"reactors", required_argument, 0, 'r'},
+        {"cpus",     required_argument, 0, 'c'},
+        {"idle",     required_argument, 0, 'i'},
+        {"hot",      required_argument, 0, 'H'},
+        {"seconds",  required_argument, 0, 't'},
+        {"message-size", required_argument, 0, 'm'},
+        {"backend",  required_argument, 0, 'B'},
+        {"churn",    no_argument,       0, 'C'},
+        {"allocator", required_argument, 0, 'a'},
+        {"hugepages", no_argument,      0, 'P'},
+        {"read-timeout", required_argument, 0, 'R'},
+        {"write-timeout", required_argument, 0, 'W'},
+        {"keepalive-timeout", required_argument, 0, 'K'},
+        {"timer-bench", no_argument,    0, 'T'},
+        {"storm",    no_argument,       0, 'S'},
+        {"rate",     required_argument, 0, 'q'},
+        {"listener", required_argument, 0, 'L'},
+        {"backlog",  required_argument, 0, 'G'},
+        {"http",     required_argument, 0, 'x'},
+        {"http-copy", no_argument,      0, 'X'},
+        {"http-bench", no_argument,     0, 'Y'},
+        {"pubsub",   no_argument,       0, 'p'},
+        {"queue-limit", required_argument, 0, 'Q'},
+        {"slow-policy", required_argument, 0, 'D'},
+        {"pubsub-bench", no_argument,   0, 'Z'},
+        {"green-bench", no_argument,    0, 'g'},
+        {"help",     no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "br:c:i:H:t:m:B:Ca:PR:W:K:TSq:L:G:x:XYpQ:D:Zgh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'b': mode = MODE_BENCH; break;
+            case 'C': mode = MODE_CHURN; break;
+            case 'P': use_hugepages = 1; break;
+            case 'R': timeouts[TIMEOUT_READ] = atof(optarg); break;
+            case 'W': timeouts[TIMEOUT_WRITE] = atof(optarg); break;
+            case 'K': timeouts[TIMEOUT_KEEPALIVE] = atof(optarg); break;
+            case 'T': mode = MODE_TIMER_BENCH; break;
+            case 'S': mode = MODE_STORM; break;
+            case 'q': rate = atof(optarg); break;
+            case 'G': listen_backlog = atoi(optarg); break;
+            case 'x': http_dir = optarg; break;
+            case 'X': body_mode = BODY_COPY; break;
+            case 'Y': mode = MODE_HTTP_BENCH; break;
+            case 'p': protocol = PROTOCOL_PUBSUB; break;
+            case 'Q': queue_limit = atoi(optarg); break;
+            case 'Z': mode = MODE_PUBSUB_BENCH; protocol = PROTOCOL_PUBSUB; break;
+            case 'g': mode = MODE_GREEN_BENCH; break;
+            case 'D':
+                if (strcmp(optarg, "drop") == 0) {
+                    slow_policy = SLOW_DROP;
+                } else if (strcmp(optarg, "disconnect") == 0) {
+                    slow_policy = SLOW_DISCONNECT;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'L':
+                if (strcmp(optarg, "reuseport") == 0) {
+                    shared_listener = 0;
+                } else if (strcmp(optarg, "shared") == 0) {
+                    shared_listener = 1;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'a':
+                if (strcmp(optarg, "slab") == 0) {
+                    use_slab = 1;
+                } else if (strcmp(optarg, "malloc") == 0) {
+                    use_slab = 0;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'r': num_reactors = atoi(optarg); reactors_given = 1; break;
+            case 'c': ncpus = parse_cpu_list(optarg, cpus, MAX_REACTORS); break;
+            case 'i': idle = atoi(optarg); break;
+            case 'H': hot = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'm': bench_message_size = strtoul(optarg, NULL, 10); break;
+            case 'B':
+                if (strcmp(optarg, "epoll") == 0) {
+                    backend = BACKEND_EPOLL;
+                } else if (strcmp(optarg, "io_uring") == 0) {
+                    backend = BACKEND_IO_URING;
+                } else if (strcmp(optarg, "green") == 0) {
+                    backend = BACKEND_GREEN;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    // One reactor per listed CPU unless --reactors says otherwise
+    if (ncpus > 0 && !reactors_given) {
+        num_reactors = ncpus;
+    }
+
+    if (num_reactors < 1 || num_reactors > MAX_REACTORS || ncpus < 0 ||
+        idle < 0 || hot < 1 || seconds < 1 || rate < 0 || listen_backlog < 1 || queue_limit < 1 ||
+        bench_message_size < 1 || bench_message_size > BENCH_MAX_MESSAGE_SIZE) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Benchmarks keep idle connections open on purpose, so they only time out when asked
+    static const int default_timeouts[3] = { READ_TIMEOUT_SEC, WRITE_TIMEOUT_SEC, KEEPALIVE_TIMEOUT_SEC };
+    for (int i = 0; i < 3; i++) {
+        if (timeouts[i] < 0) {
+            timeouts[i] = (mode == MODE_SERVE) ? default_timeouts[i] : 0;
+        }
+        timeout_ms[i] = (int)(timeouts[i] * 1000);
+    }
+
+    if (mode == MODE_TIMER_BENCH) {
+        return run_timer_benchmark() == -1 ? 1 : 0;
+    }
+
     // Set up signal handlers
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
-    
-    // Seed random number generator
-    srand(time(NULL));
-    
-    // Start server thread
-    pthread_t server_tid;
-    if (pthread_create(&server_tid, NULL, server_thread, NULL) != 0) {
-        perror("pthread_create: server");
+    // A peer that disconnects mid-write must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if (rate == 0) {
+        rate = (mode == MODE_PUBSUB_BENCH) ? PUBSUB_RATE : STORM_RATE;
+    }
+    queue_capacity = 1;
+    while (queue_capacity < (unsigned)queue_limit) {
+        queue_capacity <<= 1;
+    }
+    if (mode == MODE_PUBSUB_BENCH && bench_message_size < PUBSUB_BENCH_MIN_MESSAGE) {
+        bench_message_size = PUBSUB_BENCH_MIN_MESSAGE;
+    }
+
+    if (http_dir && (mode != MODE_SERVE || protocol != PROTOCOL_ECHO)) {
+        usage(argv[0]);
         return 1;
     }
-    
-    // Start client threads
-    pthread_t client_tids[NUM_CLIENTS];
-    for (int i = 0; i < NUM_CLIENTS; i++) {
-        int* client_id = malloc(sizeof(int));
-        *client_id = i + 1;
-        
-        if (pthread_create(&client_tids[i], NULL, client_thread, client_id) != 0) {
-            perror("pthread_create: client");
-            free(client_id);
-            continue;
+    if (http_dir) {
+        http_root_fd = open(http_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (http_root_fd == -1) {
+            perror(http_dir);
+            return 1;
         }
-        
-        // Stagger client connections
-        usleep((rand() % 300 + 100) * 1000);  // 100-400ms
+        protocol = PROTOCOL_HTTP;
+        printf("Serving files from %s (bodies via %s)\n", http_dir,
+               body_mode == BODY_SENDFILE ? "sendfile" : "read+write");
     }
-    
-    // Wait for client threads to finish
-    for (int i = 0; i < NUM_CLIENTS; i++) {
-        pthread_join(client_tids[i], NULL);
+    if (mode == MODE_HTTP_BENCH && http_bench_prepare() == -1) {
+        return 1;
     }
-    
-    // Allow time for the server to process any final messages
-    sleep(1);
-    
-    // Signal the server to stop
-    running = 0;
-    
-    // Wait for server thread to finish
-    pthread_join(server_tid, NULL);
+
+    if (backend != BACKEND_EPOLL && protocol != PROTOCOL_ECHO) {
+        printf("HTTP and pub/sub modes run on epoll only, falling back to epoll\n");
+        backend = BACKEND_EPOLL;
+    }
+    if (backend == BACKEND_IO_URING && !io_uring_usable()) {
+        printf("io_uring not usable here (%s), falling back to epoll\n", strerror(errno));
+        backend = BACKEND_EPOLL;
+    }
+
+    if (init_fd_limit() == -1) {
+        return 1;
+    }
+
+    quiet = (mode != MODE_SERVE);
+
+    if (mode == MODE_GREEN_BENCH) {
+        return run_green_benchmark(cpus, ncpus, idle, hot, seconds) == -1 ? 1 : 0;
+    }
+
+    if (start_reactors(cpus, ncpus) == -1) {
+        stop_reactors();
+        if (mode == MODE_HTTP_BENCH) {
+            http_bench_cleanup();
+        }
+        return 1;
+    }
+
+    if (mode == MODE_BENCH) {
+        int ret = run_benchmark(idle, hot, seconds);
+        stop_reactors();
+        return ret;
+    }
+
+    if (mode == MODE_STORM) {
+        int ret = run_storm_benchmark(hot, seconds, rate);
+        stop_reactors();
+        return ret;
+    }
+
+    if (mode == MODE_PUBSUB_BENCH) {
+        int ret = run_pubsub_benchmark(hot, seconds, rate);
+        stop_reactors();
+        return ret;
+    }
+
+    if (mode == MODE_HTTP_BENCH) {
+        int ret = run_http_benchmark(hot, seconds);
+        stop_reactors();
+        http_bench_cleanup();
+        return ret;
+    }
+
+    if (mode == MODE_CHURN) {
+        int ret = run_churn_benchmark(hot, seconds);
+        stop_reactors();
+        return ret;
+    }
+
+    // Serve until SIGINT/SIGTERM
+    while (running) {
+        pause();
+    }
+    stop_reactors();
     
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,717 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Load generator for 05_event_driven_server.
+//
+// Closed loop: every connection keeps one request in flight and sends the next as
+// soon as the echo comes back, so it measures how fast the server can go.
+// Open loop (--rate): requests are started on a fixed schedule no matter how the
+// server is doing. Latency is measured from the scheduled start, so a stalled
+// server shows up in the tail instead of silently slowing the client down.
+
+// Defaults
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 8080
+#define DEFAULT_CONNECTIONS 1000
+#define DEFAULT_THREADS 4
+#define DEFAULT_DURATION 10
+#define DEFAULT_MESSAGE_SIZE 64
+#define MAX_THREADS 64
+#define MAX_EVENTS 256
+#define MAX_IN_FLIGHT 256       // Per connection, open loop only
+#define DRAIN_TIMEOUT_MS 1000   // How long to wait for outstanding replies at the end
+#define RECV_CHUNK 65536
+
+// HDR-style histogram: values below 128 get their own bucket, above that every
+// power of two is split into 64 linear sub-buckets (better than 1.6% precision).
+#define HIST_SUB_BUCKETS 64
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} Histogram;
+
+// Connection state
+typedef struct {
+    int fd;
+    int connected;
+    size_t unsent;              // Request bytes still to be written
+    size_t sent_total;          // Request bytes written so far (position in the pattern)
+    size_t received;            // Reply bytes of the current response
+    uint64_t starts[MAX_IN_FLIGHT];  // Start times (ns) of the requests in flight, FIFO
+    int head;
+    int in_flight;
+    uint32_t events;            // epoll interest currently registered
+} Connection;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    Connection* connections;
+    int num_connections;
+    double rate;                // Requests/sec for this thread, 0 = closed loop
+    Histogram histogram;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t backlog_drops;     // Open loop: requests skipped because a connection was full
+    uint64_t bytes;
+    int failed;                 // Could not start; ran no connections
+} Worker;
+
+// Configuration
+static const char* host = DEFAULT_HOST;
+static int port = DEFAULT_PORT;
+static int num_connections = DEFAULT_CONNECTIONS;
+static int num_threads = DEFAULT_THREADS;
+static int duration = DEFAULT_DURATION;
+static size_t message_size = DEFAULT_MESSAGE_SIZE;
+static double target_rate = 0;  // Total requests/sec, 0 = closed loop
+static const char* format = "text";
+static const char* output_path = NULL;
+
+static struct sockaddr_in server_addr;
+static char* request_pattern = NULL;
+static pthread_barrier_t connected_barrier;  // Everyone has connected
+static pthread_barrier_t start_barrier;      // start_ns/end_ns are set
+static volatile sig_atomic_t running = 1;
+static uint64_t start_ns;
+static uint64_t end_ns;
+
+void signal_handler(int sig) {
+    running = 0;
+}
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ----- Histogram -----
+
+static inline int hist_index(uint64_t value) {
+    if (value < 2 * HIST_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - 6;  // Keep the top 7 bits: value >> shift is in [64, 127]
+    return (shift + 1) * HIST_SUB_BUCKETS + (int)((value >> shift) - HIST_SUB_BUCKETS);
+}
+
+// Smallest value that lands in bucket index
+static inline uint64_t hist_lowest(int index) {
+    if (index < 2 * HIST_SUB_BUCKETS) {
+        return (uint64_t)index;
+    }
+    int shift = index / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = (uint64_t)(index % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS);
+    return sub << shift;
+}
+
+// Largest value that lands in bucket index
+static inline uint64_t hist_highest(int index) {
+    return hist_lowest(index + 1) - 1;
+}
+
+void hist_init(Histogram* h) {
+    memset(h, 0, sizeof(Histogram));
+    h->min = UINT64_MAX;
+}
+
+static inline void hist_record(Histogram* h, uint64_t value) {
+    int index = hist_index(value);
+    if (index >= HIST_BUCKETS) {
+        index = HIST_BUCKETS - 1;
+    }
+    h->counts[index]++;
+    h->total++;
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+}
+
+void hist_merge(Histogram* into, const Histogram* from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->min < into->min) into->min = from->min;
+    if (from->max > into->max) into->max = from->max;
+}
+
+// Value at a percentile (0-100): the top of the bucket holding that rank, capped by max
+uint64_t hist_percentile(const Histogram* h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > h->total) rank = h->total;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = hist_highest(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+// ----- Connections -----
+
+// Raise the soft fd limit to the hard limit; thousands of connections need it
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+            perror("setrlimit");
+        }
+    }
+}
+
+int set_interest(Worker* w, Connection* c, uint32_t events) {
+    if (events == c->events) {
+        return 0;
+    }
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == -1) {
+        perror("epoll_ctl: mod");
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+
+// Start a non-blocking connect and register the socket
+int open_connection(Worker* w, Connection* c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    int nodelay = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if (connect(c->fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1 &&
+        errno != EINPROGRESS) {
+        perror("connect");
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        perror("epoll_ctl: add");
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->events = EPOLLOUT;
+
+    return 0;
+}
+
+void close_connection(Worker* w, Connection* c) {
+    if (c->fd >= 0) {
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+    w->errors += c->in_flight;
+    c->in_flight = 0;
+    c->connected = 0;
+}
+
+// Queue one request on a connection, started at start_ns
+int queue_request(Connection* c, uint64_t start) {
+    if (c->in_flight == MAX_IN_FLIGHT) {
+        return -1;
+    }
+    c->starts[(c->head + c->in_flight) % MAX_IN_FLIGHT] = start;
+    c->in_flight++;
+    c->unsent += message_size;
+    return 0;
+}
+
+// Write queued request bytes until the socket would block
+int flush_requests(Worker* w, Connection* c) {
+    while (c->unsent > 0) {
+        size_t offset = c->sent_total % message_size;
+        size_t len = message_size - offset;
+        if (len > c->unsent) {
+            len = c->unsent;
+        }
+
+        ssize_t n = send(c->fd, request_pattern + offset, len, MSG_NOSIGNAL);
+        if (n > 0) {
+            c->unsent -= n;
+            c->sent_total += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        return -1;
+    }
+
+    return set_interest(w, c, EPOLLIN | (c->unsent > 0 ? EPOLLOUT : 0));
+}
+
+// Read replies; every message_size bytes completes the oldest request in flight
+int read_replies(Worker* w, Connection* c, char* scratch) {
+    while (1) {
+        ssize_t n = recv(c->fd, scratch, RECV_CHUNK, 0);
+        if (n > 0) {
+            uint64_t now = now_ns();
+            c->received += n;
+            w->bytes += n;
+
+            while (c->received >= message_size && c->in_flight > 0) {
+                c->received -= message_size;
+                hist_record(&w->histogram, now - c->starts[c->head]);
+                c->head = (c->head + 1) % MAX_IN_FLIGHT;
+                c->in_flight--;
+                w->completed++;
+
+                // Closed loop: the next request goes out right away
+                if (w->rate == 0 && running && now < end_ns) {
+                    queue_request(c, now);
+                }
+            }
+            continue;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        return -1;
+    }
+}
+
+void* worker_thread(void* arg) {
+    Worker* w = (Worker*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    char* scratch = (char*)malloc(RECV_CHUNK);
+    int connected = 0;
+    int failed = 0;
+
+    // main() waits on both barriers, so a worker that cannot run still passes them
+    if (!scratch) {
+        perror("malloc scratch");
+        w->failed = 1;
+        pthread_barrier_wait(&connected_barrier);
+        pthread_barrier_wait(&start_barrier);
+        return NULL;
+    }
+
+    for (int i = 0; i < w->num_connections; i++) {
+        if (open_connection(w, &w->connections[i]) == -1) {
+            failed++;
+        }
+    }
+
+    // Wait until every connect has finished
+    while (running && connected + failed < w->num_connections) {
+        int nfds = epoll_wait(w->epoll_fd, events, MAX_EVENTS, 1000);
+        for (int i = 0; i < nfds; i++) {
+            Connection* c = (Connection*)events[i].data.ptr;
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0) {
+                fprintf(stderr, "connect: %s\n", strerror(err));
+                close_connection(w, c);
+                failed++;
+                continue;
+            }
+            c->connected = 1;
+            connected++;
+            set_interest(w, c, EPOLLIN);
+        }
+    }
+    if (failed > 0) {
+        fprintf(stderr, "Thread %d: %d of %d connections failed\n", w->id, failed, w->num_connections);
+    }
+
+    pthread_barrier_wait(&connected_barrier);
+    pthread_barrier_wait(&start_barrier);
+
+    // Closed loop: prime every connection with one request
+    if (w->rate == 0) {
+        uint64_t now = now_ns();
+        for (int i = 0; i < w->num_connections; i++) {
+            Connection* c = &w->connections[i];
+            if (c->connected) {
+                queue_request(c, now);
+                if (flush_requests(w, c) == -1) {
+                    close_connection(w, c);
+                }
+            }
+        }
+    }
+
+    double interval_ns = w->rate > 0 ? 1e9 / w->rate : 0;
+    uint64_t scheduled = 0;  // Open loop: requests started so far
+    int next_conn = 0;
+    uint64_t drain_deadline = end_ns + (uint64_t)DRAIN_TIMEOUT_MS * 1000000ULL;
+
+    while (running) {
+        uint64_t now = now_ns();
+        int timeout_ms = 100;
+
+        if (now >= end_ns) {
+            // Stop starting requests; wait for the outstanding replies
+            int outstanding = 0;
+            for (int i = 0; i < w->num_connections; i++) {
+                outstanding += w->connections[i].in_flight;
+            }
+            if (outstanding == 0 || now >= drain_deadline) {
+                break;
+            }
+        } else if (w->rate > 0 && connected > 0) {
+            // Start every request whose scheduled time has come, on the next connection
+            // round-robin. Each keeps its scheduled time as its start.
+            while (1) {
+                uint64_t due = start_ns + (uint64_t)(scheduled * interval_ns);
+                if (due > now || due >= end_ns) {
+                    // Under a millisecond to go this polls, which keeps starts on schedule
+                    if (due < end_ns) {
+                        uint64_t wait_ns = due - now;
+                        timeout_ms = (int)(wait_ns / 1000000);
+                    }
+                    break;
+                }
+
+                int tries = 0;
+                Connection* c = NULL;
+                while (tries < w->num_connections) {
+                    Connection* candidate = &w->connections[next_conn];
+                    next_conn = (next_conn + 1) % w->num_connections;
+                    tries++;
+                    if (candidate->connected && candidate->in_flight < MAX_IN_FLIGHT) {
+                        c = candidate;
+                        break;
+                    }
+                }
+
+                if (c) {
+                    queue_request(c, due);
+                    if (flush_requests(w, c) == -1) {
+                        close_connection(w, c);
+                    }
+                } else {
+                    w->backlog_drops++;
+                }
+                scheduled++;
+            }
+        }
+
+        int nfds = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout_ms);
+        if (nfds == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            Connection* c = (Connection*)events[i].data.ptr;
+            if (c->fd < 0) {
+                continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                if (read_replies(w, c, scratch) == -1) {
+                    close_connection(w, c);
+                    continue;
+                }
+            }
+
+            if (c->unsent > 0 || (events[i].events & EPOLLOUT)) {
+                if (flush_requests(w, c) == -1) {
+                    close_connection(w, c);
+                }
+            }
+        }
+    }
+
+    // Whatever is still in flight did not get an answer in time
+    for (int i = 0; i < w->num_connections; i++) {
+        Connection* c = &w->connections[i];
+        w->errors += c->in_flight;
+        c->in_flight = 0;
+        if (c->fd >= 0) {
+            close(c->fd);
+            c->fd = -1;
+        }
+    }
+
+    free(scratch);
+    return NULL;
+}
+
+// ----- Reporting -----
+
+void report(const Histogram* h, uint64_t completed, uint64_t errors, uint64_t drops,
+            uint64_t bytes, double elapsed) {
+    double throughput = completed / elapsed;
+    double mb_per_sec = 2.0 * bytes / elapsed / (1024 * 1024);  // Requests plus replies
+    const char* mode = target_rate > 0 ? "open" : "closed";
+
+    // Latencies are reported in microseconds
+    double p50 = hist_percentile(h, 50) / 1000.0;
+    double p90 = hist_percentile(h, 90) / 1000.0;
+    double p99 = hist_percentile(h, 99) / 1000.0;
+    double p999 = hist_percentile(h, 99.9) / 1000.0;
+    double max = h->total ? h->max / 1000.0 : 0;
+
+    FILE* out = stdout;
+    int new_file = 0;
+    if (output_path) {
+        struct stat st;
+        new_file = (stat(output_path, &st) == -1 || st.st_size == 0);
+        out = fopen(output_path, "a");
+        if (!out) {
+            perror("fopen output");
+            out = stdout;
+        }
+    }
+
+    if (strcmp(format, "csv") == 0) {
+        if (new_file || out == stdout) {
+            fprintf(out, "timestamp,mode,connections,threads,message_size,target_rate,"
+                         "duration_s,completed,errors,dropped,throughput_rps,mb_per_sec,"
+                         "p50_us,p90_us,p99_us,p999_us,max_us\n");
+        }
+        fprintf(out, "%ld,%s,%d,%d,%zu,%.0f,%.3f,%lu,%lu,%lu,%.1f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                (long)time(NULL), mode, num_connections, num_threads, message_size, target_rate,
+                elapsed, (unsigned long)completed, (unsigned long)errors, (unsigned long)drops,
+                throughput, mb_per_sec, p50, p90, p99, p999, max);
+    } else if (strcmp(format, "json") == 0) {
+        // One object per line, so runs can be appended to the same file
+        fprintf(out, "{\"timestamp\":%ld,\"mode\":\"%s\",\"connections\":%d,\"threads\":%d,"
+                     "\"message_size\":%zu,\"target_rate\":%.0f,\"duration_s\":%.3f,"
+                     "\"completed\":%lu,\"errors\":%lu,\"dropped\":%lu,\"throughput_rps\":%.1f,"
+                     "\"mb_per_sec\":%.2f,\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,"
+                     "\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+                (long)time(NULL), mode, num_connections, num_threads, message_size, target_rate,
+                elapsed, (unsigned long)completed, (unsigned long)errors, (unsigned long)drops,
+                throughput, mb_per_sec, p50, p90, p99, p999, max);
+    } else {
+        fprintf(out, "Mode:        %s loop", mode);
+        if (target_rate > 0) {
+            fprintf(out, " at %.0f req/s", target_rate);
+        }
+        fprintf(out, "\n");
+        fprintf(out, "Connections: %d over %d threads, %zu byte messages\n",
+                num_connections, num_threads, message_size);
+        fprintf(out, "Completed:   %lu requests in %.2f s (%lu errors, %lu dropped)\n",
+                (unsigned long)completed, elapsed, (unsigned long)errors, (unsigned long)drops);
+        fprintf(out, "Throughput:  %.1f req/s, %.2f MB/s\n", throughput, mb_per_sec);
+        fprintf(out, "Latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+                p50, p90, p99, p999, max);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+}
+
+void usage(const char* prog) {
+    printf("Usage: %s [options]\n"
+           "  --host ADDR          server address (default %s)\n"
+           "  --port N             server port (default %d)\n"
+           "  --connections N      total connections (default %d)\n"
+           "  --threads N          epoll threads (default %d)\n"
+           "  --duration S         seconds to run (default %d)\n"
+           "  --message-size N     bytes per request (default %d)\n"
+           "  --rate R             open loop at R requests/sec total; closed loop if omitted\n"
+           "  --format FMT         text (default), csv or json\n"
+           "  --output FILE        append the result to FILE instead of stdout\n",
+           prog, DEFAULT_HOST, DEFAULT_PORT, DEFAULT_CONNECTIONS, DEFAULT_THREADS,
+           DEFAULT_DURATION, DEFAULT_MESSAGE_SIZE);
+}
+
+int main(int argc, char* argv[]) {
+    static struct option long_options[] = {
+        {"host",         required_argument, 0, 'a'},
+        {"port",         required_argument, 0, 'p'},
+        {"connections",  required_argument, 0, 'c'},
+        {"threads",      required_argument, 0, 't'},
+        {"duration",     required_argument, 0, 'd'},
+        {"message-size", required_argument, 0, 'm'},
+        {"rate",         required_argument, 0, 'r'},
+        {"format",       required_argument, 0, 'f'},
+        {"output",       required_argument, 0, 'o'},
+        {"help",         no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "a:p:c:t:d:m:r:f:o:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'a': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': num_connections = atoi(optarg); break;
+            case 't': num_threads = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'm': message_size = strtoul(optarg, NULL, 10); break;
+            case 'r': target_rate = atof(optarg); break;
+            case 'f': format = optarg; break;
+            case 'o': output_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (num_connections < 1 || num_threads < 1 || num_threads > MAX_THREADS ||
+        duration < 1 || message_size < 1 || target_rate < 0 ||
+        (strcmp(format, "text") != 0 && strcmp(format, "csv") != 0 && strcmp(format, "json") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (num_threads > num_connections) {
+        num_threads = num_connections;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid address: %s\n", host);
+        return 1;
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    request_pattern = (char*)malloc(message_size);
+    if (!request_pattern) {
+        perror("malloc request");
+        return 1;
+    }
+    for (size_t i = 0; i < message_size; i++) {
+        request_pattern[i] = 'a' + i % 26;
+    }
+
+    Worker* workers = (Worker*)calloc(num_threads, sizeof(Worker));
+    Connection* connections = (Connection*)calloc(num_connections, sizeof(Connection));
+    if (!workers || !connections) {
+        perror("calloc");
+        return 1;
+    }
+
+    // Workers connect, then wait for main to start the clock
+    pthread_barrier_init(&connected_barrier, NULL, num_threads + 1);
+    pthread_barrier_init(&start_barrier, NULL, num_threads + 1);
+
+    int assigned = 0;
+    for (int i = 0; i < num_threads; i++) {
+        Worker* w = &workers[i];
+        int count = num_connections / num_threads + (i < num_connections % num_threads ? 1 : 0);
+
+        w->id = i;
+        w->connections = &connections[assigned];
+        w->num_connections = count;
+        w->rate = target_rate / num_threads;
+        hist_init(&w->histogram);
+        for (int j = 0; j < count; j++) {
+            w->connections[j].fd = -1;
+        }
+        assigned += count;
+
+        w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epoll_fd == -1) {
+            perror("epoll_create1");
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+
+    // Workers read start_ns/end_ns only after the start barrier
+    pthread_barrier_wait(&connected_barrier);
+    start_ns = now_ns();
+    end_ns = start_ns + (uint64_t)duration * 1000000000ULL;
+    pthread_barrier_wait(&start_barrier);
+
+    Histogram total;
+    hist_init(&total);
+    uint64_t completed = 0, errors = 0, drops = 0, bytes = 0;
+    int failed_workers = 0;
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        hist_merge(&total, &workers[i].histogram);
+        completed += workers[i].completed;
+        errors += workers[i].errors;
+        drops += workers[i].backlog_drops;
+        bytes += workers[i].bytes;
+        failed_workers += workers[i].failed;
+        close(workers[i].epoll_fd);
+    }
+
+    uint64_t finished = now_ns();
+    double elapsed = ((finished < end_ns ? finished : end_ns) - start_ns) / 1e9;
+    report(&total, completed, errors, drops, bytes, elapsed);
+    if (failed_workers > 0) {
+        fprintf(stderr, "%d of %d threads failed to start; their connections are not counted\n",
+                failed_workers, num_threads);
+    }
+
+    pthread_barrier_destroy(&connected_barrier);
+    pthread_barrier_destroy(&start_barrier);
+    free(connections);
+    free(workers);
+    free(request_pattern);
+    return failed_workers > 0 ? 1 : 0;
+}